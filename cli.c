@@ -0,0 +1,1484 @@
+/*
+ * tiffutils
+ *
+ * The command line program, built on the engine without Python.  Each
+ * subcommand spreads its files over the thread pool, as the batch functions
+ * of the module do, and reads the files to process from stdin, one per
+ * line, if none are given.
+ */
+
+#include "engine.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+static const char cli_usage[] =
+    "usage: tiffutils <command> [options] [file...]\n"
+    "\n"
+    "Files are read from stdin, one per line, if none are given.\n"
+    "\n"
+    "commands:\n"
+    "  convert     Save .npy or raw images as DNGs\n"
+    "      -o, --out-dir DIR      write DNGs to DIR (default: beside each image)\n"
+    "      -c, --compress         deflate compress (DNG 1.4)\n"
+    "      --cfa PATTERN          RGGB (default), BGGR, GBRG or GRBG\n"
+    "      --camera NAME          unique camera model (default: Unknown)\n"
+    "      --preview SIZE         embed an RGB preview of at most SIZE pixels\n"
+    "      --pyramid-levels N     write N reduced resolution levels\n"
+    "      --size WxH             dimensions of raw images (default: .npy)\n"
+    "      --dtype TYPE           u8, u16 (default), f16 or f32 raw samples\n"
+    "      --samples N            1 (CFA, default) or 3 (LinearRaw) raw samples\n"
+    "  info        Print the layout of the raw image of each DNG:\n"
+    "              path, width, height, samples, bits, format, compression, CFA\n"
+    "  recompress  Recompress DNGs, replacing them unless -o is given\n"
+    "      -o, --out-dir DIR      write files to DIR\n"
+    "      -c, --compression NAME deflate (default) or none\n"
+    "      --rate-limit MB/S      total megabytes per second read and written\n"
+    "  export      Render DNGs as sRGB JPEG or PNG images\n"
+    "      -o, --out-dir DIR      write images to DIR (required)\n"
+    "      -f, --format FORMAT    jpeg (default) or png\n"
+    "      -s, --size SIZE        maximum dimension (default: 1024)\n"
+    "      -q, --quality Q        JPEG quality (default: 90)\n"
+    "  watch       Convert captures as they are completed in a directory\n"
+    "      -i, --in DIR           directory to watch (required)\n"
+    "      -o, --out DIR          directory for DNGs and index.tsv (required)\n"
+    "      -c, --compress         deflate compress (DNG inputs are otherwise copied)\n"
+    "      --jpeg SIZE            write a JPEG preview of each DNG\n"
+    "      --state FILE           completed inputs (default: OUT/.tiffutils-watch)\n"
+    "      and the options of convert\n"
+    "\n"
+    "every command:\n"
+    "  -j, --threads N            files processed at once (default: one per CPU)\n";
+
+static const char *cli_cfa_names[CFA_NUM_PATTERNS] = {
+    [CFA_BGGR] = "BGGR",
+    [CFA_GBRG] = "GBRG",
+    [CFA_GRBG] = "GRBG",
+    [CFA_RGGB] = "RGGB",
+};
+
+/* Files named on the command line, or on stdin */
+struct cli_files {
+    char **paths;
+    size_t count;
+};
+
+static int cli_files(int argc, char **argv, struct cli_files *files) {
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+
+    if (argc > 0) {
+        files->paths = argv;
+        files->count = argc;
+        return 0;
+    }
+
+    files->paths = NULL;
+    files->count = 0;
+
+    while ((len = getline(&line, &line_size, stdin)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (!len) {
+            continue;
+        }
+
+        if (files->count == capacity) {
+            char **paths;
+
+            capacity = capacity ? 2 * capacity : 1024;
+            paths = realloc(files->paths, capacity * sizeof(*paths));
+            if (!paths) {
+                free(line);
+                return dng_fail(DNG_ENOMEM, "Unable to allocate file list");
+            }
+            files->paths = paths;
+        }
+
+        files->paths[files->count] = strdup(line);
+        if (!files->paths[files->count]) {
+            free(line);
+            return dng_fail(DNG_ENOMEM, "Unable to allocate file list");
+        }
+        files->count++;
+    }
+
+    free(line);
+    return 0;
+}
+
+static void cli_files_free(int argc, struct cli_files *files) {
+    if (argc > 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < files->count; i++) {
+        free(files->paths[i]);
+    }
+    free(files->paths);
+}
+
+/*
+ * A batch of files processed by a command, shared by a fixed number of
+ * lanes that each take the next file until none are left
+ */
+struct cli_batch {
+    const char **src;
+    const char **dst;       /* NULL entries replace src, or only read it */
+    size_t count;
+    size_t next;
+    int (*file)(void *arg, size_t i, const char *src, const char *dst);
+    void (*print)(void *arg, size_t i, const char *src);    /* result, or NULL */
+    void *arg;
+    int *errs;
+    char (*errmsgs)[sizeof(dng_errmsg)];
+};
+
+static void cli_lane(void *arg, size_t lane) {
+    struct cli_batch *b = arg;
+    size_t i;
+
+    (void) lane;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+        b->errs[i] = b->file(b->arg, i, b->src[i], b->dst[i]);
+        if (b->errs[i]) {
+            memcpy(b->errmsgs[i], dng_errmsg, sizeof(dng_errmsg));
+        }
+    }
+}
+
+/*
+ * Process files over the thread pool, then report each in order: its
+ * result printed on stdout, or its error on stderr
+ *
+ * @param b         Batch, with its file, print and arg set
+ * @param files     Files to process
+ * @param out_dir   Directory of the results, or NULL for beside each file
+ * @param ext       Extension of the results, or NULL to keep their names
+ * @param threads   Files processed at once, 0 for one per CPU
+ * @returns exit status: 0 if every file succeeded, otherwise 1
+ */
+static int cli_run(struct cli_batch *b, const struct cli_files *files,
+                   const char *out_dir, const char *ext, unsigned int threads) {
+    size_t lanes = threads ? threads : (size_t) pool_threads();
+    size_t failed = 0;
+
+    b->src = (const char **) files->paths;
+    b->count = files->count;
+    b->next = 0;
+    b->dst = calloc(b->count + 1, sizeof(*b->dst));
+    b->errs = calloc(b->count + 1, sizeof(*b->errs));
+    b->errmsgs = calloc(b->count + 1, sizeof(*b->errmsgs));
+    if (!b->dst || !b->errs || !b->errmsgs) {
+        fprintf(stderr, "tiffutils: out of memory\n");
+        failed = 1;
+        goto out;
+    }
+
+    for (size_t i = 0; (out_dir || ext) && i < b->count; i++) {
+        b->dst[i] = output_path(b->src[i], out_dir, ext);
+        if (!b->dst[i]) {
+            fprintf(stderr, "tiffutils: out of memory\n");
+            failed = 1;
+            goto out;
+        }
+    }
+
+    parallel_for(lanes > b->count ? b->count : lanes, cli_lane, b);
+
+    for (size_t i = 0; i < b->count; i++) {
+        if (b->errs[i]) {
+            fprintf(stderr, "tiffutils: %s: %s\n", b->src[i], b->errmsgs[i]);
+            failed++;
+        }
+        else if (b->print) {
+            b->print(b->arg, i, b->src[i]);
+        }
+    }
+
+out:
+    if (b->dst) {
+        for (size_t i = 0; i < b->count; i++) {
+            free((char *) b->dst[i]);
+        }
+    }
+    free(b->errmsgs);
+    free(b->errs);
+    free(b->dst);
+    return failed ? 1 : 0;
+}
+
+/*
+ * Layout of the image in a .npy file
+ *
+ * @param map       File
+ * @param size      Size of the file
+ * @param l         Layout returned here
+ * @param offset    Offset of the image data returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int npy_layout(const uint8_t *map, size_t size, struct strip_layout *l,
+                      size_t *offset) {
+    const int one = 1;
+    char order = *(const char *) &one ? '<' : '>';
+    char header[4096], descr[8];
+    const char *p;
+    size_t len, start;
+    unsigned long dims[3];
+    int ndims = 0, bytes;
+
+    if (size < 12 || memcmp(map, "\x93NUMPY", 6)) {
+        return dng_fail(DNG_EFORMAT, "Not a .npy file");
+    }
+
+    if (map[6] == 1) {
+        len = map[8] | map[9] << 8;
+        start = 10;
+    }
+    else {
+        len = map[8] | map[9] << 8 | (size_t) map[10] << 16 | (size_t) map[11] << 24;
+        start = 12;
+    }
+    if (len >= sizeof(header) || start + len > size) {
+        return dng_fail(DNG_EFORMAT, "Bad .npy header");
+    }
+    memcpy(header, map + start, len);
+    header[len] = '\0';
+    *offset = start + len;
+
+    p = strstr(header, "'descr':");
+    if (!p || sscanf(p, "'descr': '%7[^']'", descr) != 1) {
+        return dng_fail(DNG_EFORMAT, "Bad .npy header");
+    }
+
+    if (strstr(header, "'fortran_order': True")) {
+        return dng_fail(DNG_EFORMAT, "Fortran ordered arrays are not supported");
+    }
+
+    p = strstr(header, "'shape': (");
+    if (!p) {
+        return dng_fail(DNG_EFORMAT, "Bad .npy header");
+    }
+    p += strlen("'shape': (");
+    while (ndims < 3) {
+        char *end;
+
+        dims[ndims] = strtoul(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        ndims++;
+        p = end;
+        while (*p == ',' || *p == ' ') {
+            p++;
+        }
+    }
+
+    memset(l, 0, sizeof(*l));
+    l->planar = PLANARCONFIG_CONTIG;
+    l->sampleformat = SAMPLEFORMAT_UINT;
+
+    if (!strcmp(descr, "|u1") || !strcmp(descr, "u1")) {
+        l->bits = 8;
+    }
+    else if (descr[0] == order && !strcmp(descr + 1, "u2")) {
+        l->bits = 16;
+    }
+    else if (descr[0] == order && !strcmp(descr + 1, "f2")) {
+        l->bits = 16;
+        l->sampleformat = SAMPLEFORMAT_IEEEFP;
+    }
+    else if (descr[0] == order && !strcmp(descr + 1, "f4")) {
+        l->bits = 32;
+        l->sampleformat = SAMPLEFORMAT_IEEEFP;
+    }
+    else {
+        return dng_fail(DNG_EFORMAT, "Unsupported dtype %s", descr);
+    }
+
+    if ((ndims != 2 && !(ndims == 3 && dims[2] == 3)) ||
+        dims[0] > UINT32_MAX || dims[1] > UINT32_MAX || !dims[0] || !dims[1]) {
+        return dng_fail(DNG_EFORMAT, "Array must be (height, width) or (height, width, 3)");
+    }
+
+    l->height = dims[0];
+    l->width = dims[1];
+    l->samples = ndims == 3 ? 3 : 1;
+
+    bytes = layout_mem_bytes(l);
+    if ((size - *offset) / bytes / l->samples / l->width < l->height) {
+        return dng_fail(DNG_EFORMAT, "Array data truncated");
+    }
+
+    return 0;
+}
+
+/*
+ * Save one .npy or raw image as a DNG
+ *
+ * The image is mapped, not read, and dropped from memory as it is encoded.
+ *
+ * @param src   Image to convert
+ * @param dst   DNG to write
+ * @param raw   Layout of a raw image, or NULL if src is a .npy file
+ * @param opts  DNG options
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int convert_file(const char *src, const char *dst, const struct strip_layout *raw,
+                        const struct dng_options *opts) {
+    struct strip_layout l;
+    struct stat st;
+    size_t offset = 0;
+    uint8_t *map;
+    TIFF *tiff;
+    int fd, err = 0;
+
+    fd = open(src, O_RDONLY);
+    if (fd < 0) {
+        return dng_fail(DNG_EIO, "Failed to open file");
+    }
+
+    if (fstat(fd, &st)) {
+        close(fd);
+        return dng_fail(DNG_EIO, "Failed to stat file");
+    }
+
+    map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return dng_fail(DNG_EIO, "Failed to map file");
+    }
+
+    if (raw) {
+        l = *raw;
+        if ((size_t) st.st_size < layout_mem_rowbytes(&l) * l.height) {
+            err = dng_fail(DNG_EFORMAT, "Raw image truncated");
+        }
+    }
+    else {
+        err = npy_layout(map, st.st_size, &l, &offset);
+    }
+
+    if (!err) {
+        l.streamed = 1;
+
+        tiff = TIFFOpen(dst, dng_open_mode(BIGTIFF_AUTO, opts, &l));
+        if (!tiff) {
+            err = dng_fail(DNG_EIO, "Failed to create %s", dst);
+        }
+        else {
+            err = write_dng(tiff, opts, &l, map + offset, NULL);
+            TIFFClose(tiff);
+        }
+    }
+
+    munmap(map, st.st_size);
+    return err;
+}
+
+/* Options of a batch of images converted to DNGs */
+struct convert_args {
+    const struct strip_layout *raw;     /* layout of raw images, or NULL for .npy */
+    const struct dng_options *opts;
+};
+
+static int convert_batch_file(void *arg, size_t i, const char *src, const char *dst) {
+    const struct convert_args *a = arg;
+
+    (void) i;
+
+    return convert_file(src, dst, a->raw, a->opts);
+}
+
+/*
+ * Apply an option of the commands that convert images to DNGs
+ *
+ * @param c     Option, as returned by getopt_long()
+ * @param arg   Its argument
+ * @param opts  DNG options to update
+ * @param raw   Layout of raw images to update
+ * @returns 0 on success, -1 after reporting an unknown option or bad value
+ */
+static int cli_convert_option(int c, const char *arg, struct dng_options *opts,
+                              struct strip_layout *raw) {
+    int i;
+
+    switch (c) {
+    case 'C':
+        for (i = 0; i < CFA_NUM_PATTERNS && strcasecmp(arg, cli_cfa_names[i]); i++);
+        if (i == CFA_NUM_PATTERNS) {
+            fprintf(stderr, "tiffutils: unknown CFA pattern %s\n", arg);
+            return -1;
+        }
+        opts->pattern = i;
+        break;
+    case 'n':
+        opts->camera = arg;
+        break;
+    case 'p':
+        opts->preview = strtoul(arg, NULL, 10);
+        break;
+    case 'l':
+        opts->pyramid_levels = strtoul(arg, NULL, 10);
+        break;
+    case 'S':
+        if (sscanf(arg, "%" SCNu32 "x%" SCNu32, &raw->width, &raw->height) != 2 ||
+            !raw->width || !raw->height) {
+            fprintf(stderr, "tiffutils: size must be WIDTHxHEIGHT\n");
+            return -1;
+        }
+        break;
+    case 'd':
+        if (!strcmp(arg, "u8") || !strcmp(arg, "u16")) {
+            raw->bits = arg[1] == '8' ? 8 : 16;
+            raw->sampleformat = SAMPLEFORMAT_UINT;
+        }
+        else if (!strcmp(arg, "f16") || !strcmp(arg, "f32")) {
+            raw->bits = arg[1] == '1' ? 16 : 32;
+            raw->sampleformat = SAMPLEFORMAT_IEEEFP;
+        }
+        else {
+            fprintf(stderr, "tiffutils: dtype must be u8, u16, f16 or f32\n");
+            return -1;
+        }
+        break;
+    case 'm':
+        raw->samples = strtoul(arg, NULL, 10);
+        if (raw->samples != 1 && raw->samples != 3) {
+            fprintf(stderr, "tiffutils: samples must be 1 or 3\n");
+            return -1;
+        }
+        break;
+    default:
+        fputs(cli_usage, stderr);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cli_convert(int argc, char **argv) {
+    static const struct option options[] = {
+        {"out-dir", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 'j'},
+        {"compress", no_argument, NULL, 'c'},
+        {"cfa", required_argument, NULL, 'C'},
+        {"camera", required_argument, NULL, 'n'},
+        {"preview", required_argument, NULL, 'p'},
+        {"pyramid-levels", required_argument, NULL, 'l'},
+        {"size", required_argument, NULL, 'S'},
+        {"dtype", required_argument, NULL, 'd'},
+        {"samples", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0},
+    };
+    struct dng_options opts = {
+        .camera = "Unknown",
+        .pattern = CFA_RGGB,
+        .color_matrix1 = (float *) default_color_matrix1,
+        .color_matrix1_len = sizeof(default_color_matrix1) / sizeof(float),
+    };
+    struct strip_layout raw = {
+        .planar = PLANARCONFIG_CONTIG,
+        .samples = 1,
+        .bits = 16,
+        .sampleformat = SAMPLEFORMAT_UINT,
+    };
+    struct convert_args args = {
+        .opts = &opts,
+    };
+    struct cli_batch b = {
+        .file = convert_batch_file,
+        .arg = &args,
+    };
+    struct cli_files files;
+    const char *out_dir = NULL;
+    unsigned int threads = 0;
+    int c, err;
+
+    while ((c = getopt_long(argc, argv, "o:j:c", options, NULL)) != -1) {
+        switch (c) {
+        case 'o':
+            out_dir = optarg;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            opts.compression = 1;
+            break;
+        default:
+            err = cli_convert_option(c, optarg, &opts, &raw);
+            if (err) {
+                return 2;
+            }
+        }
+    }
+
+    if (cli_files(argc - optind, argv + optind, &files)) {
+        fprintf(stderr, "tiffutils: %s\n", dng_errmsg);
+        return 1;
+    }
+
+    args.raw = raw.width ? &raw : NULL;
+    err = cli_run(&b, &files, out_dir, ".dng", threads);
+
+    cli_files_free(argc - optind, &files);
+    return err;
+}
+
+/*
+ * Print the layout of an image as a line of tab separated fields: name,
+ * width, height, samples, bits, format, compression and CFA pattern
+ *
+ * @returns negative on error, as fprintf()
+ */
+static int cli_print_layout(FILE *f, const char *name, const struct strip_layout *l,
+                            int pattern) {
+    return fprintf(f, "%s\t%" PRIu32 "\t%" PRIu32 "\t%u\t%u\t%s\t%s\t%s\n", name,
+                   l->width, l->height, (unsigned int) l->samples, (unsigned int) l->bits,
+                   l->sampleformat == SAMPLEFORMAT_IEEEFP ? "float" : "uint",
+                   l->compression == COMPRESSION_NONE ? "none" :
+                   l->compression == COMPRESSION_ADOBE_DEFLATE ||
+                   l->compression == COMPRESSION_DEFLATE ? "deflate" : "other",
+                   pattern >= 0 ? cli_cfa_names[pattern] : "-");
+}
+
+/* Layouts read by a batch of info */
+struct info_args {
+    struct strip_layout *layouts;
+    int *patterns;
+};
+
+static int info_batch_file(void *arg, size_t i, const char *src, const char *dst) {
+    struct info_args *a = arg;
+    uint64_t *strips;
+    int err;
+
+    (void) dst;
+
+    err = open_image(src, 0, &a->layouts[i], &a->patterns[i], &strips);
+    free(strips);
+    return err;
+}
+
+static void info_batch_print(void *arg, size_t i, const char *src) {
+    struct info_args *a = arg;
+
+    cli_print_layout(stdout, src, &a->layouts[i], a->patterns[i]);
+}
+
+static int cli_info(int argc, char **argv) {
+    static const struct option options[] = {
+        {"threads", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0},
+    };
+    struct info_args args = {0};
+    struct cli_batch b = {
+        .file = info_batch_file,
+        .print = info_batch_print,
+        .arg = &args,
+    };
+    struct cli_files files;
+    unsigned int threads = 0;
+    int c, err;
+
+    while ((c = getopt_long(argc, argv, "j:", options, NULL)) != -1) {
+        switch (c) {
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fputs(cli_usage, stderr);
+            return 2;
+        }
+    }
+
+    if (cli_files(argc - optind, argv + optind, &files)) {
+        fprintf(stderr, "tiffutils: %s\n", dng_errmsg);
+        return 1;
+    }
+
+    args.layouts = calloc(files.count + 1, sizeof(*args.layouts));
+    args.patterns = calloc(files.count + 1, sizeof(*args.patterns));
+    if (!args.layouts || !args.patterns) {
+        fprintf(stderr, "tiffutils: out of memory\n");
+        err = 1;
+    }
+    else {
+        err = cli_run(&b, &files, NULL, NULL, threads);
+    }
+
+    free(args.patterns);
+    free(args.layouts);
+    cli_files_free(argc - optind, &files);
+    return err;
+}
+
+/* Options of a batch of DNGs recompressed */
+struct recompress_args {
+    uint16_t compression;
+    struct rate_limit rate;
+};
+
+static int recompress_batch_file(void *arg, size_t i, const char *src, const char *dst) {
+    struct recompress_args *a = arg;
+
+    (void) i;
+
+    return recompress_file(src, dst, a->compression, &a->rate);
+}
+
+static int cli_recompress(int argc, char **argv) {
+    static const struct option options[] = {
+        {"out-dir", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 'j'},
+        {"compression", required_argument, NULL, 'c'},
+        {"rate-limit", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    struct recompress_args args = {
+        .compression = COMPRESSION_ADOBE_DEFLATE,
+    };
+    struct cli_batch b = {
+        .file = recompress_batch_file,
+        .arg = &args,
+    };
+    struct cli_files files;
+    const char *out_dir = NULL;
+    unsigned int threads = 0;
+    double rate = 0;
+    int c, err;
+
+    while ((c = getopt_long(argc, argv, "o:j:c:", options, NULL)) != -1) {
+        switch (c) {
+        case 'o':
+            out_dir = optarg;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            if (!strcmp(optarg, "deflate")) {
+                args.compression = COMPRESSION_ADOBE_DEFLATE;
+            }
+            else if (!strcmp(optarg, "none")) {
+                args.compression = COMPRESSION_NONE;
+            }
+            else {
+                fprintf(stderr, "tiffutils: compression must be deflate or none\n");
+                return 2;
+            }
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        default:
+            fputs(cli_usage, stderr);
+            return 2;
+        }
+    }
+
+    if (cli_files(argc - optind, argv + optind, &files)) {
+        fprintf(stderr, "tiffutils: %s\n", dng_errmsg);
+        return 1;
+    }
+
+    pthread_mutex_init(&args.rate.lock, NULL);
+    args.rate.rate = rate * 1e6;
+    args.rate.start = monotonic_ns();
+
+    err = cli_run(&b, &files, out_dir, NULL, threads);
+
+    pthread_mutex_destroy(&args.rate.lock);
+    cli_files_free(argc - optind, &files);
+    return err;
+}
+
+/* Options of a batch of DNGs exported */
+struct export_args {
+    int format;
+    uint32_t size;
+    int quality;
+};
+
+static int export_batch_file(void *arg, size_t i, const char *src, const char *dst) {
+    const struct export_args *a = arg;
+
+    (void) i;
+
+    return export_image(src, dst, a->format, a->size, a->quality);
+}
+
+static int cli_export(int argc, char **argv) {
+    static const struct option options[] = {
+        {"out-dir", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 'j'},
+        {"format", required_argument, NULL, 'f'},
+        {"size", required_argument, NULL, 's'},
+        {"quality", required_argument, NULL, 'q'},
+        {NULL, 0, NULL, 0},
+    };
+    struct export_args args = {
+        .format = EXPORT_JPEG,
+        .size = 1024,
+        .quality = 90,
+    };
+    struct cli_batch b = {
+        .file = export_batch_file,
+        .arg = &args,
+    };
+    struct cli_files files;
+    const char *out_dir = NULL, *ext = ".jpg";
+    unsigned int threads = 0;
+    int c, err;
+
+    while ((c = getopt_long(argc, argv, "o:j:f:s:q:", options, NULL)) != -1) {
+        switch (c) {
+        case 'o':
+            out_dir = optarg;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "jpeg") || !strcmp(optarg, "jpg")) {
+                args.format = EXPORT_JPEG;
+                ext = ".jpg";
+            }
+            else if (!strcmp(optarg, "png")) {
+                args.format = EXPORT_PNG;
+                ext = ".png";
+            }
+            else {
+                fprintf(stderr, "tiffutils: format must be jpeg or png\n");
+                return 2;
+            }
+            break;
+        case 's':
+            args.size = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            args.quality = atoi(optarg);
+            if (args.quality < 1 || args.quality > 100) {
+                fprintf(stderr, "tiffutils: quality must be between 1 and 100\n");
+                return 2;
+            }
+            break;
+        default:
+            fputs(cli_usage, stderr);
+            return 2;
+        }
+    }
+
+    if (!out_dir) {
+        fprintf(stderr, "tiffutils: export needs --out-dir\n");
+        return 2;
+    }
+
+    if (cli_files(argc - optind, argv + optind, &files)) {
+        fprintf(stderr, "tiffutils: %s\n", dng_errmsg);
+        return 1;
+    }
+
+    err = cli_run(&b, &files, out_dir, ext, threads);
+
+    cli_files_free(argc - optind, &files);
+    return err;
+}
+
+/*
+ * Watch folder
+ *
+ * Captures are converted as they are completed in the input directory:
+ * closed after writing, or renamed into it.  Raw and .npy images are saved
+ * as DNGs, and DNGs are copied as they are, or recompressed with -c, each
+ * followed by an optional JPEG preview and a line in OUT/index.tsv.  At
+ * most one file per thread is in flight, each streamed through a mapping or
+ * a bounded buffer, so memory stays bounded however far the watcher falls
+ * behind; events wait in the kernel meanwhile, and a queue overflow
+ * rescans the directory.
+ *
+ * Completed inputs are appended to a state file, so a restarted watcher
+ * picks up the files that arrived while it was stopped.  A file that fails
+ * is retried when it is completed again, or on restart.
+ */
+
+enum watch_kind {
+    WATCH_IGNORE = 0,
+    WATCH_NPY,
+    WATCH_RAW,
+    WATCH_DNG,
+};
+
+/* Set of file names, by open addressing */
+struct name_set {
+    char **slots;
+    size_t size;    /* power of two, or 0 */
+    size_t count;
+};
+
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+
+    while (*name) {
+        h = (h ^ (uint8_t) *name++) * 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/*
+ * Add a name to a set
+ *
+ * @returns 1 if added, 0 if already present, negative enum dng_error on error
+ */
+static int name_set_add(struct name_set *s, const char *name) {
+    size_t i;
+
+    if (2 * (s->count + 1) > s->size) {
+        size_t size = s->size ? 2 * s->size : 1024;
+        char **slots = calloc(size, sizeof(*slots));
+
+        if (!slots) {
+            return dng_fail(DNG_ENOMEM, "Unable to allocate name set");
+        }
+
+        for (size_t j = 0; j < s->size; j++) {
+            if (s->slots[j]) {
+                for (i = name_hash(s->slots[j]) & (size - 1); slots[i]; i = (i + 1) & (size - 1));
+                slots[i] = s->slots[j];
+            }
+        }
+
+        free(s->slots);
+        s->slots = slots;
+        s->size = size;
+    }
+
+    for (i = name_hash(name) & (s->size - 1); s->slots[i]; i = (i + 1) & (s->size - 1)) {
+        if (!strcmp(s->slots[i], name)) {
+            return 0;
+        }
+    }
+
+    s->slots[i] = strdup(name);
+    if (!s->slots[i]) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate name set");
+    }
+    s->count++;
+
+    return 1;
+}
+
+static int name_set_contains(const struct name_set *s, const char *name) {
+    if (!s->size) {
+        return 0;
+    }
+
+    for (size_t i = name_hash(name) & (s->size - 1); s->slots[i]; i = (i + 1) & (s->size - 1)) {
+        if (!strcmp(s->slots[i], name)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void name_set_free(struct name_set *s) {
+    for (size_t i = 0; i < s->size; i++) {
+        free(s->slots[i]);
+    }
+    free(s->slots);
+}
+
+struct watch {
+    const char *in_dir;
+    const char *out_dir;
+    const struct dng_options *opts;
+    const struct strip_layout *raw;     /* NULL to ignore raw files */
+    uint16_t compression;               /* of recompressed DNGs, 0 to copy them */
+    uint32_t jpeg;                      /* JPEG preview size, 0 for none */
+    unsigned int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    struct name_set done;               /* completed inputs */
+    struct watch_job *jobs;             /* in flight */
+    unsigned int inflight;
+    FILE *state;
+    FILE *index;
+};
+
+struct watch_job {
+    struct watch *w;
+    enum watch_kind kind;
+    int again;          /* completed again while being converted */
+    struct watch_job *next;
+    char name[];
+};
+
+static enum watch_kind watch_kind(const struct watch *w, const char *name) {
+    const char *ext = strrchr(name, '.');
+
+    if (name[0] == '.' || !ext) {
+        return WATCH_IGNORE;
+    }
+    if (!strcasecmp(ext, ".npy")) {
+        return WATCH_NPY;
+    }
+    if (!strcasecmp(ext, ".raw") && w->raw) {
+        return WATCH_RAW;
+    }
+    if (!strcasecmp(ext, ".dng")) {
+        return WATCH_DNG;
+    }
+
+    return WATCH_IGNORE;
+}
+
+/*
+ * Index a converted file and mark its input complete, durably, in that
+ * order, so a crash between them only indexes it twice
+ */
+static int watch_record(struct watch *w, const char *name, const char *dst) {
+    struct strip_layout l;
+    uint64_t *strips;
+    int pattern, err;
+
+    err = open_image(dst, 0, &l, &pattern, &strips);
+    if (err) {
+        return err;
+    }
+    free(strips);
+
+    pthread_mutex_lock(&w->lock);
+    if (cli_print_layout(w->index, strrchr(dst, '/') + 1, &l, pattern) < 0 ||
+        fflush(w->index) || fdatasync(fileno(w->index))) {
+        err = dng_fail(DNG_EIO, "Failed to write index");
+    }
+    else if (fprintf(w->state, "%s\n", name) < 0 || fflush(w->state) ||
+             fdatasync(fileno(w->state))) {
+        err = dng_fail(DNG_EIO, "Failed to write state");
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return err;
+}
+
+/*
+ * Copy a file as it is, through a bounded buffer
+ *
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int copy_file(const char *src, const char *dst) {
+    uint8_t *buf;
+    int in, out, err = 0;
+
+    buf = malloc(1 << 20);
+    if (!buf) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate copy buffer");
+    }
+
+    in = open(src, O_RDONLY | O_CLOEXEC);
+    out = in < 0 ? -1 : open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (in < 0 || out < 0) {
+        err = dng_fail(DNG_EIO, "Failed to open %s", in < 0 ? src : dst);
+        goto out;
+    }
+
+    for (;;) {
+        ssize_t n = read(in, buf, 1 << 20), done = 0;
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            err = dng_fail(DNG_EIO, "Failed to read %s", src);
+            break;
+        }
+        if (!n) {
+            break;
+        }
+
+        while (done < n) {
+            ssize_t m = write(out, buf + done, n - done);
+
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                err = dng_fail(DNG_EIO, "Failed to write %s", dst);
+                goto out;
+            }
+            done += m;
+        }
+    }
+
+out:
+    if (out >= 0 && close(out) && !err) {
+        err = dng_fail(DNG_EIO, "Failed to write %s", dst);
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    free(buf);
+    return err;
+}
+
+/*
+ * Convert one file and record it
+ *
+ * @returns 0 on success, negative enum dng_error on error, after reporting
+ */
+static int watch_convert(struct watch *w, const struct watch_job *job) {
+    char *src = NULL, *dst, *tmp = NULL, *jpg = NULL;
+    int err;
+
+    if (asprintf(&src, "%s/%s", w->in_dir, job->name) < 0) {
+        src = NULL;
+    }
+    dst = src ? output_path(src, w->out_dir, ".dng") : NULL;
+    if (dst && asprintf(&tmp, "%s.tmp", dst) < 0) {
+        tmp = NULL;
+    }
+    if (src && w->jpeg) {
+        jpg = output_path(src, w->out_dir, ".jpg");
+    }
+
+    if (!tmp || (w->jpeg && !jpg)) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate paths");
+        goto out;
+    }
+
+    /* Written aside, so the output directory only holds complete files */
+    if (job->kind == WATCH_DNG && w->compression) {
+        err = recompress_file(src, tmp, w->compression, NULL);
+    }
+    else if (job->kind == WATCH_DNG) {
+        err = copy_file(src, tmp);
+    }
+    else {
+        err = convert_file(src, tmp, job->kind == WATCH_RAW ? w->raw : NULL, w->opts);
+    }
+    if (!err && rename(tmp, dst)) {
+        err = dng_fail(DNG_EIO, "Failed to rename %s", tmp);
+    }
+    if (err) {
+        unlink(tmp);
+        goto out;
+    }
+
+    if (jpg) {
+        err = export_image(dst, jpg, EXPORT_JPEG, w->jpeg, 90);
+        if (err) {
+            goto out;
+        }
+    }
+
+    err = watch_record(w, job->name, dst);
+
+out:
+    if (err) {
+        fprintf(stderr, "tiffutils: %s/%s: %s\n", w->in_dir, job->name, dng_errmsg);
+    }
+
+    free(jpg);
+    free(tmp);
+    free(dst);
+    free(src);
+    return err;
+}
+
+static void watch_job(void *arg) {
+    struct watch_job *job = arg;
+    struct watch *w = job->w;
+    struct watch_job **link;
+    int err;
+
+    /* Converted again if the file is completed again meanwhile */
+    for (;;) {
+        err = watch_convert(w, job);
+
+        pthread_mutex_lock(&w->lock);
+        if (!job->again) {
+            break;
+        }
+        job->again = 0;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    /* Failed files are retried when they are next completed */
+    if (!err && name_set_add(&w->done, job->name) < 0) {
+        fprintf(stderr, "tiffutils: %s\n", dng_errmsg);
+    }
+
+    for (link = &w->jobs; *link != job; link = &(*link)->next);
+    *link = job->next;
+    w->inflight--;
+    pthread_cond_signal(&w->idle);
+    pthread_mutex_unlock(&w->lock);
+
+    free(job);
+}
+
+/*
+ * Queue a completed file for conversion, waiting for a free thread, unless
+ * it is ignored or already converted.  A file still being converted is
+ * converted again once its conversion finishes.
+ */
+static int watch_submit(struct watch *w, const char *name) {
+    enum watch_kind kind = watch_kind(w, name);
+    struct watch_job *job;
+
+    if (kind == WATCH_IGNORE) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    if (name_set_contains(&w->done, name)) {
+        pthread_mutex_unlock(&w->lock);
+        return 0;
+    }
+
+    for (job = w->jobs; job; job = job->next) {
+        if (!strcmp(job->name, name)) {
+            job->again = 1;
+            pthread_mutex_unlock(&w->lock);
+            return 0;
+        }
+    }
+
+    job = malloc(sizeof(*job) + strlen(name) + 1);
+    if (!job) {
+        pthread_mutex_unlock(&w->lock);
+        return dng_fail(DNG_ENOMEM, "Unable to allocate job");
+    }
+    job->w = w;
+    job->kind = kind;
+    job->again = 0;
+    strcpy(job->name, name);
+
+    while (w->inflight >= w->threads) {
+        pthread_cond_wait(&w->idle, &w->lock);
+    }
+    job->next = w->jobs;
+    w->jobs = job;
+    w->inflight++;
+    pthread_mutex_unlock(&w->lock);
+
+    if (pool_submit(watch_job, job)) {
+        pthread_mutex_lock(&w->lock);
+        w->jobs = job->next;
+        w->inflight--;
+        pthread_mutex_unlock(&w->lock);
+        free(job);
+        return dng_fail(DNG_ENOMEM, "Unable to allocate task");
+    }
+
+    return 0;
+}
+
+/* Queue every file already in the input directory */
+static int watch_scan(struct watch *w) {
+    struct dirent *entry;
+    DIR *dir;
+    int err = 0;
+
+    dir = opendir(w->in_dir);
+    if (!dir) {
+        return dng_fail(DNG_EIO, "Failed to open %s", w->in_dir);
+    }
+
+    while (!err && (entry = readdir(dir))) {
+        if (entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN) {
+            err = watch_submit(w, entry->d_name);
+        }
+    }
+
+    closedir(dir);
+    return err;
+}
+
+/*
+ * Open the state file, locked against other watchers, and load the inputs
+ * already completed
+ */
+static int watch_open_state(struct watch *w, const char *path) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int err = 0;
+
+    w->state = fopen(path, "a+");
+    if (!w->state) {
+        return dng_fail(DNG_EIO, "Failed to open %s", path);
+    }
+
+    if (flock(fileno(w->state), LOCK_EX | LOCK_NB)) {
+        return dng_fail(DNG_EIO, "%s is in use by another watcher", path);
+    }
+
+    rewind(w->state);
+    while (err >= 0 && (len = getline(&line, &line_size, w->state)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len) {
+            err = name_set_add(&w->done, line);
+        }
+    }
+
+    free(line);
+    return err < 0 ? err : 0;
+}
+
+/*
+ * Convert files completed in the input directory until SIGINT or SIGTERM,
+ * then finish those in flight
+ */
+static int watch_run(struct watch *w) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2];
+    sigset_t signals;
+    int in_fd, sig_fd, stop = 0, err = 0;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    sig_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    in_fd = inotify_init1(IN_CLOEXEC);
+    if (sig_fd < 0 || in_fd < 0) {
+        err = dng_fail(DNG_EIO, "Failed to create watch");
+        goto out;
+    }
+
+    /* Watch before scanning, so no file is missed in between */
+    if (inotify_add_watch(in_fd, w->in_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        err = dng_fail(DNG_EIO, "Failed to watch %s", w->in_dir);
+        goto out;
+    }
+
+    err = watch_scan(w);
+
+    fds[0] = (struct pollfd) {.fd = in_fd, .events = POLLIN};
+    fds[1] = (struct pollfd) {.fd = sig_fd, .events = POLLIN};
+
+    while (!err && !stop) {
+        ssize_t len;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = dng_fail(DNG_EIO, "Failed to wait for files");
+            break;
+        }
+
+        if (fds[1].revents) {
+            stop = 1;
+            break;
+        }
+
+        len = read(in_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            err = dng_fail(DNG_EIO, "Failed to read events");
+            break;
+        }
+
+        for (char *p = buf; !err && p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                err = watch_scan(w);
+            }
+            else if (ev->mask & IN_IGNORED) {
+                err = dng_fail(DNG_EIO, "%s was removed", w->in_dir);
+            }
+            else if (ev->len && !(ev->mask & IN_ISDIR)) {
+                err = watch_submit(w, ev->name);
+            }
+
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+
+out:
+    pthread_mutex_lock(&w->lock);
+    while (w->inflight) {
+        pthread_cond_wait(&w->idle, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (sig_fd >= 0) {
+        close(sig_fd);
+    }
+    return err;
+}
+
+static int cli_watch(int argc, char **argv) {
+    static const struct option options[] = {
+        {"in", required_argument, NULL, 'i'},
+        {"out", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 'j'},
+        {"compress", no_argument, NULL, 'c'},
+        {"jpeg", required_argument, NULL, 'J'},
+        {"state", required_argument, NULL, 's'},
+        {"cfa", required_argument, NULL, 'C'},
+        {"camera", required_argument, NULL, 'n'},
+        {"preview", required_argument, NULL, 'p'},
+        {"pyramid-levels", required_argument, NULL, 'l'},
+        {"size", required_argument, NULL, 'S'},
+        {"dtype", required_argument, NULL, 'd'},
+        {"samples", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0},
+    };
+    struct dng_options opts = {
+        .camera = "Unknown",
+        .pattern = CFA_RGGB,
+        .color_matrix1 = (float *) default_color_matrix1,
+        .color_matrix1_len = sizeof(default_color_matrix1) / sizeof(float),
+    };
+    struct strip_layout raw = {
+        .planar = PLANARCONFIG_CONTIG,
+        .samples = 1,
+        .bits = 16,
+        .sampleformat = SAMPLEFORMAT_UINT,
+    };
+    struct watch w = {
+        .opts = &opts,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .idle = PTHREAD_COND_INITIALIZER,
+    };
+    char *state_path = NULL, *index_path = NULL;
+    char in_real[PATH_MAX], out_real[PATH_MAX];
+    unsigned int threads = 0;
+    int c, err;
+
+    while ((c = getopt_long(argc, argv, "i:o:j:c", options, NULL)) != -1) {
+        switch (c) {
+        case 'i':
+            w.in_dir = optarg;
+            break;
+        case 'o':
+            w.out_dir = optarg;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            opts.compression = 1;
+            w.compression = COMPRESSION_ADOBE_DEFLATE;
+            break;
+        case 'J':
+            w.jpeg = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            state_path = strdup(optarg);
+            break;
+        default:
+            err = cli_convert_option(c, optarg, &opts, &raw);
+            if (err) {
+                return 2;
+            }
+        }
+    }
+
+    if (!w.in_dir || !w.out_dir || optind < argc) {
+        fprintf(stderr, "tiffutils: watch needs --in and --out, and no files\n");
+        return 2;
+    }
+
+    /* Outputs in the input directory would be converted again */
+    if (!realpath(w.in_dir, in_real) || !realpath(w.out_dir, out_real)) {
+        fprintf(stderr, "tiffutils: %s: %s\n", realpath(w.in_dir, in_real) ? w.out_dir :
+                w.in_dir, strerror(errno));
+        return 1;
+    }
+    if (!strcmp(in_real, out_real)) {
+        fprintf(stderr, "tiffutils: --in and --out must be different directories\n");
+        return 2;
+    }
+
+    w.raw = raw.width ? &raw : NULL;
+    w.threads = threads ? threads : (unsigned int) pool_threads();
+
+    if ((!state_path && asprintf(&state_path, "%s/.tiffutils-watch", w.out_dir) < 0) ||
+        asprintf(&index_path, "%s/index.tsv", w.out_dir) < 0) {
+        fprintf(stderr, "tiffutils: out of memory\n");
+        return 1;
+    }
+
+    err = watch_open_state(&w, state_path);
+    if (!err) {
+        w.index = fopen(index_path, "a");
+        if (!w.index) {
+            err = dng_fail(DNG_EIO, "Failed to open %s", index_path);
+        }
+    }
+    if (!err) {
+        err = watch_run(&w);
+    }
+    if (err) {
+        fprintf(stderr, "tiffutils: %s\n", dng_errmsg);
+    }
+
+    if (w.index) {
+        fclose(w.index);
+    }
+    if (w.state) {
+        fclose(w.state);
+    }
+    name_set_free(&w.done);
+    free(index_path);
+    free(state_path);
+    return err ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct {
+        const char *name;
+        int (*run)(int argc, char **argv);
+    } commands[] = {
+        {"convert", cli_convert},
+        {"info", cli_info},
+        {"recompress", cli_recompress},
+        {"export", cli_export},
+        {"watch", cli_watch},
+    };
+
+    if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+        fputs(cli_usage, argc < 2 ? stderr : stdout);
+        return argc < 2 ? 2 : 0;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+    engine_init();
+
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (!strcmp(argv[1], commands[i].name)) {
+            return commands[i].run(argc - 1, argv + 1);
+        }
+    }
+
+    fprintf(stderr, "tiffutils: unknown command %s\n\n%s", argv[1], cli_usage);
+    return 2;
+}
@@ -0,0 +1,261 @@
+/*
+ * libtiffutils engine
+ *
+ * The interface between the parts of the engine: libtiffutils.c, built as
+ * the library; cli.c, the tiffutils program; and the Python module,
+ * tiffutils.c with pyengine.c.  Everything declared here has hidden
+ * visibility, so the library exports only the functions of tiffutils.h.
+ */
+
+#ifndef TIFFUTILS_ENGINE_H
+#define TIFFUTILS_ENGINE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+#include <png.h>
+#include <tiffio.h>
+#include <zlib.h>
+
+#include "tiffutils.h"
+
+#ifndef TIFFTAG_CFAREPEATPATTERNDIM
+#error libtiff with CFA pattern support required
+#endif
+
+#pragma GCC visibility push(hidden)
+
+enum illuminant {
+    ILLUMINANT_UNKNOWN = 0,
+    ILLUMINANT_DAYLIGHT,
+    ILLUMINANT_FLUORESCENT,
+    ILLUMINANT_TUNGSTEN,
+    ILLUMINANT_FLASH,
+    ILLUMINANT_FINE_WEATHER = 9,
+    ILLUMINANT_CLOUDY_WEATHER,
+    ILLUMINANT_SHADE,
+    ILLUMINANT_DAYLIGHT_FLUORESCENT,
+    ILLUMINANT_DAY_WHITE_FLUORESCENT,
+    ILLUMINANT_COOL_WHITE_FLUORESCENT,
+    ILLUMINANT_WHITE_FLUORESCENT,
+    ILLUMINANT_STANDARD_A = 17,
+    ILLUMINANT_STANDARD_B,
+    ILLUMINANT_STANDARD_C,
+    ILLUMINANT_D55,
+    ILLUMINANT_D65,
+    ILLUMINANT_D75,
+    ILLUMINANT_D50,
+    ILLUMINANT_ISO_TUNGSTEN,
+    ILLUMINANT_OTHER = 255,
+};
+
+enum cfa_pattern {
+    CFA_BGGR = 0,
+    CFA_GBRG,
+    CFA_GRBG,
+    CFA_RGGB,
+    CFA_NUM_PATTERNS,
+};
+
+/*
+ * Engine errors
+ *
+ * The native engine runs without the GIL, so it cannot raise exceptions
+ * itself.  Failures return one of these codes, leaving a description in
+ * dng_errmsg of the failing thread, and are raised by the caller once the
+ * GIL is held again.
+ */
+enum dng_error {
+    DNG_EIO = TDNG_EIO,             /* IOError */
+    DNG_EFORMAT = TDNG_EFORMAT,     /* ValueError, unsupported or invalid layout */
+    DNG_ENOMEM = TDNG_ENOMEM,       /* MemoryError */
+};
+
+/*
+ * Strip layout
+ *
+ * Describes how the pixels of one image directory are split into strips and
+ * encoded, and how they are held in memory.  Samples are stored in memory at
+ * their natural size, except 24-bit floats, which are held as float32.
+ * Pixels are always interleaved in memory.  With separate planes, each strip
+ * holds the rows of one sample plane, with the strips of each plane in turn.
+ */
+struct strip_layout {
+    uint32_t width;
+    uint32_t height;
+    uint32_t rowsperstrip;
+    uint16_t samples;       /* samples per pixel */
+    uint16_t planar;        /* PLANARCONFIG_* */
+    uint16_t bits;          /* bits per sample in the file */
+    uint16_t sampleformat;
+    uint16_t compression;
+    uint16_t predictor;
+    int byteswapped;        /* file byte order differs from host */
+    int streamed;           /* image memory is a shared file mapping, advised
+                               as strips are done with */
+};
+
+/* CinemaDNG tags, unknown to libtiff */
+#ifndef TIFFTAG_TIMECODES
+#define TIFFTAG_TIMECODES   51043
+#endif
+#ifndef TIFFTAG_FRAMERATE
+#define TIFFTAG_FRAMERATE   51044
+#endif
+struct dng_options {
+    const char *camera;
+    unsigned int pattern;
+    float *color_matrix1;
+    int color_matrix1_len;
+    float *color_matrix2;   /* NULL to omit */
+    int color_matrix2_len;
+    unsigned short calibration_illuminant1;     /* 0 to omit */
+    unsigned short calibration_illuminant2;     /* 0 to omit */
+    int compression;
+    uint32_t preview;       /* maximum preview dimension, 0 for no preview */
+    uint32_t pyramid_levels;    /* reduced resolution levels to write */
+    double timestamp;       /* seconds since the epoch for DateTime, 0 to omit */
+    const uint8_t *timecode;    /* SMPTE time code for TimeCodes, NULL to omit */
+    double frame_rate;      /* frames per second for FrameRate, 0 to omit */
+};
+
+/* Strips of a written raw image, recorded for frame indexes */
+struct strip_table {
+    uint32_t count;
+    uint64_t *offsets;      /* count offsets, then count byte counts */
+};
+
+/* An 8-bit RGB preview image */
+struct preview {
+    uint8_t *rgb;
+    uint32_t width;
+    uint32_t height;
+};
+
+enum export_format {
+    EXPORT_JPEG,
+    EXPORT_PNG,
+};
+
+/*
+ * File format for write_dng() output
+ *
+ * Classic TIFF offsets are 32 bits, so files over 4 GiB must be BigTIFF,
+ * which fewer readers support.
+ */
+enum bigtiff_mode {
+    BIGTIFF_NEVER,
+    BIGTIFF_ALWAYS,
+    BIGTIFF_AUTO,       /* BigTIFF only if the file could reach 4 GiB */
+};
+
+/* A TIFF file read directly */
+struct raw_tiff {
+    int fd;
+    uint64_t size;
+    int bigtiff;
+    int swapped;
+};
+
+/*
+ * A budget of bytes read and written per second, shared by every file
+ */
+struct rate_limit {
+    pthread_mutex_t lock;
+    uint64_t rate;          /* bytes per second, 0 for unlimited */
+    uint64_t start;         /* monotonic_ns() when the budget started */
+    uint64_t bytes;         /* bytes spent since */
+};
+
+/* Default ColorMatrix1, when none provided */
+extern const float default_color_matrix1[9];
+
+/* Description of the last error on each thread, set by dng_fail() */
+extern __thread char dng_errmsg[256];
+
+int dng_fail(int err, const char *fmt, ...);
+
+void engine_init(void);
+
+/* Worker pool */
+int pool_threads(void);
+int pool_submit(void (*fn)(void *), void *arg);
+void parallel_for(size_t count, void (*fn)(void *, size_t), void *arg);
+
+/* Strip layouts and codecs */
+int layout_mem_bytes(const struct strip_layout *l);
+int layout_separate(const struct strip_layout *l);
+size_t layout_mem_rowbytes(const struct strip_layout *l);
+uint32_t layout_plane_strips(const struct strip_layout *l);
+uint32_t layout_strips(const struct strip_layout *l);
+uint32_t layout_strip_rows(const struct strip_layout *l, uint32_t strip);
+int layout_native(const struct strip_layout *l);
+int decode_strip(const struct strip_layout *l, const uint8_t *raw,
+                 size_t raw_size, uint8_t *dest, uint32_t rows);
+uint8_t *strip_mem(const struct strip_layout *l, uint8_t *mem, uint32_t strip);
+
+/* Reading */
+int read_strips(TIFF *tiff, const struct strip_layout *l, void *dest);
+int read_layout(TIFF *tiff, struct strip_layout *l);
+int select_raw_directory(TIFF *tiff);
+int select_level_directory(TIFF *tiff, uint32_t level);
+int read_cfa_pattern(TIFF *tiff);
+int load_image(const char *filename, uint32_t level, struct strip_layout *l,
+               int *pattern, void **data);
+int open_image(const char *filename, uint32_t level, struct strip_layout *l,
+               int *pattern, uint64_t **strips);
+
+/* Writing */
+int capture_strips(TIFF *tiff, const struct strip_layout *l,
+                   struct strip_table *table);
+int write_dng(TIFF *tiff, const struct dng_options *opts,
+              struct strip_layout *l, const void *data,
+              struct strip_table *strips);
+const char *dng_open_mode(enum bigtiff_mode mode, const struct dng_options *opts,
+                          const struct strip_layout *l);
+
+/* Previews and export */
+int quicklook(TIFF *tiff, uint32_t max_size, struct preview *out);
+int export_image(const char *src, const char *dst, int format,
+                 uint32_t size, int quality);
+char *output_path(const char *path, const char *dir, const char *ext);
+
+/* Raw TIFF access */
+int pread_full(int fd, uint8_t *buf, size_t size, uint64_t offset);
+uint64_t read_uint(const uint8_t *p, int bytes, int swapped);
+int read_ifd_link(int fd, int bigtiff, int swapped, uint64_t ifd, uint64_t *next);
+int raw_type_size(uint16_t type);
+int write_ifd_link(const struct raw_tiff *f, uint64_t ifd, uint64_t next);
+int raw_tiff_open(const char *path, int flags, struct raw_tiff *f);
+
+/* Recompression */
+uint64_t monotonic_ns(void);
+int recompress_file(const char *src, const char *dst, uint16_t compression,
+                    struct rate_limit *rate);
+
+#pragma GCC visibility pop
+
+#endif
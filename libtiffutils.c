@@ -0,0 +1,4448 @@
+/*
+ * libtiffutils
+ *
+ * The DNG engine, free of CPython, and the interface of tiffutils.h.  The
+ * tiffutils program and the Python module are built on the same engine,
+ * through the internal interface of engine.h.
+ */
+
+#include "engine.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum tiff_cfa_color {
+    CFA_RED = 0,
+    CFA_GREEN = 1,
+    CFA_BLUE = 2,
+};
+
+static const char cfa_patterns[4][CFA_NUM_PATTERNS] = {
+    [CFA_BGGR] = {CFA_BLUE, CFA_GREEN, CFA_GREEN, CFA_RED},
+    [CFA_GBRG] = {CFA_GREEN, CFA_BLUE, CFA_RED, CFA_GREEN},
+    [CFA_GRBG] = {CFA_GREEN, CFA_RED, CFA_BLUE, CFA_GREEN},
+    [CFA_RGGB] = {CFA_RED, CFA_GREEN, CFA_GREEN, CFA_BLUE},
+};
+
+/* Default ColorMatrix1, when none provided */
+const float default_color_matrix1[] = {
+     2.005, -0.771, -0.269,
+    -0.752,  1.688,  0.064,
+    -0.149,  0.283,  0.745
+};
+
+/* DNG 1.5 predictors, not yet named by libtiff */
+#ifndef PREDICTOR_HORIZONTALX2
+#define PREDICTOR_HORIZONTALX2      34892
+#define PREDICTOR_HORIZONTALX4      34893
+#define PREDICTOR_FLOATINGPOINTX2   34894
+#define PREDICTOR_FLOATINGPOINTX4   34895
+#endif
+
+/* Target uncompressed size of each written strip */
+#define STRIP_TARGET_BYTES  (256*1024)
+
+/* Upper bound on worker threads */
+#define POOL_MAX_THREADS    256
+
+/*
+ * Native worker pool
+ *
+ * A fixed set of worker threads, started on first use and shared by every
+ * parallel operation of the engine.  Work is submitted either as independent
+ * tasks, or as a parallel loop in which the calling thread participates.
+ * Loops started from a worker thread run inline, so nested parallelism
+ * cannot deadlock the pool.
+ */
+
+struct pool_task {
+    void (*fn)(void *arg);
+    void *arg;
+    int heap;   /* task was allocated by pool_submit() */
+    struct pool_task *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pool_task *head, *tail;
+    int nthreads;   /* workers started */
+    int limit;      /* workers to use, 0 until first use */
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread int pool_in_worker;
+
+static void *pool_worker(void *unused) {
+    struct pool_task *task;
+
+    pool_in_worker = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.head) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+
+        task = pool.head;
+        pool.head = task->next;
+        if (!pool.head) {
+            pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        task->fn(task->arg);
+        if (task->heap) {
+            free(task);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Number of threads parallel operations should use
+ */
+int pool_threads(void) {
+    long cpus;
+
+    if (!pool.limit) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.limit = cpus < 1 ? 1 : cpus > POOL_MAX_THREADS ? POOL_MAX_THREADS : cpus;
+    }
+
+    return pool.limit;
+}
+
+/*
+ * Start workers up to the thread limit.  Called with pool.lock held.
+ *
+ * @returns number of running workers
+ */
+static int pool_start_locked(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int want = pool_threads();
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (pool.nthreads < want) {
+        if (pthread_create(&thread, &attr, pool_worker, NULL)) {
+            break;
+        }
+        pool.nthreads++;
+    }
+
+    pthread_attr_destroy(&attr);
+    return pool.nthreads;
+}
+
+static void pool_enqueue_locked(struct pool_task *task) {
+    task->next = NULL;
+    if (pool.tail) {
+        pool.tail->next = task;
+    }
+    else {
+        pool.head = task;
+    }
+    pool.tail = task;
+}
+
+/*
+ * Run fn(arg) on a worker, without waiting for it
+ *
+ * Runs fn inline if no worker can be started.
+ *
+ * @returns 0 on success, -1 if the task could not be allocated
+ */
+int pool_submit(void (*fn)(void *), void *arg) {
+    struct pool_task *task = malloc(sizeof(*task));
+
+    if (!task) {
+        return -1;
+    }
+
+    task->fn = fn;
+    task->arg = arg;
+    task->heap = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool_start_locked() < 1) {
+        pthread_mutex_unlock(&pool.lock);
+        free(task);
+        fn(arg);
+        return 0;
+    }
+    pool_enqueue_locked(task);
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    return 0;
+}
+
+/*
+ * Workers do not survive fork(), so the child starts over with an empty pool
+ */
+static void pool_atfork_child(void) {
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.head = pool.tail = NULL;
+    pool.nthreads = 0;
+}
+
+struct pool_loop {
+    void (*fn)(void *arg, size_t index);
+    void *arg;
+    size_t count;
+    size_t next;        /* next index to claim */
+    int helpers;        /* helpers not yet finished, under pool.lock */
+    pthread_cond_t done;
+};
+
+static void pool_loop_run(struct pool_loop *loop) {
+    size_t i;
+
+    while ((i = __sync_fetch_and_add(&loop->next, 1)) < loop->count) {
+        loop->fn(loop->arg, i);
+    }
+}
+
+static void pool_loop_helper(void *arg) {
+    struct pool_loop *loop = arg;
+
+    pool_loop_run(loop);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--loop->helpers == 0) {
+        pthread_cond_signal(&loop->done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Run fn(arg, i) for every i in [0, count) across the worker pool
+ *
+ * Returns once every call has completed.  The calling thread takes part in
+ * the loop, and helpers still queued when the work runs out are withdrawn
+ * rather than waited for.
+ *
+ * @param count Number of iterations
+ * @param fn    Function to run for each iteration
+ * @param arg   Argument passed to fn
+ */
+void parallel_for(size_t count, void (*fn)(void *, size_t), void *arg) {
+    struct pool_loop loop = {
+        .fn = fn,
+        .arg = arg,
+        .count = count,
+    };
+    struct pool_task **link;
+    int helpers = pool_threads() - 1;
+
+    if (helpers > (int) count - 1) {
+        helpers = count - 1;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (helpers > 0 && !pool_in_worker && pool_start_locked() < helpers) {
+        helpers = pool.nthreads;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (helpers <= 0 || pool_in_worker) {
+        for (size_t i = 0; i < count; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+
+    struct pool_task tasks[helpers];
+
+    pthread_cond_init(&loop.done, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    loop.helpers = helpers;
+    for (int i = 0; i < helpers; i++) {
+        tasks[i] = (struct pool_task) {
+            .fn = pool_loop_helper,
+            .arg = &loop,
+        };
+        pool_enqueue_locked(&tasks[i]);
+    }
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_loop_run(&loop);
+
+    pthread_mutex_lock(&pool.lock);
+    /* Withdraw helpers that never started */
+    pool.tail = NULL;
+    for (link = &pool.head; *link; ) {
+        if ((*link)->arg == &loop && (*link)->fn == pool_loop_helper) {
+            *link = (*link)->next;
+            loop.helpers--;
+        }
+        else {
+            pool.tail = *link;
+            link = &(*link)->next;
+        }
+    }
+    while (loop.helpers) {
+        pthread_cond_wait(&loop.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_cond_destroy(&loop.done);
+}
+
+__thread char dng_errmsg[256];
+
+int dng_fail(int err, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(dng_errmsg, sizeof(dng_errmsg), fmt, ap);
+    va_end(ap);
+
+    return err;
+}
+
+/*
+ * DNG 24-bit floating point
+ *
+ * 1 sign, 7 exponent (bias 63) and 16 mantissa bits.  Held in memory as
+ * float32, so these convert between the two bit patterns.
+ */
+static uint32_t float_to_fp24(uint32_t f) {
+    uint32_t sign = (f >> 8) & 0x800000;
+    int32_t exp = (f >> 23) & 0xff;
+    uint32_t mant = f & 0x7fffff;
+    uint32_t bits, rem;
+    int shift;
+
+    /* Infinity and NaN, keeping NaN non-zero */
+    if (exp == 0xff) {
+        return sign | 0x7f0000 | (mant ? 0x8000 | (mant >> 7) : 0);
+    }
+
+    /* Too large, saturate to infinity */
+    if (exp - 64 >= 0x7f) {
+        return sign | 0x7f0000;
+    }
+
+    /* Denormal in 24 bits, round half up */
+    if (exp - 64 <= 0) {
+        shift = 72 - exp;
+        if (!exp || shift > 24) {
+            return sign;
+        }
+        mant |= 0x800000;
+        return sign | ((mant + (1 << (shift - 1))) >> shift);
+    }
+
+    /* Round to nearest even, carrying into the exponent */
+    bits = ((exp - 64) << 16) | (mant >> 7);
+    rem = mant & 0x7f;
+    if (rem > 0x40 || (rem == 0x40 && (bits & 1))) {
+        bits++;
+    }
+
+    return sign | bits;
+}
+
+static uint32_t fp24_to_float(uint32_t v) {
+    uint32_t sign = (v & 0x800000) << 8;
+    uint32_t exp = (v >> 16) & 0x7f;
+    uint32_t mant = v & 0xffff;
+    int top;
+
+    if (exp == 0x7f) {
+        return sign | 0x7f800000 | (mant << 7);
+    }
+
+    if (!exp) {
+        if (!mant) {
+            return sign;
+        }
+        /* Denormal, normalize */
+        top = 31 - __builtin_clz(mant);
+        return sign | ((top + 49) << 23) | ((mant << (23 - top)) & 0x7fffff);
+    }
+
+    return sign | ((exp + 64) << 23) | (mant << 7);
+}
+
+/*
+ * Floating point predictor (Adobe TIFF Technote 3, DNG 1.5 X2/X4 variants)
+ *
+ * Each row is split into byte planes, most significant plane first, and
+ * the planes are byte-differenced with a stride of the samples per pixel,
+ * times 2 or 4 for the X2 and X4 predictors.
+ */
+
+/*
+ * Split n samples of size bytes into big-endian byte planes
+ */
+static void fp_shuffle(const uint8_t *src, uint8_t *dst, size_t n, int bytes) {
+    size_t i = 0;
+
+#if defined(__SSE2__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const __m128i mask8 = _mm_set1_epi32(0xff);
+    const __m128i mask16 = _mm_set1_epi16(0xff);
+
+    if (bytes == 4) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *) (src + 4*i));
+            __m128i v1 = _mm_loadu_si128((const __m128i *) (src + 4*i + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *) (src + 4*i + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *) (src + 4*i + 48));
+
+            for (int plane = 0; plane < 4; plane++) {
+                int shift = 8*(3 - plane);
+                __m128i a0 = _mm_and_si128(_mm_srl_epi32(v0, _mm_cvtsi32_si128(shift)), mask8);
+                __m128i a1 = _mm_and_si128(_mm_srl_epi32(v1, _mm_cvtsi32_si128(shift)), mask8);
+                __m128i a2 = _mm_and_si128(_mm_srl_epi32(v2, _mm_cvtsi32_si128(shift)), mask8);
+                __m128i a3 = _mm_and_si128(_mm_srl_epi32(v3, _mm_cvtsi32_si128(shift)), mask8);
+                __m128i lo = _mm_packs_epi32(a0, a1);
+                __m128i hi = _mm_packs_epi32(a2, a3);
+
+                _mm_storeu_si128((__m128i *) (dst + plane*n + i),
+                                 _mm_packus_epi16(lo, hi));
+            }
+        }
+    }
+    else if (bytes == 2) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *) (src + 2*i));
+            __m128i v1 = _mm_loadu_si128((const __m128i *) (src + 2*i + 16));
+
+            _mm_storeu_si128((__m128i *) (dst + i),
+                             _mm_packus_epi16(_mm_srli_epi16(v0, 8),
+                                              _mm_srli_epi16(v1, 8)));
+            _mm_storeu_si128((__m128i *) (dst + n + i),
+                             _mm_packus_epi16(_mm_and_si128(v0, mask16),
+                                              _mm_and_si128(v1, mask16)));
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        for (int b = 0; b < bytes; b++) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            dst[(bytes - 1 - b)*n + i] = src[bytes*i + b];
+#else
+            dst[b*n + i] = src[bytes*i + b];
+#endif
+        }
+    }
+}
+
+/*
+ * Merge big-endian byte planes back into n samples of size bytes
+ */
+static void fp_unshuffle(const uint8_t *src, uint8_t *dst, size_t n, int bytes) {
+    size_t i = 0;
+
+#if defined(__SSE2__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (bytes == 4) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i p0 = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i p1 = _mm_loadu_si128((const __m128i *) (src + n + i));
+            __m128i p2 = _mm_loadu_si128((const __m128i *) (src + 2*n + i));
+            __m128i p3 = _mm_loadu_si128((const __m128i *) (src + 3*n + i));
+            __m128i low_lo = _mm_unpacklo_epi8(p3, p2);
+            __m128i low_hi = _mm_unpackhi_epi8(p3, p2);
+            __m128i high_lo = _mm_unpacklo_epi8(p1, p0);
+            __m128i high_hi = _mm_unpackhi_epi8(p1, p0);
+            __m128i *out = (__m128i *) (dst + 4*i);
+
+            _mm_storeu_si128(out, _mm_unpacklo_epi16(low_lo, high_lo));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low_lo, high_lo));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(low_hi, high_hi));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(low_hi, high_hi));
+        }
+    }
+    else if (bytes == 2) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i p0 = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i p1 = _mm_loadu_si128((const __m128i *) (src + n + i));
+            __m128i *out = (__m128i *) (dst + 2*i);
+
+            _mm_storeu_si128(out, _mm_unpacklo_epi8(p1, p0));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(p1, p0));
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        for (int b = 0; b < bytes; b++) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            dst[bytes*i + b] = src[(bytes - 1 - b)*n + i];
+#else
+            dst[bytes*i + b] = src[b*n + i];
+#endif
+        }
+    }
+}
+
+/*
+ * Apply the floating point predictor to one row
+ *
+ * @param row       Row of n samples, replaced by its predicted form
+ * @param scratch   Scratch space of the same size as the row
+ * @param n         Samples in the row
+ * @param bytes     Bytes per sample
+ * @param stride    Differencing stride, in samples
+ */
+static void fp_predict_row(uint8_t *row, uint8_t *scratch, size_t n, int bytes,
+                           int stride) {
+    size_t len = n*bytes;
+    size_t i = stride;
+
+    fp_shuffle(row, scratch, n, bytes);
+
+    memcpy(row, scratch, (size_t) stride < len ? (size_t) stride : len);
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *) (scratch + i));
+        __m128i prev = _mm_loadu_si128((const __m128i *) (scratch + i - stride));
+        _mm_storeu_si128((__m128i *) (row + i), _mm_sub_epi8(cur, prev));
+    }
+#endif
+
+    for (; i < len; i++) {
+        row[i] = scratch[i] - scratch[i - stride];
+    }
+}
+
+/*
+ * Undo the floating point predictor on one row
+ *
+ * @param row   Predicted row, clobbered
+ * @param out   Destination for the n host-order samples
+ */
+static void fp_unpredict_row(uint8_t *row, uint8_t *out, size_t n, int bytes,
+                             int stride) {
+    size_t len = n*bytes;
+
+    for (size_t i = stride; i < len; i++) {
+        row[i] += row[i - stride];
+    }
+
+    fp_unshuffle(row, out, n, bytes);
+}
+
+/*
+ * Undo horizontal differencing on one row of native-order integers, in place
+ */
+static void int_unpredict_row(uint8_t *row, size_t n, int bytes, int stride) {
+    if (bytes == 1) {
+        for (size_t i = stride; i < n; i++) {
+            row[i] += row[i - stride];
+        }
+    }
+    else if (bytes == 2) {
+        uint16_t *r = (uint16_t *) row;
+        for (size_t i = stride; i < n; i++) {
+            r[i] += r[i - stride];
+        }
+    }
+    else {
+        uint32_t *r = (uint32_t *) row;
+        for (size_t i = stride; i < n; i++) {
+            r[i] += r[i - stride];
+        }
+    }
+}
+
+static void swab_samples(uint8_t *data, size_t n, int bytes) {
+    uint8_t t;
+
+    for (size_t i = 0; i < n; i++, data += bytes) {
+        for (int b = 0; b < bytes/2; b++) {
+            t = data[b];
+            data[b] = data[bytes - 1 - b];
+            data[bytes - 1 - b] = t;
+        }
+    }
+}
+
+static int layout_file_bytes(const struct strip_layout *l) {
+    return l->bits/8;
+}
+
+int layout_mem_bytes(const struct strip_layout *l) {
+    return l->bits == 24 ? 4 : l->bits/8;
+}
+
+/* Whether each strip holds a single plane of a multi-sample image */
+int layout_separate(const struct strip_layout *l) {
+    return l->planar == PLANARCONFIG_SEPARATE && l->samples > 1;
+}
+
+/* Samples in one row of a strip */
+static size_t layout_row_samples(const struct strip_layout *l) {
+    return (size_t) l->width * (layout_separate(l) ? 1 : l->samples);
+}
+
+/* Samples in one row of the image in memory, where planes are interleaved */
+static size_t layout_mem_row_samples(const struct strip_layout *l) {
+    return (size_t) l->width * l->samples;
+}
+
+/* Bytes in one row of the image in memory */
+size_t layout_mem_rowbytes(const struct strip_layout *l) {
+    return layout_mem_row_samples(l) * layout_mem_bytes(l);
+}
+
+uint32_t layout_plane_strips(const struct strip_layout *l) {
+    return (l->height + l->rowsperstrip - 1) / l->rowsperstrip;
+}
+
+uint32_t layout_strips(const struct strip_layout *l) {
+    return layout_plane_strips(l) * (layout_separate(l) ? l->samples : 1);
+}
+
+uint32_t layout_strip_rows(const struct strip_layout *l, uint32_t strip) {
+    uint32_t first = (strip % layout_plane_strips(l)) * l->rowsperstrip;
+    return l->height - first < l->rowsperstrip ? l->height - first : l->rowsperstrip;
+}
+
+/* Differencing stride, in samples, of the layout's predictor */
+static int layout_predictor_stride(const struct strip_layout *l) {
+    int samples = layout_separate(l) ? 1 : l->samples;
+
+    switch (l->predictor) {
+    case PREDICTOR_HORIZONTALX2:
+    case PREDICTOR_FLOATINGPOINTX2:
+        return 2*samples;
+    case PREDICTOR_HORIZONTALX4:
+    case PREDICTOR_FLOATINGPOINTX4:
+        return 4*samples;
+    default:
+        return samples;
+    }
+}
+
+static int layout_fp_predictor(const struct strip_layout *l) {
+    return l->predictor == PREDICTOR_FLOATINGPOINT ||
+           l->predictor == PREDICTOR_FLOATINGPOINTX2 ||
+           l->predictor == PREDICTOR_FLOATINGPOINTX4;
+}
+
+static int layout_int_predictor(const struct strip_layout *l) {
+    return l->predictor == PREDICTOR_HORIZONTAL ||
+           l->predictor == PREDICTOR_HORIZONTALX2 ||
+           l->predictor == PREDICTOR_HORIZONTALX4;
+}
+
+/*
+ * Whether strips are stored exactly as they are held in memory
+ */
+static int layout_is_raw(const struct strip_layout *l) {
+    return l->compression == COMPRESSION_NONE && l->bits != 24 &&
+           (!l->byteswapped || l->bits == 8);
+}
+
+/*
+ * Whether the native strip codec can decode this layout.  Others are left
+ * to libtiff.
+ */
+int layout_native(const struct strip_layout *l) {
+    if (l->compression != COMPRESSION_NONE &&
+        l->compression != COMPRESSION_ADOBE_DEFLATE &&
+        l->compression != COMPRESSION_DEFLATE) {
+        return 0;
+    }
+
+    if (l->compression == COMPRESSION_NONE) {
+        return 1;
+    }
+
+    if (layout_fp_predictor(l)) {
+        return l->sampleformat == SAMPLEFORMAT_IEEEFP;
+    }
+
+    return l->predictor == PREDICTOR_NONE || layout_int_predictor(l);
+}
+
+/* One encoded or raw strip */
+struct strip_buf {
+    uint8_t *data;
+    size_t size;
+    int owned;      /* data was allocated for this strip */
+    int err;
+    char errmsg[sizeof(dng_errmsg)];
+};
+
+static void strip_buf_release(struct strip_buf *buf) {
+    if (buf->owned) {
+        free(buf->data);
+    }
+    buf->data = NULL;
+    buf->owned = 0;
+}
+
+/*
+ * Convert rows from their in-memory to their file representation
+ */
+static void pack_rows(const struct strip_layout *l, const uint8_t *src,
+                      uint8_t *dst, size_t samples) {
+    if (l->bits != 24) {
+        memcpy(dst, src, samples * layout_file_bytes(l));
+        return;
+    }
+
+    for (size_t i = 0; i < samples; i++, dst += 3) {
+        uint32_t f, v;
+
+        memcpy(&f, src + 4*i, 4);
+        v = float_to_fp24(f);
+        dst[0] = v;
+        dst[1] = v >> 8;
+        dst[2] = v >> 16;
+    }
+}
+
+/*
+ * Convert rows from their file to their in-memory representation
+ *
+ * 24-bit samples are read in file byte order, except after the floating
+ * point predictor, which leaves them in host order.
+ */
+static void unpack_rows(const struct strip_layout *l, const uint8_t *src,
+                        uint8_t *dst, size_t samples, int swapped) {
+    if (l->bits != 24) {
+        if (dst != src) {
+            memcpy(dst, src, samples * layout_file_bytes(l));
+        }
+        if (swapped) {
+            swab_samples(dst, samples, layout_file_bytes(l));
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < samples; i++, src += 3) {
+        uint32_t v, f;
+
+        if (swapped) {
+            v = (src[0] << 16) | (src[1] << 8) | src[2];
+        }
+        else {
+            v = src[0] | (src[1] << 8) | (src[2] << 16);
+        }
+        f = fp24_to_float(v);
+        memcpy(dst + 4*i, &f, 4);
+    }
+}
+
+/*
+ * Encode one strip
+ *
+ * @param l     Layout of the image
+ * @param src   First row of the strip, in memory representation
+ * @param rows  Rows in the strip
+ * @param out   Encoded strip returned here, borrowing src when possible
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int encode_strip(const struct strip_layout *l, const uint8_t *src,
+                        uint32_t rows, struct strip_buf *out) {
+    size_t row_samples = layout_row_samples(l);
+    size_t file_rowbytes = row_samples * layout_file_bytes(l);
+    size_t mem_rowbytes = row_samples * layout_mem_bytes(l);
+    size_t size = rows * file_rowbytes;
+    uint8_t *raw, *scratch = NULL;
+    uLongf compressed_size;
+    int err = 0;
+
+    if (layout_is_raw(l)) {
+        out->data = (uint8_t *) src;
+        out->size = size;
+        out->owned = 0;
+        return 0;
+    }
+
+    raw = malloc(size);
+    if (!raw) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+    }
+
+    if (layout_fp_predictor(l)) {
+        scratch = malloc(file_rowbytes);
+        if (!scratch) {
+            err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+            goto out_free_raw;
+        }
+    }
+
+    for (uint32_t row = 0; row < rows; row++) {
+        uint8_t *dst = raw + row * file_rowbytes;
+
+        pack_rows(l, src + row * mem_rowbytes, dst, row_samples);
+
+        if (scratch) {
+            fp_predict_row(dst, scratch, row_samples, layout_file_bytes(l),
+                           layout_predictor_stride(l));
+        }
+    }
+
+    free(scratch);
+
+    if (l->compression == COMPRESSION_NONE) {
+        out->data = raw;
+        out->size = size;
+        out->owned = 1;
+        return 0;
+    }
+
+    compressed_size = compressBound(size);
+    out->data = malloc(compressed_size);
+    if (!out->data) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+        goto out_free_raw;
+    }
+
+    if (compress2(out->data, &compressed_size, raw, size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(out->data);
+        out->data = NULL;
+        err = dng_fail(DNG_EIO, "Failed to compress strip");
+        goto out_free_raw;
+    }
+
+    out->size = compressed_size;
+    out->owned = 1;
+
+out_free_raw:
+    free(raw);
+    return err;
+}
+
+/*
+ * Decode one strip
+ *
+ * @param l         Layout of the image
+ * @param raw       Strip as stored in the file
+ * @param raw_size  Size of raw
+ * @param dest      First row of the strip, in memory representation
+ * @param rows      Rows in the strip
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int decode_strip(const struct strip_layout *l, const uint8_t *raw,
+                 size_t raw_size, uint8_t *dest, uint32_t rows) {
+    size_t row_samples = layout_row_samples(l);
+    size_t file_rowbytes = row_samples * layout_file_bytes(l);
+    size_t mem_rowbytes = row_samples * layout_mem_bytes(l);
+    size_t size = rows * file_rowbytes;
+    int in_place = file_rowbytes == mem_rowbytes;
+    uint8_t *data, *scratch = NULL;
+    uLongf inflated = size;
+    int err = 0;
+
+    if (l->compression == COMPRESSION_NONE) {
+        if (raw_size < size) {
+            return dng_fail(DNG_EIO, "Strip truncated");
+        }
+        data = (uint8_t *) raw;
+        in_place = 0;
+    }
+    else {
+        data = in_place ? dest : malloc(size);
+        if (!data) {
+            return dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+        }
+
+        if (uncompress(data, &inflated, raw, raw_size) != Z_OK || inflated != size) {
+            err = dng_fail(DNG_EIO, "Failed to decompress strip");
+            goto out;
+        }
+    }
+
+    if (layout_fp_predictor(l)) {
+        scratch = malloc(2*file_rowbytes);
+        if (!scratch) {
+            err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+            goto out;
+        }
+    }
+
+    for (uint32_t row = 0; row < rows; row++) {
+        uint8_t *src = data + row * file_rowbytes;
+        uint8_t *dst = dest + row * mem_rowbytes;
+
+        if (scratch) {
+            uint8_t *work = in_place ? src : scratch;
+
+            if (!in_place) {
+                memcpy(work, src, file_rowbytes);
+            }
+
+            /* The predictor leaves samples in host order */
+            fp_unpredict_row(work, scratch + file_rowbytes, row_samples,
+                             layout_file_bytes(l), layout_predictor_stride(l));
+            unpack_rows(l, scratch + file_rowbytes, dst, row_samples, 0);
+        }
+        else {
+            unpack_rows(l, src, dst, row_samples, l->byteswapped);
+            if (layout_int_predictor(l)) {
+                int_unpredict_row(dst, row_samples, layout_mem_bytes(l),
+                                  layout_predictor_stride(l));
+            }
+        }
+    }
+
+out:
+    free(scratch);
+    if (data != raw && data != dest) {
+        free(data);
+    }
+    return err;
+}
+
+/* A batch of strips being encoded or decoded in parallel */
+struct strip_batch {
+    const struct strip_layout *l;
+    uint8_t *mem;               /* image in memory representation */
+    uint32_t first;             /* first strip of the batch */
+    struct strip_buf *bufs;
+};
+
+/*
+ * First sample of a strip in memory.  For separate planes, the first sample
+ * of the strip's plane in its first row.
+ */
+uint8_t *strip_mem(const struct strip_layout *l, uint8_t *mem, uint32_t strip) {
+    uint32_t plane_strips = layout_plane_strips(l);
+    size_t row = (size_t) (strip % plane_strips) * l->rowsperstrip;
+
+    mem += row * layout_mem_rowbytes(l);
+    if (layout_separate(l)) {
+        mem += (strip / plane_strips) * layout_mem_bytes(l);
+    }
+
+    return mem;
+}
+
+/*
+ * Advise the kernel how the memory of strips [first, first + n) of a
+ * streamed image will be used
+ *
+ * Only contiguous images are advised, as their strips are contiguous in
+ * memory.  Pages shared with neighbouring strips are not dropped.
+ */
+static void stream_advise(const struct strip_layout *l, const uint8_t *mem,
+                          uint32_t first, uint32_t n, int advice) {
+    uint32_t nstrips = layout_plane_strips(l);
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start, end;
+
+    if (!l->streamed || layout_separate(l) || first >= nstrips) {
+        return;
+    }
+
+    if (n > nstrips - first) {
+        n = nstrips - first;
+    }
+
+    start = (uintptr_t) strip_mem(l, (uint8_t *) mem, first);
+    end = first + n < nstrips ? (uintptr_t) strip_mem(l, (uint8_t *) mem, first + n) :
+                                (uintptr_t) mem + layout_mem_rowbytes(l) * l->height;
+
+    if (advice == MADV_DONTNEED) {
+        start = (start + page - 1) & ~(page - 1);
+        end &= ~(page - 1);
+    }
+    else {
+        start &= ~(page - 1);
+        end = (end + page - 1) & ~(page - 1);
+    }
+
+    if (start < end) {
+        madvise((void *) start, end - start, advice);
+    }
+}
+
+/*
+ * Copy one sample plane of interleaved rows into a packed plane
+ */
+static void gather_plane(const struct strip_layout *l, const uint8_t *src,
+                         uint8_t *dst, uint32_t rows) {
+    size_t n = (size_t) rows * l->width;
+    size_t stride = l->samples;
+
+    switch (layout_mem_bytes(l)) {
+    case 1:
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = src[i*stride];
+        }
+        break;
+    case 2:
+        for (size_t i = 0; i < n; i++) {
+            ((uint16_t *) dst)[i] = ((const uint16_t *) src)[i*stride];
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < n; i++) {
+            ((uint32_t *) dst)[i] = ((const uint32_t *) src)[i*stride];
+        }
+        break;
+    }
+}
+
+/*
+ * Copy a packed plane into one sample plane of interleaved rows
+ */
+static void scatter_plane(const struct strip_layout *l, const uint8_t *src,
+                          uint8_t *dst, uint32_t rows) {
+    size_t n = (size_t) rows * l->width;
+    size_t stride = l->samples;
+
+    switch (layout_mem_bytes(l)) {
+    case 1:
+        for (size_t i = 0; i < n; i++) {
+            dst[i*stride] = src[i];
+        }
+        break;
+    case 2:
+        for (size_t i = 0; i < n; i++) {
+            ((uint16_t *) dst)[i*stride] = ((const uint16_t *) src)[i];
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < n; i++) {
+            ((uint32_t *) dst)[i*stride] = ((const uint32_t *) src)[i];
+        }
+        break;
+    }
+}
+
+static uint8_t *alloc_plane_strip(const struct strip_layout *l) {
+    return malloc((size_t) l->rowsperstrip * l->width * layout_mem_bytes(l));
+}
+
+static void encode_strip_task(void *arg, size_t i) {
+    struct strip_batch *b = arg;
+    uint32_t strip = b->first + i;
+    uint32_t rows = layout_strip_rows(b->l, strip);
+    struct strip_buf *buf = &b->bufs[i];
+    uint8_t *src = strip_mem(b->l, b->mem, strip);
+    uint8_t *plane = NULL;
+
+    if (layout_separate(b->l)) {
+        plane = alloc_plane_strip(b->l);
+        if (!plane) {
+            buf->err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+            goto out;
+        }
+        gather_plane(b->l, src, plane, rows);
+        buf->err = encode_strip(b->l, plane, rows, buf);
+    }
+    else {
+        buf->err = encode_strip(b->l, src, rows, buf);
+    }
+
+    /* A raw strip borrows the gathered plane */
+    if (plane && buf->data == plane) {
+        buf->owned = 1;
+    }
+    else {
+        free(plane);
+    }
+
+out:
+    if (buf->err) {
+        memcpy(buf->errmsg, dng_errmsg, sizeof(dng_errmsg));
+    }
+}
+
+static void decode_strip_task(void *arg, size_t i) {
+    struct strip_batch *b = arg;
+    uint32_t strip = b->first + i;
+    uint32_t rows = layout_strip_rows(b->l, strip);
+    struct strip_buf *buf = &b->bufs[i];
+    uint8_t *dest = strip_mem(b->l, b->mem, strip);
+    uint8_t *plane = NULL;
+
+    if (layout_separate(b->l)) {
+        plane = alloc_plane_strip(b->l);
+        if (!plane) {
+            buf->err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+            goto out;
+        }
+    }
+
+    buf->err = decode_strip(b->l, buf->data, buf->size, plane ? plane : dest, rows);
+
+    if (plane) {
+        if (!buf->err) {
+            scatter_plane(b->l, plane, dest, rows);
+        }
+        free(plane);
+    }
+
+out:
+    if (buf->err) {
+        memcpy(buf->errmsg, dng_errmsg, sizeof(dng_errmsg));
+    }
+}
+
+/*
+ * Return the first error of a batch, releasing all of its strips
+ */
+static int strip_batch_finish(struct strip_buf *bufs, uint32_t n) {
+    int err = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (bufs[i].err && !err) {
+            err = dng_fail(bufs[i].err, "%s", bufs[i].errmsg);
+        }
+        bufs[i].err = 0;
+        strip_buf_release(&bufs[i]);
+    }
+
+    return err;
+}
+
+static uint32_t strip_batch_size(void) {
+    return 4 * pool_threads();
+}
+
+/*
+ * Encode and write every strip of an image
+ *
+ * Strips are encoded in parallel a batch at a time, and written in order
+ * from the calling thread.  The strip tags must already be set.
+ *
+ * @param tiff  File to write to
+ * @param l     Layout of the image
+ * @param data  Image in memory representation
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int write_strips(TIFF *tiff, const struct strip_layout *l, const void *data) {
+    uint32_t nstrips = layout_strips(l);
+    uint32_t batch = strip_batch_size();
+    struct strip_buf *bufs;
+    int err = 0;
+
+    bufs = calloc(batch, sizeof(*bufs));
+    if (!bufs) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strips");
+    }
+
+    stream_advise(l, data, 0, nstrips, MADV_SEQUENTIAL);
+
+    for (uint32_t first = 0; first < nstrips && !err; first += batch) {
+        uint32_t n = nstrips - first < batch ? nstrips - first : batch;
+        struct strip_batch b = {
+            .l = l,
+            .mem = (uint8_t *) data,
+            .first = first,
+            .bufs = bufs,
+        };
+
+        /* Read the next batch ahead while this one is encoded */
+        stream_advise(l, data, first + n, batch, MADV_WILLNEED);
+
+        parallel_for(n, encode_strip_task, &b);
+
+        for (uint32_t i = 0; i < n && !bufs[i].err; i++) {
+            if (TIFFWriteRawStrip(tiff, first + i, bufs[i].data, bufs[i].size) < 0) {
+                bufs[i].err = dng_fail(DNG_EIO, "libtiff failed to write strip.");
+                memcpy(bufs[i].errmsg, dng_errmsg, sizeof(dng_errmsg));
+            }
+        }
+
+        err = strip_batch_finish(bufs, n);
+        stream_advise(l, data, first, n, MADV_DONTNEED);
+    }
+
+    free(bufs);
+    return err;
+}
+
+/*
+ * Read and decode every strip of an image
+ *
+ * Raw strips are read in order from the calling thread a batch at a time,
+ * and decoded in parallel.  Layouts the native codec does not handle are
+ * decoded by libtiff.
+ *
+ * @param tiff  File to read from, at the image directory
+ * @param l     Layout of the image
+ * @param dest  Destination for the image in memory representation
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int read_strips(TIFF *tiff, const struct strip_layout *l, void *dest) {
+    uint32_t nstrips = layout_strips(l);
+    uint32_t batch = strip_batch_size();
+    size_t rowbytes = layout_row_samples(l) * layout_mem_bytes(l);
+    struct strip_batch b = {
+        .l = l,
+        .mem = dest,
+    };
+    uint64_t *bytecounts;
+    uint8_t *plane = NULL;
+    int err = 0;
+
+    if (TIFFNumberOfStrips(tiff) < nstrips) {
+        return dng_fail(DNG_EFORMAT, "Image has too few strips");
+    }
+
+    if (!layout_native(l)) {
+        if (l->bits == 24) {
+            return dng_fail(DNG_EFORMAT, "Unsupported compression for 24-bit floating point");
+        }
+
+        if (layout_separate(l)) {
+            plane = alloc_plane_strip(l);
+            if (!plane) {
+                return dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+            }
+        }
+
+        for (uint32_t strip = 0; strip < nstrips && !err; strip++) {
+            uint32_t rows = layout_strip_rows(l, strip);
+            tmsize_t size = rows * rowbytes;
+            uint8_t *mem = strip_mem(l, dest, strip);
+
+            if (TIFFReadEncodedStrip(tiff, strip, plane ? plane : mem, size) < size) {
+                err = dng_fail(DNG_EIO, "libtiff failed to read strip");
+            }
+            else if (plane) {
+                scatter_plane(l, plane, mem, rows);
+            }
+            stream_advise(l, dest, strip, 1, MADV_DONTNEED);
+        }
+
+        free(plane);
+        return err;
+    }
+
+    if (layout_is_raw(l) && !layout_separate(l)) {
+        for (uint32_t strip = 0; strip < nstrips; strip++) {
+            tmsize_t size = layout_strip_rows(l, strip) * rowbytes;
+
+            if (TIFFReadRawStrip(tiff, strip, strip_mem(l, dest, strip), size) < size) {
+                return dng_fail(DNG_EIO, "libtiff failed to read strip");
+            }
+            stream_advise(l, dest, strip, 1, MADV_DONTNEED);
+        }
+
+        return 0;
+    }
+
+    if (!TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &bytecounts)) {
+        return dng_fail(DNG_EIO, "Strip byte counts not found");
+    }
+
+    b.bufs = calloc(batch, sizeof(*b.bufs));
+    if (!b.bufs) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strips");
+    }
+
+    for (b.first = 0; b.first < nstrips && !err; b.first += batch) {
+        uint32_t n = nstrips - b.first < batch ? nstrips - b.first : batch;
+
+        for (uint32_t i = 0; i < n; i++) {
+            struct strip_buf *buf = &b.bufs[i];
+
+            buf->size = bytecounts[b.first + i];
+            buf->data = malloc(buf->size ? buf->size : 1);
+            buf->owned = 1;
+            if (!buf->data) {
+                err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+                break;
+            }
+
+            if (TIFFReadRawStrip(tiff, b.first + i, buf->data, buf->size) < (tmsize_t) buf->size) {
+                err = dng_fail(DNG_EIO, "libtiff failed to read strip");
+                break;
+            }
+        }
+
+        if (!err) {
+            parallel_for(n, decode_strip_task, &b);
+            err = strip_batch_finish(b.bufs, n);
+            stream_advise(l, dest, b.first, n, MADV_DONTNEED);
+        }
+        else {
+            strip_batch_finish(b.bufs, n);
+        }
+    }
+
+    free(b.bufs);
+    return err;
+}
+
+/*
+ * Read the strip layout of the current directory
+ *
+ * @param tiff  File positioned at the image directory
+ * @param l     Layout returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int read_layout(TIFF *tiff, struct strip_layout *l) {
+    memset(l, 0, sizeof(*l));
+
+    if (TIFFIsTiled(tiff)) {
+        return dng_fail(DNG_EFORMAT, "Tiled images not supported");
+    }
+
+    if (!TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &l->width)) {
+        return dng_fail(DNG_EIO, "Image width not found");
+    }
+
+    if (!TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &l->height)) {
+        return dng_fail(DNG_EIO, "Image length not found");
+    }
+
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &l->planar);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLESPERPIXEL, &l->samples);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &l->bits);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLEFORMAT, &l->sampleformat);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_COMPRESSION, &l->compression);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &l->rowsperstrip);
+
+    if (!TIFFGetField(tiff, TIFFTAG_PREDICTOR, &l->predictor)) {
+        l->predictor = PREDICTOR_NONE;
+    }
+
+    if (!l->rowsperstrip || l->rowsperstrip > l->height) {
+        l->rowsperstrip = l->height;
+    }
+
+    l->byteswapped = TIFFIsByteSwapped(tiff);
+
+    if (l->sampleformat == SAMPLEFORMAT_IEEEFP) {
+        if (l->bits != 16 && l->bits != 24 && l->bits != 32) {
+            return dng_fail(DNG_EFORMAT, "Unsupported floating point bit depth %hu", l->bits);
+        }
+    }
+    else if (l->bits != 8 && l->bits != 16) {
+        return dng_fail(DNG_EFORMAT, "Unsupported bit depth %hu", l->bits);
+    }
+
+    return 0;
+}
+
+/*
+ * Move to the raw image directory
+ *
+ * The raw image is IFD0, unless IFD0 is a reduced resolution preview, in
+ * which case it is the first full resolution SubIFD.  The same holds for
+ * the first IFD of each frame of a multi-frame file.
+ *
+ * @param tiff  File positioned at IFD0, or the first IFD of a frame
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int select_raw_directory(TIFF *tiff) {
+    uint64_t start = TIFFCurrentDirOffset(tiff);
+    uint32_t subfiletype;
+    uint16_t count;
+    uint64_t *offsets;
+
+    if (!TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &subfiletype) ||
+        !(subfiletype & FILETYPE_REDUCEDIMAGE)) {
+        return 0;
+    }
+
+    if (!TIFFGetField(tiff, TIFFTAG_SUBIFD, &count, &offsets) || !count) {
+        return 0;
+    }
+
+    /* The offsets belong to IFD0, which is freed on leaving it */
+    uint64_t subifds[count];
+    memcpy(subifds, offsets, sizeof(subifds));
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (!TIFFSetSubDirectory(tiff, subifds[i])) {
+            return dng_fail(DNG_EIO, "Failed to read SubIFD");
+        }
+
+        if (!TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &subfiletype) ||
+            !(subfiletype & FILETYPE_REDUCEDIMAGE)) {
+            return 0;
+        }
+    }
+
+    /* No full resolution SubIFD, use the preview */
+    if (!TIFFSetSubDirectory(tiff, start)) {
+        return dng_fail(DNG_EIO, "Failed to read IFD0");
+    }
+
+    return 0;
+}
+
+/*
+ * Move to a reduced resolution pyramid level
+ *
+ * Levels are the reduced resolution LinearRaw SubIFDs of IFD0, in order.
+ * Only the tags of the SubIFDs before the level are read.
+ *
+ * @param tiff   File positioned at IFD0
+ * @param level  Level to select, from 1
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int select_level_directory(TIFF *tiff, uint32_t level) {
+    uint32_t subfiletype;
+    uint16_t count, photometric;
+    uint64_t *offsets;
+    uint32_t found = 0;
+
+    if (!TIFFGetField(tiff, TIFFTAG_SUBIFD, &count, &offsets)) {
+        count = 0;
+    }
+
+    /* The offsets belong to IFD0, which is freed on leaving it */
+    uint64_t subifds[count ? count : 1];
+    memcpy(subifds, offsets, count * sizeof(*subifds));
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (!TIFFSetSubDirectory(tiff, subifds[i])) {
+            return dng_fail(DNG_EIO, "Failed to read SubIFD");
+        }
+
+        if (TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &subfiletype) &&
+            (subfiletype & FILETYPE_REDUCEDIMAGE) &&
+            TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photometric) &&
+            photometric == PHOTOMETRIC_LINEARRAW && ++found == level) {
+            return 0;
+        }
+    }
+
+    return dng_fail(DNG_EFORMAT, "Pyramid level %u not found", level);
+}
+
+/*
+ * Rows per strip for writing, keeping strips near STRIP_TARGET_BYTES and
+ * covering whole CFA rows
+ */
+static uint32_t choose_rowsperstrip(const struct strip_layout *l) {
+    size_t rowbytes = layout_row_samples(l) * layout_file_bytes(l);
+    uint32_t rows = rowbytes ? STRIP_TARGET_BYTES / rowbytes : 1;
+
+    rows &= ~1u;
+    if (rows < 2) {
+        rows = 2;
+    }
+    if (rows > l->height) {
+        rows = l->height ? l->height : 1;
+    }
+
+    return rows;
+}
+
+/*
+ * CFAPattern is fixed-count in older libtiff, and variable-count since
+ */
+static int cfa_pattern_passcount(TIFF *tiff) {
+    const TIFFField *field = TIFFFieldWithTag(tiff, TIFFTAG_CFAPATTERN);
+
+    return field && TIFFFieldPassCount(field);
+}
+
+/*
+ * Determine the CFA pattern of the current directory
+ *
+ * @param tiff  File positioned at the image directory
+ * @returns one of enum cfa_pattern, or -1 if unknown
+ */
+int read_cfa_pattern(TIFF *tiff) {
+    uint16_t *cfarepeatpatterndim[2];
+    uint8_t *cfapattern[4];
+    uint16_t count = 4;
+    short x, y;
+
+    if (!TIFFGetField(tiff, TIFFTAG_CFAREPEATPATTERNDIM, &cfarepeatpatterndim)) {
+        return -1;
+    }
+
+    x = (*cfarepeatpatterndim)[0];
+    y = (*cfarepeatpatterndim)[1];
+
+    /* Only support 2x2 CFA patterns */
+    if (x != 2 || y != 2) {
+        return -1;
+    }
+
+    if (cfa_pattern_passcount(tiff)) {
+        if (!TIFFGetField(tiff, TIFFTAG_CFAPATTERN, &count, &cfapattern)) {
+            return -1;
+        }
+    }
+    else if (!TIFFGetField(tiff, TIFFTAG_CFAPATTERN, &cfapattern)) {
+        return -1;
+    }
+
+    if (count != 4) {
+        return -1;
+    }
+
+    /* Look for matching known pattern */
+    for (int i = 0; i < CFA_NUM_PATTERNS; i++) {
+        if (!memcmp(*cfapattern, cfa_patterns[i], 4)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Load the raw image, or a pyramid level, of a file, without Python
+ *
+ * @param filename  File to load
+ * @param level     Pyramid level, or 0 for the raw image
+ * @param l         Layout of the image returned here
+ * @param pattern   CFA pattern returned here, -1 if unknown
+ * @param data      Image returned here in memory representation, to be
+ *                  freed by the caller
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int load_image(const char *filename, uint32_t level, struct strip_layout *l,
+               int *pattern, void **data) {
+    TIFF *tiff;
+    int err;
+
+    tiff = TIFFOpen(filename, "r");
+    if (!tiff) {
+        return dng_fail(DNG_EIO, "Failed to open file");
+    }
+
+    err = level ? select_level_directory(tiff, level) : select_raw_directory(tiff);
+    if (!err) {
+        err = read_layout(tiff, l);
+    }
+    if (err) {
+        goto out;
+    }
+
+    *pattern = read_cfa_pattern(tiff);
+
+    *data = malloc(layout_mem_rowbytes(l) * l->height);
+    if (!*data) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate image");
+        goto out;
+    }
+
+    err = read_strips(tiff, l, *data);
+    if (err) {
+        free(*data);
+        *data = NULL;
+    }
+
+out:
+    TIFFClose(tiff);
+    return err;
+}
+
+/*
+ * Read the layout of the raw image, or a pyramid level, of a file without
+ * decoding it
+ *
+ * @param filename  File to open
+ * @param level     Pyramid level, or 0 for the raw image
+ * @param l         Layout of the image returned here
+ * @param pattern   CFA pattern returned here, -1 if unknown
+ * @param strips    Strip offsets then byte counts returned here, to be
+ *                  freed by the caller, or NULL if the native codec
+ *                  cannot read the strips one by one
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int open_image(const char *filename, uint32_t level, struct strip_layout *l,
+               int *pattern, uint64_t **strips) {
+    uint32_t nstrips;
+    uint64_t *offsets, *bytecounts;
+    TIFF *tiff;
+    int err;
+
+    *strips = NULL;
+
+    tiff = TIFFOpen(filename, "r");
+    if (!tiff) {
+        return dng_fail(DNG_EIO, "Failed to open file");
+    }
+
+    err = level ? select_level_directory(tiff, level) : select_raw_directory(tiff);
+    if (!err) {
+        err = read_layout(tiff, l);
+    }
+    if (err) {
+        goto out;
+    }
+
+    *pattern = read_cfa_pattern(tiff);
+
+    nstrips = layout_strips(l);
+    if (!layout_native(l) || layout_separate(l) || TIFFNumberOfStrips(tiff) < nstrips ||
+        !TIFFGetField(tiff, TIFFTAG_STRIPOFFSETS, &offsets) ||
+        !TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &bytecounts)) {
+        goto out;
+    }
+
+    *strips = malloc(2 * (size_t) nstrips * sizeof(uint64_t));
+    if (!*strips) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate strip table");
+        goto out;
+    }
+
+    memcpy(*strips, offsets, nstrips * sizeof(uint64_t));
+    memcpy(*strips + nstrips, bytecounts, nstrips * sizeof(uint64_t));
+
+out:
+    TIFFClose(tiff);
+    return err;
+}
+
+/* CinemaDNG tags, registered with libtiff by engine_init() */
+static const TIFFFieldInfo cinema_fields[] = {
+    {TIFFTAG_TIMECODES, 8, 8, TIFF_BYTE, FIELD_CUSTOM, 1, 0, (char *) "TimeCodes"},
+    {TIFFTAG_FRAMERATE, 1, 1, TIFF_SRATIONAL, FIELD_CUSTOM, 1, 0, (char *) "FrameRate"},
+};
+
+static TIFFExtendProc parent_extender;
+
+static void tag_extender(TIFF *tiff) {
+    TIFFMergeFieldInfo(tiff, cinema_fields, sizeof(cinema_fields) / sizeof(cinema_fields[0]));
+
+    if (parent_extender) {
+        parent_extender(tiff);
+    }
+}
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static void engine_init_once(void) {
+    pthread_atfork(NULL, NULL, pool_atfork_child);
+    parent_extender = TIFFSetTagExtender(tag_extender);
+}
+
+/*
+ * Register the engine with libtiff and fork(), once per process, before
+ * any file is opened
+ */
+void engine_init(void) {
+    pthread_once(&engine_once, engine_init_once);
+}
+
+/*
+ * Record the strips written to the current directory, before it is
+ * written
+ */
+int capture_strips(TIFF *tiff, const struct strip_layout *l,
+                   struct strip_table *table) {
+    uint32_t count = layout_strips(l);
+    uint64_t *offsets, *bytecounts;
+
+    if (!TIFFGetField(tiff, TIFFTAG_STRIPOFFSETS, &offsets) ||
+        !TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &bytecounts)) {
+        return dng_fail(DNG_EIO, "Strip offsets not found");
+    }
+
+    table->offsets = malloc(2 * (size_t) count * sizeof(uint64_t));
+    if (!table->offsets) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strip table");
+    }
+
+    memcpy(table->offsets, offsets, count * sizeof(uint64_t));
+    memcpy(table->offsets + count, bytecounts, count * sizeof(uint64_t));
+    table->count = count;
+    return 0;
+}
+
+/*
+ * Preview rendering
+ *
+ * Previews are rendered by binning each 2x2 CFA quad to an RGB superpixel
+ * and box-averaging blocks of superpixels down to the preview size, in a
+ * single pass over the raw data.  LinearRaw pixels are box-averaged
+ * directly.  The result is gray-world balanced, scaled to its brightest
+ * pixel and sRGB gamma encoded into 8 bits.
+ */
+
+static float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    float f;
+    int top;
+
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    }
+    else if (exp) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    else if (mant) {
+        /* Denormal, normalize */
+        top = 31 - __builtin_clz(mant);
+        bits = sign | ((top + 103) << 23) | ((mant << (23 - top)) & 0x7fffff);
+    }
+    else {
+        bits = sign;
+    }
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/*
+ * Convert n samples in memory representation to float
+ */
+static void samples_to_float(const struct strip_layout *l, const uint8_t *src,
+                             float *dst, size_t n) {
+    if (l->sampleformat == SAMPLEFORMAT_IEEEFP) {
+        if (l->bits == 16) {
+            for (size_t i = 0; i < n; i++) {
+                dst[i] = half_to_float(((const uint16_t *) src)[i]);
+            }
+        }
+        else {
+            memcpy(dst, src, n * sizeof(float));
+        }
+    }
+    else if (l->bits == 8) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = src[i];
+        }
+    }
+    else {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = ((const uint16_t *) src)[i];
+        }
+    }
+}
+
+/*
+ * Accumulate one row of uint16 CFA quads into per-quad color sums
+ *
+ * @param row0      First row of the quads
+ * @param row1      Second row of the quads
+ * @param quads     Quads in the row
+ * @param colors    Color at each position of the quad, from cfa_patterns
+ * @param acc       Red, green and blue sums, in planes of quads entries
+ */
+static void bin_cfa_u16(const uint16_t *row0, const uint16_t *row1, size_t quads,
+                        const char *colors, float *acc) {
+    float *plane[4] = {
+        acc + colors[0]*quads, acc + colors[1]*quads,
+        acc + colors[2]*quads, acc + colors[3]*quads,
+    };
+    size_t q = 0;
+
+#if defined(__SSE2__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const __m128i mask = _mm_set1_epi32(0xffff);
+
+    for (; q + 4 <= quads; q += 4) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *) (row0 + 2*q));
+        __m128i v1 = _mm_loadu_si128((const __m128i *) (row1 + 2*q));
+        __m128 pos[4] = {
+            _mm_cvtepi32_ps(_mm_and_si128(v0, mask)),
+            _mm_cvtepi32_ps(_mm_srli_epi32(v0, 16)),
+            _mm_cvtepi32_ps(_mm_and_si128(v1, mask)),
+            _mm_cvtepi32_ps(_mm_srli_epi32(v1, 16)),
+        };
+
+        for (int p = 0; p < 4; p++) {
+            _mm_storeu_ps(plane[p] + q, _mm_add_ps(_mm_loadu_ps(plane[p] + q), pos[p]));
+        }
+    }
+#endif
+
+    for (; q < quads; q++) {
+        plane[0][q] += row0[2*q];
+        plane[1][q] += row0[2*q + 1];
+        plane[2][q] += row1[2*q];
+        plane[3][q] += row1[2*q + 1];
+    }
+}
+
+static void bin_cfa_float(const float *row0, const float *row1, size_t quads,
+                          const char *colors, float *acc) {
+    float *plane[4] = {
+        acc + colors[0]*quads, acc + colors[1]*quads,
+        acc + colors[2]*quads, acc + colors[3]*quads,
+    };
+
+    for (size_t q = 0; q < quads; q++) {
+        plane[0][q] += row0[2*q];
+        plane[1][q] += row0[2*q + 1];
+        plane[2][q] += row1[2*q];
+        plane[3][q] += row1[2*q + 1];
+    }
+}
+
+static void bin_rgb_float(const float *row, size_t pixels, float *acc) {
+    for (size_t x = 0; x < pixels; x++) {
+        acc[x] += row[3*x];
+        acc[pixels + x] += row[3*x + 1];
+        acc[2*pixels + x] += row[3*x + 2];
+    }
+}
+
+static float srgb_encode(float v) {
+    return v <= 0.0031308f ? 12.92f*v : 1.055f*powf(v, 1/2.4f) - 0.055f;
+}
+
+/* 8-bit sRGB encoding of 4096 linear steps from 0 to 1 */
+static void srgb_lut(uint8_t lut[4096]) {
+    for (int i = 0; i < 4096; i++) {
+        lut[i] = 255 * srgb_encode(i / 4095.0f) + 0.5f;
+    }
+}
+
+/*
+ * Accumulate rows of quads into per-quad color sums
+ *
+ * A row of quads is a pair of CFA rows, or a single RGB row, where each
+ * pixel is a quad.
+ *
+ * @param l         Layout of the image
+ * @param colors    CFA colors, from cfa_patterns, or NULL for RGB images
+ * @param data      First row, in memory representation
+ * @param qrows     Rows of quads to accumulate
+ * @param acc       Red, green and blue sums, in planes of one entry per quad
+ * @param scratch   Two rows of float samples
+ */
+static void bin_quad_rows(const struct strip_layout *l, const char *colors,
+                          const uint8_t *data, size_t qrows, float *acc,
+                          float *scratch) {
+    int fast = colors && l->sampleformat == SAMPLEFORMAT_UINT && l->bits == 16;
+    size_t rowbytes = layout_mem_rowbytes(l);
+    size_t row_samples = layout_mem_row_samples(l);
+    size_t quads = colors ? l->width/2 : l->width;
+
+    for (size_t qy = 0; qy < qrows; qy++) {
+        const uint8_t *row = data + (colors ? 2*qy : qy) * rowbytes;
+
+        if (fast) {
+            bin_cfa_u16((const uint16_t *) row,
+                        (const uint16_t *) (row + rowbytes), quads, colors, acc);
+        }
+        else if (colors) {
+            samples_to_float(l, row, scratch, 2 * row_samples);
+            bin_cfa_float(scratch, scratch + row_samples, quads, colors, acc);
+        }
+        else {
+            samples_to_float(l, row, scratch, row_samples);
+            bin_rgb_float(scratch, quads, acc);
+        }
+    }
+}
+
+/*
+ * Box-average blocks of factor quad sums into interleaved RGB pixels
+ *
+ * @param acc       Color sums of quads wide rows, from bin_quad_rows()
+ * @param quads     Quads per row
+ * @param factor    Quads per block side
+ * @param width     Output pixels
+ * @param qrows     Rows of quads accumulated in acc
+ * @param positions Samples of each color per quad
+ * @param out       width RGB pixels
+ */
+static void box_columns(const float *acc, size_t quads, size_t factor, size_t width,
+                        size_t qrows, const float positions[3], float *out) {
+    for (size_t ox = 0; ox < width; ox++) {
+        size_t col = ox * factor;
+        size_t ncols = quads - col < factor ? quads - col : factor;
+
+        for (int c = 0; c < 3; c++) {
+            float sum = 0;
+
+            for (size_t x = col; x < col + ncols; x++) {
+                sum += acc[c*quads + x];
+            }
+            out[3*ox + c] = sum / (qrows * ncols * positions[c]);
+        }
+    }
+}
+
+/*
+ * Render an 8-bit RGB preview of a CFA or LinearRaw image
+ *
+ * @param l         Layout of the image
+ * @param pattern   CFA pattern of single sample images
+ * @param data      Image in memory representation
+ * @param max_size  Maximum preview dimension
+ * @param out       Preview returned here, to be freed by the caller
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int render_preview(const struct strip_layout *l, unsigned int pattern,
+                          const uint8_t *data, uint32_t max_size,
+                          struct preview *out) {
+    int cfa = l->samples == 1;
+    const char *colors = cfa_patterns[pattern];
+    size_t qw = cfa ? l->width/2 : l->width;
+    size_t qh = cfa ? l->height/2 : l->height;
+    size_t rowbytes = layout_mem_rowbytes(l);
+    size_t row_samples = (size_t) l->width * l->samples;
+    float positions[3] = {1, 1, 1};
+    float mean[3] = {0, 0, 0};
+    float gain[3], white = 0;
+    uint8_t lut[4096];
+    float *acc, *rows, *img;
+    size_t ow, oh, factor;
+    int err = 0;
+
+    if (!qw || !qh) {
+        return dng_fail(DNG_EFORMAT, "Image too small for preview");
+    }
+
+    if (l->samples != 1 && l->samples != 3) {
+        return dng_fail(DNG_EFORMAT, "Preview requires CFA or RGB image");
+    }
+
+    /* Superpixels box-averaged into each preview pixel */
+    factor = ((qw > qh ? qw : qh) + max_size - 1) / max_size;
+    ow = (qw + factor - 1) / factor;
+    oh = (qh + factor - 1) / factor;
+
+    if (cfa) {
+        positions[0] = positions[1] = positions[2] = 0;
+        for (int p = 0; p < 4; p++) {
+            positions[(int) colors[p]]++;
+        }
+    }
+
+    acc = malloc(3 * qw * sizeof(float));
+    rows = malloc(2 * row_samples * sizeof(float));
+    img = malloc(3 * ow * oh * sizeof(float));
+    out->rgb = malloc(3 * ow * oh);
+    if (!acc || !rows || !img || !out->rgb) {
+        free(out->rgb);
+        out->rgb = NULL;
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate preview");
+        goto out;
+    }
+
+    for (size_t oy = 0; oy < oh; oy++) {
+        size_t first = oy * factor;
+        size_t nrows = qh - first < factor ? qh - first : factor;
+
+        memset(acc, 0, 3 * qw * sizeof(float));
+        bin_quad_rows(l, cfa ? colors : NULL, data + (cfa ? 2*first : first) * rowbytes,
+                      nrows, acc, rows);
+        box_columns(acc, qw, factor, ow, nrows, positions, &img[3*oy*ow]);
+
+        for (size_t i = 3*oy*ow; i < 3*(oy + 1)*ow; i++) {
+            if (!(img[i] > 0)) {
+                img[i] = 0;
+            }
+            mean[i % 3] += img[i];
+        }
+    }
+
+    /* Gray world white balance, scaled to the brightest pixel */
+    for (int c = 0; c < 3; c++) {
+        gain[c] = mean[c] > 0 ? mean[1] / mean[c] : 1;
+        if (!(gain[c] > 0) || !isfinite(gain[c])) {
+            gain[c] = 1;
+        }
+    }
+
+    for (size_t i = 0; i < 3 * ow * oh; i++) {
+        img[i] *= gain[i % 3];
+        if (img[i] > white && isfinite(img[i])) {
+            white = img[i];
+        }
+    }
+
+    if (!(white > 0)) {
+        white = 1;
+    }
+
+    srgb_lut(lut);
+
+    for (size_t i = 0; i < 3 * ow * oh; i++) {
+        float v = img[i] / white * 4095;
+
+        out->rgb[i] = lut[v < 4095 ? (int) v : 4095];
+    }
+
+    out->width = ow;
+    out->height = oh;
+
+out:
+    free(img);
+    free(rows);
+    free(acc);
+    return err;
+}
+
+/* Output rows per quicklook task */
+#define QUICKLOOK_TASK_ROWS 8
+
+/*
+ * Quicklook of a raw image, binned band by band
+ *
+ * Each task reads and decodes only the strips under its band of output
+ * rows, straight from the file descriptor, so the image is never held
+ * whole.  Images read_strips() must decode through libtiff are decoded
+ * whole first instead.
+ */
+struct quicklook {
+    struct strip_layout l;
+    const char *colors;         /* CFA colors, NULL for RGB images */
+    float positions[3];
+    int fd;
+    uint64_t *offsets;          /* strip offsets, copied from the directory */
+    uint64_t *bytecounts;
+    uint8_t *image;             /* whole image, or NULL to decode per band */
+    size_t quads_wide, quads_high, factor;
+    size_t width, height;       /* output size */
+    float *rgb;                 /* binned output, camera RGB */
+    int err;
+    char errmsg[sizeof(dng_errmsg)];
+};
+
+int pread_full(int fd, uint8_t *buf, size_t size, uint64_t offset) {
+    while (size) {
+        ssize_t n = pread(fd, buf, size, offset);
+
+        if (n <= 0) {
+            return dng_fail(DNG_EIO, "Failed to read strip");
+        }
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Decode the strips covering rows [first, last) into consecutive rows of
+ * dest, starting with the first row of the first strip
+ */
+static int quicklook_decode(const struct quicklook *q, uint32_t first, uint32_t last,
+                            uint8_t *dest) {
+    const struct strip_layout *l = &q->l;
+    size_t rowbytes = layout_mem_rowbytes(l);
+    uint8_t *raw = NULL;
+    size_t raw_alloc = 0;
+    int err = 0;
+
+    for (uint32_t strip = first / l->rowsperstrip;
+         strip * l->rowsperstrip < last && !err; strip++) {
+        size_t size = q->bytecounts[strip];
+
+        if (size > raw_alloc) {
+            free(raw);
+            raw = malloc(size);
+            raw_alloc = raw ? size : 0;
+            if (!raw) {
+                err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+                break;
+            }
+        }
+
+        err = pread_full(q->fd, raw, size, q->offsets[strip]);
+        if (!err) {
+            err = decode_strip(l, raw, size, dest, layout_strip_rows(l, strip));
+        }
+        dest += l->rowsperstrip * rowbytes;
+    }
+
+    free(raw);
+    return err;
+}
+
+static void quicklook_task(void *arg, size_t i) {
+    struct quicklook *q = arg;
+    const struct strip_layout *l = &q->l;
+    size_t rowbytes = layout_mem_rowbytes(l);
+    int rows_per_quad = q->colors ? 2 : 1;
+    size_t oy0 = i * QUICKLOOK_TASK_ROWS;
+    size_t oy1 = oy0 + QUICKLOOK_TASK_ROWS < q->height ? oy0 + QUICKLOOK_TASK_ROWS : q->height;
+    size_t qy1 = oy1 * q->factor < q->quads_high ? oy1 * q->factor : q->quads_high;
+    uint32_t first = oy0 * q->factor * rows_per_quad;
+    uint32_t last = qy1 * rows_per_quad;
+    uint32_t base = q->image ? 0 : first / l->rowsperstrip * l->rowsperstrip;
+    float *acc = malloc(3 * q->quads_wide * sizeof(float));
+    float *scratch = malloc(2 * layout_mem_row_samples(l) * sizeof(float));
+    uint8_t *band = q->image;
+    int err = 0;
+
+    if (!band) {
+        uint32_t end = (last + l->rowsperstrip - 1) / l->rowsperstrip * l->rowsperstrip;
+
+        band = malloc((size_t) (end - base) * rowbytes);
+    }
+
+    if (!acc || !scratch || !band) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate quicklook band");
+        goto out;
+    }
+
+    if (!q->image) {
+        err = quicklook_decode(q, first, last, band);
+        if (err) {
+            goto out;
+        }
+    }
+
+    for (size_t oy = oy0; oy < oy1; oy++) {
+        size_t qy = oy * q->factor;
+        size_t nrows = q->quads_high - qy < q->factor ? q->quads_high - qy : q->factor;
+
+        memset(acc, 0, 3 * q->quads_wide * sizeof(float));
+        bin_quad_rows(l, q->colors, band + (qy * rows_per_quad - base) * rowbytes,
+                      nrows, acc, scratch);
+        box_columns(acc, q->quads_wide, q->factor, q->width, nrows, q->positions,
+                    q->rgb + 3 * oy * q->width);
+    }
+
+out:
+    if (err && !__atomic_exchange_n(&q->err, err, __ATOMIC_RELAXED)) {
+        memcpy(q->errmsg, dng_errmsg, sizeof(dng_errmsg));
+    }
+    if (band != q->image) {
+        free(band);
+    }
+    free(scratch);
+    free(acc);
+}
+
+/*
+ * Invert a 3x3 matrix
+ *
+ * @returns 0 on success, -1 if singular
+ */
+static int invert3(const float m[9], float inv[9]) {
+    float det = m[0]*(m[4]*m[8] - m[5]*m[7]) -
+                m[1]*(m[3]*m[8] - m[5]*m[6]) +
+                m[2]*(m[3]*m[7] - m[4]*m[6]);
+
+    if (!(fabsf(det) > 1e-12f)) {
+        return -1;
+    }
+
+    inv[0] = (m[4]*m[8] - m[5]*m[7]) / det;
+    inv[1] = (m[2]*m[7] - m[1]*m[8]) / det;
+    inv[2] = (m[1]*m[5] - m[2]*m[4]) / det;
+    inv[3] = (m[5]*m[6] - m[3]*m[8]) / det;
+    inv[4] = (m[0]*m[8] - m[2]*m[6]) / det;
+    inv[5] = (m[2]*m[3] - m[0]*m[5]) / det;
+    inv[6] = (m[3]*m[7] - m[4]*m[6]) / det;
+    inv[7] = (m[1]*m[6] - m[0]*m[7]) / det;
+    inv[8] = (m[0]*m[4] - m[1]*m[3]) / det;
+    return 0;
+}
+
+/*
+ * Camera RGB to white balanced linear sRGB
+ *
+ * ColorMatrix1 maps XYZ to camera RGB.  Its inverse, followed by XYZ to
+ * linear sRGB, is scaled so that the camera neutral maps to white.  The
+ * neutral is AsShotNeutral, or D65 through ColorMatrix1.
+ *
+ * @param tiff  File positioned at IFD0
+ * @param m     Camera RGB to sRGB matrix returned here
+ */
+static void quicklook_matrix(TIFF *tiff, float m[9]) {
+    static const float xyz_to_srgb[9] = {
+         3.2406f, -1.5372f, -0.4986f,
+        -0.9689f,  1.8758f,  0.0415f,
+         0.0557f, -0.2040f,  1.0570f,
+    };
+    static const float d65[3] = {0.9505f, 1.0f, 1.0890f};
+    const float *cm = default_color_matrix1;
+    float neutral[3], cam_to_xyz[9];
+    uint16_t count;
+    float *values;
+
+    if (TIFFGetField(tiff, TIFFTAG_COLORMATRIX1, &count, &values) && count == 9) {
+        cm = values;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        neutral[i] = cm[3*i]*d65[0] + cm[3*i + 1]*d65[1] + cm[3*i + 2]*d65[2];
+    }
+
+    if (TIFFGetField(tiff, TIFFTAG_ASSHOTNEUTRAL, &count, &values) && count == 3) {
+        memcpy(neutral, values, sizeof(neutral));
+    }
+
+    if (invert3(cm, cam_to_xyz)) {
+        memcpy(m, (float[9]){1, 0, 0, 0, 1, 0, 0, 0, 1}, 9 * sizeof(float));
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        float white = 0;
+
+        for (int j = 0; j < 3; j++) {
+            m[3*i + j] = xyz_to_srgb[3*i]*cam_to_xyz[j] +
+                         xyz_to_srgb[3*i + 1]*cam_to_xyz[3 + j] +
+                         xyz_to_srgb[3*i + 2]*cam_to_xyz[6 + j];
+            white += m[3*i + j] * neutral[j];
+        }
+
+        for (int j = 0; j < 3; j++) {
+            m[3*i + j] = white > 0 ? m[3*i + j] / white : (i == j);
+        }
+    }
+}
+
+/*
+ * Choose the source of a quicklook: the smallest of the raw image and the
+ * pyramid levels at least max_size on its larger side, else the largest
+ *
+ * @param tiff      File positioned at IFD0
+ * @param max_size  Requested size
+ * @returns pyramid level, or 0 for the raw image
+ */
+static uint32_t quicklook_level(TIFF *tiff, uint32_t max_size) {
+    uint32_t best = 0, best_size = 0, found = 0;
+    uint32_t subfiletype, width, height;
+    uint16_t count, photometric;
+    uint64_t *offsets;
+
+    if (!TIFFGetField(tiff, TIFFTAG_SUBIFD, &count, &offsets) || !count) {
+        return 0;
+    }
+
+    uint64_t subifds[count];
+    memcpy(subifds, offsets, sizeof(subifds));
+
+    /* Quads of a CFA image become quicklook pixels */
+    if (!select_raw_directory(tiff) &&
+        TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width) &&
+        TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height)) {
+        best_size = width > height ? width : height;
+        if (TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photometric) &&
+            photometric == PHOTOMETRIC_CFA) {
+            best_size /= 2;
+        }
+    }
+
+    for (uint16_t i = 0; i < count; i++) {
+        uint32_t size;
+
+        if (!TIFFSetSubDirectory(tiff, subifds[i]) ||
+            !TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &subfiletype) ||
+            !(subfiletype & FILETYPE_REDUCEDIMAGE) ||
+            !TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photometric) ||
+            photometric != PHOTOMETRIC_LINEARRAW) {
+            continue;
+        }
+
+        found++;
+        if (!TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width) ||
+            !TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height)) {
+            continue;
+        }
+
+        size = width > height ? width : height;
+        if ((size >= max_size && (best_size < max_size || size < best_size)) ||
+            (size < max_size && best_size < max_size && size > best_size)) {
+            best = found;
+            best_size = size;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Render a small 8-bit sRGB image of the raw image of a DNG
+ *
+ * CFA quads are binned into pixels and box-averaged down to max_size,
+ * band by band across the worker pool, reading the smallest pyramid level
+ * that is large enough when there are levels.  Camera RGB is mapped
+ * through quicklook_matrix(), scaled to WhiteLevel (or the brightest
+ * pixel when there is none) and sRGB encoded through a LUT.
+ *
+ * @param tiff      File positioned at IFD0
+ * @param max_size  Maximum output dimension
+ * @param out       Output returned here, to be freed by the caller
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int quicklook(TIFF *tiff, uint32_t max_size, struct preview *out) {
+    struct quicklook q = {
+        .positions = {1, 1, 1},
+        .fd = TIFFFileno(tiff),
+    };
+    struct strip_layout *l = &q.l;
+    unsigned int pattern;
+    float matrix[9], black = 0, white = 0, scale;
+    uint32_t level, nstrips;
+    uint16_t count;
+    uint64_t *offsets, *bytecounts;
+    float *blacklevel;
+    uint32_t *whitelevel;
+    uint8_t lut[4096];
+    int err;
+
+    if (!max_size) {
+        return dng_fail(DNG_EFORMAT, "Quicklook size must be positive");
+    }
+
+    quicklook_matrix(tiff, matrix);
+    level = quicklook_level(tiff, max_size);
+
+    if (!TIFFSetDirectory(tiff, 0)) {
+        return dng_fail(DNG_EIO, "Failed to read IFD0");
+    }
+
+    err = select_raw_directory(tiff);
+    if (err) {
+        return err;
+    }
+
+    /* Levels are scaled like the raw image they were reduced from */
+    if (TIFFGetField(tiff, TIFFTAG_BLACKLEVEL, &count, &blacklevel) && count) {
+        black = blacklevel[0];
+    }
+    if (TIFFGetField(tiff, TIFFTAG_WHITELEVEL, &count, &whitelevel) && count) {
+        white = whitelevel[0];
+    }
+
+    if (level) {
+        if (!TIFFSetDirectory(tiff, 0)) {
+            return dng_fail(DNG_EIO, "Failed to read IFD0");
+        }
+        err = select_level_directory(tiff, level);
+    }
+    if (!err) {
+        err = read_layout(tiff, l);
+    }
+    if (err) {
+        return err;
+    }
+
+    if (l->samples == 1) {
+        int found = read_cfa_pattern(tiff);
+
+        pattern = found >= 0 ? found : CFA_RGGB;
+        q.colors = cfa_patterns[pattern];
+        q.positions[0] = q.positions[1] = q.positions[2] = 0;
+        for (int p = 0; p < 4; p++) {
+            q.positions[(int) q.colors[p]]++;
+        }
+    }
+    else if (l->samples != 3) {
+        return dng_fail(DNG_EFORMAT, "Quicklook requires CFA or RGB image");
+    }
+
+    q.quads_wide = q.colors ? l->width/2 : l->width;
+    q.quads_high = q.colors ? l->height/2 : l->height;
+    if (!q.quads_wide || !q.quads_high) {
+        return dng_fail(DNG_EFORMAT, "Image too small for quicklook");
+    }
+
+    q.factor = ((q.quads_wide > q.quads_high ? q.quads_wide : q.quads_high) +
+                max_size - 1) / max_size;
+    q.width = (q.quads_wide + q.factor - 1) / q.factor;
+    q.height = (q.quads_high + q.factor - 1) / q.factor;
+
+    nstrips = layout_strips(l);
+    if (layout_native(l) && !layout_separate(l)) {
+        if (TIFFNumberOfStrips(tiff) < nstrips ||
+            !TIFFGetField(tiff, TIFFTAG_STRIPOFFSETS, &offsets) ||
+            !TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &bytecounts)) {
+            return dng_fail(DNG_EFORMAT, "Strips not found");
+        }
+
+        q.offsets = malloc(nstrips * sizeof(*q.offsets));
+        q.bytecounts = malloc(nstrips * sizeof(*q.bytecounts));
+        if (!q.offsets || !q.bytecounts) {
+            err = dng_fail(DNG_ENOMEM, "Unable to allocate strip table");
+            goto out;
+        }
+        memcpy(q.offsets, offsets, nstrips * sizeof(*q.offsets));
+        memcpy(q.bytecounts, bytecounts, nstrips * sizeof(*q.bytecounts));
+    }
+    else {
+        q.image = malloc(layout_mem_rowbytes(l) * l->height);
+        if (!q.image) {
+            err = dng_fail(DNG_ENOMEM, "Unable to allocate image");
+            goto out;
+        }
+
+        err = read_strips(tiff, l, q.image);
+        if (err) {
+            goto out;
+        }
+    }
+
+    q.rgb = malloc(3 * sizeof(float) * q.width * q.height);
+    out->rgb = malloc(3 * (size_t) q.width * q.height);
+    if (!q.rgb || !out->rgb) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate quicklook");
+        goto out;
+    }
+
+    parallel_for((q.height + QUICKLOOK_TASK_ROWS - 1) / QUICKLOOK_TASK_ROWS,
+                 quicklook_task, &q);
+    if (q.err) {
+        err = dng_fail(q.err, "%s", q.errmsg);
+        goto out;
+    }
+
+    /* To sRGB, scaled to the white level or the brightest pixel */
+    scale = 0;
+    for (size_t i = 0; i < (size_t) q.width * q.height; i++) {
+        float *px = &q.rgb[3*i];
+        float cam[3] = {px[0] - black, px[1] - black, px[2] - black};
+
+        for (int c = 0; c < 3; c++) {
+            px[c] = matrix[3*c]*cam[0] + matrix[3*c + 1]*cam[1] + matrix[3*c + 2]*cam[2];
+            if (px[c] > scale && isfinite(px[c])) {
+                scale = px[c];
+            }
+        }
+    }
+
+    if (white > black) {
+        scale = white - black;
+    }
+    scale = scale > 0 ? 4095 / scale : 0;
+
+    srgb_lut(lut);
+    for (size_t i = 0; i < 3 * (size_t) q.width * q.height; i++) {
+        float v = q.rgb[i] * scale;
+
+        out->rgb[i] = lut[v > 0 ? (v < 4095 ? (int) v : 4095) : 0];
+    }
+
+    out->width = q.width;
+    out->height = q.height;
+
+out:
+    if (err) {
+        free(out->rgb);
+        out->rgb = NULL;
+    }
+    free(q.rgb);
+    free(q.image);
+    free(q.bytecounts);
+    free(q.offsets);
+    return err;
+}
+
+/*
+ * Batch export
+ */
+
+struct jpeg_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf env;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    struct jpeg_error *err = (struct jpeg_error *) cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    dng_fail(DNG_EIO, "libjpeg: %s", msg);
+    longjmp(err->env, 1);
+}
+
+/*
+ * Write an 8-bit RGB image as a baseline JPEG
+ *
+ * @param file      Destination, positioned at the start
+ * @param img       Image to write
+ * @param quality   JPEG quality, 1 to 100
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int write_jpeg(FILE *file, const struct preview *img, int quality) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error jerr;
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.env)) {
+        jpeg_destroy_compress(&cinfo);
+        return DNG_EIO;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, file);
+
+    cinfo.image_width = img->width;
+    cinfo.image_height = img->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = img->rgb + 3 * (size_t) cinfo.next_scanline * img->width;
+
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return 0;
+}
+
+static void png_error_fn(png_structp png, png_const_charp msg) {
+    dng_fail(DNG_EIO, "libpng: %s", msg);
+    png_longjmp(png, 1);
+}
+
+/*
+ * Write an 8-bit RGB image as a PNG
+ *
+ * @param file  Destination, positioned at the start
+ * @param img   Image to write
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int write_png(FILE *file, const struct preview *img) {
+    png_structp png;
+    png_infop info;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_fn, NULL);
+    if (!png) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate PNG writer");
+    }
+
+    info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_write_struct(&png, NULL);
+        return dng_fail(DNG_ENOMEM, "Unable to allocate PNG writer");
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return DNG_EIO;
+    }
+
+    png_init_io(png, file);
+    png_set_IHDR(png, info, img->width, img->height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    for (uint32_t y = 0; y < img->height; y++) {
+        png_write_row(png, img->rgb + 3 * (size_t) y * img->width);
+    }
+
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+
+    return 0;
+}
+
+/*
+ * Render one DNG with quicklook() and write it as a JPEG or PNG
+ *
+ * @param src       DNG to read
+ * @param dst       Image to write
+ * @param format    enum export_format
+ * @param size      Maximum output dimension
+ * @param quality   JPEG quality
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int export_image(const char *src, const char *dst, int format,
+                 uint32_t size, int quality) {
+    struct preview img = {0};
+    TIFF *tiff;
+    FILE *file;
+    int err;
+
+    tiff = TIFFOpen(src, "r");
+    if (!tiff) {
+        return dng_fail(DNG_EIO, "Failed to open file");
+    }
+
+    err = quicklook(tiff, size, &img);
+    TIFFClose(tiff);
+    if (err) {
+        return err;
+    }
+
+    file = fopen(dst, "wb");
+    if (!file) {
+        free(img.rgb);
+        return dng_fail(DNG_EIO, "Failed to create %s", dst);
+    }
+
+    if (format == EXPORT_PNG) {
+        err = write_png(file, &img);
+    }
+    else {
+        err = write_jpeg(file, &img, quality);
+    }
+
+    if (fclose(file) && !err) {
+        err = dng_fail(DNG_EIO, "Failed to write %s", dst);
+    }
+
+    free(img.rgb);
+    return err;
+}
+
+/*
+ * Path in a directory, or beside a file, named after a file with its
+ * extension replaced
+ *
+ * @param path  File to name the result after
+ * @param dir   Directory, or NULL for the directory of path
+ * @param ext   Extension, with its dot, or NULL to keep the name whole
+ * @returns malloc'd path, or NULL if it could not be allocated
+ */
+char *output_path(const char *path, const char *dir, const char *ext) {
+    const char *base, *dot;
+    size_t stem, prefix;
+    char *out;
+
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    prefix = base - path;
+
+    dot = ext ? strrchr(base, '.') : NULL;
+    stem = dot && dot != base ? (size_t) (dot - base) : strlen(base);
+    ext = ext ? ext : "";
+
+    if (dir) {
+        out = malloc(strlen(dir) + 1 + stem + strlen(ext) + 1);
+        if (out) {
+            sprintf(out, "%s/%.*s%s", dir, (int) stem, base, ext);
+        }
+    }
+    else {
+        out = malloc(prefix + stem + strlen(ext) + 1);
+        if (out) {
+            sprintf(out, "%.*s%s", (int) (prefix + stem), path, ext);
+        }
+    }
+
+    return out;
+}
+
+static uint16_t float_to_half(float f) {
+    uint32_t x, sign, absx, exp, mant, h, rem, half;
+    int shift;
+
+    memcpy(&x, &f, sizeof(x));
+    sign = (x >> 16) & 0x8000;
+    absx = x & 0x7fffffff;
+
+    /* Infinity and NaN */
+    if (absx >= 0x7f800000) {
+        return sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0);
+    }
+
+    /* Rounds to infinity */
+    if (absx >= 0x477ff000) {
+        return sign | 0x7c00;
+    }
+
+    exp = absx >> 23;
+    mant = absx & 0x7fffff;
+
+    if (exp < 113) {
+        /* Denormal, or rounds to zero */
+        if (absx < 0x33000000) {
+            return sign;
+        }
+        mant |= 0x800000;
+        shift = 126 - exp;
+        h = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+    }
+    else {
+        h = ((exp - 112) << 10) | (mant >> 13);
+        rem = mant & 0x1fff;
+        half = 0x1000;
+    }
+
+    /* Round to nearest even, which may carry into the exponent */
+    if (rem > half || (rem == half && (h & 1))) {
+        h++;
+    }
+
+    return sign | h;
+}
+
+/*
+ * Convert n float samples to memory representation, rounding and clamping
+ * integer samples
+ */
+static void float_to_samples(const struct strip_layout *l, const float *src,
+                             uint8_t *dst, size_t n) {
+    if (l->sampleformat == SAMPLEFORMAT_IEEEFP) {
+        if (l->bits == 16) {
+            for (size_t i = 0; i < n; i++) {
+                ((uint16_t *) dst)[i] = float_to_half(src[i]);
+            }
+        }
+        else {
+            memcpy(dst, src, n * sizeof(float));
+        }
+    }
+    else {
+        float max = l->bits == 8 ? 255 : 65535;
+
+        for (size_t i = 0; i < n; i++) {
+            float v = src[i] + 0.5f;
+
+            v = v > 0 ? (v < max ? v : max) : 0;
+            if (l->bits == 8) {
+                dst[i] = v;
+            }
+            else {
+                ((uint16_t *) dst)[i] = v;
+            }
+        }
+    }
+}
+
+/* Output rows per downsampling task */
+#define PYRAMID_TASK_ROWS   32
+
+/*
+ * Reduced resolution level of the raw image
+ *
+ * Level 1 bins each CFA quad into an RGB pixel, or box-averages 2x2 pixels
+ * of a LinearRaw image, and each further level box-averages 2x2 pixels of
+ * the level before it.  rgb is only kept while building the next level.
+ */
+struct pyramid_level {
+    struct strip_layout l;  /* 3-sample LinearRaw, in the raw sample format */
+    float *rgb;             /* level at full precision, source of the next */
+    uint8_t *mem;           /* level in memory representation */
+};
+
+struct pyramid_task {
+    const struct strip_layout *src_l;   /* layout of src */
+    const uint8_t *src;     /* raw image, or NULL to reduce src_rgb */
+    const float *src_rgb;   /* previous level */
+    size_t src_width;       /* pixels (or quads) accumulated per row */
+    const char *colors;     /* CFA colors, NULL for RGB sources */
+    float positions[3];     /* CFA positions of each color */
+    struct pyramid_level *dst;
+    int err;
+};
+
+static void pyramid_task(void *arg, size_t i) {
+    struct pyramid_task *t = arg;
+    struct pyramid_level *dst = t->dst;
+    size_t w = dst->l.width;
+    size_t first = i * PYRAMID_TASK_ROWS;
+    size_t last = first + PYRAMID_TASK_ROWS < dst->l.height ?
+                  first + PYRAMID_TASK_ROWS : dst->l.height;
+    size_t row_samples = t->src ? layout_mem_row_samples(t->src_l) : 3 * t->src_width;
+    size_t rowbytes = t->src ? layout_mem_rowbytes(t->src_l) : 0;
+    int fast = t->colors && t->src_l->sampleformat == SAMPLEFORMAT_UINT &&
+               t->src_l->bits == 16;
+    float *acc = malloc(3 * t->src_width * sizeof(float));
+    float *rows = malloc(2 * row_samples * sizeof(float));
+    float *scratch = dst->rgb ? NULL : malloc(3 * w * sizeof(float));
+    float scale[3];
+
+    if (!acc || !rows || (!dst->rgb && !scratch)) {
+        __atomic_store_n(&t->err, DNG_ENOMEM, __ATOMIC_RELAXED);
+        goto out;
+    }
+
+    for (int c = 0; c < 3; c++) {
+        scale[c] = t->colors ? 1 / t->positions[c] : 0.25f;
+    }
+
+    for (size_t y = first; y < last; y++) {
+        float *out = dst->rgb ? dst->rgb + 3 * w * y : scratch;
+
+        memset(acc, 0, 3 * t->src_width * sizeof(float));
+
+        /* Vertical pass, into color planes */
+        if (fast) {
+            const uint8_t *row = t->src + 2*y*rowbytes;
+
+            bin_cfa_u16((const uint16_t *) row, (const uint16_t *) (row + rowbytes),
+                        t->src_width, t->colors, acc);
+        }
+        else if (t->src) {
+            samples_to_float(t->src_l, t->src + 2*y*rowbytes, rows, 2 * row_samples);
+            if (t->colors) {
+                bin_cfa_float(rows, rows + row_samples, t->src_width, t->colors, acc);
+            }
+            else {
+                bin_rgb_float(rows, t->src_width, acc);
+                bin_rgb_float(rows + row_samples, t->src_width, acc);
+            }
+        }
+        else {
+            bin_rgb_float(t->src_rgb + 2*y*row_samples, t->src_width, acc);
+            bin_rgb_float(t->src_rgb + (2*y + 1)*row_samples, t->src_width, acc);
+        }
+
+        /* Horizontal pass, interleaving the colors */
+        for (size_t x = 0; x < w; x++) {
+            for (int c = 0; c < 3; c++) {
+                const float *plane = acc + c * t->src_width;
+
+                if (t->colors) {
+                    out[3*x + c] = plane[x] * scale[c];
+                }
+                else {
+                    out[3*x + c] = (plane[2*x] + plane[2*x + 1]) * scale[c];
+                }
+            }
+        }
+
+        float_to_samples(&dst->l, out, dst->mem + y * layout_mem_rowbytes(&dst->l), 3 * w);
+    }
+
+out:
+    free(scratch);
+    free(rows);
+    free(acc);
+}
+
+static void pyramid_free(struct pyramid_level *levels, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        free(levels[i].rgb);
+        free(levels[i].mem);
+    }
+    free(levels);
+}
+
+/*
+ * Build the reduced resolution levels of an image
+ *
+ * Each level is built from the one before it, with the rows of a level
+ * split between the worker pool.
+ *
+ * @param l         Layout of the raw image
+ * @param pattern   CFA pattern of single sample images
+ * @param data      Raw image in memory representation
+ * @param n         Number of levels
+ * @param out       Levels returned here, to be freed with pyramid_free()
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int build_pyramid(const struct strip_layout *l, unsigned int pattern,
+                         const uint8_t *data, uint32_t n,
+                         struct pyramid_level **out) {
+    struct pyramid_level *levels;
+    int cfa = l->samples == 1;
+
+    if (l->samples != 1 && l->samples != 3) {
+        return dng_fail(DNG_EFORMAT, "Pyramid levels require CFA or RGB image");
+    }
+
+    if (n >= 32 || (l->width >> n) == 0 || (l->height >> n) == 0) {
+        return dng_fail(DNG_EFORMAT, "Image too small for %u pyramid levels", n);
+    }
+
+    levels = calloc(n, sizeof(*levels));
+    if (!levels) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate pyramid");
+    }
+
+    for (uint32_t k = 0; k < n; k++) {
+        struct pyramid_level *level = &levels[k];
+        struct strip_layout *src_l = k ? &levels[k-1].l : NULL;
+        struct pyramid_task t = {
+            .src_l = l,
+            .src = k ? NULL : data,
+            .src_rgb = k ? levels[k-1].rgb : NULL,
+            .src_width = k ? src_l->width : (cfa ? l->width/2 : l->width),
+            .colors = !k && cfa ? cfa_patterns[pattern] : NULL,
+            .positions = {1, 1, 1},
+            .dst = level,
+        };
+
+        level->l = (struct strip_layout) {
+            .width = l->width >> (k + 1),
+            .height = l->height >> (k + 1),
+            .samples = 3,
+            .planar = PLANARCONFIG_CONTIG,
+            .bits = l->bits,
+            .sampleformat = l->sampleformat,
+        };
+
+        if (t.colors) {
+            t.positions[0] = t.positions[1] = t.positions[2] = 0;
+            for (int p = 0; p < 4; p++) {
+                t.positions[(int) t.colors[p]]++;
+            }
+        }
+
+        /* Only the next level needs this one at full precision */
+        if (k + 1 < n) {
+            level->rgb = malloc(3 * sizeof(float) * level->l.width * level->l.height);
+        }
+        level->mem = malloc(layout_mem_rowbytes(&level->l) * level->l.height);
+        if ((k + 1 < n && !level->rgb) || !level->mem) {
+            pyramid_free(levels, n);
+            return dng_fail(DNG_ENOMEM, "Unable to allocate pyramid level");
+        }
+
+        parallel_for((level->l.height + PYRAMID_TASK_ROWS - 1) / PYRAMID_TASK_ROWS,
+                     pyramid_task, &t);
+        if (t.err) {
+            pyramid_free(levels, n);
+            return dng_fail(t.err, "Unable to allocate pyramid rows");
+        }
+
+        if (k) {
+            free(levels[k-1].rgb);
+            levels[k-1].rgb = NULL;
+        }
+    }
+
+    *out = levels;
+    return 0;
+}
+
+/*
+ * Fill in the strip size, compression and predictor of a layout to be
+ * written
+ */
+static void prepare_layout(struct strip_layout *l, int compression) {
+    int fp = l->sampleformat == SAMPLEFORMAT_IEEEFP;
+
+    l->rowsperstrip = choose_rowsperstrip(l);
+    l->compression = compression ? COMPRESSION_ADOBE_DEFLATE : COMPRESSION_NONE;
+    l->byteswapped = 0;
+
+    l->predictor = PREDICTOR_NONE;
+    if (compression && fp) {
+        l->predictor = l->samples == 1 ? PREDICTOR_FLOATINGPOINTX2 : PREDICTOR_FLOATINGPOINT;
+    }
+}
+
+/*
+ * Set the tags describing the image data of a directory
+ */
+static void set_image_tags(TIFF *tiff, const struct strip_layout *l,
+                           uint32_t subfiletype, uint16_t photometric) {
+    TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, subfiletype);
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, l->width);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, l->height);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, l->planar);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, l->bits);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, l->samples);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, photometric);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, l->rowsperstrip);
+
+    if (l->sampleformat == SAMPLEFORMAT_IEEEFP) {
+        TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    }
+
+    TIFFSetField(tiff, TIFFTAG_COMPRESSION, l->compression);
+    if (l->predictor != PREDICTOR_NONE) {
+        TIFFSetField(tiff, TIFFTAG_PREDICTOR, l->predictor);
+    }
+}
+
+/*
+ * Set the tags of the raw image directory
+ *
+ * Single sample images are CFA data, and multi-sample images LinearRaw.
+ */
+static void set_raw_tags(TIFF *tiff, const struct dng_options *opts,
+                         const struct strip_layout *l, uint32_t subfiletype) {
+    int cfa = l->samples == 1;
+
+    set_image_tags(tiff, l, subfiletype,
+                   cfa ? PHOTOMETRIC_CFA : PHOTOMETRIC_LINEARRAW);
+
+    if (cfa) {
+        TIFFSetField(tiff, TIFFTAG_CFAREPEATPATTERNDIM, (short[]){2,2});
+        if (cfa_pattern_passcount(tiff)) {
+            TIFFSetField(tiff, TIFFTAG_CFAPATTERN, 4, cfa_patterns[opts->pattern]);
+        }
+        else {
+            TIFFSetField(tiff, TIFFTAG_CFAPATTERN, cfa_patterns[opts->pattern]);
+        }
+    }
+}
+
+/*
+ * Set the DNG tags that describe the whole file, which belong in IFD0
+ *
+ * Deflate compression and floating point samples require DNG 1.4, and the
+ * floating point predictor for CFA data (X2, predicting from the same color
+ * two pixels back) requires DNG 1.5.
+ *
+ * @param tiff  File positioned at IFD0
+ * @param opts  DNG options
+ * @param raw   Layout of the raw image, prepared for writing
+ */
+static void set_dng_tags(TIFF *tiff, const struct dng_options *opts,
+                         const struct strip_layout *raw) {
+    const char *version = "\001\001\0\0";
+    const char *backward_version = "\001\0\0\0";
+
+    if (raw->sampleformat == SAMPLEFORMAT_IEEEFP ||
+        raw->compression != COMPRESSION_NONE) {
+        version = backward_version = "\001\004\0\0";
+    }
+
+    if (opts->timecode || opts->frame_rate) {
+        version = backward_version = "\001\004\0\0";
+    }
+
+    if (raw->predictor == PREDICTOR_FLOATINGPOINTX2) {
+        version = backward_version = "\001\005\0\0";
+    }
+
+    TIFFSetField(tiff, TIFFTAG_DNGVERSION, version);
+    TIFFSetField(tiff, TIFFTAG_DNGBACKWARDVERSION, backward_version);
+    TIFFSetField(tiff, TIFFTAG_UNIQUECAMERAMODEL, opts->camera);
+    TIFFSetField(tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+
+    TIFFSetField(tiff, TIFFTAG_COLORMATRIX1, opts->color_matrix1_len,
+                 opts->color_matrix1);
+
+    if (opts->color_matrix2) {
+        TIFFSetField(tiff, TIFFTAG_COLORMATRIX2, opts->color_matrix2_len,
+                     opts->color_matrix2);
+    }
+
+    if (opts->timestamp > 0) {
+        time_t seconds = opts->timestamp;
+        char datetime[20];
+        struct tm tm;
+
+        if (gmtime_r(&seconds, &tm) &&
+            strftime(datetime, sizeof(datetime), "%Y:%m:%d %H:%M:%S", &tm)) {
+            TIFFSetField(tiff, TIFFTAG_DATETIME, datetime);
+        }
+    }
+
+    if (opts->timecode) {
+        TIFFSetField(tiff, TIFFTAG_TIMECODES, opts->timecode);
+    }
+
+    if (opts->frame_rate) {
+        TIFFSetField(tiff, TIFFTAG_FRAMERATE, opts->frame_rate);
+    }
+
+    if (opts->calibration_illuminant1) {
+        TIFFSetField(tiff, TIFFTAG_CALIBRATIONILLUMINANT1,
+                     opts->calibration_illuminant1);
+    }
+
+    if (opts->calibration_illuminant2) {
+        TIFFSetField(tiff, TIFFTAG_CALIBRATIONILLUMINANT2,
+                     opts->calibration_illuminant2);
+    }
+}
+
+/*
+ * Reserve SubIFDs for the directories written after the current one
+ */
+static void set_subifd_tag(TIFF *tiff, uint16_t count) {
+    uint64_t offsets[count];
+
+    memset(offsets, 0, sizeof(offsets));
+    TIFFSetField(tiff, TIFFTAG_SUBIFD, count, offsets);
+}
+
+/*
+ * Write the reduced resolution levels, each as a LinearRaw SubIFD
+ *
+ * @param tiff      File, following the directory that reserved the SubIFDs
+ * @param opts      DNG options
+ * @param levels    Levels from build_pyramid()
+ * @param n         Number of levels
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int write_pyramid(TIFF *tiff, const struct dng_options *opts,
+                         struct pyramid_level *levels, uint32_t n) {
+    for (uint32_t k = 0; k < n; k++) {
+        struct strip_layout *pl = &levels[k].l;
+        int err;
+
+        prepare_layout(pl, opts->compression);
+        set_image_tags(tiff, pl, FILETYPE_REDUCEDIMAGE, PHOTOMETRIC_LINEARRAW);
+
+        err = write_strips(tiff, pl, levels[k].mem);
+        if (err) {
+            return err;
+        }
+
+        if (!TIFFWriteDirectory(tiff)) {
+            return dng_fail(DNG_EIO, "libtiff failed to write directory.");
+        }
+    }
+
+    return 0;
+}
+
+/* Raw strips and preview, produced together */
+struct dng_render {
+    struct strip_batch strips;  /* every strip of the raw image */
+    const struct dng_options *opts;
+    struct preview preview;
+    int preview_err;
+    char preview_errmsg[sizeof(dng_errmsg)];
+};
+
+/* The preview is rendered by the first task, while the rest encode strips */
+static void dng_render_task(void *arg, size_t i) {
+    struct dng_render *r = arg;
+
+    if (i > 0) {
+        encode_strip_task(&r->strips, i - 1);
+        return;
+    }
+
+    r->preview_err = render_preview(r->strips.l, r->opts->pattern, r->strips.mem,
+                                    r->opts->preview, &r->preview);
+    if (r->preview_err) {
+        memcpy(r->preview_errmsg, dng_errmsg, sizeof(dng_errmsg));
+    }
+}
+
+/*
+ * Write a DNG with a preview in IFD0 and the raw image in a SubIFD
+ *
+ * The preview is rendered concurrently with encoding the raw strips, which
+ * are all held until the preview has been written.  Uncompressed strips
+ * borrow the image, so only compressed data is held.
+ */
+static int write_dng_with_preview(TIFF *tiff, const struct dng_options *opts,
+                                  struct strip_layout *l, const void *data,
+                                  struct strip_table *strips) {
+    uint32_t nstrips = layout_strips(l);
+    struct strip_layout pl = {
+        .samples = 3,
+        .planar = PLANARCONFIG_CONTIG,
+        .bits = 8,
+        .sampleformat = SAMPLEFORMAT_UINT,
+    };
+    struct dng_render r = {
+        .strips = {
+            .l = l,
+            .mem = (uint8_t *) data,
+        },
+        .opts = opts,
+    };
+    int err = 0;
+
+    r.strips.bufs = calloc(nstrips, sizeof(*r.strips.bufs));
+    if (!r.strips.bufs) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strips");
+    }
+
+    parallel_for(nstrips + 1, dng_render_task, &r);
+
+    if (r.preview_err) {
+        err = dng_fail(r.preview_err, "%s", r.preview_errmsg);
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < nstrips; i++) {
+        if (r.strips.bufs[i].err) {
+            goto out;
+        }
+    }
+
+    /* IFD0, the preview */
+    pl.width = r.preview.width;
+    pl.height = r.preview.height;
+    prepare_layout(&pl, 0);
+
+    set_image_tags(tiff, &pl, FILETYPE_REDUCEDIMAGE, PHOTOMETRIC_RGB);
+    set_dng_tags(tiff, opts, l);
+    set_subifd_tag(tiff, 1 + opts->pyramid_levels);
+
+    err = write_strips(tiff, &pl, r.preview.rgb);
+    if (err) {
+        goto out;
+    }
+
+    if (!TIFFWriteDirectory(tiff)) {
+        err = dng_fail(DNG_EIO, "libtiff failed to write directory.");
+        goto out;
+    }
+
+    /* SubIFD, the raw image */
+    set_raw_tags(tiff, opts, l, 0);
+
+    for (uint32_t i = 0; i < nstrips; i++) {
+        struct strip_buf *buf = &r.strips.bufs[i];
+
+        if (TIFFWriteRawStrip(tiff, i, buf->data, buf->size) < 0) {
+            err = dng_fail(DNG_EIO, "libtiff failed to write strip.");
+            goto out;
+        }
+    }
+
+    if (strips) {
+        err = capture_strips(tiff, l, strips);
+        if (err) {
+            goto out;
+        }
+    }
+
+    if (!TIFFWriteDirectory(tiff)) {
+        err = dng_fail(DNG_EIO, "libtiff failed to write directory.");
+    }
+
+out:
+    /* Reports the first strip error, if any */
+    if (!err) {
+        err = strip_batch_finish(r.strips.bufs, nstrips);
+    }
+    else {
+        strip_batch_finish(r.strips.bufs, nstrips);
+    }
+    free(r.strips.bufs);
+    free(r.preview.rgb);
+    return err;
+}
+
+/*
+ * Write an image as a DNG
+ *
+ * Single sample images are written as CFA data, and multi-sample images as
+ * LinearRaw.  Sets every tag, writes the strips and the directories, with
+ * the raw image in IFD0, or in a SubIFD when a preview is requested.
+ * Pyramid levels follow as SubIFDs of IFD0.
+ *
+ * @param tiff  File to write to
+ * @param opts  DNG options
+ * @param l     Image layout, including planar configuration.  rowsperstrip,
+ *              compression and predictor are filled in here.
+ * @param data  Image in memory representation
+ * @param strips  Strips of the raw image returned here if not NULL, to be
+ *                freed by the caller
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int write_dng(TIFF *tiff, const struct dng_options *opts,
+              struct strip_layout *l, const void *data,
+              struct strip_table *strips) {
+    struct pyramid_level *levels = NULL;
+    int err;
+
+    prepare_layout(l, opts->compression);
+
+    if (opts->pyramid_levels) {
+        err = build_pyramid(l, opts->pattern, data, opts->pyramid_levels, &levels);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (opts->preview) {
+        err = write_dng_with_preview(tiff, opts, l, data, strips);
+    }
+    else {
+        set_raw_tags(tiff, opts, l, 0);
+        set_dng_tags(tiff, opts, l);
+        if (opts->pyramid_levels) {
+            set_subifd_tag(tiff, opts->pyramid_levels);
+        }
+
+        err = write_strips(tiff, l, data);
+        if (!err && strips) {
+            err = capture_strips(tiff, l, strips);
+        }
+        if (!err && !TIFFWriteDirectory(tiff)) {
+            err = dng_fail(DNG_EIO, "libtiff failed to write directory.");
+        }
+    }
+
+    if (levels) {
+        if (!err) {
+            err = write_pyramid(tiff, opts, levels, opts->pyramid_levels);
+        }
+        pyramid_free(levels, opts->pyramid_levels);
+    }
+
+    return err;
+}
+
+/*
+ * Upper bound on the bytes of a prepared layout's strips, and their
+ * offset and byte count tables
+ *
+ * DEFLATE may expand incompressible data, by at most zlib's
+ * compressBound() of a little over 1/4096 plus 13 bytes per stream.
+ */
+static uint64_t strips_size_bound(const struct strip_layout *l) {
+    uint64_t bytes = (uint64_t) l->width * l->height * l->samples * layout_file_bytes(l);
+    uint64_t strips = layout_strips(l);
+
+    if (l->compression != COMPRESSION_NONE) {
+        bytes += (bytes >> 11) + 16 * strips;
+    }
+
+    return bytes + 16 * strips;
+}
+
+/*
+ * Upper bound on the size of the file write_dng() writes
+ *
+ * @param opts  Options the file is written with
+ * @param l     Layout of the raw image
+ * @returns bound in bytes
+ */
+static uint64_t dng_size_bound(const struct dng_options *opts,
+                               const struct strip_layout *l) {
+    struct strip_layout raw = *l;
+    uint64_t bound = 1 << 20;   /* headers, IFDs and tag data */
+
+    prepare_layout(&raw, opts->compression);
+    bound += strips_size_bound(&raw);
+
+    for (uint32_t k = 0; k < opts->pyramid_levels && k < 32; k++) {
+        struct strip_layout level = {
+            .width = l->width >> (k + 1),
+            .height = l->height >> (k + 1),
+            .samples = 3,
+            .planar = PLANARCONFIG_CONTIG,
+            .bits = l->bits,
+            .sampleformat = l->sampleformat,
+        };
+
+        if (!level.width || !level.height) {
+            break;
+        }
+        prepare_layout(&level, opts->compression);
+        bound += strips_size_bound(&level);
+    }
+
+    if (opts->preview) {
+        bound += 3 * (uint64_t) opts->preview * opts->preview;
+    }
+
+    return bound;
+}
+
+/*
+ * libtiff mode to open a file for write_dng() with
+ */
+const char *dng_open_mode(enum bigtiff_mode mode, const struct dng_options *opts,
+                          const struct strip_layout *l) {
+    if (mode == BIGTIFF_AUTO) {
+        return dng_size_bound(opts, l) > UINT32_MAX ? "w8" : "w";
+    }
+
+    return mode == BIGTIFF_ALWAYS ? "w8" : "w";
+}
+
+/*
+ * Raw TIFF access
+ *
+ * Reading and patching TIFF structures straight from the file, without
+ * libtiff, for recompression and for the crash recovery of pyengine.c.
+ */
+
+/*
+ * Read an unsigned integer in the byte order of a TIFF file
+ */
+uint64_t read_uint(const uint8_t *p, int bytes, int swapped) {
+    int little = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) != !!swapped;
+    uint64_t v = 0;
+
+    for (int i = 0; i < bytes; i++) {
+        v |= (uint64_t) p[i] << (little ? 8*i : 8*(bytes - 1 - i));
+    }
+
+    return v;
+}
+
+/*
+ * Write an unsigned integer in the byte order of a TIFF file
+ */
+static void write_uint(uint8_t *p, int bytes, int swapped, uint64_t v) {
+    int little = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) != !!swapped;
+
+    for (int i = 0; i < bytes; i++) {
+        p[i] = v >> (little ? 8*i : 8*(bytes - 1 - i));
+    }
+}
+
+/*
+ * Read the offset of the IFD following another, straight from the file
+ *
+ * @param fd        File descriptor of the TIFF file
+ * @param bigtiff   File is BigTIFF
+ * @param swapped   File is in the opposite byte order to the host
+ * @param ifd       IFD to follow, or 0 for the first IFD
+ * @param next      Offset of the following IFD returned here, 0 if none
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int read_ifd_link(int fd, int bigtiff, int swapped, uint64_t ifd, uint64_t *next) {
+    int count_bytes = bigtiff ? 8 : 2;
+    int entry_bytes = bigtiff ? 20 : 12;
+    int offset_bytes = bigtiff ? 8 : 4;
+    uint8_t buf[8];
+    uint64_t at;
+
+    if (!ifd) {
+        at = bigtiff ? 8 : 4;
+    }
+    else {
+        if (pread(fd, buf, count_bytes, ifd) != count_bytes) {
+            return dng_fail(DNG_EIO, "Failed to read IFD");
+        }
+        at = ifd + count_bytes + entry_bytes * read_uint(buf, count_bytes, swapped);
+    }
+
+    if (pread(fd, buf, offset_bytes, at) != offset_bytes) {
+        return dng_fail(DNG_EIO, "Failed to read IFD link");
+    }
+
+    *next = read_uint(buf, offset_bytes, swapped);
+    return 0;
+}
+
+/*
+ * Size of a TIFF field type in bytes, 0 if unknown
+ */
+int raw_type_size(uint16_t type) {
+    switch (type) {
+    case TIFF_BYTE:
+    case TIFF_ASCII:
+    case TIFF_SBYTE:
+    case TIFF_UNDEFINED:
+        return 1;
+    case TIFF_SHORT:
+    case TIFF_SSHORT:
+        return 2;
+    case TIFF_LONG:
+    case TIFF_SLONG:
+    case TIFF_FLOAT:
+    case TIFF_IFD:
+        return 4;
+    case TIFF_RATIONAL:
+    case TIFF_SRATIONAL:
+    case TIFF_DOUBLE:
+    case TIFF_LONG8:
+    case TIFF_SLONG8:
+    case TIFF_IFD8:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Write the link to the IFD following another, straight to the file
+ *
+ * @param f     File
+ * @param ifd   IFD to link from, or 0 for the header
+ * @param next  Offset of the following IFD, 0 to end the chain
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int write_ifd_link(const struct raw_tiff *f, uint64_t ifd, uint64_t next) {
+    int count_bytes = f->bigtiff ? 8 : 2;
+    int entry_bytes = f->bigtiff ? 20 : 12;
+    int word = f->bigtiff ? 8 : 4;
+    int little = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) != !!f->swapped;
+    uint8_t buf[8];
+    uint64_t at;
+
+    if (!ifd) {
+        at = word;
+    }
+    else {
+        if (pread_full(f->fd, buf, count_bytes, ifd)) {
+            return dng_fail(DNG_EIO, "Failed to read IFD");
+        }
+        at = ifd + count_bytes + entry_bytes * read_uint(buf, count_bytes, f->swapped);
+    }
+
+    for (int i = 0; i < word; i++) {
+        buf[i] = next >> (little ? 8*i : 8*(word - 1 - i));
+    }
+
+    if (pwrite(f->fd, buf, word, at) != word) {
+        return dng_fail(DNG_EIO, "Failed to write IFD link");
+    }
+
+    return 0;
+}
+
+/*
+ * Open a TIFF file to read, or write, its structure directly
+ *
+ * @param path  File
+ * @param flags open() flags
+ * @param f     File opened here, to be closed by the caller
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int raw_tiff_open(const char *path, int flags, struct raw_tiff *f) {
+    uint8_t header[4];
+    struct stat st;
+
+    f->fd = open(path, flags);
+    if (f->fd < 0) {
+        return dng_fail(DNG_EIO, "Failed to open file");
+    }
+
+    if (fstat(f->fd, &st) || pread(f->fd, header, sizeof(header), 0) != sizeof(header)) {
+        close(f->fd);
+        f->fd = -1;
+        return dng_fail(DNG_EIO, "Failed to read header");
+    }
+    f->size = st.st_size;
+
+    f->bigtiff = 0;
+    f->swapped = 0;
+    if (!memcmp(header, "II", 2) || !memcmp(header, "MM", 2)) {
+        f->swapped = (header[0] == 'I') != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+        f->bigtiff = read_uint(header + 2, 2, f->swapped) == 43;
+    }
+    if (!f->bigtiff && read_uint(header + 2, 2, f->swapped) != 42) {
+        close(f->fd);
+        f->fd = -1;
+        return dng_fail(DNG_EFORMAT, "Not a TIFF file");
+    }
+
+    return 0;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * Recompression
+ *
+ * Files are rewritten directly, without libtiff.  Every IFD is copied with
+ * its tags as they are, so tags libtiff doesn't know survive, and only the
+ * entries describing strips change.  The strips of an image already in the
+ * target compression, or in one the native codec can't decode, are copied
+ * verbatim; the rest are decoded and encoded again, one at a time.
+ */
+
+/* Nesting of SubIFDs, and entries in an IFD, beyond which a file is rejected */
+#define RECOMPRESS_MAX_DEPTH    4
+#define RECOMPRESS_MAX_ENTRIES  4096
+
+/*
+ * Spend bytes from a rate limit, sleeping until they are within it
+ */
+static void rate_limit_spend(struct rate_limit *r, uint64_t bytes) {
+    uint64_t due, now;
+    struct timespec delay;
+
+    if (!r || !r->rate) {
+        return;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->bytes += bytes;
+    due = r->start + (uint64_t) ((double) r->bytes / r->rate * 1e9);
+    pthread_mutex_unlock(&r->lock);
+
+    now = monotonic_ns();
+    if (due > now) {
+        delay.tv_sec = (due - now) / 1000000000;
+        delay.tv_nsec = (due - now) % 1000000000;
+        while (nanosleep(&delay, &delay) && errno == EINTR);
+    }
+}
+
+/* An IFD entry, with its values in the byte order of the file */
+struct rc_entry {
+    uint16_t tag;
+    uint16_t type;
+    uint64_t count;
+    uint8_t *value;
+};
+
+struct rc_ifd {
+    struct rc_entry *entries;
+    uint32_t count;
+};
+
+/* A file being recompressed */
+struct recompress {
+    struct raw_tiff in;
+    struct raw_tiff out;
+    uint64_t end;           /* end of the output written so far */
+    uint16_t compression;   /* COMPRESSION_* to write */
+    uint8_t version;        /* DNG 1.x version the strips written need */
+    struct rate_limit *rate;
+};
+
+static void rc_ifd_free(struct rc_ifd *ifd) {
+    for (uint32_t i = 0; i < ifd->count; i++) {
+        free(ifd->entries[i].value);
+    }
+    free(ifd->entries);
+    ifd->entries = NULL;
+    ifd->count = 0;
+}
+
+static struct rc_entry *rc_find(const struct rc_ifd *ifd, uint16_t tag) {
+    for (uint32_t i = 0; i < ifd->count; i++) {
+        if (ifd->entries[i].tag == tag) {
+            return &ifd->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Unsigned integer value of an entry, or def if it is missing or not an
+ * unsigned integer
+ */
+static uint64_t rc_value(const struct recompress *rc, const struct rc_ifd *ifd,
+                         uint16_t tag, uint64_t i, uint64_t def) {
+    const struct rc_entry *e = rc_find(ifd, tag);
+    int size;
+
+    if (!e || i >= e->count) {
+        return def;
+    }
+
+    switch (e->type) {
+    case TIFF_BYTE:
+    case TIFF_SHORT:
+    case TIFF_LONG:
+    case TIFF_IFD:
+    case TIFF_LONG8:
+    case TIFF_IFD8:
+        size = raw_type_size(e->type);
+        return read_uint(e->value + i * size, size, rc->in.swapped);
+    default:
+        return def;
+    }
+}
+
+/*
+ * Set an entry to unsigned integer values, adding it in tag order if it is
+ * missing
+ *
+ * @param rc        File
+ * @param ifd       IFD to set the entry of
+ * @param tag       Tag
+ * @param type      TIFF_SHORT, TIFF_LONG, TIFF_LONG8, TIFF_IFD or TIFF_IFD8
+ * @param count     Number of values
+ * @param values    Values, which must fit in type
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int rc_set(const struct recompress *rc, struct rc_ifd *ifd, uint16_t tag,
+                  uint16_t type, uint64_t count, const uint64_t *values) {
+    int size = raw_type_size(type);
+    struct rc_entry *e = rc_find(ifd, tag);
+    uint8_t *value;
+
+    value = malloc(count ? count * size : 1);
+    if (!value) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate IFD entry");
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        write_uint(value + i * size, size, rc->out.swapped, values[i]);
+    }
+
+    if (!e) {
+        struct rc_entry *entries;
+        uint32_t at = 0;
+
+        entries = realloc(ifd->entries, (ifd->count + 1) * sizeof(*entries));
+        if (!entries) {
+            free(value);
+            return dng_fail(DNG_ENOMEM, "Unable to allocate IFD entry");
+        }
+        ifd->entries = entries;
+
+        while (at < ifd->count && entries[at].tag < tag) {
+            at++;
+        }
+        memmove(&entries[at + 1], &entries[at], (ifd->count - at) * sizeof(*entries));
+        ifd->count++;
+
+        e = &entries[at];
+        e->tag = tag;
+        e->value = NULL;
+    }
+
+    free(e->value);
+    e->type = type;
+    e->count = count;
+    e->value = value;
+
+    return 0;
+}
+
+static void rc_remove(struct rc_ifd *ifd, uint16_t tag) {
+    struct rc_entry *e = rc_find(ifd, tag);
+
+    if (e) {
+        free(e->value);
+        memmove(e, e + 1, (ifd->entries + ifd->count - (e + 1)) * sizeof(*e));
+        ifd->count--;
+    }
+}
+
+static int rc_read(struct recompress *rc, uint8_t *buf, size_t size, uint64_t offset) {
+    if (offset > rc->in.size || size > rc->in.size - offset) {
+        return dng_fail(DNG_EFORMAT, "Data past the end of the file");
+    }
+
+    rate_limit_spend(rc->rate, size);
+    return pread_full(rc->in.fd, buf, size, offset);
+}
+
+/*
+ * Append data to the output, on a word boundary
+ *
+ * @param rc        File
+ * @param data      Data to write
+ * @param size      Size of data
+ * @param offset    Offset written at returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int rc_write(struct recompress *rc, const uint8_t *data, size_t size,
+                    uint64_t *offset) {
+    uint64_t at = (rc->end + 1) & ~1ull;
+
+    if (!rc->out.bigtiff && at + size > UINT32_MAX) {
+        return dng_fail(DNG_EFORMAT, "Recompressed file exceeds the 4 GiB of classic TIFF");
+    }
+
+    rate_limit_spend(rc->rate, size);
+
+    *offset = at;
+    while (size) {
+        ssize_t n = pwrite(rc->out.fd, data, size, at);
+
+        if (n <= 0) {
+            return dng_fail(DNG_EIO, "Failed to write file");
+        }
+        data += n;
+        size -= n;
+        at += n;
+    }
+    rc->end = at;
+
+    return 0;
+}
+
+/*
+ * Read an IFD, with every value
+ *
+ * @param rc        File
+ * @param offset    Offset of the IFD
+ * @param ifd       IFD returned here, to be freed with rc_ifd_free()
+ * @param next      Offset of the following IFD returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int rc_read_ifd(struct recompress *rc, uint64_t offset, struct rc_ifd *ifd,
+                       uint64_t *next) {
+    int count_bytes = rc->in.bigtiff ? 8 : 2;
+    int entry_bytes = rc->in.bigtiff ? 20 : 12;
+    int word = rc->in.bigtiff ? 8 : 4;
+    uint8_t buf[8], *entries;
+    uint64_t count;
+    int err;
+
+    err = rc_read(rc, buf, count_bytes, offset);
+    if (err) {
+        return err;
+    }
+    count = read_uint(buf, count_bytes, rc->in.swapped);
+    if (!count || count > RECOMPRESS_MAX_ENTRIES) {
+        return dng_fail(DNG_EFORMAT, "IFD has %" PRIu64 " entries", count);
+    }
+
+    entries = malloc(count * entry_bytes + word);
+    ifd->entries = calloc(count, sizeof(*ifd->entries));
+    ifd->count = 0;
+    if (!entries || !ifd->entries) {
+        free(entries);
+        free(ifd->entries);
+        ifd->entries = NULL;
+        return dng_fail(DNG_ENOMEM, "Unable to allocate IFD");
+    }
+
+    err = rc_read(rc, entries, count * entry_bytes + word, offset + count_bytes);
+
+    for (uint64_t i = 0; i < count && !err; i++) {
+        const uint8_t *entry = entries + i * entry_bytes;
+        struct rc_entry *e = &ifd->entries[i];
+        int size;
+        uint64_t bytes;
+
+        e->tag = read_uint(entry, 2, rc->in.swapped);
+        e->type = read_uint(entry + 2, 2, rc->in.swapped);
+        e->count = read_uint(entry + 4, word, rc->in.swapped);
+
+        size = raw_type_size(e->type);
+        if (!size) {
+            err = dng_fail(DNG_EFORMAT, "Tag %u has unknown type %u", e->tag, e->type);
+            break;
+        }
+        if (e->count > rc->in.size / size) {
+            err = dng_fail(DNG_EFORMAT, "Tag %u has %" PRIu64 " values, more than fit in the file",
+                           e->tag, e->count);
+            break;
+        }
+        bytes = e->count * size;
+
+        e->value = malloc(bytes ? bytes : 1);
+        if (!e->value) {
+            err = dng_fail(DNG_ENOMEM, "Unable to allocate IFD entry");
+            break;
+        }
+        ifd->count++;
+
+        if (bytes <= (uint64_t) word) {
+            memcpy(e->value, entry + 4 + word, bytes);
+        }
+        else {
+            err = rc_read(rc, e->value, bytes,
+                          read_uint(entry + 4 + word, word, rc->in.swapped));
+        }
+    }
+
+    if (!err) {
+        *next = read_uint(entries + count * entry_bytes, word, rc->in.swapped);
+    }
+
+    free(entries);
+    if (err) {
+        rc_ifd_free(ifd);
+    }
+    return err;
+}
+
+/*
+ * Append an IFD, after its values, with no following IFD
+ *
+ * @param rc        File
+ * @param ifd       IFD to write
+ * @param offset    Offset of the IFD returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int rc_write_ifd(struct recompress *rc, const struct rc_ifd *ifd, uint64_t *offset) {
+    int count_bytes = rc->out.bigtiff ? 8 : 2;
+    int entry_bytes = rc->out.bigtiff ? 20 : 12;
+    int word = rc->out.bigtiff ? 8 : 4;
+    int swapped = rc->out.swapped;
+    size_t size = count_bytes + ifd->count * entry_bytes + word;
+    uint8_t *buf, *p;
+    int err = 0;
+
+    /* The link to the next IFD is left 0 */
+    buf = calloc(1, size);
+    if (!buf) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate IFD");
+    }
+
+    write_uint(buf, count_bytes, swapped, ifd->count);
+
+    p = buf + count_bytes;
+    for (uint32_t i = 0; i < ifd->count && !err; i++, p += entry_bytes) {
+        const struct rc_entry *e = &ifd->entries[i];
+        uint64_t bytes = e->count * raw_type_size(e->type);
+
+        write_uint(p, 2, swapped, e->tag);
+        write_uint(p + 2, 2, swapped, e->type);
+        write_uint(p + 4, word, swapped, e->count);
+
+        if (bytes > (uint64_t) word) {
+            uint64_t at;
+
+            err = rc_write(rc, e->value, bytes, &at);
+            write_uint(p + 4 + word, word, swapped, at);
+        }
+        else {
+            memcpy(p + 4 + word, e->value, bytes);
+        }
+    }
+
+    if (!err) {
+        err = rc_write(rc, buf, size, offset);
+    }
+
+    free(buf);
+    return err;
+}
+
+/*
+ * Layout of the strips of an IFD, from its entries
+ */
+static void rc_layout(const struct recompress *rc, const struct rc_ifd *ifd,
+                      struct strip_layout *l) {
+    l->width = rc_value(rc, ifd, TIFFTAG_IMAGEWIDTH, 0, 0);
+    l->height = rc_value(rc, ifd, TIFFTAG_IMAGELENGTH, 0, 0);
+    l->samples = rc_value(rc, ifd, TIFFTAG_SAMPLESPERPIXEL, 0, 1);
+    l->planar = rc_value(rc, ifd, TIFFTAG_PLANARCONFIG, 0, PLANARCONFIG_CONTIG);
+    l->bits = rc_value(rc, ifd, TIFFTAG_BITSPERSAMPLE, 0, 1);
+    l->sampleformat = rc_value(rc, ifd, TIFFTAG_SAMPLEFORMAT, 0, SAMPLEFORMAT_UINT);
+    l->compression = rc_value(rc, ifd, TIFFTAG_COMPRESSION, 0, COMPRESSION_NONE);
+    l->predictor = rc_value(rc, ifd, TIFFTAG_PREDICTOR, 0, PREDICTOR_NONE);
+    l->rowsperstrip = rc_value(rc, ifd, TIFFTAG_ROWSPERSTRIP, 0, l->height);
+    l->byteswapped = rc->in.swapped;
+    l->streamed = 0;
+
+    if (l->rowsperstrip > l->height) {
+        l->rowsperstrip = l->height;
+    }
+}
+
+/*
+ * Whether the strips of a layout can be decoded and encoded again
+ */
+static int rc_recodable(const struct strip_layout *l, uint64_t nstrips) {
+    int fp = l->sampleformat == SAMPLEFORMAT_IEEEFP;
+
+    if (!l->width || !l->height || !l->rowsperstrip || !l->samples) {
+        return 0;
+    }
+
+    if (l->sampleformat != SAMPLEFORMAT_UINT && !fp) {
+        return 0;
+    }
+
+    if (!(l->bits == 8 && !fp) && l->bits != 16 && !(l->bits == 24 && fp) &&
+        !(l->bits == 32 && fp)) {
+        return 0;
+    }
+
+    /* Samples are written in host order */
+    if (l->byteswapped && l->bits != 8) {
+        return 0;
+    }
+
+    return layout_native(l) && nstrips == layout_strips(l);
+}
+
+/*
+ * Copy the strips of an IFD, recompressing them if possible, and point
+ * its entries at the copies
+ */
+static int rc_copy_strips(struct recompress *rc, struct rc_ifd *ifd) {
+    uint16_t offsets_tag = TIFFTAG_STRIPOFFSETS, bytecounts_tag = TIFFTAG_STRIPBYTECOUNTS;
+    uint16_t type = rc->out.bigtiff ? TIFF_LONG8 : TIFF_LONG;
+    struct strip_layout l, t;
+    struct rc_entry *e;
+    uint64_t n, *offsets = NULL, max_bytes = 0;
+    uint8_t *raw = NULL, *mem = NULL;
+    int recode, err = 0;
+
+    e = rc_find(ifd, offsets_tag);
+    if (!e) {
+        offsets_tag = TIFFTAG_TILEOFFSETS;
+        bytecounts_tag = TIFFTAG_TILEBYTECOUNTS;
+        e = rc_find(ifd, offsets_tag);
+    }
+    if (!e) {
+        return 0;
+    }
+
+    n = e->count;
+    e = rc_find(ifd, bytecounts_tag);
+    if (!n || !e || e->count != n) {
+        return dng_fail(DNG_EFORMAT, "Strip offsets and byte counts differ");
+    }
+
+    rc_layout(rc, ifd, &l);
+    recode = offsets_tag == TIFFTAG_STRIPOFFSETS && l.compression != rc->compression &&
+             rc_recodable(&l, n);
+
+    /* Compressed as by save_dng() */
+    t = l;
+    t.compression = rc->compression;
+    t.byteswapped = 0;
+    t.predictor = PREDICTOR_NONE;
+    if (t.compression != COMPRESSION_NONE && t.sampleformat == SAMPLEFORMAT_IEEEFP) {
+        t.predictor = t.samples == 1 ? PREDICTOR_FLOATINGPOINTX2 : PREDICTOR_FLOATINGPOINT;
+    }
+
+    offsets = malloc(2 * n * sizeof(uint64_t));
+    if (!offsets) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strip table");
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        offsets[n + i] = rc_value(rc, ifd, bytecounts_tag, i, 0);
+        if (offsets[n + i] > max_bytes) {
+            max_bytes = offsets[n + i];
+        }
+    }
+
+    if (max_bytes > rc->in.size) {
+        err = dng_fail(DNG_EFORMAT, "Strip past the end of the file");
+        goto out;
+    }
+
+    raw = malloc(max_bytes ? max_bytes : 1);
+    if (recode) {
+        mem = malloc((size_t) l.rowsperstrip * layout_row_samples(&l) * layout_mem_bytes(&l));
+    }
+    if (!raw || (recode && !mem)) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+        goto out;
+    }
+
+    for (uint64_t i = 0; i < n && !err; i++) {
+        uint64_t size = offsets[n + i];
+        struct strip_buf buf = {
+            .data = raw,
+            .size = size,
+        };
+
+        err = rc_read(rc, raw, size, rc_value(rc, ifd, offsets_tag, i, 0));
+        if (!err && recode) {
+            uint32_t rows = layout_strip_rows(&l, i);
+
+            err = decode_strip(&l, raw, size, mem, rows);
+            if (!err) {
+                err = encode_strip(&t, mem, rows, &buf);
+            }
+        }
+        if (!err) {
+            err = rc_write(rc, buf.data, buf.size, &offsets[i]);
+            offsets[n + i] = buf.size;
+        }
+        if (buf.data != raw) {
+            strip_buf_release(&buf);
+        }
+    }
+
+    if (!err) {
+        err = rc_set(rc, ifd, offsets_tag, type, n, offsets);
+    }
+    if (!err) {
+        err = rc_set(rc, ifd, bytecounts_tag, type, n, offsets + n);
+    }
+
+    if (!err && recode) {
+        uint64_t compression = t.compression, predictor = t.predictor;
+
+        err = rc_set(rc, ifd, TIFFTAG_COMPRESSION, TIFF_SHORT, 1, &compression);
+        if (!err && t.predictor != PREDICTOR_NONE) {
+            err = rc_set(rc, ifd, TIFFTAG_PREDICTOR, TIFF_SHORT, 1, &predictor);
+        }
+        else {
+            rc_remove(ifd, TIFFTAG_PREDICTOR);
+        }
+
+        /* As set_dng_tags() */
+        if (t.compression != COMPRESSION_NONE && rc->version < 4) {
+            rc->version = 4;
+        }
+        if (t.predictor == PREDICTOR_FLOATINGPOINTX2) {
+            rc->version = 5;
+        }
+    }
+
+out:
+    free(mem);
+    free(raw);
+    free(offsets);
+    return err;
+}
+
+/*
+ * Copy a block of data an IFD points to, such as an old-style JPEG
+ * thumbnail, and point the copy of the IFD at the copy of the block
+ *
+ * @param rc            Files
+ * @param ifd           IFD to update
+ * @param offset_tag    Tag holding the offset of the block
+ * @param length_tag    Tag holding its length
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int rc_copy_block(struct recompress *rc, struct rc_ifd *ifd, uint16_t offset_tag,
+                         uint16_t length_tag) {
+    uint64_t offset, length;
+    uint8_t *data;
+    int err;
+
+    if (!rc_find(ifd, offset_tag)) {
+        return 0;
+    }
+    if (!rc_find(ifd, length_tag)) {
+        return dng_fail(DNG_EFORMAT, "Tag %u has no length", offset_tag);
+    }
+
+    length = rc_value(rc, ifd, length_tag, 0, 0);
+    if (length > rc->in.size) {
+        return dng_fail(DNG_EFORMAT, "Data past the end of the file");
+    }
+
+    data = malloc(length ? length : 1);
+    if (!data) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate tag %u data", offset_tag);
+    }
+
+    err = rc_read(rc, data, length, rc_value(rc, ifd, offset_tag, 0, 0));
+    if (!err) {
+        err = rc_write(rc, data, length, &offset);
+    }
+    if (!err) {
+        err = rc_set(rc, ifd, offset_tag, rc->out.bigtiff ? TIFF_LONG8 : TIFF_LONG, 1, &offset);
+    }
+
+    free(data);
+    return err;
+}
+
+/*
+ * Copy an IFD, its SubIFDs and its strips
+ *
+ * IFDs chained after a SubIFD are not followed.
+ *
+ * @param rc        File
+ * @param offset    Offset of the IFD in the input
+ * @param depth     Nesting of the IFD in SubIFDs
+ * @param copied    Offset of the copy in the output returned here
+ * @param next      Offset of the following IFD in the input returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int rc_copy_ifd(struct recompress *rc, uint64_t offset, int depth,
+                       uint64_t *copied, uint64_t *next) {
+    static const uint16_t pointer_tags[] = {
+        TIFFTAG_SUBIFD, TIFFTAG_EXIFIFD, TIFFTAG_GPSIFD, TIFFTAG_INTEROPERABILITYIFD,
+    };
+    struct rc_ifd ifd;
+    int err;
+
+    if (depth > RECOMPRESS_MAX_DEPTH) {
+        return dng_fail(DNG_EFORMAT, "SubIFDs nested too deep");
+    }
+
+    err = rc_read_ifd(rc, offset, &ifd, next);
+    if (err) {
+        return err;
+    }
+
+    for (size_t k = 0; k < sizeof(pointer_tags) / sizeof(pointer_tags[0]) && !err; k++) {
+        struct rc_entry *e = rc_find(&ifd, pointer_tags[k]);
+        uint64_t *children, unused;
+        uint16_t type;
+
+        if (!e) {
+            continue;
+        }
+
+        children = malloc(e->count * sizeof(uint64_t) + 1);
+        if (!children) {
+            err = dng_fail(DNG_ENOMEM, "Unable to allocate SubIFDs");
+            break;
+        }
+
+        for (uint64_t i = 0; i < e->count && !err; i++) {
+            err = rc_copy_ifd(rc, rc_value(rc, &ifd, pointer_tags[k], i, 0), depth + 1,
+                              &children[i], &unused);
+        }
+
+        /* Offsets keep their type, widened in BigTIFF */
+        type = e->type == TIFF_LONG || e->type == TIFF_LONG8 ? TIFF_LONG : TIFF_IFD;
+        if (rc->out.bigtiff) {
+            type = type == TIFF_LONG ? TIFF_LONG8 : TIFF_IFD8;
+        }
+        if (!err) {
+            err = rc_set(rc, &ifd, pointer_tags[k], type, e->count, children);
+        }
+        free(children);
+    }
+
+    if (!err) {
+        err = rc_copy_block(rc, &ifd, TIFFTAG_JPEGIFOFFSET, TIFFTAG_JPEGIFBYTECOUNT);
+    }
+    if (!err) {
+        err = rc_copy_strips(rc, &ifd);
+    }
+
+    /* Unused space of the input, meaningless in the copy */
+    rc_remove(&ifd, TIFFTAG_FREEOFFSETS);
+    rc_remove(&ifd, TIFFTAG_FREEBYTECOUNTS);
+
+    /* IFDs are copied after their SubIFDs, so IFD0 knows the version needed */
+    if (!err && rc->version) {
+        static const uint16_t version_tags[] = {
+            TIFFTAG_DNGVERSION, TIFFTAG_DNGBACKWARDVERSION,
+        };
+
+        for (size_t k = 0; k < 2; k++) {
+            struct rc_entry *e = rc_find(&ifd, version_tags[k]);
+
+            if (e && e->type == TIFF_BYTE && e->count == 4 && e->value[0] == 1 &&
+                e->value[1] < rc->version) {
+                e->value[1] = rc->version;
+                e->value[2] = e->value[3] = 0;
+            }
+        }
+    }
+
+    if (!err) {
+        err = rc_write_ifd(rc, &ifd, copied);
+    }
+
+    rc_ifd_free(&ifd);
+    return err;
+}
+
+/*
+ * Recompress a TIFF file
+ *
+ * The copy is written in the byte order and format, classic or BigTIFF, of
+ * the original, with every top-level IFD in order.
+ *
+ * @param src           File to recompress
+ * @param dst           File to write, or NULL to replace src, which is
+ *                      only replaced once the copy is complete
+ * @param compression   COMPRESSION_NONE or COMPRESSION_ADOBE_DEFLATE
+ * @param rate          Budget of bytes read and written, or NULL
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int recompress_file(const char *src, const char *dst, uint16_t compression,
+                    struct rate_limit *rate) {
+    struct recompress rc = {
+        .compression = compression,
+        .rate = rate,
+    };
+    uint8_t header[16] = {0};
+    uint64_t ifd = 0, next, copied, prev = 0, header_offset;
+    char *tmp = NULL;
+    int err;
+
+    err = raw_tiff_open(src, O_RDONLY, &rc.in);
+    if (err) {
+        return err;
+    }
+
+    if (!dst) {
+        tmp = malloc(strlen(src) + sizeof(".tmp"));
+        if (!tmp) {
+            close(rc.in.fd);
+            return dng_fail(DNG_ENOMEM, "Unable to allocate path");
+        }
+        sprintf(tmp, "%s.tmp", src);
+    }
+
+    rc.out = rc.in;
+    rc.out.fd = open(tmp ? tmp : dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (rc.out.fd < 0) {
+        err = dng_fail(DNG_EIO, "Failed to create %s", tmp ? tmp : dst);
+        goto out;
+    }
+
+    /* The header, linked to the first IFD once it is written */
+    err = rc_read(&rc, header, rc.in.bigtiff ? 8 : 4, 0);
+    if (!err) {
+        err = rc_write(&rc, header, rc.in.bigtiff ? 16 : 8, &header_offset);
+    }
+    if (!err) {
+        err = read_ifd_link(rc.in.fd, rc.in.bigtiff, rc.in.swapped, 0, &ifd);
+    }
+
+    for (uint64_t n = 0; !err && ifd; n++) {
+        if (n > rc.in.size) {
+            err = dng_fail(DNG_EFORMAT, "IFD chain loops");
+            break;
+        }
+
+        err = rc_copy_ifd(&rc, ifd, 0, &copied, &next);
+        if (!err) {
+            err = write_ifd_link(&rc.out, prev, copied);
+        }
+        prev = copied;
+        ifd = next;
+    }
+
+    if (!err && fdatasync(rc.out.fd)) {
+        err = dng_fail(DNG_EIO, "Failed to sync %s", tmp ? tmp : dst);
+    }
+
+    if (close(rc.out.fd) && !err) {
+        err = dng_fail(DNG_EIO, "Failed to write %s", tmp ? tmp : dst);
+    }
+
+    if (tmp) {
+        if (!err && rename(tmp, src)) {
+            err = dng_fail(DNG_EIO, "Failed to replace file");
+        }
+        if (err) {
+            unlink(tmp);
+        }
+    }
+
+out:
+    close(rc.in.fd);
+    free(tmp);
+    return err;
+}
+
+/*
+ * Public interface
+ *
+ * The functions declared in tiffutils.h, translating its plain structs to
+ * and from the engine's layouts.
+ */
+
+static int tdng_layout(const struct tdng_image *img, struct strip_layout *l) {
+    int bits_ok;
+
+    if (!img->width || !img->height || !img->data) {
+        return dng_fail(DNG_EFORMAT, "Image is empty");
+    }
+
+    if (img->samples != 1 && img->samples != 3) {
+        return dng_fail(DNG_EFORMAT, "Images must have 1 or 3 samples");
+    }
+
+    switch (img->format) {
+    case TDNG_UINT:
+        bits_ok = img->bits == 8 || img->bits == 16;
+        break;
+    case TDNG_FLOAT:
+        bits_ok = img->bits == 16 || img->bits == 24 || img->bits == 32;
+        break;
+    default:
+        return dng_fail(DNG_EFORMAT, "Unknown sample format %u", img->format);
+    }
+    if (!bits_ok) {
+        return dng_fail(DNG_EFORMAT, "Unsupported %u-bit samples", img->bits);
+    }
+
+    memset(l, 0, sizeof(*l));
+    l->width = img->width;
+    l->height = img->height;
+    l->samples = img->samples;
+    l->planar = PLANARCONFIG_CONTIG;
+    l->bits = img->bits;
+    l->sampleformat = img->format;
+
+    return 0;
+}
+
+/* Whether a CalibrationIlluminant value is one of enum illuminant */
+static int tdng_illuminant_valid(unsigned short illuminant) {
+    return illuminant <= ILLUMINANT_FLASH ||
+           (illuminant >= ILLUMINANT_FINE_WEATHER &&
+            illuminant <= ILLUMINANT_WHITE_FLUORESCENT) ||
+           (illuminant >= ILLUMINANT_STANDARD_A && illuminant <= ILLUMINANT_ISO_TUNGSTEN) ||
+           illuminant == ILLUMINANT_OTHER;
+}
+
+static void tdng_image_from_layout(const struct strip_layout *l, int pattern,
+                                   void *data, struct tdng_image *img) {
+    img->width = l->width;
+    img->height = l->height;
+    img->samples = l->samples;
+    img->bits = l->bits;
+    img->format = l->sampleformat == SAMPLEFORMAT_IEEEFP ? TDNG_FLOAT : TDNG_UINT;
+    img->pattern = pattern;
+    img->data = data;
+}
+
+int tdng_write(const char *path, const struct tdng_image *img,
+               const struct tdng_options *opts) {
+    static const struct tdng_options defaults = {
+        .pattern = TDNG_CFA_RGGB,
+    };
+    static const enum bigtiff_mode bigtiff_modes[] = {
+        [TDNG_BIGTIFF_AUTO] = BIGTIFF_AUTO,
+        [TDNG_BIGTIFF_NEVER] = BIGTIFF_NEVER,
+        [TDNG_BIGTIFF_ALWAYS] = BIGTIFF_ALWAYS,
+    };
+    struct dng_options o;
+    struct strip_layout l;
+    TIFF *tiff;
+    int err;
+
+    engine_init();
+
+    opts = opts ? opts : &defaults;
+
+    err = tdng_layout(img, &l);
+    if (err) {
+        return err;
+    }
+
+    /* The engine indexes tables with these */
+    if ((unsigned int) opts->pattern >= CFA_NUM_PATTERNS) {
+        return dng_fail(DNG_EFORMAT, "Invalid CFA pattern %d", opts->pattern);
+    }
+
+    if ((unsigned int) opts->bigtiff > TDNG_BIGTIFF_ALWAYS) {
+        return dng_fail(DNG_EFORMAT, "Unknown BigTIFF mode %d", opts->bigtiff);
+    }
+
+    if (!tdng_illuminant_valid(opts->illuminant1) ||
+        !tdng_illuminant_valid(opts->illuminant2)) {
+        return dng_fail(DNG_EFORMAT, "Invalid calibration illuminant");
+    }
+
+    o = (struct dng_options) {
+        .camera = opts->camera ? opts->camera : "Unknown",
+        .pattern = opts->pattern,
+        .color_matrix1 = (float *) (opts->color_matrix1 ? opts->color_matrix1 :
+                                    default_color_matrix1),
+        .color_matrix1_len = 9,
+        .color_matrix2 = (float *) opts->color_matrix2,
+        .color_matrix2_len = opts->color_matrix2 ? 9 : 0,
+        .calibration_illuminant1 = opts->illuminant1,
+        .calibration_illuminant2 = opts->illuminant2,
+        .compression = opts->compress,
+        .preview = opts->preview,
+        .pyramid_levels = opts->pyramid_levels,
+    };
+
+    tiff = TIFFOpen(path, dng_open_mode(bigtiff_modes[opts->bigtiff], &o, &l));
+    if (!tiff) {
+        return dng_fail(DNG_EIO, "Failed to create %s", path);
+    }
+
+    err = write_dng(tiff, &o, &l, img->data, NULL);
+    TIFFClose(tiff);
+
+    return err;
+}
+
+int tdng_read(const char *path, struct tdng_image *img) {
+    struct strip_layout l;
+    void *data;
+    int pattern = -1, err;
+
+    engine_init();
+
+    err = load_image(path, 0, &l, &pattern, &data);
+    if (err) {
+        return err;
+    }
+
+    tdng_image_from_layout(&l, pattern, data, img);
+    return 0;
+}
+
+int tdng_info(const char *path, struct tdng_image *img) {
+    struct strip_layout l;
+    uint64_t *strips;
+    int pattern = -1, err;
+
+    engine_init();
+
+    err = open_image(path, 0, &l, &pattern, &strips);
+    if (err) {
+        return err;
+    }
+    free(strips);
+
+    tdng_image_from_layout(&l, pattern, NULL, img);
+    return 0;
+}
+
+void tdng_free(struct tdng_image *img) {
+    free(img->data);
+    img->data = NULL;
+}
+
+const char *tdng_errmsg(void) {
+    return dng_errmsg;
+}
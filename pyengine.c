@@ -0,0 +1,2329 @@
+/*
+ * libtiffutils engine, Python module parts
+ *
+ * See pyengine.h.  Built into the Python module with libtiffutils.c.
+ */
+
+#include "pyengine.h"
+
+/*
+ * Embedded preview candidate
+ */
+struct preview_ifd {
+    uint64_t offset;    /* Directory offset, 0 if none found */
+    uint32_t size;      /* Larger of width and height */
+    int meets;          /* size is at least the requested size */
+};
+
+/*
+ * Consider the current directory as an embedded preview
+ *
+ * Reduced resolution RGB, YCbCr and grayscale directories are previews.
+ * Of those at least max_size pixels on their larger side, the smallest is
+ * chosen, otherwise the largest.  Only tags are read.
+ *
+ * @param tiff      File positioned at the directory
+ * @param max_size  Requested preview size
+ * @param best      Best candidate so far, updated
+ */
+static void consider_preview(TIFF *tiff, uint32_t max_size, struct preview_ifd *best) {
+    uint32_t subfiletype, width, height, size;
+    uint16_t photometric;
+    int meets;
+
+    if (!TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &subfiletype) ||
+        !(subfiletype & FILETYPE_REDUCEDIMAGE)) {
+        return;
+    }
+
+    if (!TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photometric) ||
+        (photometric != PHOTOMETRIC_RGB && photometric != PHOTOMETRIC_YCBCR &&
+         photometric != PHOTOMETRIC_MINISBLACK)) {
+        return;
+    }
+
+    if (!TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width) ||
+        !TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height)) {
+        return;
+    }
+
+    size = width > height ? width : height;
+    meets = size >= max_size;
+
+    if (!best->offset ||
+        (meets && (!best->meets || size < best->size)) ||
+        (!meets && !best->meets && size > best->size)) {
+        best->offset = TIFFCurrentDirOffset(tiff);
+        best->size = size;
+        best->meets = meets;
+    }
+}
+
+/*
+ * Find the embedded preview closest to a requested size
+ *
+ * Walks the IFD chain and the SubIFDs of each IFD, reading only
+ * directory tags, and leaves the file positioned at the chosen preview.
+ *
+ * @param tiff      File positioned at IFD0
+ * @param max_size  Requested preview size, see consider_preview()
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int select_preview_directory(TIFF *tiff, uint32_t max_size) {
+    struct preview_ifd best = {0};
+    tdir_t dir = 0;
+
+    do {
+        uint16_t count;
+        uint64_t *offsets;
+
+        consider_preview(tiff, max_size, &best);
+
+        if (!TIFFGetField(tiff, TIFFTAG_SUBIFD, &count, &offsets) || !count) {
+            continue;
+        }
+
+        /* The offsets belong to the IFD, which is freed on leaving it */
+        uint64_t subifds[count];
+        memcpy(subifds, offsets, sizeof(subifds));
+
+        for (uint16_t i = 0; i < count; i++) {
+            if (!TIFFSetSubDirectory(tiff, subifds[i])) {
+                return dng_fail(DNG_EIO, "Failed to read SubIFD");
+            }
+
+            consider_preview(tiff, max_size, &best);
+        }
+
+        if (!TIFFSetDirectory(tiff, dir)) {
+            return dng_fail(DNG_EIO, "Failed to read IFD%u", (unsigned) dir);
+        }
+    } while (dir++, TIFFReadDirectory(tiff));
+
+    if (!best.offset) {
+        return dng_fail(DNG_EFORMAT, "No preview image found");
+    }
+
+    if (!TIFFSetSubDirectory(tiff, best.offset)) {
+        return dng_fail(DNG_EIO, "Failed to read preview directory");
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the current directory is a JPEG stream that can be returned as is
+ *
+ * A single strip JPEG image is a complete JPEG stream, once any shared
+ * JPEGTables are merged in.
+ */
+int preview_is_jpeg(TIFF *tiff) {
+    uint16_t compression;
+
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_COMPRESSION, &compression);
+
+    return compression == COMPRESSION_JPEG && !TIFFIsTiled(tiff) &&
+           TIFFNumberOfStrips(tiff) == 1;
+}
+
+/*
+ * Read a single strip JPEG preview as a standalone JPEG stream
+ *
+ * @param tiff  File positioned at the preview directory
+ * @param out   malloc'd JPEG stream returned here
+ * @param size  Size of the stream returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int read_jpeg_preview(TIFF *tiff, uint8_t **out, size_t *size) {
+    uint64_t *bytecounts;
+    uint32_t ntables = 0;
+    uint8_t *tables = NULL;
+    uint8_t *buf;
+    size_t prefix = 0;
+
+    if (!TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &bytecounts) || bytecounts[0] < 4) {
+        return dng_fail(DNG_EFORMAT, "Invalid JPEG preview strip");
+    }
+
+    /* Tables are a stream of their own: SOI, tables, EOI */
+    if (TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &ntables, &tables) && ntables > 4 &&
+        tables[0] == 0xff && tables[1] == 0xd8 &&
+        tables[ntables - 2] == 0xff && tables[ntables - 1] == 0xd9) {
+        prefix = ntables - 2;
+    }
+
+    buf = malloc(prefix + bytecounts[0]);
+    if (!buf) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate JPEG preview");
+    }
+
+    if (TIFFReadRawStrip(tiff, 0, buf + prefix, bytecounts[0]) < (tmsize_t) bytecounts[0]) {
+        free(buf);
+        return dng_fail(DNG_EIO, "libtiff failed to read strip");
+    }
+
+    /* Splice the tables in after the strip's SOI, replacing it */
+    if (prefix && buf[prefix] == 0xff && buf[prefix + 1] == 0xd8) {
+        memcpy(buf, tables, prefix);
+        memmove(buf + prefix, buf + prefix + 2, bytecounts[0] - 2);
+        *size = prefix + bytecounts[0] - 2;
+    }
+    else {
+        memmove(buf, buf + prefix, bytecounts[0]);
+        *size = bytecounts[0];
+    }
+
+    *out = buf;
+    return 0;
+}
+
+/*
+ * Decode a preview that read_strips() cannot handle through libtiff's RGBA
+ * interface, such as tiled or multi-strip JPEG
+ *
+ * @param tiff    File positioned at the preview directory
+ * @param width   Preview width
+ * @param height  Preview height
+ * @param dest    Destination for width * height RGB pixels
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int read_rgba_preview(TIFF *tiff, uint32_t width, uint32_t height, uint8_t *dest) {
+    size_t pixels = (size_t) width * height;
+    uint32_t *raster = malloc(pixels * sizeof(*raster) + 1);
+
+    if (!raster) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate preview");
+    }
+
+    if (!TIFFReadRGBAImageOriented(tiff, width, height, raster, ORIENTATION_TOPLEFT, 0)) {
+        free(raster);
+        return dng_fail(DNG_EFORMAT, "libtiff failed to decode preview");
+    }
+
+    for (size_t i = 0; i < pixels; i++) {
+        dest[3*i] = TIFFGetR(raster[i]);
+        dest[3*i + 1] = TIFFGetG(raster[i]);
+        dest[3*i + 2] = TIFFGetB(raster[i]);
+    }
+
+    free(raster);
+    return 0;
+}
+
+/*
+ * Format the header of a .npy file holding an image
+ *
+ * @param l     Layout of the image
+ * @param buf   Header returned here, padded so the data is 64-byte aligned
+ * @param size  Size of buf
+ * @returns size of the header
+ */
+static size_t npy_header(const struct strip_layout *l, char *buf, size_t size) {
+    const int one = 1;
+    char order = *(const char *) &one ? '<' : '>';
+    char descr[8], shape[64];
+    size_t len;
+
+    if (l->sampleformat == SAMPLEFORMAT_IEEEFP) {
+        snprintf(descr, sizeof(descr), "%cf%d", order, layout_mem_bytes(l));
+    }
+    else if (l->bits == 8) {
+        snprintf(descr, sizeof(descr), "|u1");
+    }
+    else {
+        snprintf(descr, sizeof(descr), "%cu2", order);
+    }
+
+    if (l->samples > 1) {
+        snprintf(shape, sizeof(shape), "(%" PRIu32 ", %" PRIu32 ", %u)",
+                 l->height, l->width, (unsigned int) l->samples);
+    }
+    else {
+        snprintf(shape, sizeof(shape), "(%" PRIu32 ", %" PRIu32 ")", l->height, l->width);
+    }
+
+    /* Version 1.0: magic, version, little-endian length of the dictionary */
+    len = snprintf(buf + 10, size - 10,
+                   "{'descr': '%s', 'fortran_order': False, 'shape': %s, }", descr, shape);
+    while ((10 + len + 1) % 64) {
+        buf[10 + len++] = ' ';
+    }
+    buf[10 + len++] = '\n';
+
+    memcpy(buf, "\x93NUMPY\x01\x00", 8);
+    buf[8] = len & 0xff;
+    buf[9] = len >> 8;
+
+    return 10 + len;
+}
+
+/*
+ * Decode the raw image, or a pyramid level, of a file into a new .npy
+ * file through a shared mapping
+ *
+ * Strips are dropped from memory as they are decoded, so the image is
+ * never all resident.
+ *
+ * @param filename  File to load
+ * @param level     Pyramid level, or 0 for the raw image
+ * @param out_path  .npy file to create, replacing any file there
+ * @param pattern   CFA pattern returned here, -1 if unknown
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int load_image_to_file(const char *filename, uint32_t level, const char *out_path,
+                       int *pattern) {
+    struct strip_layout l;
+    char header[256];
+    size_t header_size, size;
+    uint8_t *map;
+    TIFF *tiff;
+    int fd, err;
+
+    /* Read strips rather than map the file, which would be as large */
+    tiff = TIFFOpen(filename, "rm");
+    if (!tiff) {
+        return dng_fail(DNG_EIO, "Failed to open file");
+    }
+
+    err = level ? select_level_directory(tiff, level) : select_raw_directory(tiff);
+    if (!err) {
+        err = read_layout(tiff, &l);
+    }
+    if (err) {
+        goto out;
+    }
+
+    *pattern = read_cfa_pattern(tiff);
+
+    header_size = npy_header(&l, header, sizeof(header));
+    size = header_size + layout_mem_rowbytes(&l) * l.height;
+
+    fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        err = dng_fail(DNG_EIO, "Failed to create %s: %s", out_path, strerror(errno));
+        goto out;
+    }
+
+    if (ftruncate(fd, size)) {
+        err = dng_fail(DNG_EIO, "Failed to size %s: %s", out_path, strerror(errno));
+        close(fd);
+        goto out;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        err = dng_fail(DNG_EIO, "Failed to map %s: %s", out_path, strerror(errno));
+        goto out;
+    }
+
+    memcpy(map, header, header_size);
+
+    l.streamed = 1;
+    err = read_strips(tiff, &l, map + header_size);
+    munmap(map, size);
+
+out:
+    TIFFClose(tiff);
+    return err;
+}
+
+void export_lane(void *arg, size_t lane) {
+    struct export_batch *b = arg;
+    size_t i;
+
+    (void) lane;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+        b->errs[i] = export_image(b->src[i], b->dst[i], b->format, b->size, b->quality);
+        if (b->errs[i]) {
+            memcpy(b->errmsgs[i], dng_errmsg, sizeof(dng_errmsg));
+        }
+    }
+}
+
+/*
+ * Frame index
+ *
+ * A sidecar file beside a multi-frame file, "<path>.idx", holding a header
+ * and one record per frame: the offset of the frame's first IFD, its
+ * timestamp, and the layout and strip table of its raw image.  Readers load
+ * it with one read and then reach the pixel data of any frame directly.
+ * The header records the size of the TIFF file when it was last updated,
+ * so frames written after it are found by walking the IFD chain on from
+ * the last indexed frame.
+ *
+ * Neither file is synced as frames are written.  At a checkpoint the TIFF
+ * file is synced, then the header is rewritten with the number of frames
+ * now durable and the index is synced, so after a crash the durable frames
+ * are intact and only frames written since need to be checked.
+ */
+
+struct index_header {
+    char magic[8];
+    uint64_t tiff_size;     /* size of the TIFF file when last updated */
+    uint64_t frames;
+    uint64_t durable;       /* frames on disk as of the last checkpoint */
+};
+
+void index_free(struct frame_index *idx) {
+    for (uint32_t i = 0; i < idx->frames; i++) {
+        free(idx->strips[i]);
+    }
+    free(idx->strips);
+    free(idx->records);
+    memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * Append a record to an index, taking ownership of its strip table
+ */
+static int index_push(struct frame_index *idx, const struct index_record *rec,
+                      uint64_t *strips) {
+    if (idx->frames == idx->alloc) {
+        uint32_t alloc = idx->alloc ? 2 * idx->alloc : 64;
+        struct index_record *records = realloc(idx->records, alloc * sizeof(*records));
+        uint64_t **tables;
+
+        if (records) {
+            idx->records = records;
+        }
+        tables = records ? realloc(idx->strips, alloc * sizeof(*tables)) : NULL;
+        if (!tables) {
+            free(strips);
+            return dng_fail(DNG_ENOMEM, "Unable to allocate frame index");
+        }
+        idx->strips = tables;
+        idx->alloc = alloc;
+    }
+
+    idx->records[idx->frames] = *rec;
+    idx->strips[idx->frames] = strips;
+    idx->frames++;
+    return 0;
+}
+
+void record_from_layout(struct index_record *rec, const struct strip_layout *l,
+                        uint32_t nstrips, int pattern) {
+    rec->width = l->width;
+    rec->height = l->height;
+    rec->rowsperstrip = l->rowsperstrip;
+    rec->nstrips = nstrips;
+    rec->samples = l->samples;
+    rec->planar = l->planar;
+    rec->bits = l->bits;
+    rec->sampleformat = l->sampleformat;
+    rec->compression = l->compression;
+    rec->predictor = l->predictor;
+    rec->byteswapped = l->byteswapped;
+    rec->pattern = pattern;
+}
+
+void layout_from_record(struct strip_layout *l, const struct index_record *rec) {
+    memset(l, 0, sizeof(*l));
+    l->width = rec->width;
+    l->height = rec->height;
+    l->rowsperstrip = rec->rowsperstrip;
+    l->samples = rec->samples;
+    l->planar = rec->planar;
+    l->bits = rec->bits;
+    l->sampleformat = rec->sampleformat;
+    l->compression = rec->compression;
+    l->predictor = rec->predictor;
+    l->byteswapped = rec->byteswapped;
+}
+
+/*
+ * Load an index file
+ *
+ * Missing, foreign or damaged indexes, and indexes of a file larger than
+ * the TIFF file now is, load as empty.  Only whole records are loaded.
+ * After a crash the header may describe data that never reached the TIFF
+ * file, so only the durable frames are loaded.
+ *
+ * @param path      Index file
+ * @param tiff_size Current size of the TIFF file
+ * @param durable   Load only the frames durable at the last checkpoint
+ * @param idx       Index returned here, to be freed with index_free()
+ * @param covered   Size of the TIFF file the index describes returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int index_load(const char *path, uint64_t tiff_size, int durable,
+                      struct frame_index *idx, uint64_t *covered) {
+    struct index_header header;
+    FILE *file;
+    int err = 0;
+
+    memset(idx, 0, sizeof(*idx));
+    *covered = 0;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic))) {
+        goto out;
+    }
+
+    if (durable) {
+        header.frames = header.durable < header.frames ? header.durable : header.frames;
+    }
+    else if (header.tiff_size > tiff_size) {
+        goto out;
+    }
+
+    for (uint64_t i = 0; i < header.frames && !err; i++) {
+        struct index_record rec;
+        uint64_t *strips = NULL;
+
+        if (fread(&rec, sizeof(rec), 1, file) != 1 || rec.ifd_offset >= tiff_size) {
+            break;
+        }
+
+        if (rec.nstrips) {
+            strips = malloc(2 * (size_t) rec.nstrips * sizeof(*strips));
+            if (!strips) {
+                err = dng_fail(DNG_ENOMEM, "Unable to allocate frame index");
+                break;
+            }
+            if (fread(strips, sizeof(*strips), 2 * (size_t) rec.nstrips, file) !=
+                    2 * (size_t) rec.nstrips) {
+                free(strips);
+                break;
+            }
+        }
+
+        err = index_push(idx, &rec, strips);
+    }
+
+    /* A partial index only covers up to its last frame */
+    *covered = idx->frames == header.frames ? header.tiff_size : 0;
+
+out:
+    fclose(file);
+    if (err) {
+        index_free(idx);
+    }
+    return err;
+}
+
+/*
+ * Write an index header, leaving the file position at the end
+ */
+static int index_write_header(FILE *file, uint64_t frames, uint64_t durable,
+                              uint64_t tiff_size) {
+    struct index_header header = {
+        .magic = INDEX_MAGIC,
+        .tiff_size = tiff_size,
+        .frames = frames,
+        .durable = durable,
+    };
+
+    if (fseek(file, 0, SEEK_SET) ||
+        fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fseek(file, 0, SEEK_END) || fflush(file)) {
+        return dng_fail(DNG_EIO, "Failed to write frame index");
+    }
+
+    return 0;
+}
+
+static int index_write_record(FILE *file, const struct index_record *rec,
+                              const uint64_t *strips) {
+    if (fwrite(rec, sizeof(*rec), 1, file) != 1 ||
+        (rec->nstrips && fwrite(strips, sizeof(*strips), 2 * (size_t) rec->nstrips, file) !=
+            2 * (size_t) rec->nstrips)) {
+        return dng_fail(DNG_EIO, "Failed to write frame index");
+    }
+
+    return 0;
+}
+
+/*
+ * Write a whole index to a new file
+ *
+ * @param path      Index file
+ * @param idx       Index to write
+ * @param tiff_size Size of the TIFF file the index describes
+ * @param durable   Frames on disk, if the TIFF file has been synced
+ * @param out       Index file, positioned at its end, returned here if not
+ *                  NULL, otherwise the file is synced and closed
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int index_save(const char *path, const struct frame_index *idx,
+               uint64_t tiff_size, uint64_t durable, FILE **out) {
+    FILE *file = fopen(path, "w+b");
+    int err;
+
+    if (!file) {
+        return dng_fail(DNG_EIO, "Failed to create frame index %s", path);
+    }
+
+    err = index_write_header(file, 0, 0, 0);
+    for (uint32_t i = 0; i < idx->frames && !err; i++) {
+        err = index_write_record(file, &idx->records[i], idx->strips[i]);
+    }
+    if (!err) {
+        err = index_write_header(file, idx->frames, durable, tiff_size);
+    }
+    if (!err && !out && fdatasync(fileno(file))) {
+        err = dng_fail(DNG_EIO, "Failed to sync frame index");
+    }
+
+    if (err || !out) {
+        fclose(file);
+    }
+    else {
+        *out = file;
+    }
+    return err;
+}
+
+/*
+ * Timestamp from the DateTime tag of the current directory, 0 if none
+ */
+static double read_timestamp(TIFF *tiff) {
+    char *datetime;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (!TIFFGetField(tiff, TIFFTAG_DATETIME, &datetime) ||
+        sscanf(datetime, "%d:%d:%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return 0;
+    }
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
+}
+
+/*
+ * Index frames by walking the IFD chain
+ *
+ * Frames whose raw image can't be read directly are indexed without a
+ * strip table, so readers go through libtiff for them.
+ *
+ * @param tiff  File positioned at the first frame to index
+ * @param idx   Index to append to
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int index_scan(TIFF *tiff, struct frame_index *idx) {
+    int err = 0;
+
+    do {
+        struct index_record rec = {
+            .ifd_offset = TIFFCurrentDirOffset(tiff),
+            .timestamp = read_timestamp(tiff),
+            .pattern = -1,
+        };
+        struct strip_table table = {0};
+        struct strip_layout l;
+        int pattern;
+
+        if (!select_raw_directory(tiff) && !read_layout(tiff, &l)) {
+            pattern = read_cfa_pattern(tiff);
+            if (layout_native(&l) && !layout_separate(&l) &&
+                TIFFNumberOfStrips(tiff) >= layout_strips(&l)) {
+                err = capture_strips(tiff, &l, &table);
+                if (err) {
+                    break;
+                }
+            }
+            record_from_layout(&rec, &l, table.count, pattern);
+        }
+
+        err = index_push(idx, &rec, table.offsets);
+        if (err) {
+            break;
+        }
+
+        if (!TIFFSetSubDirectory(tiff, rec.ifd_offset)) {
+            err = dng_fail(DNG_EIO, "Failed to read frame directory");
+            break;
+        }
+    } while (TIFFReadDirectory(tiff));
+
+    return err;
+}
+
+/*
+ * Index a multi-frame file, starting from its index file
+ *
+ * Frames the index file doesn't cover are found by walking the IFD chain
+ * on from the last indexed frame.
+ *
+ * @param tiff      File, opened for reading
+ * @param path      Index file
+ * @param idx       Index returned here, to be freed with index_free()
+ * @param stale     Whether the index file was incomplete returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int index_open(TIFF *tiff, const char *path, struct frame_index *idx, int *stale) {
+    struct stat st;
+    uint64_t covered, first = 0;
+    int err;
+
+    if (fstat(TIFFFileno(tiff), &st)) {
+        return dng_fail(DNG_EIO, "Failed to stat file");
+    }
+
+    err = index_load(path, st.st_size, 0, idx, &covered);
+    if (!err) {
+        err = read_ifd_link(TIFFFileno(tiff), TIFFIsBigTIFF(tiff),
+                            TIFFIsByteSwapped(tiff), 0, &first);
+    }
+    if (err) {
+        index_free(idx);
+        return err;
+    }
+
+    /* An index of some other file */
+    if (idx->frames && idx->records[0].ifd_offset != first) {
+        index_free(idx);
+        covered = 0;
+    }
+
+    *stale = covered != (uint64_t) st.st_size;
+    if (!*stale) {
+        return 0;
+    }
+
+    /* Walk on from the last indexed frame, or from IFD0 */
+    if (idx->frames) {
+        uint64_t last = idx->records[idx->frames - 1].ifd_offset;
+
+        if (!TIFFSetSubDirectory(tiff, last)) {
+            index_free(idx);
+            return dng_fail(DNG_EIO, "Failed to read frame directory");
+        }
+        if (!TIFFReadDirectory(tiff)) {
+            return 0;
+        }
+    }
+    else if (!TIFFSetDirectory(tiff, 0)) {
+        return dng_fail(DNG_EIO, "Failed to read IFD0");
+    }
+
+    err = index_scan(tiff, idx);
+    if (err) {
+        index_free(idx);
+    }
+    return err;
+}
+
+/*
+ * Open the index of a file being appended to
+ *
+ * The index is rewritten whole, covering every frame already in the file.
+ *
+ * @param path          TIFF file, which need not exist yet
+ * @param index_path    Index file
+ * @param out           Index file, positioned at its end, returned here
+ * @param frames        Frames in the index returned here
+ * @param last_ifd      First IFD of the last frame returned here, 0 if none
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int index_resume(const char *path, const char *index_path, FILE **out,
+                 uint64_t *frames, uint64_t *last_ifd) {
+    struct frame_index idx = {0};
+    uint64_t tiff_size = 0;
+    struct stat st;
+    int stale, err = 0;
+
+    if (!stat(path, &st) && st.st_size) {
+        TIFF *tiff = TIFFOpen(path, "r");
+
+        if (!tiff) {
+            return dng_fail(DNG_EIO, "Failed to open file");
+        }
+
+        err = index_open(tiff, index_path, &idx, &stale);
+        TIFFClose(tiff);
+        tiff_size = st.st_size;
+    }
+
+    if (!err) {
+        err = index_save(index_path, &idx, tiff_size, 0, out);
+    }
+
+    *frames = idx.frames;
+    *last_ifd = idx.frames ? idx.records[idx.frames - 1].ifd_offset : 0;
+    index_free(&idx);
+    return err;
+}
+
+/*
+ * Append the frame just written to an index file
+ *
+ * @param index     Index file, positioned at its end
+ * @param tiff      File the frame was written to
+ * @param frames    Frames in the index, incremented here
+ * @param last_ifd  First IFD of the previous frame, 0 if none, updated to
+ *                  that of this frame
+ * @param durable   Frames on disk as of the last checkpoint
+ * @param rec       Record of the frame, without its IFD offset
+ * @param strips    Strip table of the raw image
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int index_append(FILE *index, TIFF *tiff, uint64_t *frames, uint64_t *last_ifd,
+                 uint64_t durable, struct index_record *rec,
+                 const struct strip_table *strips) {
+    int fd = TIFFFileno(tiff);
+    struct strip_layout l;
+    struct stat st;
+    int err;
+
+    /* The previous frame now links to this one */
+    err = read_ifd_link(fd, TIFFIsBigTIFF(tiff), TIFFIsByteSwapped(tiff), *last_ifd,
+                        &rec->ifd_offset);
+    if (err) {
+        return err;
+    }
+
+    layout_from_record(&l, rec);
+    rec->nstrips = layout_native(&l) && !layout_separate(&l) ? strips->count : 0;
+    err = index_write_record(index, rec, strips->offsets);
+    if (err) {
+        return err;
+    }
+
+    if (fstat(fd, &st)) {
+        return dng_fail(DNG_EIO, "Failed to stat file");
+    }
+
+    err = index_write_header(index, *frames + 1, durable, st.st_size);
+    if (err) {
+        return err;
+    }
+
+    (*frames)++;
+    *last_ifd = rec->ifd_offset;
+    return 0;
+}
+
+/*
+ * Make every frame written so far durable
+ *
+ * @param index     Index file, positioned at its end
+ * @param tiff      File the frames were written to
+ * @param frames    Frames in the index
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int index_checkpoint(FILE *index, TIFF *tiff, uint64_t frames) {
+    int fd = TIFFFileno(tiff);
+    struct stat st;
+    int err;
+
+    if (fdatasync(fd) || fstat(fd, &st)) {
+        return dng_fail(DNG_EIO, "Failed to sync file");
+    }
+
+    err = index_write_header(index, frames, frames, st.st_size);
+    if (err) {
+        return err;
+    }
+
+    if (fdatasync(fileno(index))) {
+        return dng_fail(DNG_EIO, "Failed to sync frame index");
+    }
+
+    return 0;
+}
+
+/*
+ * Crash recovery
+ *
+ * Frames written since the last checkpoint may be partly on disk: strips
+ * missing, an IFD cut short or never written, or a link to an IFD that
+ * isn't there.  Each frame is checked straight from the file, without
+ * libtiff, which would trust whatever it found.  Frames are appended in
+ * order, so the first frame that is incomplete ends the file.
+ */
+
+/*
+ * Read the unsigned integer values of an IFD entry
+ *
+ * @param f         File
+ * @param entry     IFD entry
+ * @param values    malloc'd values returned here
+ * @param count     Number of values returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+static int raw_entry_values(const struct raw_tiff *f, const uint8_t *entry,
+                            uint64_t **values, uint64_t *count) {
+    int word = f->bigtiff ? 8 : 4;
+    uint16_t type = read_uint(entry + 2, 2, f->swapped);
+    int size = raw_type_size(type);
+    const uint8_t *p = entry + 4 + word;
+    uint8_t *buf = NULL;
+    uint64_t n = read_uint(entry + 4, word, f->swapped);
+
+    if (type != TIFF_SHORT && type != TIFF_LONG && type != TIFF_IFD &&
+        type != TIFF_LONG8 && type != TIFF_IFD8) {
+        return dng_fail(DNG_EFORMAT, "Unexpected field type %u", type);
+    }
+
+    /* Checked against the file size by the caller */
+    if (n * size > (uint64_t) word) {
+        buf = malloc(n * size);
+        if (!buf) {
+            return dng_fail(DNG_ENOMEM, "Unable to allocate field");
+        }
+        if (pread_full(f->fd, buf, n * size, read_uint(p, word, f->swapped))) {
+            free(buf);
+            return dng_fail(DNG_EIO, "Failed to read field");
+        }
+        p = buf;
+    }
+
+    *values = malloc((n ? n : 1) * sizeof(**values));
+    if (!*values) {
+        free(buf);
+        return dng_fail(DNG_ENOMEM, "Unable to allocate field");
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        (*values)[i] = read_uint(p + i * size, size, f->swapped);
+    }
+
+    *count = n;
+    free(buf);
+    return 0;
+}
+
+/*
+ * Check that an IFD, its data and its SubIFDs are all within the file
+ *
+ * @param f     File
+ * @param ifd   Offset of the IFD
+ * @param depth SubIFD nesting depth
+ * @param end   Raised to the end of the last byte of the IFD or its data,
+ *              including any that were found before it proved incomplete
+ * @returns 1 if the IFD is complete, 0 if not, negative enum dng_error on
+ *          error
+ */
+static int raw_ifd_complete(const struct raw_tiff *f, uint64_t ifd, int depth, uint64_t *end) {
+    int count_bytes = f->bigtiff ? 8 : 2;
+    int entry_bytes = f->bigtiff ? 20 : 12;
+    int word = f->bigtiff ? 8 : 4;
+    uint64_t *offsets = NULL, *bytecounts = NULL, *subifds = NULL;
+    uint64_t noffsets = 0, nbytecounts = 0, nsubifds = 0;
+    uint8_t buf[8], *entries = NULL;
+    uint64_t n, ifd_end;
+    uint16_t prev_tag = 0;
+    int ret = 0;
+
+    if (!ifd || ifd & 1 || ifd + count_bytes > f->size || depth > 2) {
+        return 0;
+    }
+
+    if (pread_full(f->fd, buf, count_bytes, ifd)) {
+        return dng_fail(DNG_EIO, "Failed to read IFD");
+    }
+
+    /* Unwritten pages read back as zeros */
+    n = read_uint(buf, count_bytes, f->swapped);
+    ifd_end = ifd + count_bytes + n * entry_bytes + word;
+    if (!n || n > 4096 || ifd_end > f->size) {
+        return 0;
+    }
+
+    entries = malloc(n * entry_bytes);
+    if (!entries) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate IFD");
+    }
+
+    if (pread_full(f->fd, entries, n * entry_bytes, ifd + count_bytes)) {
+        ret = dng_fail(DNG_EIO, "Failed to read IFD");
+        goto out;
+    }
+
+    if (ifd_end > *end) {
+        *end = ifd_end;
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        const uint8_t *entry = entries + i * entry_bytes;
+        uint16_t tag = read_uint(entry, 2, f->swapped);
+        int size = raw_type_size(read_uint(entry + 2, 2, f->swapped));
+        uint64_t values = read_uint(entry + 4, word, f->swapped);
+        uint64_t bytes = values * size;
+        uint64_t **table = NULL, *count;
+
+        /* Tags are written in ascending order */
+        if (!size || (i && tag <= prev_tag) || values > f->size) {
+            goto out;
+        }
+        prev_tag = tag;
+
+        if (bytes > (uint64_t) word) {
+            uint64_t offset = read_uint(entry + 4 + word, word, f->swapped);
+
+            if (offset > f->size || bytes > f->size - offset) {
+                goto out;
+            }
+            if (offset + bytes > *end) {
+                *end = offset + bytes;
+            }
+        }
+
+        switch (tag) {
+        case TIFFTAG_STRIPOFFSETS:
+        case TIFFTAG_TILEOFFSETS:
+            table = &offsets;
+            count = &noffsets;
+            break;
+        case TIFFTAG_STRIPBYTECOUNTS:
+        case TIFFTAG_TILEBYTECOUNTS:
+            table = &bytecounts;
+            count = &nbytecounts;
+            break;
+        case TIFFTAG_SUBIFD:
+            table = &subifds;
+            count = &nsubifds;
+            break;
+        }
+
+        /* A field of the wrong type is as good as incomplete */
+        if (table && !*table) {
+            ret = raw_entry_values(f, entry, table, count);
+            if (ret) {
+                ret = ret == DNG_EFORMAT ? 0 : ret;
+                goto out;
+            }
+        }
+    }
+
+    if (!noffsets || noffsets != nbytecounts) {
+        goto out;
+    }
+
+    for (uint64_t i = 0; i < noffsets; i++) {
+        if (offsets[i] > f->size || bytecounts[i] > f->size - offsets[i]) {
+            goto out;
+        }
+        if (offsets[i] + bytecounts[i] > *end) {
+            *end = offsets[i] + bytecounts[i];
+        }
+    }
+
+    for (uint64_t i = 0; i < nsubifds; i++) {
+        ret = raw_ifd_complete(f, subifds[i], depth + 1, end);
+        if (ret <= 0) {
+            goto out;
+        }
+    }
+
+    ret = 1;
+
+out:
+    free(subifds);
+    free(bytecounts);
+    free(offsets);
+    free(entries);
+    return ret;
+}
+
+/*
+ * Recover a multi-frame file after a crash
+ *
+ * Frames are checked from the last durable frame in the index, or from
+ * the first frame without one.  The chain is ended after the last complete
+ * frame, the file truncated after its data, and a complete index written.
+ *
+ * @param path      Multi-frame file
+ * @param frames    Number of frames recovered returned here
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int recover_frames(const char *path, uint64_t *frames) {
+    struct frame_index idx = {0};
+    struct raw_tiff f = {0};
+    uint64_t covered, first = 0, last = 0, next, end = 0;
+    char *index_path;
+    TIFF *tiff;
+    int stale, err = 0;
+
+    index_path = malloc(strlen(path) + sizeof(INDEX_SUFFIX));
+    if (!index_path) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate path");
+    }
+    sprintf(index_path, "%s" INDEX_SUFFIX, path);
+
+    err = raw_tiff_open(path, O_RDWR, &f);
+    if (err) {
+        free(index_path);
+        return err;
+    }
+
+    err = index_load(index_path, f.size, 1, &idx, &covered);
+    if (!err) {
+        err = read_ifd_link(f.fd, f.bigtiff, f.swapped, 0, &first);
+    }
+    if (err) {
+        goto out;
+    }
+
+    /* Checked afresh, in case the index is of some other file */
+    if (idx.frames && idx.records[0].ifd_offset != first) {
+        index_free(&idx);
+    }
+
+    *frames = 0;
+    if (idx.frames) {
+        *frames = idx.frames - 1;
+        last = idx.frames > 1 ? idx.records[idx.frames - 2].ifd_offset : 0;
+        next = idx.records[idx.frames - 1].ifd_offset;
+    }
+    else {
+        next = first;
+    }
+
+    /* Frames are appended, so each IFD follows the last */
+    while (next > last) {
+        uint64_t frame_end = end;
+        int complete = raw_ifd_complete(&f, next, 0, &frame_end);
+
+        if (complete < 0) {
+            err = complete;
+            goto out;
+        }
+
+        /* A durable frame that isn't complete discredits the index */
+        if (!complete && !end && idx.frames) {
+            index_free(&idx);
+            *frames = 0;
+            last = 0;
+            next = first;
+            continue;
+        }
+        if (!complete) {
+            break;
+        }
+
+        (*frames)++;
+        last = next;
+        end = frame_end;
+
+        err = read_ifd_link(f.fd, f.bigtiff, f.swapped, last, &next);
+        if (err) {
+            goto out;
+        }
+    }
+
+    if (!*frames) {
+        err = dng_fail(DNG_EIO, "No complete frames");
+        goto out;
+    }
+
+    if (next) {
+        err = write_ifd_link(&f, last, 0);
+        if (err) {
+            goto out;
+        }
+    }
+
+    if ((end < f.size && ftruncate(f.fd, end)) || fdatasync(f.fd)) {
+        err = dng_fail(DNG_EIO, "Failed to truncate file");
+        goto out;
+    }
+
+    /* A complete index of the recovered file */
+    index_free(&idx);
+    unlink(index_path);
+
+    tiff = TIFFFdOpen(f.fd, path, "r");
+    if (!tiff) {
+        err = dng_fail(DNG_EIO, "Failed to reopen file");
+        goto out;
+    }
+
+    err = index_open(tiff, index_path, &idx, &stale);
+    if (!err && idx.frames != *frames) {
+        err = dng_fail(DNG_EIO, "Recovered %" PRIu64 " frames, but found %u",
+                       *frames, idx.frames);
+    }
+    if (!err) {
+        err = index_save(index_path, &idx, end, idx.frames, NULL);
+    }
+
+    /* TIFFClose() closes the descriptor */
+    TIFFClose(tiff);
+    f.fd = -1;
+
+out:
+    if (f.fd >= 0) {
+        close(f.fd);
+    }
+    index_free(&idx);
+    free(index_path);
+    return err;
+}
+
+/*
+ * Rewrite the DNG tags of IFD0, leaving the image data in place
+ *
+ * libtiff writes the updated IFD at the end of the file, pointing at the
+ * strips and SubIFDs already there, and links it in place of the old one,
+ * which is left as a few unreferenced bytes.
+ *
+ * @param filename  DNG to update
+ * @param opts      Tags to set.  A NULL camera or color matrix, or a 0
+ *                  illuminant, leaves the tag as it is.
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int update_dng_tags(const char *filename, const struct dng_options *opts) {
+    uint8_t *version;
+    TIFF *tiff;
+    int err = 0;
+
+    tiff = TIFFOpen(filename, "r+");
+    if (!tiff) {
+        return dng_fail(DNG_EIO, "libtiff failed to open file for update.");
+    }
+
+    if (!TIFFGetField(tiff, TIFFTAG_DNGVERSION, &version)) {
+        TIFFClose(tiff);
+        return dng_fail(DNG_EFORMAT, "Not a DNG");
+    }
+
+    if (opts->camera) {
+        TIFFSetField(tiff, TIFFTAG_UNIQUECAMERAMODEL, opts->camera);
+    }
+    if (opts->color_matrix1) {
+        TIFFSetField(tiff, TIFFTAG_COLORMATRIX1, opts->color_matrix1_len,
+                     opts->color_matrix1);
+    }
+    if (opts->color_matrix2) {
+        TIFFSetField(tiff, TIFFTAG_COLORMATRIX2, opts->color_matrix2_len,
+                     opts->color_matrix2);
+    }
+    if (opts->calibration_illuminant1) {
+        TIFFSetField(tiff, TIFFTAG_CALIBRATIONILLUMINANT1,
+                     opts->calibration_illuminant1);
+    }
+    if (opts->calibration_illuminant2) {
+        TIFFSetField(tiff, TIFFTAG_CALIBRATIONILLUMINANT2,
+                     opts->calibration_illuminant2);
+    }
+
+    if (!TIFFRewriteDirectory(tiff)) {
+        err = dng_fail(DNG_EIO, "libtiff failed to rewrite directory.");
+    }
+    TIFFClose(tiff);
+
+    return err;
+}
+
+/*
+ * In-memory TIFF files
+ *
+ * libtiff writes through these procs to a growable buffer, so a frame can
+ * be encoded without touching the disk and then written with one call.
+ */
+
+static tmsize_t mem_read(thandle_t handle, void *buf, tmsize_t size) {
+    struct mem_file *m = (struct mem_file *) handle;
+
+    if (m->pos >= m->size) {
+        return 0;
+    }
+    if ((size_t) size > m->size - m->pos) {
+        size = m->size - m->pos;
+    }
+
+    memcpy(buf, m->data + m->pos, size);
+    m->pos += size;
+    return size;
+}
+
+static tmsize_t mem_write(thandle_t handle, void *buf, tmsize_t size) {
+    struct mem_file *m = (struct mem_file *) handle;
+
+    if (m->pos + size > m->alloc) {
+        size_t alloc = m->alloc ? m->alloc : 65536;
+        uint8_t *data;
+
+        while (alloc < m->pos + size) {
+            alloc *= 2;
+        }
+        data = realloc(m->data, alloc);
+        if (!data) {
+            return -1;
+        }
+        m->data = data;
+        m->alloc = alloc;
+    }
+
+    /* Seeks past the end leave a gap, as in a file */
+    if (m->pos > m->size) {
+        memset(m->data + m->size, 0, m->pos - m->size);
+    }
+
+    memcpy(m->data + m->pos, buf, size);
+    m->pos += size;
+    if (m->pos > m->size) {
+        m->size = m->pos;
+    }
+    return size;
+}
+
+static toff_t mem_seek(thandle_t handle, toff_t offset, int whence) {
+    struct mem_file *m = (struct mem_file *) handle;
+
+    switch (whence) {
+    case SEEK_CUR:
+        offset += m->pos;
+        break;
+    case SEEK_END:
+        offset += m->size;
+        break;
+    }
+
+    m->pos = offset;
+    return offset;
+}
+
+static int mem_close(thandle_t handle) {
+    return 0;
+}
+
+static toff_t mem_size(thandle_t handle) {
+    return ((struct mem_file *) handle)->size;
+}
+
+static int mem_map(thandle_t handle, void **base, toff_t *size) {
+    return 0;
+}
+
+static void mem_unmap(thandle_t handle, void *base, toff_t size) {
+}
+
+/*
+ * Open an empty in-memory TIFF file for writing, reusing its buffer
+ */
+static TIFF *mem_tiff_open(struct mem_file *m, const char *name) {
+    m->size = 0;
+    m->pos = 0;
+
+    return TIFFClientOpen(name, "wm", (thandle_t) m, mem_read, mem_write, mem_seek,
+                          mem_close, mem_size, mem_map, mem_unmap);
+}
+
+/*
+ * CinemaDNG sequences
+ *
+ * Each frame is a DNG of its own, encoded into memory and handed to an
+ * I/O thread, so encoding a frame overlaps writing the one before.
+ * Uncompressed frames of one layout differ only in their pixels, TimeCodes
+ * and DateTime, so after the first such frame the rest are written from a
+ * template: its header, the image straight from the caller's array, and
+ * its directory with those two values patched.
+ */
+
+/*
+ * SMPTE time code of a frame, as in the DNG TimeCodes tag
+ *
+ * Non-drop-frame, counting frames at the nominal (rounded) frame rate.
+ */
+void cinema_timecode(uint64_t frame, double fps, uint8_t timecode[8]) {
+    uint64_t nominal = fps > 1 ? (uint64_t) (fps + 0.5) : 1;
+    uint64_t seconds = frame / nominal;
+    unsigned int fields[4] = {
+        frame % nominal,
+        seconds % 60,
+        seconds / 60 % 60,
+        seconds / 3600 % 24,
+    };
+
+    memset(timecode, 0, 8);
+    for (int i = 0; i < 4; i++) {
+        timecode[i] = (fields[i] / 10) << 4 | fields[i] % 10;
+    }
+}
+
+static void format_datetime(double timestamp, char datetime[20]) {
+    time_t seconds = timestamp;
+    struct tm tm;
+
+    memset(datetime, 0, 20);
+    if (gmtime_r(&seconds, &tm)) {
+        strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tm);
+    }
+}
+
+void cinema_template_free(struct cinema_template *t) {
+    free(t->head);
+    free(t->tail);
+    memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Find the out-of-line value of a tag in an in-memory classic TIFF
+ *
+ * @returns offset of the value, or 0 if not found
+ */
+static size_t mem_tag_value(const struct mem_file *m, uint16_t tag, uint64_t bytes) {
+    uint64_t ifd, n;
+
+    if (m->size < 8) {
+        return 0;
+    }
+
+    ifd = read_uint(m->data + 4, 4, 0);
+    if (ifd + 2 > m->size) {
+        return 0;
+    }
+
+    n = read_uint(m->data + ifd, 2, 0);
+    if (ifd + 2 + 12 * n > m->size) {
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        const uint8_t *entry = m->data + ifd + 2 + 12 * i;
+        int size = raw_type_size(read_uint(entry + 2, 2, 0));
+        uint64_t offset = read_uint(entry + 8, 4, 0);
+
+        if (read_uint(entry, 2, 0) == tag) {
+            if (read_uint(entry + 4, 4, 0) * size != bytes || bytes <= 4 ||
+                offset + bytes > m->size) {
+                return 0;
+            }
+            return offset;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Build a template from an encoded frame, if it has the form
+ *
+ * @param t         Template returned here
+ * @param m         Encoded frame
+ * @param l         Layout of the frame
+ * @param strips    Strip table of the frame
+ * @returns 1 if a template was built, 0 if the frame doesn't fit one,
+ *          negative enum dng_error on error
+ */
+static int cinema_template_build(struct cinema_template *t, const struct mem_file *m,
+                                 const struct strip_layout *l,
+                                 const struct strip_table *strips) {
+    uint64_t *offsets = strips->offsets, *bytecounts = strips->offsets + strips->count;
+    size_t image = layout_mem_rowbytes(l) * l->height;
+    size_t timecode, datetime, head, end;
+
+    /* Strips must hold the image as it is in memory, in order */
+    if (l->compression != COMPRESSION_NONE || layout_separate(l) || !strips->count) {
+        return 0;
+    }
+
+    head = offsets[0];
+    end = head;
+    for (uint32_t i = 0; i < strips->count; i++) {
+        if (offsets[i] != end) {
+            return 0;
+        }
+        end += bytecounts[i];
+    }
+    if (end != head + image || end > m->size) {
+        return 0;
+    }
+
+    timecode = mem_tag_value(m, TIFFTAG_TIMECODES, 8);
+    datetime = mem_tag_value(m, TIFFTAG_DATETIME, 20);
+    if (timecode < head + image || datetime < head + image) {
+        return 0;
+    }
+
+    cinema_template_free(t);
+    t->head = malloc(head);
+    t->tail = malloc(m->size - head - image);
+    if (!t->head || !t->tail) {
+        cinema_template_free(t);
+        return dng_fail(DNG_ENOMEM, "Unable to allocate frame template");
+    }
+
+    t->l = *l;
+    t->head_size = head;
+    t->image_size = image;
+    t->tail_size = m->size - head - image;
+    t->timecode_at = timecode - head - image;
+    t->datetime_at = datetime - head - image;
+    memcpy(t->head, m->data, head);
+    memcpy(t->tail, m->data + head + image, t->tail_size);
+    return 1;
+}
+
+/*
+ * Whether frames of a layout can be written from a template
+ */
+static int cinema_template_fits(const struct cinema_template *t,
+                                const struct strip_layout *l) {
+    return t->head && t->l.width == l->width && t->l.height == l->height &&
+           t->l.samples == l->samples && t->l.planar == l->planar &&
+           t->l.bits == l->bits && t->l.sampleformat == l->sampleformat;
+}
+
+/*
+ * Write all of a vector of buffers, across partial writes
+ */
+static int writev_full(int fd, struct iovec *iov, int count) {
+    while (count) {
+        ssize_t n = writev(fd, iov, count);
+
+        if (n < 0) {
+            return dng_fail(DNG_EIO, "Failed to write frame");
+        }
+
+        while (count && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int cinema_write_frame(struct cinema_frame *f) {
+    uint8_t *data = f->encoded.data;
+    struct iovec iov[3];
+    int count = 0, fd, err;
+
+    if (f->image) {
+        iov[count++] = (struct iovec) {data, f->head_size};
+        iov[count++] = (struct iovec) {(void *) f->image, f->image_size};
+    }
+    iov[count++] = (struct iovec) {data + f->head_size, f->encoded.size - f->head_size};
+
+    fd = open(f->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return dng_fail(DNG_EIO, "Failed to create %s", f->path);
+    }
+
+    err = writev_full(fd, iov, count);
+    if (close(fd) && !err) {
+        err = dng_fail(DNG_EIO, "Failed to write %s", f->path);
+    }
+    return err;
+}
+
+static void *cinema_io_thread(void *arg) {
+    struct cinema_io *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+    while (1) {
+        while (!io->pending && !io->quit) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+        if (!io->pending) {
+            break;
+        }
+
+        pthread_mutex_unlock(&io->lock);
+        int err = cinema_write_frame(io->pending);
+        pthread_mutex_lock(&io->lock);
+
+        if (err && !io->err) {
+            io->err = err;
+            memcpy(io->errmsg, dng_errmsg, sizeof(dng_errmsg));
+        }
+        io->pending = NULL;
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return NULL;
+}
+
+int cinema_io_start(struct cinema_io *io) {
+    memset(io, 0, sizeof(*io));
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+
+    if (pthread_create(&io->thread, NULL, cinema_io_thread, io)) {
+        pthread_cond_destroy(&io->cond);
+        pthread_mutex_destroy(&io->lock);
+        return dng_fail(DNG_ENOMEM, "Unable to start I/O thread");
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for the frame being written, if any
+ *
+ * @returns 0 if every frame so far was written, negative enum dng_error
+ *          of the first that wasn't otherwise, which is then cleared
+ */
+int cinema_io_wait(struct cinema_io *io) {
+    int err;
+
+    pthread_mutex_lock(&io->lock);
+    while (io->pending) {
+        pthread_cond_wait(&io->cond, &io->lock);
+    }
+    err = io->err;
+    if (err) {
+        dng_fail(err, "%s", io->errmsg);
+        io->err = 0;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return err;
+}
+
+/*
+ * Hand a frame to the I/O thread, which must be idle
+ */
+void cinema_io_submit(struct cinema_io *io, struct cinema_frame *f) {
+    pthread_mutex_lock(&io->lock);
+    io->pending = f;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+}
+
+void cinema_io_stop(struct cinema_io *io) {
+    pthread_mutex_lock(&io->lock);
+    io->quit = 1;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+
+    pthread_join(io->thread, NULL);
+    pthread_cond_destroy(&io->cond);
+    pthread_mutex_destroy(&io->lock);
+}
+
+/*
+ * Encode a frame for the I/O thread
+ *
+ * @param t     Template, built here from the frame when there is none that
+ *              fits and the frame has the form
+ * @param f     Frame to encode into, with its path set
+ * @param opts  DNG options, including the frame's TimeCodes and DateTime
+ * @param l     Image layout
+ * @param data  Image in memory representation, which must remain
+ *              unchanged until the frame is written
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int cinema_encode(struct cinema_template *t, struct cinema_frame *f,
+                  const struct dng_options *opts, struct strip_layout *l,
+                  const void *data) {
+    struct strip_table strips = {0};
+    int templated = !opts->preview && !opts->pyramid_levels &&
+                    !opts->compression && !layout_separate(l) &&
+                    (l->bits == 8 || l->bits == 16 || l->bits == 32);
+    TIFF *tiff;
+    int err;
+
+    if (templated && cinema_template_fits(t, l)) {
+        struct mem_file *m = &f->encoded;
+        size_t size = t->head_size + t->tail_size;
+        uint8_t *tail;
+        char datetime[20];
+
+        if (m->alloc < size) {
+            uint8_t *buf = realloc(m->data, size);
+
+            if (!buf) {
+                return dng_fail(DNG_ENOMEM, "Unable to allocate frame");
+            }
+            m->data = buf;
+            m->alloc = size;
+        }
+
+        format_datetime(opts->timestamp, datetime);
+        tail = m->data + t->head_size;
+        memcpy(m->data, t->head, t->head_size);
+        memcpy(tail, t->tail, t->tail_size);
+        memcpy(tail + t->timecode_at, opts->timecode, 8);
+        memcpy(tail + t->datetime_at, datetime, 20);
+        m->size = size;
+
+        f->image = data;
+        f->head_size = t->head_size;
+        f->image_size = t->image_size;
+        return 0;
+    }
+
+    tiff = mem_tiff_open(&f->encoded, f->path);
+    if (!tiff) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate frame");
+    }
+
+    err = write_dng(tiff, opts, l, data, templated ? &strips : NULL);
+    TIFFClose(tiff);
+
+    if (!err && templated) {
+        err = cinema_template_build(t, &f->encoded, l, &strips);
+        err = err < 0 ? err : 0;
+    }
+
+    free(strips.offsets);
+    f->image = NULL;
+    f->head_size = 0;
+    return err;
+}
+
+/*
+ * Capture sessions
+ *
+ * A pool of frame buffers, allocated once, passed between producers (camera
+ * callbacks) and native writer threads through two lock-free bounded
+ * queues: free slots and frames ready to write.  Semaphores count the
+ * entries of each queue, so threads only sleep when there is nothing to
+ * take.
+ */
+
+enum capture_slot_state {
+    SLOT_FREE,
+    SLOT_ACQUIRED,
+    SLOT_QUEUED,
+    SLOT_WRITING,
+};
+
+static int ring_init(struct ring *r, uint32_t capacity) {
+    uint64_t size = 1;
+
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    r->cells = malloc(size * sizeof(*r->cells));
+    if (!r->cells) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate queue");
+    }
+
+    for (uint64_t i = 0; i < size; i++) {
+        r->cells[i].seq = i;
+    }
+    r->mask = size - 1;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+static int ring_push(struct ring *r, uint32_t value) {
+    uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+    while (1) {
+        struct ring_cell *cell = &r->cells[pos & r->mask];
+        int64_t dif = (int64_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->value = value;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (dif < 0) {
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int ring_pop(struct ring *r, uint32_t *value) {
+    uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    while (1) {
+        struct ring_cell *cell = &r->cells[pos & r->mask];
+        int64_t dif = (int64_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *value = cell->value;
+                __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (dif < 0) {
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Pop an entry counted by a semaphore that has been taken
+ *
+ * The entry may still be being published by its producer.
+ */
+static uint32_t ring_take(struct ring *r) {
+    uint32_t value;
+
+    while (!ring_pop(r, &value)) {
+        sched_yield();
+    }
+
+    return value;
+}
+
+static void capture_write(struct capture *c, uint32_t k) {
+    struct capture_slot *slot = &c->slots[k];
+    struct dng_options opts = c->opts;
+    struct strip_layout l = c->l;
+    uint64_t latency, max;
+    TIFF *tiff;
+    int err;
+
+    opts.timestamp = slot->timestamp;
+
+    tiff = TIFFOpen(slot->path, dng_open_mode(BIGTIFF_AUTO, &opts, &l));
+    if (!tiff) {
+        err = dng_fail(DNG_EIO, "Failed to open file");
+    }
+    else {
+        err = write_dng(tiff, &opts, &l, c->pool + k * c->slot_bytes, NULL);
+        TIFFClose(tiff);
+    }
+
+    if (err) {
+        __atomic_add_fetch(&c->failed, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&c->err_lock);
+        if (!c->err) {
+            c->err = err;
+            memcpy(c->errmsg, dng_errmsg, sizeof(dng_errmsg));
+            c->errpath = strdup(slot->path);
+        }
+        pthread_mutex_unlock(&c->err_lock);
+    }
+
+    latency = monotonic_ns() - slot->submitted_ns;
+    __atomic_add_fetch(&c->latency_total_ns, latency, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&c->latency_max_ns, __ATOMIC_RELAXED);
+    while (latency > max &&
+           !__atomic_compare_exchange_n(&c->latency_max_ns, &max, latency, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&c->written, 1, __ATOMIC_RELAXED);
+
+    free(slot->path);
+    slot->path = NULL;
+    __atomic_store_n(&slot->state, SLOT_FREE, __ATOMIC_RELEASE);
+    ring_push(&c->free_ring, k);
+    sem_post(&c->free_count);
+}
+
+static void *capture_writer(void *arg) {
+    struct capture *c = arg;
+    uint32_t k;
+
+    while (1) {
+        while (sem_wait(&c->ready_count)) {
+        }
+
+        /* Stopping posts one extra count per writer */
+        if (__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+            if (!ring_pop(&c->ready_ring, &k)) {
+                break;
+            }
+        }
+        else {
+            k = ring_take(&c->ready_ring);
+        }
+
+        __atomic_store_n(&c->slots[k].state, SLOT_WRITING, __ATOMIC_RELAXED);
+        capture_write(c, k);
+    }
+
+    return NULL;
+}
+
+/*
+ * Allocate the buffer pool and start the writers
+ *
+ * @param c         Session, with opts, l and policy set
+ * @param max_bytes Memory for buffers, rounded down to whole buffers, but
+ *                  at least one
+ * @param writers   Number of writer threads
+ * @param lock      Lock the buffers into memory
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int capture_start(struct capture *c, size_t max_bytes, int writers, int lock) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = layout_mem_rowbytes(&c->l) * c->l.height;
+    int err;
+
+    c->slot_bytes = (bytes + page - 1) / page * page;
+    c->nslots = max_bytes / c->slot_bytes ? max_bytes / c->slot_bytes : 1;
+    if (c->nslots > (1u << 20)) {
+        c->nslots = 1u << 20;
+    }
+    c->pool_bytes = c->slot_bytes * c->nslots;
+
+    if (posix_memalign((void **) &c->pool, page, c->pool_bytes)) {
+        c->pool = NULL;
+        return dng_fail(DNG_ENOMEM, "Unable to allocate %zu bytes of buffers",
+                        c->pool_bytes);
+    }
+
+    if (lock) {
+        if (mlock(c->pool, c->pool_bytes)) {
+            return dng_fail(DNG_ENOMEM, "Unable to lock buffers in memory: %s",
+                            strerror(errno));
+        }
+        c->locked = 1;
+    }
+
+    c->slots = calloc(c->nslots, sizeof(*c->slots));
+    if (!c->slots) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate buffers");
+    }
+
+    err = ring_init(&c->free_ring, c->nslots);
+    if (!err) {
+        err = ring_init(&c->ready_ring, c->nslots);
+    }
+    if (err) {
+        return err;
+    }
+
+    for (uint32_t k = 0; k < c->nslots; k++) {
+        ring_push(&c->free_ring, k);
+    }
+    sem_init(&c->free_count, 0, c->nslots);
+    sem_init(&c->ready_count, 0, 0);
+    pthread_mutex_init(&c->err_lock, NULL);
+
+    c->writers = calloc(writers, sizeof(*c->writers));
+    if (!c->writers) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate writers");
+    }
+
+    for (c->nwriters = 0; c->nwriters < writers; c->nwriters++) {
+        if (pthread_create(&c->writers[c->nwriters], NULL, capture_writer, c)) {
+            return dng_fail(DNG_ENOMEM, "Unable to start writer thread");
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write every queued frame and stop the writers
+ */
+void capture_stop(struct capture *c) {
+    if (!c->writers) {
+        return;
+    }
+
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < c->nwriters; i++) {
+        sem_post(&c->ready_count);
+    }
+    for (int i = 0; i < c->nwriters; i++) {
+        pthread_join(c->writers[i], NULL);
+    }
+
+    free(c->writers);
+    c->writers = NULL;
+    c->nwriters = 0;
+}
+
+/*
+ * Free a session, which must be stopped
+ */
+void capture_free(struct capture *c) {
+    if (c->slots) {
+        for (uint32_t k = 0; k < c->nslots; k++) {
+            free(c->slots[k].path);
+        }
+        free(c->slots);
+        sem_destroy(&c->free_count);
+        sem_destroy(&c->ready_count);
+        pthread_mutex_destroy(&c->err_lock);
+    }
+    free(c->errpath);
+    free(c->free_ring.cells);
+    free(c->ready_ring.cells);
+    if (c->locked) {
+        munlock(c->pool, c->pool_bytes);
+    }
+    free(c->pool);
+    c->pool = NULL;
+    c->slots = NULL;
+    c->free_ring.cells = c->ready_ring.cells = NULL;
+}
+
+/*
+ * Take a free buffer, applying the session's policy when there is none
+ *
+ * @returns buffer number, or -1 if the frame is dropped
+ */
+int64_t capture_acquire(struct capture *c) {
+    uint32_t k;
+
+    if (!sem_trywait(&c->free_count)) {
+        k = ring_take(&c->free_ring);
+    }
+    else if (c->policy == CAPTURE_DROP_NEWEST) {
+        __atomic_add_fetch(&c->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    else if (c->policy == CAPTURE_DROP_OLDEST && !sem_trywait(&c->ready_count)) {
+        k = ring_take(&c->ready_ring);
+        free(c->slots[k].path);
+        c->slots[k].path = NULL;
+        __atomic_add_fetch(&c->dropped, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        /* Every buffer is being filled or written */
+        while (sem_wait(&c->free_count)) {
+        }
+        k = ring_take(&c->free_ring);
+    }
+
+    __atomic_store_n(&c->slots[k].state, SLOT_ACQUIRED, __ATOMIC_RELAXED);
+    return k;
+}
+
+/*
+ * Return a buffer that won't be submitted
+ *
+ * @returns 0 on success, negative enum dng_error if the buffer wasn't
+ *          acquired
+ */
+int capture_release(struct capture *c, uint32_t k) {
+    int acquired = SLOT_ACQUIRED;
+
+    if (!__atomic_compare_exchange_n(&c->slots[k].state, &acquired, SLOT_FREE, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return dng_fail(DNG_EFORMAT, "Buffer was not acquired, or already submitted");
+    }
+
+    ring_push(&c->free_ring, k);
+    sem_post(&c->free_count);
+    return 0;
+}
+
+/*
+ * Queue a filled buffer to be written
+ *
+ * @param c     Session
+ * @param k     Buffer number
+ * @param path  File to write, taken over by the session
+ * @returns 0 on success, negative enum dng_error if the buffer wasn't
+ *          acquired
+ */
+int capture_submit(struct capture *c, uint32_t k, char *path) {
+    struct capture_slot *slot = &c->slots[k];
+    struct timespec now;
+    int acquired = SLOT_ACQUIRED;
+
+    if (!__atomic_compare_exchange_n(&slot->state, &acquired, SLOT_QUEUED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        free(path);
+        return dng_fail(DNG_EFORMAT, "Buffer was not acquired, or already submitted");
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->path = path;
+    slot->timestamp = now.tv_sec + now.tv_nsec / 1e9;
+    slot->submitted_ns = monotonic_ns();
+
+    __atomic_add_fetch(&c->submitted, 1, __ATOMIC_RELAXED);
+    ring_push(&c->ready_ring, k);
+    sem_post(&c->ready_count);
+    return 0;
+}
+
+/* Strips read and decoded directly from a file descriptor */
+struct direct_read {
+    const struct strip_layout *l;
+    int fd;
+    const uint64_t *offsets;
+    const uint64_t *bytecounts;
+    uint8_t *dest;
+    int err;
+    char errmsg[sizeof(dng_errmsg)];
+};
+
+static void direct_read_task(void *arg, size_t i) {
+    struct direct_read *d = arg;
+    uint8_t *raw = malloc(d->bytecounts[i] ? d->bytecounts[i] : 1);
+    int err;
+
+    if (!raw) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+    }
+    else {
+        err = pread_full(d->fd, raw, d->bytecounts[i], d->offsets[i]);
+    }
+
+    if (!err) {
+        err = decode_strip(d->l, raw, d->bytecounts[i], strip_mem(d->l, d->dest, i),
+                           layout_strip_rows(d->l, i));
+    }
+
+    if (err && !__atomic_exchange_n(&d->err, err, __ATOMIC_RELAXED)) {
+        memcpy(d->errmsg, dng_errmsg, sizeof(dng_errmsg));
+    }
+    free(raw);
+}
+
+/*
+ * Read a contiguous image in a natively decoded format from its strip
+ * table, reading and decoding strips in parallel
+ *
+ * @param fd        File descriptor to read from
+ * @param l         Layout of the image
+ * @param strips    Strip offsets, then byte counts
+ * @param dest      Destination for the image in memory representation
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int read_strips_direct(int fd, const struct strip_layout *l,
+                       const uint64_t *strips, void *dest) {
+    uint32_t nstrips = layout_strips(l);
+    struct direct_read d = {
+        .l = l,
+        .fd = fd,
+        .offsets = strips,
+        .bytecounts = strips + nstrips,
+        .dest = dest,
+    };
+
+    parallel_for(nstrips, direct_read_task, &d);
+    if (d.err) {
+        return dng_fail(d.err, "%s", d.errmsg);
+    }
+
+    return 0;
+}
+
+#define CACHE_NONE UINT32_MAX
+
+/*
+ * Set up a cache of the strips of an image readable by the native codec
+ *
+ * @param c         Cache to set up
+ * @param fd        File to read strips from, owned by the cache
+ * @param l         Layout of the image, contiguous and native
+ * @param strips    Strip offsets then byte counts, owned by the cache
+ * @param max_bytes Decoded bytes to keep
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int strip_cache_init(struct strip_cache *c, int fd, const struct strip_layout *l,
+                     uint64_t *strips, size_t max_bytes) {
+    uint32_t nstrips = layout_strips(l);
+
+    memset(c, 0, sizeof(*c));
+    c->l = *l;
+    c->fd = fd;
+    c->strips = strips;
+    c->head = c->tail = CACHE_NONE;
+    c->max_bytes = max_bytes;
+
+    c->data = calloc(nstrips, sizeof(*c->data));
+    c->prev = malloc(nstrips * sizeof(*c->prev));
+    c->next = malloc(nstrips * sizeof(*c->next));
+    if (!c->data || !c->prev || !c->next) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strip cache");
+    }
+
+    return 0;
+}
+
+void strip_cache_free(struct strip_cache *c) {
+    if (c->data) {
+        for (uint32_t i = 0; i < layout_strips(&c->l); i++) {
+            free(c->data[i]);
+        }
+    }
+
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+
+    free(c->data);
+    free(c->prev);
+    free(c->next);
+    free(c->strips);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static void strip_cache_unlink(struct strip_cache *c, uint32_t s) {
+    if (c->prev[s] != CACHE_NONE) {
+        c->next[c->prev[s]] = c->next[s];
+    }
+    else {
+        c->head = c->next[s];
+    }
+
+    if (c->next[s] != CACHE_NONE) {
+        c->prev[c->next[s]] = c->prev[s];
+    }
+    else {
+        c->tail = c->prev[s];
+    }
+}
+
+static void strip_cache_push(struct strip_cache *c, uint32_t s) {
+    c->prev[s] = CACHE_NONE;
+    c->next[s] = c->head;
+    if (c->head != CACHE_NONE) {
+        c->prev[c->head] = s;
+    }
+    else {
+        c->tail = s;
+    }
+    c->head = s;
+}
+
+/* Missing strips of a request, decoded in parallel */
+struct cache_fill {
+    struct strip_cache *c;
+    uint32_t *strips;
+    int err;
+    char errmsg[sizeof(dng_errmsg)];
+};
+
+static void cache_fill_task(void *arg, size_t i) {
+    struct cache_fill *f = arg;
+    struct strip_cache *c = f->c;
+    uint32_t s = f->strips[i];
+    uint32_t nstrips = layout_strips(&c->l);
+    uint64_t size = c->strips[nstrips + s];
+    uint8_t *raw = malloc(size ? size : 1);
+    int err;
+
+    if (!raw) {
+        err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+    }
+    else {
+        err = pread_full(c->fd, raw, size, c->strips[s]);
+    }
+
+    if (!err) {
+        err = decode_strip(&c->l, raw, size, c->data[s], layout_strip_rows(&c->l, s));
+    }
+
+    if (err && !__atomic_exchange_n(&f->err, err, __ATOMIC_RELAXED)) {
+        memcpy(f->errmsg, dng_errmsg, sizeof(dng_errmsg));
+    }
+    free(raw);
+}
+
+/*
+ * Copy rows of an image out of its cache, decoding the strips missing
+ *
+ * Missing strips are decoded in parallel.  Afterwards, the least recently
+ * used strips are dropped until the cache fits.
+ *
+ * @param c     Cache of the image
+ * @param first First row to copy
+ * @param rows  Rows to copy
+ * @param dest  Destination for the rows in memory representation
+ * @returns 0 on success, negative enum dng_error on error
+ */
+int strip_cache_read(struct strip_cache *c, uint32_t first, uint32_t rows,
+                     uint8_t *dest) {
+    const struct strip_layout *l = &c->l;
+    size_t rowbytes = layout_mem_rowbytes(l);
+    uint32_t s0 = first / l->rowsperstrip;
+    uint32_t s1 = rows ? (first + rows - 1) / l->rowsperstrip + 1 : s0;
+    struct cache_fill f = {
+        .c = c,
+    };
+    size_t missing = 0;
+    int err = 0;
+
+    f.strips = malloc((s1 - s0 + 1) * sizeof(*f.strips));
+    if (!f.strips) {
+        return dng_fail(DNG_ENOMEM, "Unable to allocate strip list");
+    }
+
+    for (uint32_t s = s0; s < s1; s++) {
+        if (c->data[s]) {
+            continue;
+        }
+
+        c->data[s] = malloc(layout_strip_rows(l, s) * rowbytes);
+        if (!c->data[s]) {
+            err = dng_fail(DNG_ENOMEM, "Unable to allocate strip");
+            break;
+        }
+        f.strips[missing++] = s;
+    }
+
+    if (!err) {
+        parallel_for(missing, cache_fill_task, &f);
+        if (f.err) {
+            err = dng_fail(f.err, "%s", f.errmsg);
+        }
+    }
+
+    /* Strips that failed, or were never filled, are not kept */
+    if (err) {
+        for (size_t i = 0; i < missing; i++) {
+            free(c->data[f.strips[i]]);
+            c->data[f.strips[i]] = NULL;
+        }
+        free(f.strips);
+        return err;
+    }
+
+    for (size_t i = 0; i < missing; i++) {
+        uint32_t s = f.strips[i];
+
+        c->bytes += layout_strip_rows(l, s) * rowbytes;
+        strip_cache_push(c, s);
+    }
+    free(f.strips);
+
+    for (uint32_t s = s0; s < s1; s++) {
+        uint32_t start = s * l->rowsperstrip;
+        uint32_t lo = first > start ? first : start;
+        uint32_t hi = start + layout_strip_rows(l, s);
+
+        if (hi > first + rows) {
+            hi = first + rows;
+        }
+
+        memcpy(dest + (size_t) (lo - first) * rowbytes,
+               c->data[s] + (size_t) (lo - start) * rowbytes, (hi - lo) * rowbytes);
+
+        strip_cache_unlink(c, s);
+        strip_cache_push(c, s);
+    }
+
+    while (c->bytes > c->max_bytes && c->tail != CACHE_NONE) {
+        uint32_t s = c->tail;
+
+        strip_cache_unlink(c, s);
+        free(c->data[s]);
+        c->data[s] = NULL;
+        c->bytes -= layout_strip_rows(l, s) * rowbytes;
+    }
+
+    return 0;
+}
+
+void recompress_lane(void *arg, size_t lane) {
+    struct recompress_batch *b = arg;
+    size_t i;
+
+    (void) lane;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+        b->errs[i] = recompress_file(b->src[i], b->dst[i], b->compression, &b->rate);
+        if (b->errs[i]) {
+            memcpy(b->errmsgs[i], dng_errmsg, sizeof(dng_errmsg));
+        }
+    }
+}
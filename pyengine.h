@@ -0,0 +1,255 @@
+/*
+ * libtiffutils engine, Python module parts
+ *
+ * The parts of the engine only the Python module calls: embedded previews,
+ * frame indexes and crash recovery of multi-frame files, CinemaDNG
+ * sequences, capture sessions, cached strip reads and the batch lanes.
+ * They are free of CPython like the rest of the engine, but are built into
+ * the module alone, from pyengine.c.
+ */
+
+#ifndef TIFFUTILS_PYENGINE_H
+#define TIFFUTILS_PYENGINE_H
+
+#include "engine.h"
+
+#pragma GCC visibility push(hidden)
+
+/*
+ * A batch of exports, shared by a fixed number of lanes that each take the
+ * next image until none are left
+ */
+struct export_batch {
+    const char **src;
+    const char **dst;
+    size_t count;
+    size_t next;
+    int format;
+    uint32_t size;
+    int quality;
+    int *errs;
+    char (*errmsgs)[sizeof(dng_errmsg)];
+};
+
+#define INDEX_MAGIC     "TIFFIDX1"
+#define INDEX_SUFFIX    ".idx"
+
+struct index_record {
+    uint64_t ifd_offset;    /* first IFD of the frame */
+    double timestamp;       /* seconds since the epoch, 0 if unknown */
+    uint32_t width;
+    uint32_t height;
+    uint32_t rowsperstrip;
+    uint32_t nstrips;       /* 0 if the raw image cannot be read directly */
+    uint16_t samples;
+    uint16_t planar;
+    uint16_t bits;
+    uint16_t sampleformat;
+    uint16_t compression;
+    uint16_t predictor;
+    uint16_t byteswapped;
+    int16_t pattern;        /* enum cfa_pattern, -1 if unknown */
+    uint64_t reserved;
+    /* Followed in the file by nstrips offsets, then nstrips byte counts */
+};
+
+struct frame_index {
+    uint32_t frames;
+    uint32_t alloc;
+    struct index_record *records;
+    uint64_t **strips;      /* strip table of each record */
+};
+
+struct mem_file {
+    uint8_t *data;
+    size_t size;
+    size_t alloc;
+    size_t pos;
+};
+
+/* A frame laid out as header, image, directory */
+struct cinema_template {
+    struct strip_layout l;      /* layout of the frames it fits */
+    uint8_t *head;
+    size_t head_size;
+    size_t image_size;
+    uint8_t *tail;              /* IFD and its values */
+    size_t tail_size;
+    size_t timecode_at;         /* offsets of the values in tail */
+    size_t datetime_at;
+};
+
+/* A frame encoded and waiting to be written */
+struct cinema_frame {
+    char *path;
+    struct mem_file encoded;    /* whole frame, or template head and tail */
+    const void *image;          /* image between head and tail, if templated */
+    size_t head_size;
+    size_t image_size;
+};
+
+/* Writer of one sequence, with its I/O thread */
+struct cinema_io {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct cinema_frame *pending;   /* frame being written, NULL if idle */
+    int quit;
+    int err;
+    char errmsg[sizeof(dng_errmsg)];
+};
+
+enum capture_policy {
+    CAPTURE_BLOCK,          /* wait for a buffer */
+    CAPTURE_DROP_OLDEST,    /* reuse the buffer of the oldest queued frame */
+    CAPTURE_DROP_NEWEST,    /* drop the frame that has no buffer */
+};
+
+/*
+ * Bounded multi-producer multi-consumer queue of slot numbers
+ *
+ * Each cell carries a sequence number recording whether it is ready to
+ * be pushed to or popped from in the current lap of the ring.
+ */
+struct ring_cell {
+    uint64_t seq;
+    uint32_t value;
+};
+
+struct ring {
+    struct ring_cell *cells;
+    uint64_t mask;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+};
+
+struct capture_slot {
+    int state;                  /* enum capture_slot_state */
+    char *path;
+    uint64_t submitted_ns;      /* monotonic time of submission */
+    double timestamp;
+};
+
+struct capture {
+    struct dng_options opts;
+    struct strip_layout l;
+    uint8_t *pool;
+    size_t slot_bytes;          /* page rounded size of each buffer */
+    size_t pool_bytes;
+    int locked;                 /* pool is mlock()ed */
+    uint32_t nslots;
+    struct capture_slot *slots;
+    struct ring free_ring;
+    struct ring ready_ring;
+    sem_t free_count;
+    sem_t ready_count;
+    int policy;                 /* enum capture_policy */
+    int stop;
+    pthread_t *writers;
+    int nwriters;
+
+    /* Counters */
+    uint64_t submitted;
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t failed;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+
+    pthread_mutex_t err_lock;
+    int err;                    /* first failure */
+    char errmsg[sizeof(dng_errmsg)];
+    char *errpath;
+};
+
+/* Decoded strips of an image, kept in least recently used order */
+struct strip_cache {
+    struct strip_layout l;
+    int fd;                 /* file to read strips from, -1 if closed */
+    uint64_t *strips;       /* offsets, then byte counts */
+    uint8_t **data;         /* decoded strips, NULL if not cached */
+    uint32_t *prev, *next;  /* recency list, most recent first */
+    uint32_t head, tail;
+    size_t bytes;           /* decoded bytes cached */
+    size_t max_bytes;
+};
+
+/*
+ * A batch of files recompressed by a fixed number of lanes, each taking
+ * the next file until none are left
+ */
+struct recompress_batch {
+    const char **src;
+    const char **dst;       /* NULL entries replace src */
+    size_t count;
+    size_t next;
+    uint16_t compression;
+    struct rate_limit rate;
+    int *errs;
+    char (*errmsgs)[sizeof(dng_errmsg)];
+};
+
+/* Embedded previews */
+int select_preview_directory(TIFF *tiff, uint32_t max_size);
+int preview_is_jpeg(TIFF *tiff);
+int read_jpeg_preview(TIFF *tiff, uint8_t **out, size_t *size);
+int read_rgba_preview(TIFF *tiff, uint32_t width, uint32_t height, uint8_t *dest);
+
+int load_image_to_file(const char *filename, uint32_t level, const char *out_path,
+                       int *pattern);
+
+/* Frame indexes */
+void index_free(struct frame_index *idx);
+void record_from_layout(struct index_record *rec, const struct strip_layout *l,
+                        uint32_t nstrips, int pattern);
+void layout_from_record(struct strip_layout *l, const struct index_record *rec);
+int index_save(const char *path, const struct frame_index *idx,
+               uint64_t tiff_size, uint64_t durable, FILE **out);
+int index_scan(TIFF *tiff, struct frame_index *idx);
+int index_open(TIFF *tiff, const char *path, struct frame_index *idx, int *stale);
+int index_resume(const char *path, const char *index_path, FILE **out,
+                 uint64_t *frames, uint64_t *last_ifd);
+int index_append(FILE *index, TIFF *tiff, uint64_t *frames, uint64_t *last_ifd,
+                 uint64_t durable, struct index_record *rec,
+                 const struct strip_table *strips);
+int index_checkpoint(FILE *index, TIFF *tiff, uint64_t frames);
+
+/* Crash recovery */
+int recover_frames(const char *path, uint64_t *frames);
+int update_dng_tags(const char *filename, const struct dng_options *opts);
+
+/* CinemaDNG sequences */
+void cinema_timecode(uint64_t frame, double fps, uint8_t timecode[8]);
+void cinema_template_free(struct cinema_template *t);
+int cinema_io_start(struct cinema_io *io);
+int cinema_io_wait(struct cinema_io *io);
+void cinema_io_submit(struct cinema_io *io, struct cinema_frame *f);
+void cinema_io_stop(struct cinema_io *io);
+int cinema_encode(struct cinema_template *t, struct cinema_frame *f,
+                  const struct dng_options *opts, struct strip_layout *l,
+                  const void *data);
+
+/* Capture sessions */
+int capture_start(struct capture *c, size_t max_bytes, int writers, int lock);
+void capture_stop(struct capture *c);
+void capture_free(struct capture *c);
+int64_t capture_acquire(struct capture *c);
+int capture_release(struct capture *c, uint32_t k);
+int capture_submit(struct capture *c, uint32_t k, char *path);
+
+/* Direct and cached strip reads */
+int read_strips_direct(int fd, const struct strip_layout *l,
+                       const uint64_t *strips, void *dest);
+int strip_cache_init(struct strip_cache *c, int fd, const struct strip_layout *l,
+                     uint64_t *strips, size_t max_bytes);
+void strip_cache_free(struct strip_cache *c);
+int strip_cache_read(struct strip_cache *c, uint32_t first, uint32_t rows,
+                     uint8_t *dest);
+
+/* Batch lanes */
+void export_lane(void *arg, size_t lane);
+void recompress_lane(void *arg, size_t lane);
+
+#pragma GCC visibility pop
+
+#endif
@@ -33,17 +33,20 @@ setup(
     author_email="aerialrobotics@ncsu.edu",
     url="https://github.com/ncsuarc/tiffutils",
     license="BSD",
+    python_requires=">=3.6",
     install_requires=["numpy"],
     # Use our custom_build_ext that dynamically imports numpy and make sure
     # that numpy is installed before we run it
     cmdclass={"build_ext": numpy_build_ext},
     setup_requires=["numpy"],
+    scripts=["scripts/tiffutils-recompress"],
     ext_modules=[
         Extension(
             "tiffutils",
             extra_compile_args=["-std=gnu99", "-g3"],
-            libraries=["tiff"],
-            sources=["tiffutils.c"],
+            libraries=["tiff", "z", "jpeg", "png", "m", "pthread", "rt"],
+            sources=["tiffutils.c", "pyengine.c", "libtiffutils.c"],
+            depends=["engine.h", "pyengine.h", "tiffutils.h"],
         )
     ],
 )
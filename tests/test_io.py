@@ -3,13 +3,23 @@
 import tiffutils
 import fractions
 from pyexiv2.metadata import ImageMetadata
+import ctypes
 import numpy as np
 import os
+import shutil
+import signal
+import struct
+import subprocess
 import tempfile
+import time
 import unittest
 
 test_dir = os.path.dirname(__file__)
 
+# tiffutils program and libtiffutils, built by make
+tiffutils_cli = os.path.join(test_dir, '..', 'tiffutils')
+libtiffutils_so = os.path.join(test_dir, '..', 'libtiffutils.so')
+
 # GRBG DNG image of field
 field_dng = os.path.join(test_dir, 'images/field.dng')
 field_data = os.path.join(test_dir, 'images/field.npy')
@@ -25,6 +35,41 @@ class TestLoadDNG(unittest.TestCase):
         data, cfa = tiffutils.load_dng(field_dng)
         self.assertTrue((data==reference).all())
 
+    def test_shared_memory(self):
+        from multiprocessing import shared_memory
+
+        reference = np.load(field_data)
+        name = 'tiffutils_test_%d' % os.getpid()
+        data, cfa = tiffutils.load_dng(field_dng, shm_name=name)
+
+        shm = shared_memory.SharedMemory(name)
+        try:
+            view = np.ndarray(data.shape, data.dtype, buffer=shm.buf)
+            self.assertTrue((view==reference).all())
+            del view, data
+        finally:
+            shm.close()
+            shm.unlink()
+
+    def test_dlpack(self):
+        reference = np.load(field_data)
+        image, cfa = tiffutils.load_dng(field_dng, as_='dlpack')
+
+        self.assertIsInstance(image, tiffutils.DNGImage)
+        self.assertEqual(cfa, tiffutils.CFA_GRBG)
+        self.assertEqual(image.cfa, tiffutils.CFA_GRBG)
+        self.assertEqual(image.shape, reference.shape)
+        self.assertEqual(image.dtype, reference.dtype)
+
+        # Each export shares the decoded memory
+        data = np.asarray(image)
+        self.assertTrue((data==reference).all())
+        self.assertTrue(np.shares_memory(data, np.from_dlpack(image)))
+        self.assertTrue(np.shares_memory(data, np.asarray(memoryview(image))))
+
+    def test_invalid_as(self):
+        self.assertRaises(ValueError, tiffutils.load_dng, field_dng, as_='torch')
+
 def str_to_array(s, shape):
     """
     Convert flat string list of floats to np.array with shape
@@ -65,6 +110,138 @@ class TestSaveDNG(unittest.TestCase):
         data, cfa = tiffutils.load_dng(self.name)
         self.assertTrue((data==self.reference).all())
 
+    def test_bigtiff(self):
+        def version():
+            with open(self.name, 'rb') as f:
+                return f.read(4)[2]
+
+        tiffutils.save_dng(self.reference, self.name, bigtiff=True)
+        self.assertEqual(version(), 43)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==self.reference).all())
+
+        for bigtiff in ('auto', False):
+            tiffutils.save_dng(self.reference, self.name, bigtiff=bigtiff)
+            self.assertEqual(version(), 42)
+
+        self.assertRaises(ValueError, tiffutils.save_dng, self.reference,
+                          self.name, bigtiff='always')
+
+    def test_memmap(self):
+        path = os.path.join(self.tempdir, 'image.npy')
+        try:
+            data, cfa = tiffutils.load_dng(field_dng, out_path=path)
+            self.assertIsInstance(data, np.memmap)
+            self.assertEqual(cfa, tiffutils.CFA_GRBG)
+            self.assertTrue((data==self.reference).all())
+            del data
+
+            image = np.load(path, mmap_mode='r')
+            tiffutils.save_dng(image, self.name, compression=True)
+            del image
+
+            data, cfa = tiffutils.load_dng(self.name)
+            self.assertTrue((data==self.reference).all())
+        finally:
+            os.remove(path)
+
+    def test_float32(self):
+        reference = self.reference.astype(np.float32) / 65535
+        tiffutils.save_dng(reference, self.name)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertEqual(data.dtype, np.float32)
+        self.assertTrue((data==reference).all())
+
+    def test_float32_compressed(self):
+        reference = self.reference.astype(np.float32) / 65535
+        tiffutils.save_dng(reference, self.name, compression=True)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertEqual(data.dtype, np.float32)
+        self.assertTrue((data==reference).all())
+
+    def test_float16_compressed(self):
+        reference = (self.reference.astype(np.float32) / 65535).astype(np.float16)
+        tiffutils.save_dng(reference, self.name, compression=True)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertEqual(data.dtype, np.float16)
+        self.assertTrue((data==reference).all())
+
+    def test_float24(self):
+        reference = self.reference.astype(np.float32) / 65535
+        tiffutils.save_dng(reference, self.name, compression=True,
+                           bits_per_sample=24)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertEqual(data.dtype, np.float32)
+        # 16 bit mantissa
+        self.assertTrue(np.allclose(data, reference, rtol=2**-16, atol=0))
+
+    def test_bits_per_sample_bad(self):
+        with self.assertRaises(ValueError):
+            tiffutils.save_dng(self.reference, self.name, bits_per_sample=24)
+
+    def linear_raw(self):
+        """Half resolution (H, W, 3) image from the reference CFA data"""
+        return np.ascontiguousarray(np.stack([self.reference[0::2,1::2],
+                                              self.reference[0::2,0::2],
+                                              self.reference[1::2,0::2]],
+                                             axis=-1))
+
+    def test_linear_raw(self):
+        reference = self.linear_raw()
+        tiffutils.save_dng(reference, self.name)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertEqual(data.shape, reference.shape)
+        self.assertEqual(cfa, None)
+        self.assertTrue((data==reference).all())
+
+    def test_linear_raw_separate_compressed(self):
+        reference = self.linear_raw()
+        tiffutils.save_dng(reference, self.name, compression=True,
+                           planar_config=tiffutils.PLANARCONFIG_SEPARATE)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertEqual(data.shape, reference.shape)
+        self.assertTrue((data==reference).all())
+
+    def test_linear_raw_separate_float32(self):
+        reference = self.linear_raw().astype(np.float32) / 65535
+        tiffutils.save_dng(reference, self.name, compression=True,
+                           planar_config=tiffutils.PLANARCONFIG_SEPARATE)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==reference).all())
+
+    def test_linear_raw_bad_samples(self):
+        with self.assertRaises(ValueError):
+            tiffutils.save_dng(np.zeros((10, 10, 2), dtype=np.uint16),
+                               self.name)
+
+    def test_preview(self):
+        tiffutils.save_dng(self.reference, self.name, preview=512)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==self.reference).all())
+
+        meta = ImageMetadata(self.name)
+        meta.read()
+        self.assertEqual(int(meta['Exif.Image.NewSubfileType'].value), 1)
+        self.assertLessEqual(int(meta['Exif.Image.ImageWidth'].value), 512)
+        self.assertLessEqual(int(meta['Exif.Image.ImageLength'].value), 512)
+
+    def test_preview_separate(self):
+        reference = self.linear_raw()
+        tiffutils.save_dng(reference, self.name, preview=256)
+        expected = tiffutils.load_preview(self.name)
+
+        tiffutils.save_dng(reference, self.name, preview=256,
+                           planar_config=tiffutils.PLANARCONFIG_SEPARATE)
+        preview = tiffutils.load_preview(self.name)
+        self.assertTrue((preview==expected).all())
+
+    def test_preview_compressed_cfa(self):
+        tiffutils.save_dng(self.reference, self.name, preview=512,
+                           compression=True, cfa_pattern=tiffutils.CFA_BGGR)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertEqual(cfa, tiffutils.CFA_BGGR)
+        self.assertTrue((data==self.reference).all())
+
     def test_data_none(self):
         with self.assertRaises(TypeError):
             tiffutils.save_dng(None, self.name)
@@ -97,6 +274,22 @@ class TestSaveDNG(unittest.TestCase):
 
         self.assertTrue((color_matrix1==matrix).all())
 
+    def test_color_matrix1_preview(self):
+        matrix = np.array([
+           [1, 0, 0],
+           [0, 1, 0],
+           [0, 0, 1]])
+
+        tiffutils.save_dng(self.reference, self.name,
+                           color_matrix1=matrix, preview=256)
+
+        meta = ImageMetadata(self.name)
+        meta.read()
+        color_matrix1 = str_to_array(meta['Exif.Image.ColorMatrix1'].value,
+                                     matrix.shape)
+
+        self.assertTrue((color_matrix1==matrix).all())
+
     def test_color_matrix1_bad(self):
         matrix = np.array([True, False, True])
 
@@ -165,3 +358,1183 @@ class TestSaveDNG(unittest.TestCase):
         meta.read()
         illuminant2 = float(meta['Exif.Image.CalibrationIlluminant2'].value)
         self.assertEquals(illuminant2, tiffutils.ILLUMINANT_D65)
+
+    def test_update_tags(self):
+        matrix = np.array([
+           [1, 0, 0],
+           [0, 1, 0],
+           [0, 0, 1]])
+
+        tiffutils.save_dng(self.reference, self.name, preview=64,
+                           compression=True, camera='Old')
+        size = os.path.getsize(self.name)
+
+        tiffutils.update_dng_tags(self.name, camera='New', color_matrix1=matrix,
+                                  calibration_illuminant1=tiffutils.ILLUMINANT_D65)
+
+        # Only IFD0 is written again
+        self.assertLess(os.path.getsize(self.name) - size, 4096)
+
+        meta = ImageMetadata(self.name)
+        meta.read()
+        self.assertEqual(meta['Exif.Image.UniqueCameraModel'].value, 'New')
+        color_matrix1 = str_to_array(meta['Exif.Image.ColorMatrix1'].value,
+                                     matrix.shape)
+        self.assertTrue((color_matrix1==matrix).all())
+        illuminant1 = float(meta['Exif.Image.CalibrationIlluminant1'].value)
+        self.assertEqual(illuminant1, tiffutils.ILLUMINANT_D65)
+
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==self.reference).all())
+
+    def test_update_tags_not_dng(self):
+        with open(self.name, 'wb') as f:
+            f.write(b'not a tiff')
+
+        with self.assertRaises(IOError):
+            tiffutils.update_dng_tags(self.name, camera='New')
+
+class TestOpenDNG(unittest.TestCase):
+
+    def setUp(self):
+        self.image = (np.random.rand(2000, 64, 3) * 65535).astype(np.uint16)
+        fd, self.path = tempfile.mkstemp(suffix='.dng')
+        os.close(fd)
+        tiffutils.save_dng(self.image, self.path, compression=True)
+
+    def tearDown(self):
+        os.remove(self.path)
+
+    def test_metadata(self):
+        image = tiffutils.open_dng(field_dng)
+        reference = np.load(field_data)
+
+        self.assertEqual(image.shape, reference.shape)
+        self.assertEqual(image.dtype, reference.dtype)
+        self.assertEqual(image.cfa, tiffutils.CFA_GRBG)
+        self.assertEqual(len(image), reference.shape[0])
+        self.assertTrue((np.asarray(image)==reference).all())
+
+    def test_getitem(self):
+        image = tiffutils.open_dng(self.path, cache_bytes=300000)
+
+        for key in [5, -1, slice(10, 20), slice(None, None, -7), slice(20, 10),
+                    (slice(100, 50, -3), slice(4, 9)), (7, 3, 1), np.int64(9),
+                    Ellipsis, (Ellipsis, 2), (slice(None), 0)]:
+            data = image[key]
+            self.assertEqual(data.shape, self.image[key].shape)
+            self.assertTrue((data==self.image[key]).all())
+
+        self.assertRaises(IndexError, image.__getitem__, 2000)
+
+    def test_decodes_on_demand(self):
+        image = tiffutils.open_dng(self.path)
+        self.assertTrue((image[:10]==self.image[:10]).all())
+
+        # Later strips are read from the file only when first indexed
+        with open(self.path, 'r+b') as f:
+            f.truncate(os.path.getsize(self.path) // 4)
+
+        self.assertTrue((image[:10]==self.image[:10]).all())
+        self.assertRaises(IOError, image.__getitem__, slice(-10, None))
+        self.assertRaises(IOError, np.asarray, image)
+
+class TestChunked(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.frames = (np.random.rand(3, 2000, 256) * 65535).astype(np.uint16)
+        self.paths = [os.path.join(self.tempdir, 'frame%d.dng' % i) for i in range(3)]
+        for frame, path in zip(self.frames, self.paths):
+            tiffutils.save_dng(frame, path, compression=True)
+
+    def tearDown(self):
+        for name in os.listdir(self.tempdir):
+            os.remove(os.path.join(self.tempdir, name))
+        os.rmdir(self.tempdir)
+
+    def test_layout(self):
+        array = tiffutils.as_chunked(self.paths)
+
+        self.assertEqual(array.shape, self.frames.shape)
+        self.assertEqual(array.dtype, self.frames.dtype)
+        self.assertEqual(array.ndim, 3)
+        self.assertEqual(len(array), 3)
+
+        frames, rows, cols = array.chunks
+        self.assertEqual(frames, (1, 1, 1))
+        self.assertEqual(sum(rows), 2000)
+        self.assertGreater(len(rows), 1)
+        self.assertEqual(cols, (256,))
+
+    def test_getitem(self):
+        array = tiffutils.as_chunked(self.paths)
+
+        for key in [0, -1, slice(1, 3), (slice(None), slice(10, 20)),
+                    (slice(None, None, -1), 5, slice(3, 9)), (Ellipsis, 0),
+                    slice(3, 1), np.int64(2)]:
+            data = array[key]
+            self.assertEqual(data.shape, self.frames[key].shape)
+            self.assertTrue((data==self.frames[key]).all())
+
+        self.assertTrue((np.asarray(array)==self.frames).all())
+        self.assertRaises(IndexError, array.__getitem__, 3)
+
+    def test_mismatch(self):
+        tiffutils.save_dng(self.frames[0][:1000], self.paths[2])
+        array = tiffutils.as_chunked(self.paths)
+
+        self.assertTrue((array[1]==self.frames[1]).all())
+        self.assertRaises(ValueError, array.__getitem__, 2)
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, tiffutils.as_chunked, [])
+        self.assertRaises(TypeError, tiffutils.as_chunked, [1])
+
+class TestCache(unittest.TestCase):
+
+    def setUp(self):
+        self.image = (np.random.rand(32, 48) * 65535).astype(np.uint16)
+        fd, self.path = tempfile.mkstemp(suffix='.dng')
+        os.close(fd)
+        tiffutils.save_dng(self.image, self.path)
+
+    def tearDown(self):
+        tiffutils.cache(0)
+        os.remove(self.path)
+
+    def test_disabled(self):
+        self.assertEqual(tiffutils.cache()['max_bytes'], 0)
+
+        first, cfa = tiffutils.load_dng(self.path)
+        second, cfa = tiffutils.load_dng(self.path)
+        self.assertTrue(first.flags.writeable)
+        self.assertFalse(np.shares_memory(first, second))
+
+    def test_hit(self):
+        tiffutils.cache(1 << 20)
+        hits = tiffutils.cache()['hits']
+
+        first, cfa = tiffutils.load_dng(self.path)
+        second, cfa = tiffutils.load_dng(self.path)
+        self.assertTrue((second==self.image).all())
+        self.assertEqual(cfa, tiffutils.CFA_RGGB)
+        self.assertTrue(np.shares_memory(first, second))
+        self.assertFalse(second.flags.writeable)
+
+        stats = tiffutils.cache()
+        self.assertEqual(stats['hits'], hits + 1)
+        self.assertEqual(stats['frames'], 1)
+        self.assertEqual(stats['bytes'], self.image.nbytes)
+
+    def test_modified(self):
+        tiffutils.cache(1 << 20)
+        first, cfa = tiffutils.load_dng(self.path)
+
+        tiffutils.save_dng(self.image + 1, self.path)
+        os.utime(self.path, ns=(0, 12345))
+        second, cfa = tiffutils.load_dng(self.path)
+        self.assertTrue((second==self.image + 1).all())
+
+    def test_budget(self):
+        tiffutils.cache(self.image.nbytes)
+        tiffutils.load_dng(self.path)
+        tiffutils.load_dng(field_dng)
+
+        # The larger frame does not fit, and is not cached
+        self.assertEqual(tiffutils.cache()['frames'], 1)
+
+        tiffutils.cache(self.image.nbytes - 1)
+        self.assertEqual(tiffutils.cache()['frames'], 0)
+
+class TestPyramid(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.name = os.path.join(self.tempdir, 'pyramid.dng')
+        self.reference = np.load(field_data)
+
+    def tearDown(self):
+        if os.path.exists(self.name):
+            os.remove(self.name)
+        os.rmdir(self.tempdir)
+
+    def binned(self):
+        # Default RGGB pattern
+        r = self.reference.astype(np.float64)
+        return np.dstack([r[0::2,0::2],
+                          (r[0::2,1::2] + r[1::2,0::2]) / 2,
+                          r[1::2,1::2]])
+
+    def test_levels(self):
+        tiffutils.save_dng(self.reference, self.name, pyramid_levels=2)
+
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==self.reference).all())
+
+        level1, cfa = tiffutils.load_dng(self.name, level=1)
+        self.assertEqual(cfa, None)
+        self.assertEqual(level1.dtype, np.uint16)
+        self.assertTrue((level1==np.round(self.binned())).all())
+
+        level2, cfa = tiffutils.load_dng(self.name, level=2)
+        b = self.binned()
+        b = (b[0::2,0::2] + b[1::2,0::2] + b[0::2,1::2] + b[1::2,1::2]) / 4
+        self.assertTrue((level2==np.round(b)).all())
+
+    def test_levels_separate(self):
+        rgb = np.round(self.binned()).astype(np.uint16)
+        tiffutils.save_dng(rgb, self.name, pyramid_levels=2)
+        expected = [tiffutils.load_dng(self.name, level=n)[0] for n in (1, 2)]
+
+        tiffutils.save_dng(rgb, self.name, pyramid_levels=2,
+                           planar_config=tiffutils.PLANARCONFIG_SEPARATE)
+        for n in (1, 2):
+            level, cfa = tiffutils.load_dng(self.name, level=n)
+            self.assertTrue((level==expected[n-1]).all())
+
+    def test_levels_preview_compressed(self):
+        tiffutils.save_dng(self.reference, self.name, pyramid_levels=1,
+                           preview=256, compression=True)
+
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==self.reference).all())
+
+        level1, cfa = tiffutils.load_dng(self.name, level=1)
+        self.assertTrue((level1==np.round(self.binned())).all())
+
+        preview = tiffutils.load_preview(self.name)
+        self.assertLessEqual(max(preview.shape[:2]), 256)
+
+    def test_level_missing(self):
+        tiffutils.save_dng(self.reference, self.name, pyramid_levels=1)
+        self.assertRaises(ValueError, tiffutils.load_dng, self.name, level=2)
+
+    def test_too_many_levels(self):
+        self.assertRaises(ValueError, tiffutils.save_dng, self.reference,
+                          self.name, pyramid_levels=20)
+
+class TestLoadPreview(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.name = os.path.join(self.tempdir, 'load_preview.dng')
+        self.reference = np.load(field_data)
+
+    def tearDown(self):
+        if os.path.exists(self.name):
+            os.remove(self.name)
+        os.rmdir(self.tempdir)
+
+    def test_preview(self):
+        tiffutils.save_dng(self.reference, self.name, preview=256)
+        preview = tiffutils.load_preview(self.name)
+
+        self.assertEqual(preview.dtype, np.uint8)
+        self.assertEqual(preview.ndim, 3)
+        self.assertEqual(preview.shape[2], 3)
+        self.assertLessEqual(max(preview.shape[:2]), 256)
+
+    def test_max_size_larger(self):
+        tiffutils.save_dng(self.reference, self.name, preview=256)
+        small = tiffutils.load_preview(self.name)
+        preview = tiffutils.load_preview(self.name, max_size=1024)
+        self.assertEqual(preview.shape, small.shape)
+
+    def test_no_preview(self):
+        tiffutils.save_dng(self.reference, self.name)
+        self.assertRaises(ValueError, tiffutils.load_preview, self.name)
+
+class TestQuicklook(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.name = os.path.join(self.tempdir, 'quicklook.dng')
+        self.reference = np.load(field_data)
+
+    def tearDown(self):
+        if os.path.exists(self.name):
+            os.remove(self.name)
+        os.rmdir(self.tempdir)
+
+    def test_field(self):
+        image = tiffutils.quicklook(field_dng, max_size=256)
+        self.assertEqual(image.dtype, np.uint8)
+        self.assertEqual(image.shape[2], 3)
+        self.assertLessEqual(max(image.shape[:2]), 256)
+
+    def test_compressed(self):
+        tiffutils.save_dng(self.reference, self.name)
+        expected = tiffutils.quicklook(self.name)
+
+        tiffutils.save_dng(self.reference, self.name, compression=True)
+        image = tiffutils.quicklook(self.name)
+        self.assertTrue((image==expected).all())
+
+    def test_pyramid(self):
+        tiffutils.save_dng(self.reference, self.name)
+        expected = tiffutils.quicklook(self.name)
+
+        tiffutils.save_dng(self.reference, self.name, pyramid_levels=2)
+        image = tiffutils.quicklook(self.name)
+        # Binned from the level rather than the raw image
+        diff = np.abs(image.astype(int) - expected)
+        self.assertLessEqual(diff.max(), 1)
+
+    def test_separate(self):
+        r = self.reference
+        rgb = np.ascontiguousarray(np.dstack([r[0::2,1::2], r[0::2,0::2],
+                                              r[1::2,0::2]]))
+        tiffutils.save_dng(rgb, self.name)
+        expected = tiffutils.quicklook(self.name)
+
+        tiffutils.save_dng(rgb, self.name,
+                           planar_config=tiffutils.PLANARCONFIG_SEPARATE)
+        image = tiffutils.quicklook(self.name)
+        self.assertTrue((image==expected).all())
+
+    def test_max_size_bad(self):
+        self.assertRaises(ValueError, tiffutils.quicklook, field_dng, max_size=0)
+
+class TestExport(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        for name in os.listdir(self.tempdir):
+            os.remove(os.path.join(self.tempdir, name))
+        os.rmdir(self.tempdir)
+
+    def test_jpeg(self):
+        paths = tiffutils.export([field_dng], self.tempdir, size=256)
+        self.assertEqual(paths, [os.path.join(self.tempdir, 'field.jpg')])
+
+        with open(paths[0], 'rb') as f:
+            self.assertEqual(f.read(2), b'\xff\xd8')
+
+    def test_png(self):
+        paths = tiffutils.export([field_dng, field_dng], self.tempdir,
+                                 format='png', size=256, threads=2)
+        self.assertEqual(len(paths), 2)
+
+        with open(paths[0], 'rb') as f:
+            self.assertEqual(f.read(8), b'\x89PNG\r\n\x1a\n')
+
+    def test_missing(self):
+        missing = os.path.join(self.tempdir, 'missing.dng')
+        self.assertRaises(IOError, tiffutils.export, [field_dng, missing],
+                          self.tempdir)
+        self.assertTrue(os.path.exists(os.path.join(self.tempdir, 'field.jpg')))
+
+    def test_format_bad(self):
+        self.assertRaises(ValueError, tiffutils.export, [field_dng],
+                          self.tempdir, format='gif')
+
+class TestRecompress(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.outdir = tempfile.mkdtemp()
+        self.reference = np.load(field_data)
+        self.name = os.path.join(self.tempdir, 'raw.dng')
+        tiffutils.save_dng(self.reference, self.name, preview=64,
+                           cfa_pattern=tiffutils.CFA_GRBG)
+
+    def tearDown(self):
+        for d in (self.tempdir, self.outdir):
+            for name in os.listdir(d):
+                os.remove(os.path.join(d, name))
+            os.rmdir(d)
+
+    def test_deflate(self):
+        paths = tiffutils.recompress([self.name, field_dng], out_dir=self.outdir,
+                                     threads=2)
+        self.assertEqual(paths, [os.path.join(self.outdir, 'raw.dng'),
+                                 os.path.join(self.outdir, 'field.dng')])
+        self.assertLess(os.path.getsize(paths[0]), os.path.getsize(self.name))
+
+        for path in paths:
+            data, cfa = tiffutils.load_dng(path)
+            self.assertEqual(cfa, tiffutils.CFA_GRBG)
+            self.assertTrue((data==self.reference).all())
+
+        self.assertEqual(tiffutils.load_preview(paths[0]).shape[2], 3)
+
+    def test_in_place(self):
+        size = os.path.getsize(self.name)
+        tiffutils.recompress([self.name])
+        tiffutils.recompress([self.name], compression='none', rate_limit=1 << 30)
+
+        self.assertEqual(os.path.getsize(self.name), size)
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==self.reference).all())
+        self.assertEqual(os.listdir(self.tempdir), ['raw.dng'])
+
+    def test_nested_ifds(self):
+        """Pointers into the input are remapped, not copied as plain values"""
+        thumbnail = b'\xff\xd8thumbs\xff\xd9'
+        strip = np.arange(64, dtype='<u2').tobytes()
+        # IFD0, EXIF IFD, Interoperability IFD, thumbnail, strip
+        exif, interop, thumb_at, strip_at = 170, 188, 206, 216
+
+        def entry(tag, type, count, value):
+            fmt = '<HHI' + ('HH' if type == 3 else '4s' if type in (1, 2) else 'I')
+            args = (value, 0) if type == 3 else (value,)
+            return struct.pack(fmt, tag, type, count, *args)
+
+        ifd0 = [entry(256, 3, 1, 8), entry(257, 3, 1, 8), entry(258, 3, 1, 16),
+                entry(259, 3, 1, 1), entry(262, 3, 1, 1), entry(273, 4, 1, strip_at),
+                entry(277, 3, 1, 1), entry(278, 3, 1, 8), entry(279, 4, 1, len(strip)),
+                entry(513, 4, 1, thumb_at), entry(514, 4, 1, len(thumbnail)),
+                entry(34665, 4, 1, exif), entry(50706, 1, 4, b'\x01\x04\x00\x00')]
+        data = (b'II' + struct.pack('<HI', 42, 8) +
+                struct.pack('<H', len(ifd0)) + b''.join(ifd0) + b'\0' * 4 +
+                struct.pack('<H', 1) + entry(40965, 4, 1, interop) + b'\0' * 4 +
+                struct.pack('<H', 1) + entry(1, 2, 4, b'R98\0') + b'\0' * 4 +
+                thumbnail + strip)
+        self.assertEqual(len(data), strip_at + len(strip))
+        with open(self.name, 'wb') as f:
+            f.write(data)
+
+        path, = tiffutils.recompress([self.name], out_dir=self.outdir)
+        with open(path, 'rb') as f:
+            out = f.read()
+
+        def tags(offset):
+            count, = struct.unpack_from('<H', out, offset)
+            return {e[0]: e for e in (struct.unpack_from('<HHI4s', out, offset + 2 + 12 * i)
+                                      for i in range(count))}
+
+        def long_value(ifd, tag):
+            return struct.unpack('<I', ifd[tag][3])[0]
+
+        ifd0 = tags(struct.unpack_from('<I', out, 4)[0])
+        thumb_at, thumb_len = long_value(ifd0, 513), long_value(ifd0, 514)
+        self.assertEqual(out[thumb_at:thumb_at + thumb_len], thumbnail)
+
+        exif = tags(long_value(ifd0, 34665))
+        interop = tags(long_value(exif, 40965))
+        self.assertEqual(interop[1][3], b'R98\0')
+
+    def test_count_bad(self):
+        with open(self.name, 'r+b') as f:
+            ifd, = struct.unpack('<I', f.read(8)[4:])
+            # Count of the first entry, NewSubfileType
+            f.seek(ifd + 6)
+            f.write(struct.pack('<I', 1 << 30))
+
+        with self.assertRaisesRegex(ValueError, 'Tag 254 has 1073741824 values'):
+            tiffutils.recompress([self.name], out_dir=self.outdir)
+
+    def test_compression_bad(self):
+        for compression in ('jxl', 'zstd'):
+            self.assertRaises(ValueError, tiffutils.recompress, [self.name],
+                              compression=compression)
+
+@unittest.skipUnless(os.path.exists(tiffutils_cli), 'tiffutils not built')
+class TestCommandLine(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.outdir = os.path.join(self.tempdir, 'out')
+        os.mkdir(self.outdir)
+        self.image = np.arange(64 * 48, dtype=np.uint16).reshape(48, 64)
+
+    def tearDown(self):
+        shutil.rmtree(self.tempdir)
+
+    def run_cli(self, *args, **kwargs):
+        return subprocess.run([tiffutils_cli] + list(args), capture_output=True,
+                              text=True, timeout=60, **kwargs)
+
+    def save_npy(self, count):
+        paths = []
+        for i in range(count):
+            paths.append(os.path.join(self.tempdir, 'image%d.npy' % i))
+            np.save(paths[-1], self.image + i)
+        return paths
+
+    def test_convert(self):
+        paths = self.save_npy(3)
+        result = self.run_cli('convert', '-j', '2', '-o', self.outdir,
+                              '--cfa', 'GRBG', '-c', *paths)
+        self.assertEqual(result.returncode, 0, result.stderr)
+
+        for i in range(3):
+            data, cfa = tiffutils.load_dng(os.path.join(self.outdir, 'image%d.dng' % i))
+            self.assertEqual(cfa, tiffutils.CFA_GRBG)
+            self.assertTrue((data==self.image + i).all())
+
+    def test_convert_stdin(self):
+        paths = self.save_npy(2)
+        result = self.run_cli('convert', input='\n'.join(paths) + '\n')
+        self.assertEqual(result.returncode, 0, result.stderr)
+
+        data, cfa = tiffutils.load_dng(os.path.join(self.tempdir, 'image1.dng'))
+        self.assertEqual(cfa, tiffutils.CFA_RGGB)
+        self.assertTrue((data==self.image + 1).all())
+
+    def test_convert_raw(self):
+        path = os.path.join(self.tempdir, 'frame.raw')
+        self.image.tofile(path)
+
+        result = self.run_cli('convert', '--size', '64x48', '--dtype', 'u16', path)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        data, cfa = tiffutils.load_dng(os.path.join(self.tempdir, 'frame.dng'))
+        self.assertTrue((data==self.image).all())
+
+        # Too short for the given size
+        result = self.run_cli('convert', '--size', '64x64', path)
+        self.assertEqual(result.returncode, 1)
+        self.assertIn('frame.raw', result.stderr)
+
+    def test_info(self):
+        missing = os.path.join(self.tempdir, 'missing.dng')
+        result = self.run_cli('info', '-j', '4', field_dng, missing, field_dng)
+        self.assertEqual(result.returncode, 1)
+        self.assertIn('missing.dng', result.stderr)
+
+        # One line per readable file, in the order given
+        line = '%s\t4016\t2688\t1\t16\tuint\tnone\tGRBG' % field_dng
+        self.assertEqual(result.stdout.splitlines(), [line, line])
+
+    def test_recompress(self):
+        name = os.path.join(self.tempdir, 'raw.dng')
+        tiffutils.save_dng(self.image, name)
+
+        result = self.run_cli('recompress', '-o', self.outdir, name)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        out = os.path.join(self.outdir, 'raw.dng')
+        self.assertLess(os.path.getsize(out), os.path.getsize(name))
+
+        result = self.run_cli('info', out)
+        self.assertEqual(result.stdout.split('\t')[6], 'deflate')
+
+        # In place, back to uncompressed
+        result = self.run_cli('recompress', '-c', 'none', out)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        data, cfa = tiffutils.load_dng(out)
+        self.assertTrue((data==self.image).all())
+        self.assertEqual(os.path.getsize(out), os.path.getsize(name))
+
+    def test_export(self):
+        result = self.run_cli('export', '-o', self.outdir, '-f', 'png', '-s', '64',
+                              field_dng)
+        self.assertEqual(result.returncode, 0, result.stderr)
+
+        with open(os.path.join(self.outdir, 'field.png'), 'rb') as f:
+            self.assertEqual(f.read(8), b'\x89PNG\r\n\x1a\n')
+
+    def test_usage(self):
+        self.assertEqual(self.run_cli().returncode, 2)
+        self.assertEqual(self.run_cli('bogus').returncode, 2)
+        self.assertEqual(self.run_cli('export', field_dng).returncode, 2)
+        self.assertEqual(self.run_cli('recompress', '-c', 'jxl', field_dng).returncode, 2)
+
+        result = self.run_cli('--help')
+        self.assertEqual(result.returncode, 0)
+        self.assertIn('usage: tiffutils', result.stdout)
+
+class TDNGImage(ctypes.Structure):
+    _fields_ = [('width', ctypes.c_uint32), ('height', ctypes.c_uint32),
+                ('samples', ctypes.c_uint16), ('bits', ctypes.c_uint16),
+                ('format', ctypes.c_uint16), ('pattern', ctypes.c_int),
+                ('data', ctypes.c_void_p)]
+
+class TDNGOptions(ctypes.Structure):
+    _fields_ = [('camera', ctypes.c_char_p), ('pattern', ctypes.c_int),
+                ('color_matrix1', ctypes.POINTER(ctypes.c_float)),
+                ('color_matrix2', ctypes.POINTER(ctypes.c_float)),
+                ('illuminant1', ctypes.c_ushort), ('illuminant2', ctypes.c_ushort),
+                ('compress', ctypes.c_int), ('preview', ctypes.c_uint32),
+                ('pyramid_levels', ctypes.c_uint32), ('bigtiff', ctypes.c_int)]
+
+# enum tdng_error and enum tdng_format of tiffutils.h
+TDNG_EIO, TDNG_EFORMAT = -1, -2
+TDNG_UINT, TDNG_FLOAT = 1, 3
+
+@unittest.skipUnless(os.path.exists(libtiffutils_so), 'libtiffutils not built')
+class TestLibrary(unittest.TestCase):
+
+    def setUp(self):
+        self.lib = ctypes.CDLL(libtiffutils_so)
+        self.lib.tdng_errmsg.restype = ctypes.c_char_p
+        self.tempdir = tempfile.mkdtemp()
+        self.path = os.path.join(self.tempdir, 'image.dng').encode()
+        self.image = np.arange(64 * 48, dtype=np.uint16).reshape(48, 64)
+
+    def tearDown(self):
+        shutil.rmtree(self.tempdir)
+
+    def tdng_image(self, array, format):
+        samples = array.shape[2] if array.ndim == 3 else 1
+        return TDNGImage(array.shape[1], array.shape[0], samples,
+                         array.dtype.itemsize * 8, format, -1,
+                         array.ctypes.data_as(ctypes.c_void_p))
+
+    def write(self, img, opts=None):
+        return self.lib.tdng_write(self.path, ctypes.byref(img),
+                                   ctypes.byref(opts) if opts else None)
+
+    def read(self):
+        img = TDNGImage()
+        self.assertEqual(self.lib.tdng_read(self.path, ctypes.byref(img)), 0)
+        try:
+            size = img.width * img.height * img.samples * img.bits // 8
+            return img, ctypes.string_at(img.data, size)
+        finally:
+            self.lib.tdng_free(ctypes.byref(img))
+            self.assertIsNone(img.data)
+
+    def test_cfa(self):
+        opts = TDNGOptions(camera=b'Test', pattern=tiffutils.CFA_GRBG,
+                           illuminant1=tiffutils.ILLUMINANT_D65, compress=1)
+        self.assertEqual(self.write(self.tdng_image(self.image, TDNG_UINT), opts), 0)
+
+        img, data = self.read()
+        self.assertEqual((img.width, img.height, img.samples, img.bits, img.format),
+                         (64, 48, 1, 16, TDNG_UINT))
+        self.assertEqual(img.pattern, tiffutils.CFA_GRBG)
+        self.assertEqual(data, self.image.tobytes())
+
+        # The Python module reads the same image
+        data, cfa = tiffutils.load_dng(self.path.decode())
+        self.assertEqual(cfa, tiffutils.CFA_GRBG)
+        self.assertTrue((data==self.image).all())
+
+    def test_linear_raw(self):
+        image = np.random.rand(16, 24, 3).astype(np.float32)
+        self.assertEqual(self.write(self.tdng_image(image, TDNG_FLOAT)), 0)
+
+        img, data = self.read()
+        self.assertEqual((img.samples, img.bits, img.format, img.pattern),
+                         (3, 32, TDNG_FLOAT, -1))
+        self.assertEqual(data, image.tobytes())
+
+    def test_info(self):
+        self.write(self.tdng_image(self.image, TDNG_UINT))
+
+        img = TDNGImage()
+        self.assertEqual(self.lib.tdng_info(self.path, ctypes.byref(img)), 0)
+        self.assertEqual((img.width, img.height, img.pattern), (64, 48, tiffutils.CFA_RGGB))
+        self.assertIsNone(img.data)
+
+    def test_read_errors(self):
+        img = TDNGImage()
+        missing = os.path.join(self.tempdir, 'missing.dng').encode()
+        self.assertEqual(self.lib.tdng_read(missing, ctypes.byref(img)), TDNG_EIO)
+        self.assertEqual(self.lib.tdng_info(missing, ctypes.byref(img)), TDNG_EIO)
+        self.assertTrue(self.lib.tdng_errmsg())
+
+    def test_write_errors(self):
+        img = self.tdng_image(self.image, TDNG_UINT)
+        cases = [
+            (TDNGOptions(pattern=4), b'Invalid CFA pattern 4'),
+            (TDNGOptions(pattern=-1), b'Invalid CFA pattern -1'),
+            (TDNGOptions(bigtiff=3), b'Unknown BigTIFF mode 3'),
+            (TDNGOptions(illuminant2=16), b'Invalid calibration illuminant'),
+        ]
+        for opts, msg in cases:
+            self.assertEqual(self.write(img, opts), TDNG_EFORMAT)
+            self.assertEqual(self.lib.tdng_errmsg(), msg)
+
+        wide = self.image.astype(np.uint32)
+        self.assertEqual(self.write(self.tdng_image(wide, TDNG_UINT)), TDNG_EFORMAT)
+        bad = self.tdng_image(self.image, 2)
+        self.assertEqual(self.write(bad), TDNG_EFORMAT)
+
+        self.path = os.path.join(self.tempdir, 'missing', 'image.dng').encode()
+        self.assertEqual(self.write(img), TDNG_EIO)
+        self.assertFalse(os.path.exists(self.path))
+
+@unittest.skipUnless(os.path.exists(tiffutils_cli), 'tiffutils not built')
+class TestWatch(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.indir = os.path.join(self.tempdir, 'in')
+        self.outdir = os.path.join(self.tempdir, 'out')
+        os.mkdir(self.indir)
+        os.mkdir(self.outdir)
+        self.log = os.path.join(self.tempdir, 'log')
+        self.image = np.arange(64 * 48, dtype=np.uint16).reshape(48, 64)
+        self.proc = None
+
+    def tearDown(self):
+        if self.proc and self.proc.poll() is None:
+            self.proc.kill()
+            self.proc.wait()
+        shutil.rmtree(self.tempdir)
+
+    def start(self, *args):
+        with open(self.log, 'a') as log:
+            self.proc = subprocess.Popen([tiffutils_cli, 'watch', '-i', self.indir,
+                                          '-o', self.outdir, '-j', '2'] + list(args),
+                                         stderr=log)
+
+    def stop(self):
+        self.proc.send_signal(signal.SIGTERM)
+        self.assertEqual(self.proc.wait(timeout=30), 0)
+
+    def wait_for(self, done, timeout=30):
+        deadline = time.monotonic() + timeout
+        while not done():
+            self.assertIsNone(self.proc.poll(), 'watch exited')
+            if time.monotonic() > deadline:
+                self.fail('timed out')
+            time.sleep(0.05)
+
+    def indexed(self):
+        try:
+            with open(os.path.join(self.outdir, 'index.tsv')) as f:
+                return [line.split('\t')[0] for line in f]
+        except FileNotFoundError:
+            return []
+
+    def logged(self):
+        with open(self.log) as f:
+            return f.read()
+
+    def test_convert(self):
+        dng = os.path.join(self.tempdir, 'capture.dng')
+        tiffutils.save_dng(self.image, dng, cfa_pattern=tiffutils.CFA_GRBG)
+        with open(dng, 'rb') as f:
+            original = f.read()
+
+        self.start()
+        np.save(os.path.join(self.indir, 'image.npy'), self.image)
+        os.rename(dng, os.path.join(self.indir, 'capture.dng'))
+        np.save(os.path.join(self.indir, '.hidden.npy'), self.image)
+        self.wait_for(lambda: len(self.indexed()) == 2)
+        self.stop()
+
+        self.assertEqual(sorted(self.indexed()), ['capture.dng', 'image.dng'])
+        self.assertEqual(sorted(os.listdir(self.outdir)),
+                         ['.tiffutils-watch', 'capture.dng', 'image.dng', 'index.tsv'])
+
+        data, cfa = tiffutils.load_dng(os.path.join(self.outdir, 'image.dng'))
+        self.assertTrue((data==self.image).all())
+
+        # DNGs are copied as they are without -c
+        with open(os.path.join(self.outdir, 'capture.dng'), 'rb') as f:
+            self.assertEqual(f.read(), original)
+
+    def test_restart(self):
+        np.save(os.path.join(self.indir, 'first.npy'), self.image)
+
+        # Files already there are picked up
+        self.start('-c')
+        self.wait_for(lambda: self.indexed() == ['first.dng'])
+        self.stop()
+
+        # Only the file that arrived while stopped is converted
+        np.save(os.path.join(self.indir, 'second.npy'), self.image + 1)
+        self.start('-c')
+        self.wait_for(lambda: len(self.indexed()) == 2)
+        self.stop()
+
+        self.assertEqual(self.indexed(), ['first.dng', 'second.dng'])
+        data, cfa = tiffutils.load_dng(os.path.join(self.outdir, 'second.dng'))
+        self.assertTrue((data==self.image + 1).all())
+
+    def test_retry(self):
+        path = os.path.join(self.indir, 'image.npy')
+        self.start()
+
+        with open(path, 'wb') as f:
+            f.write(b'\x93NUMPY')
+        self.wait_for(lambda: 'image.npy' in self.logged())
+        self.assertEqual(self.indexed(), [])
+
+        # Completed again, the file that failed is retried
+        np.save(path, self.image)
+        self.wait_for(lambda: self.indexed() == ['image.dng'])
+        self.stop()
+
+        data, cfa = tiffutils.load_dng(os.path.join(self.outdir, 'image.dng'))
+        self.assertTrue((data==self.image).all())
+
+class TestMultiFrame(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.name = os.path.join(self.tempdir, 'frames.dng')
+        self.frames = [(np.random.rand(32, 48) * 65535).astype(np.uint16)
+                       for i in range(5)]
+
+    def tearDown(self):
+        for name in (self.name, self.name + '.idx'):
+            if os.path.exists(name):
+                os.remove(name)
+        os.rmdir(self.tempdir)
+
+    def test_frames(self):
+        with tiffutils.MultiFrameWriter(self.name, compression=True,
+                                        cfa_pattern=tiffutils.CFA_BGGR) as writer:
+            for i, frame in enumerate(self.frames):
+                self.assertEqual(writer.write(frame), i)
+            self.assertEqual(writer.frames, len(self.frames))
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertEqual(len(reader), len(self.frames))
+            for i, frame in enumerate(self.frames):
+                data, cfa = reader[i]
+                self.assertEqual(cfa, tiffutils.CFA_BGGR)
+                self.assertTrue((data==frame).all())
+
+            data, cfa = reader[-1]
+            self.assertTrue((data==self.frames[-1]).all())
+
+            self.assertRaises(IndexError, reader.read, len(self.frames))
+
+    def test_first_frame_load_dng(self):
+        with tiffutils.MultiFrameWriter(self.name) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+
+        data, cfa = tiffutils.load_dng(self.name)
+        self.assertTrue((data==self.frames[0]).all())
+
+    def test_append(self):
+        with tiffutils.MultiFrameWriter(self.name) as writer:
+            writer.write(self.frames[0])
+
+        with tiffutils.MultiFrameWriter(self.name, append=True,
+                                        pyramid_levels=1) as writer:
+            writer.write(self.frames[1])
+
+        reader = tiffutils.MultiFrameReader(self.name)
+        self.assertEqual(len(reader), 2)
+        self.assertTrue((reader[0][0]==self.frames[0]).all())
+        self.assertTrue((reader[1][0]==self.frames[1]).all())
+        self.assertEqual(reader.read(1, level=1)[0].shape, (16, 24, 3))
+        reader.close()
+
+    def test_bigtiff(self):
+        with tiffutils.MultiFrameWriter(self.name, index=True,
+                                        bigtiff=True) as writer:
+            writer.write(self.frames[0])
+
+        with tiffutils.MultiFrameWriter(self.name, append=True,
+                                        index=True) as writer:
+            writer.write(self.frames[1])
+
+        with open(self.name, 'rb') as f:
+            self.assertEqual(f.read(4)[2], 43)
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertEqual(len(reader), 2)
+            self.assertTrue((reader[0][0]==self.frames[0]).all())
+            self.assertTrue((reader[1][0]==self.frames[1]).all())
+
+    def test_update_tags(self):
+        with tiffutils.MultiFrameWriter(self.name, index=True) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+
+        tiffutils.update_dng_tags(self.name, camera='New')
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertEqual(len(reader), len(self.frames))
+            for i, frame in enumerate(self.frames):
+                self.assertTrue((reader[i][0]==frame).all())
+
+    def test_write_closed(self):
+        writer = tiffutils.MultiFrameWriter(self.name)
+        writer.close()
+        self.assertRaises(ValueError, writer.write, self.frames[0])
+
+    def test_index(self):
+        with tiffutils.MultiFrameWriter(self.name, index=True, preview=16,
+                                        cfa_pattern=tiffutils.CFA_GRBG) as writer:
+            for i, frame in enumerate(self.frames):
+                writer.write(frame, timestamp=1000.5 + i)
+
+        self.assertTrue(os.path.exists(self.name + '.idx'))
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertFalse(reader.stale)
+            self.assertEqual(len(reader), len(self.frames))
+            for i, frame in enumerate(self.frames):
+                data, cfa = reader[i]
+                self.assertEqual(cfa, tiffutils.CFA_GRBG)
+                self.assertTrue((data==frame).all())
+                self.assertEqual(reader.timestamp(i), 1000.5 + i)
+
+    def test_stale_index(self):
+        with tiffutils.MultiFrameWriter(self.name, index=True) as writer:
+            writer.write(self.frames[0], timestamp=1000)
+
+        # Appended without updating the index
+        with tiffutils.MultiFrameWriter(self.name, append=True) as writer:
+            writer.write(self.frames[1], timestamp=2000)
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertTrue(reader.stale)
+            self.assertEqual(len(reader), 2)
+            self.assertTrue((reader[1][0]==self.frames[1]).all())
+            self.assertEqual(reader.timestamp(1), 2000)
+
+        # Appending with the index brings it up to date
+        with tiffutils.MultiFrameWriter(self.name, append=True,
+                                        index=True) as writer:
+            writer.write(self.frames[2])
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertFalse(reader.stale)
+            self.assertEqual(len(reader), 3)
+            for i in range(3):
+                self.assertTrue((reader[i][0]==self.frames[i]).all())
+
+    def test_missing_index(self):
+        with tiffutils.MultiFrameWriter(self.name, index=True,
+                                        compression=True) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+
+        os.remove(self.name + '.idx')
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertTrue(reader.stale)
+            self.assertEqual(len(reader), len(self.frames))
+            self.assertTrue((reader[3][0]==self.frames[3]).all())
+
+    def test_checkpoint(self):
+        with tiffutils.MultiFrameWriter(self.name, checkpoint=2) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+            writer.checkpoint()
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertFalse(reader.stale)
+            self.assertEqual(len(reader), len(self.frames))
+
+    def test_checkpoint_no_index(self):
+        with tiffutils.MultiFrameWriter(self.name) as writer:
+            self.assertRaises(ValueError, writer.checkpoint)
+
+    def test_recover(self):
+        with tiffutils.MultiFrameWriter(self.name, checkpoint=2) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+
+        # Lose the end of the last frame
+        size = os.path.getsize(self.name)
+        os.truncate(self.name, size - 100)
+
+        self.assertEqual(tiffutils.recover(self.name), len(self.frames) - 1)
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertFalse(reader.stale)
+            self.assertEqual(len(reader), len(self.frames) - 1)
+            for i in range(len(reader)):
+                self.assertTrue((reader[i][0]==self.frames[i]).all())
+
+        # Appending continues after the recovered frames
+        with tiffutils.MultiFrameWriter(self.name, append=True,
+                                        checkpoint=1) as writer:
+            writer.write(self.frames[-1])
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertEqual(len(reader), len(self.frames))
+            self.assertTrue((reader[-1][0]==self.frames[-1]).all())
+
+    def test_recover_without_index(self):
+        with tiffutils.MultiFrameWriter(self.name) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+
+        # Unwritten pages after the last complete frame
+        with open(self.name, 'r+b') as f:
+            f.seek(-400, os.SEEK_END)
+            f.write(b'\0' * 4096)
+
+        self.assertEqual(tiffutils.recover(self.name), len(self.frames) - 1)
+        self.assertTrue(os.path.exists(self.name + '.idx'))
+
+        with tiffutils.MultiFrameReader(self.name) as reader:
+            self.assertEqual(len(reader), len(self.frames) - 1)
+            self.assertTrue((reader[-1][0]==self.frames[-2]).all())
+
+class TestCinemaDNG(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.dir = os.path.join(self.tempdir, 'clip')
+        self.frames = [(np.random.rand(32, 48) * 65535).astype(np.uint16)
+                       for i in range(4)]
+
+    def tearDown(self):
+        if os.path.exists(self.dir):
+            for name in os.listdir(self.dir):
+                os.remove(os.path.join(self.dir, name))
+            os.rmdir(self.dir)
+        os.rmdir(self.tempdir)
+
+    def test_frames(self):
+        with tiffutils.CinemaDNGWriter(self.dir, 24) as writer:
+            for i, frame in enumerate(self.frames):
+                self.assertEqual(writer.write(frame), i)
+            self.assertEqual(writer.frames, len(self.frames))
+
+        names = sorted(os.listdir(self.dir))
+        self.assertEqual(names, ['clip_%06d.dng' % i
+                                 for i in range(len(self.frames))])
+
+        for name, frame in zip(names, self.frames):
+            data, cfa = tiffutils.load_dng(os.path.join(self.dir, name))
+            self.assertTrue((data==frame).all())
+
+    def test_compressed(self):
+        with tiffutils.CinemaDNGWriter(self.dir, 30, compression=True,
+                                       name='take', start_frame=100) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+
+        name = os.path.join(self.dir, 'take_000103.dng')
+        data, cfa = tiffutils.load_dng(name)
+        self.assertTrue((data==self.frames[3]).all())
+
+    def test_tags(self):
+        with tiffutils.CinemaDNGWriter(self.dir, 25) as writer:
+            for frame in self.frames:
+                writer.write(frame)
+
+        for i in (0, len(self.frames) - 1):
+            meta = ImageMetadata(os.path.join(self.dir, 'clip_%06d.dng' % i))
+            meta.read()
+            self.assertTrue('Exif.Image.TimeCodes' in meta)
+            self.assertEqual(float(meta['Exif.Image.FrameRate'].value), 25)
+
+    def test_write_closed(self):
+        writer = tiffutils.CinemaDNGWriter(self.dir, 24)
+        writer.close()
+        self.assertRaises(ValueError, writer.write, self.frames[0])
+
+    def test_invalid_fps(self):
+        self.assertRaises(ValueError, tiffutils.CinemaDNGWriter, self.dir, 0)
+
+class TestCaptureSession(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.frame = (np.random.rand(32, 48) * 65535).astype(np.uint16)
+
+    def tearDown(self):
+        for name in os.listdir(self.tempdir):
+            os.remove(os.path.join(self.tempdir, name))
+        os.rmdir(self.tempdir)
+
+    def path(self, i):
+        return os.path.join(self.tempdir, 'frame%d.dng' % i)
+
+    def test_capture(self):
+        with tiffutils.CaptureSession((32, 48), np.uint16, writers=2,
+                                      compression=True,
+                                      cfa_pattern=tiffutils.CFA_GBRG) as session:
+            for i in range(8):
+                buf = session.acquire()
+                self.assertEqual(buf.shape, (32, 48))
+                buf[:] = self.frame + i
+                session.submit(buf, self.path(i))
+
+        stats = session.stats
+        self.assertEqual(stats['submitted'], 8)
+        self.assertEqual(stats['written'], 8)
+        self.assertEqual(stats['dropped'], 0)
+        self.assertEqual(stats['failed'], 0)
+
+        for i in range(8):
+            data, cfa = tiffutils.load_dng(self.path(i))
+            self.assertEqual(cfa, tiffutils.CFA_GBRG)
+            self.assertTrue((data==self.frame + i).all())
+
+    def test_drop_newest(self):
+        session = tiffutils.CaptureSession((32, 48), np.uint16,
+                                           max_inflight_bytes=0,
+                                           on_full='drop_newest')
+        self.assertEqual(session.buffers, 1)
+
+        buf = session.acquire()
+        self.assertIsNone(session.acquire())
+        self.assertEqual(session.stats['dropped'], 1)
+
+        session.release(buf)
+        self.assertIsNotNone(session.acquire())
+        session.close()
+
+    def test_invalid_submit(self):
+        session = tiffutils.CaptureSession((32, 48), np.uint16)
+
+        self.assertRaises(ValueError, session.submit, self.frame, self.path(0))
+
+        buf = session.acquire()
+        session.submit(buf, self.path(0))
+        self.assertRaises(ValueError, session.submit, buf, self.path(1))
+        session.close()
+
+        self.assertRaises(ValueError, session.acquire)
+
+    def test_failed(self):
+        session = tiffutils.CaptureSession((32, 48), np.uint16)
+        buf = session.acquire()
+        session.submit(buf, os.path.join(self.tempdir, 'missing', 'frame.dng'))
+
+        self.assertRaises(IOError, session.close)
+        self.assertEqual(session.stats['failed'], 1)
+
+    def test_invalid_options(self):
+        self.assertRaises(ValueError, tiffutils.CaptureSession, (32, 48),
+                          on_full='wait')
+        self.assertRaises(ValueError, tiffutils.CaptureSession, (32, 48, 4))
+        self.assertRaises(ValueError, tiffutils.CaptureSession, (32, 48),
+                          np.int32)
+
+class TestAio(unittest.TestCase):
+
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp()
+        self.image = (np.random.rand(32, 48) * 65535).astype(np.uint16)
+
+    def tearDown(self):
+        for name in os.listdir(self.tempdir):
+            os.remove(os.path.join(self.tempdir, name))
+        os.rmdir(self.tempdir)
+
+    def path(self, i):
+        return os.path.join(self.tempdir, 'image%d.dng' % i)
+
+    def test_save_load(self):
+        import asyncio
+        import tiffutils.aio
+
+        async def roundtrip():
+            await asyncio.gather(*[
+                tiffutils.aio.save_dng(self.image + i, self.path(i),
+                                       compression=True,
+                                       cfa_pattern=tiffutils.CFA_GRBG)
+                for i in range(4)])
+            return await asyncio.gather(*[tiffutils.aio.load_dng(self.path(i))
+                                          for i in range(4)])
+
+        results = asyncio.run(roundtrip())
+        for i, (data, cfa) in enumerate(results):
+            self.assertEqual(cfa, tiffutils.CFA_GRBG)
+            self.assertTrue((data==self.image + i).all())
+
+    def test_errors(self):
+        import asyncio
+        import tiffutils.aio
+
+        async def load_missing():
+            await tiffutils.aio.load_dng(os.path.join(self.tempdir, 'missing.dng'))
+
+        async def save_invalid():
+            tiffutils.aio.save_dng(self.image.astype(np.int32), self.path(0))
+
+        self.assertRaises(IOError, asyncio.run, load_missing())
+        self.assertRaises(ValueError, asyncio.run, save_invalid())
+
+        # Requires a running loop
+        self.assertRaises(RuntimeError, tiffutils.aio.load_dng, self.path(0))
@@ -1,63 +1,34 @@
 #include <Python.h>
-#include <tiffio.h>
 
-#ifndef TIFFTAG_CFAREPEATPATTERNDIM
-#error libtiff with CFA pattern support required
-#endif
+#include "pyengine.h"
 
 #define PY_ARRAY_UNIQUE_SYMBOL  tiffutils_core_ARRAY_API
 #include <numpy/arrayobject.h>
 
-enum illuminant {
-    ILLUMINANT_UNKNOWN = 0,
-    ILLUMINANT_DAYLIGHT,
-    ILLUMINANT_FLUORESCENT,
-    ILLUMINANT_TUNGSTEN,
-    ILLUMINANT_FLASH,
-    ILLUMINANT_FINE_WEATHER = 9,
-    ILLUMINANT_CLOUDY_WEATHER,
-    ILLUMINANT_SHADE,
-    ILLUMINANT_DAYLIGHT_FLUORESCENT,
-    ILLUMINANT_DAY_WHITE_FLUORESCENT,
-    ILLUMINANT_COOL_WHITE_FLUORESCENT,
-    ILLUMINANT_WHITE_FLUORESCENT,
-    ILLUMINANT_STANDARD_A = 17,
-    ILLUMINANT_STANDARD_B,
-    ILLUMINANT_STANDARD_C,
-    ILLUMINANT_D55,
-    ILLUMINANT_D65,
-    ILLUMINANT_D75,
-    ILLUMINANT_D50,
-    ILLUMINANT_ISO_TUNGSTEN,
-};
-
-enum tiff_cfa_color {
-    CFA_RED = 0,
-    CFA_GREEN = 1,
-    CFA_BLUE = 2,
-};
-
-enum cfa_pattern {
-    CFA_BGGR = 0,
-    CFA_GBRG,
-    CFA_GRBG,
-    CFA_RGGB,
-    CFA_NUM_PATTERNS,
-};
-
-static const char cfa_patterns[4][CFA_NUM_PATTERNS] = {
-    [CFA_BGGR] = {CFA_BLUE, CFA_GREEN, CFA_GREEN, CFA_RED},
-    [CFA_GBRG] = {CFA_GREEN, CFA_BLUE, CFA_RED, CFA_GREEN},
-    [CFA_GRBG] = {CFA_GREEN, CFA_RED, CFA_BLUE, CFA_GREEN},
-    [CFA_RGGB] = {CFA_RED, CFA_GREEN, CFA_GREEN, CFA_BLUE},
-};
-
-/* Default ColorMatrix1, when none provided */
-static const float default_color_matrix1[] = {
-     2.005, -0.771, -0.269,
-    -0.752,  1.688,  0.064,
-    -0.149,  0.283,  0.745
-};
+/*
+ * Raise the exception for an engine error
+ *
+ * @param err   Negative enum dng_error value
+ * @returns NULL, for convenience
+ */
+static PyObject *raise_dng_error(int err) {
+    PyObject *type;
+
+    switch (err) {
+    case DNG_ENOMEM:
+        type = PyExc_MemoryError;
+        break;
+    case DNG_EFORMAT:
+        type = PyExc_ValueError;
+        break;
+    default:
+        type = PyExc_IOError;
+        break;
+    }
+
+    PyErr_SetString(type, dng_errmsg);
+    return NULL;
+}
 
 /*
  * Create flat float array from PyArray
@@ -162,164 +133,332 @@ static int handle_color_matrix1(PyObject *array, float **color_matrix1, int *len
     return PyArray_to_float_array(array, color_matrix1, len);
 }
 
-static PyObject *tiffutils_save_dng(PyObject *self, PyObject *args, PyObject *kwds) {
-    static char *kwlist[] = {
-        "image", "filename", "camera", "cfa_pattern", "color_matrix1",
-        "color_matrix2", "calibration_illuminant1", "calibration_illuminant2",
-        "compression", NULL
-    };
+/*
+ * Validate DNG options and convert their color matrices
+ *
+ * @param color_matrix1 ColorMatrix1 ndarray, or Py_None for the default
+ * @param color_matrix2 ColorMatrix2 ndarray, or Py_None to omit
+ * @param opts          Options, with color matrices allocated here, to be
+ *                      freed with free_dng_options()
+ * @returns 0 on success, negative on error, with exception set
+ */
+static int handle_dng_options(PyObject *color_matrix1, PyObject *color_matrix2,
+                              struct dng_options *opts) {
+    if (opts->pattern >= CFA_NUM_PATTERNS) {
+        PyErr_SetString(PyExc_ValueError, "Invalid CFA pattern");
+        return -1;
+    }
 
-    PyArrayObject *array;
-    PyObject *color_matrix1_ndarray = Py_None;
-    PyObject *color_matrix2_ndarray = Py_None;
-    unsigned short calibration_illuminant1 = 0;
-    unsigned short calibration_illuminant2 = 0;
-    unsigned int pattern = CFA_RGGB;
-    float *color_matrix1, *color_matrix2 = NULL;
-    unsigned int compression = 0;
-    int color_matrix1_len, color_matrix2_len;
-    int ndims, width, height, type, bytes_per_pixel;
-    npy_intp *dims;
-    char *filename;
-    char *camera = "Unknown";
-    char *mem;
-    TIFF *file = NULL;
+    if (handle_color_matrix1(color_matrix1, &opts->color_matrix1,
+                             &opts->color_matrix1_len)) {
+        return -1;
+    }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|sIOOHHI", kwlist, &array,
-                                     &filename, &camera, &pattern,
-                                     &color_matrix1_ndarray,
-                                     &color_matrix2_ndarray,
-                                     &calibration_illuminant1,
-                                     &calibration_illuminant2,
-                                     &compression)) {
-        return NULL;
+    if ((color_matrix2 != Py_None) &&
+        PyArray_to_float_array(color_matrix2, &opts->color_matrix2,
+                               &opts->color_matrix2_len)) {
+        free(opts->color_matrix1);
+        opts->color_matrix1 = NULL;
+        return -1;
     }
 
-    if (pattern >= CFA_NUM_PATTERNS) {
-        PyErr_SetString(PyExc_ValueError, "Invalid CFA pattern");
-        return NULL;
+    return 0;
+}
+
+static void free_dng_options(struct dng_options *opts) {
+    free(opts->color_matrix1);
+    free(opts->color_matrix2);
+    opts->color_matrix1 = NULL;
+    opts->color_matrix2 = NULL;
+}
+
+/*
+ * Determine the layout of an image to save
+ *
+ * @param array             2D CFA or (height, width, 3) LinearRaw image
+ * @param bits_per_sample   Bits per sample to store, or 0 for the dtype size
+ * @param layout            Layout with planar configuration set, completed
+ *                          here
+ * @returns 0 on success, negative on error, with exception set
+ */
+static int PyArray_to_layout(PyArrayObject *array, unsigned short bits_per_sample,
+                             struct strip_layout *layout) {
+    int ndims, type;
+    npy_intp *dims;
+
+    if (layout->planar != PLANARCONFIG_CONTIG &&
+        layout->planar != PLANARCONFIG_SEPARATE) {
+        PyErr_SetString(PyExc_ValueError, "Invalid planar configuration");
+        return -1;
     }
 
     if (!PyArray_Check(array)) {
         PyErr_SetString(PyExc_TypeError, "ndarray required");
-        return NULL;
+        return -1;
     }
 
     if (!PyArray_ISCONTIGUOUS(array)) {
         PyErr_SetString(PyExc_ValueError, "ndarray must be contiguous");
-        return NULL;
+        return -1;
     }
 
     ndims = PyArray_NDIM(array);
     dims = PyArray_DIMS(array);
     type = PyArray_TYPE(array);
-    mem = PyArray_BYTES(array);
 
-    if (ndims != 2) {
-        PyErr_SetString(PyExc_ValueError, "ndarray must be 2 dimensional");
-        return NULL;
+    layout->samples = 1;
+    layout->sampleformat = SAMPLEFORMAT_UINT;
+
+    /* 2D CFA, or 3D LinearRaw with 3 color samples per pixel */
+    if (ndims == 3 && dims[2] == 3) {
+        layout->samples = 3;
+    }
+    else if (ndims == 3) {
+        PyErr_SetString(PyExc_ValueError, "3 dimensional ndarray must have 3 samples per pixel");
+        return -1;
+    }
+    else if (ndims != 2) {
+        PyErr_SetString(PyExc_ValueError, "ndarray must be 2 or 3 dimensional");
+        return -1;
+    }
+
+    if (dims[0] > UINT32_MAX || dims[1] > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "ndarray dimensions must fit in 32 bits");
+        return -1;
     }
 
-    height = dims[0];
-    width = dims[1];
+    layout->height = dims[0];
+    layout->width = dims[1];
 
     switch (type) {
     case NPY_UINT8:
-        bytes_per_pixel = 1;
+        layout->bits = 8;
         break;
     case NPY_UINT16:
-        bytes_per_pixel = 2;
+        layout->bits = 16;
+        break;
+    case NPY_HALF:
+        layout->bits = 16;
+        layout->sampleformat = SAMPLEFORMAT_IEEEFP;
+        break;
+    case NPY_FLOAT32:
+        layout->bits = 32;
+        layout->sampleformat = SAMPLEFORMAT_IEEEFP;
         break;
     default:
-        PyErr_SetString(PyExc_ValueError, "ndarray must be uint8 or uint16");
-        return NULL;
+        PyErr_SetString(PyExc_ValueError,
+                        "ndarray must be uint8, uint16, float16 or float32");
+        return -1;
     }
 
-    if (handle_color_matrix1(color_matrix1_ndarray, &color_matrix1,
-                             &color_matrix1_len)) {
-        return NULL;
+    /* float32 may be stored as DNG 24-bit floating point */
+    if (bits_per_sample && bits_per_sample != layout->bits) {
+        if (type != NPY_FLOAT32 || bits_per_sample != 24) {
+            PyErr_SetString(PyExc_ValueError,
+                            "bits_per_sample must match dtype, or be 24 for float32");
+            return -1;
+        }
+        layout->bits = 24;
     }
 
-    if ((color_matrix2_ndarray != Py_None) &&
-        PyArray_to_float_array(color_matrix2_ndarray, &color_matrix2,
-                               &color_matrix2_len)) {
-        goto err;
+    return 0;
+}
+
+/*
+ * Whether an image is a numpy.memmap sharing its file, whose pages may be
+ * dropped once encoded
+ *
+ * Copy-on-write maps are not, as dropping their pages would lose changes.
+ *
+ * @returns 1 if so, 0 if not, negative on error, with exception set
+ */
+static int PyArray_is_shared_memmap(PyArrayObject *array) {
+    PyObject *numpy, *memmap, *mode;
+    int shared;
+
+    numpy = PyImport_ImportModule("numpy");
+    if (!numpy) {
+        return -1;
+    }
+    memmap = PyObject_GetAttrString(numpy, "memmap");
+    Py_DECREF(numpy);
+    if (!memmap) {
+        return -1;
     }
 
-    file = TIFFOpen(filename, "w");
-    if (file == NULL) {
-        PyErr_SetString(PyExc_IOError, "libtiff failed to open file for writing.");
-        goto err;
+    shared = PyObject_IsInstance((PyObject *) array, memmap);
+    Py_DECREF(memmap);
+    if (shared <= 0) {
+        return shared;
     }
 
-    TIFFSetField(file, TIFFTAG_IMAGEWIDTH, width);
-    TIFFSetField(file, TIFFTAG_IMAGELENGTH, height);
-    TIFFSetField(file, TIFFTAG_UNIQUECAMERAMODEL, camera);
+    mode = PyObject_GetAttrString((PyObject *) array, "mode");
+    if (!mode) {
+        return -1;
+    }
+    shared = !PyUnicode_Check(mode) || PyUnicode_CompareWithASCIIString(mode, "c");
+    Py_DECREF(mode);
 
-    TIFFSetField(file, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    TIFFSetField(file, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(file, TIFFTAG_SUBFILETYPE, 0);
+    return shared;
+}
 
-    TIFFSetField(file, TIFFTAG_BITSPERSAMPLE, 8*bytes_per_pixel);
-    TIFFSetField(file, TIFFTAG_SAMPLESPERPIXEL, 1);
-    TIFFSetField(file, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
+/*
+ * Convert a bigtiff argument, True, False or "auto", for
+ * PyArg_ParseTupleAndKeywords()
+ *
+ * @param obj   Argument
+ * @param addr  enum bigtiff_mode to store the mode to
+ * @returns 1 on success, 0 with exception set on error
+ */
+static int bigtiff_converter(PyObject *obj, void *addr) {
+    enum bigtiff_mode *mode = addr;
+    int yes;
 
-    /* Deflate compression requires DNG 1.4 */
-    if (compression) {
-        TIFFSetField(file, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
-        TIFFSetField(file, TIFFTAG_DNGVERSION, "\001\004\0\0");
-        TIFFSetField(file, TIFFTAG_DNGBACKWARDVERSION, "\001\004\0\0");
+    if (PyUnicode_Check(obj)) {
+        if (PyUnicode_CompareWithASCIIString(obj, "auto")) {
+            PyErr_SetString(PyExc_ValueError, "bigtiff must be True, False or 'auto'");
+            return 0;
+        }
+        *mode = BIGTIFF_AUTO;
+        return 1;
     }
-    else {
-        TIFFSetField(file, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-        TIFFSetField(file, TIFFTAG_DNGVERSION, "\001\001\0\0");
-        TIFFSetField(file, TIFFTAG_DNGBACKWARDVERSION, "\001\0\0\0");
+
+    yes = PyObject_IsTrue(obj);
+    if (yes < 0) {
+        return 0;
     }
+    *mode = yes ? BIGTIFF_ALWAYS : BIGTIFF_NEVER;
+
+    return 1;
+}
+
+static PyObject *tiffutils_save_dng(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "image", "filename", "camera", "cfa_pattern", "color_matrix1",
+        "color_matrix2", "calibration_illuminant1", "calibration_illuminant2",
+        "compression", "bits_per_sample", "planar_config", "preview",
+        "pyramid_levels", "bigtiff", NULL
+    };
+
+    PyArrayObject *array;
+    PyObject *color_matrix1_ndarray = Py_None;
+    PyObject *color_matrix2_ndarray = Py_None;
+    struct dng_options opts = {
+        .camera = "Unknown",
+        .pattern = CFA_RGGB,
+    };
+    struct strip_layout layout = {
+        .planar = PLANARCONFIG_CONTIG,
+    };
+    unsigned int compression = 0;
+    unsigned short bits_per_sample = 0;
+    enum bigtiff_mode bigtiff = BIGTIFF_AUTO;
+    int err;
+    char *filename;
+    TIFF *file = NULL;
 
-    TIFFSetField(file, TIFFTAG_CFAREPEATPATTERNDIM, (short[]){2,2});
-    TIFFSetField(file, TIFFTAG_CFAPATTERN, cfa_patterns[pattern]);
-    TIFFSetField(file, TIFFTAG_COLORMATRIX1, color_matrix1_len, color_matrix1);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|sIOOHHIHHIIO&", kwlist, &array,
+                                     &filename, &opts.camera, &opts.pattern,
+                                     &color_matrix1_ndarray,
+                                     &color_matrix2_ndarray,
+                                     &opts.calibration_illuminant1,
+                                     &opts.calibration_illuminant2,
+                                     &compression, &bits_per_sample,
+                                     &layout.planar, &opts.preview,
+                                     &opts.pyramid_levels, bigtiff_converter,
+                                     &bigtiff)) {
+        return NULL;
+    }
 
-    if (color_matrix2) {
-        TIFFSetField(file, TIFFTAG_COLORMATRIX2, color_matrix2_len, color_matrix2);
+    if (PyArray_to_layout(array, bits_per_sample, &layout)) {
+        return NULL;
     }
 
-    if (calibration_illuminant1) {
-        TIFFSetField(file, TIFFTAG_CALIBRATIONILLUMINANT1, calibration_illuminant1);
+    layout.streamed = PyArray_is_shared_memmap(array);
+    if (layout.streamed < 0) {
+        return NULL;
     }
 
-    if (calibration_illuminant2) {
-        TIFFSetField(file, TIFFTAG_CALIBRATIONILLUMINANT2, calibration_illuminant2);
+    opts.compression = compression;
+
+    if (handle_dng_options(color_matrix1_ndarray, color_matrix2_ndarray, &opts)) {
+        return NULL;
     }
 
-    for (int row = 0; row < height; row++) {
-        if (TIFFWriteScanline(file, mem, row, 0) < 0) {
-            TIFFClose(file);
-            PyErr_SetString(PyExc_IOError, "libtiff failed to write row.");
-            goto err;
-        }
-        else {
-            mem += width * bytes_per_pixel;
-        }
+    file = TIFFOpen(filename, dng_open_mode(bigtiff, &opts, &layout));
+    if (file == NULL) {
+        PyErr_SetString(PyExc_IOError, "libtiff failed to open file for writing.");
+        goto err;
     }
 
-    TIFFWriteDirectory(file);
+    Py_BEGIN_ALLOW_THREADS
+    err = write_dng(file, &opts, &layout, PyArray_BYTES(array), NULL);
     TIFFClose(file);
+    Py_END_ALLOW_THREADS
 
-    if (color_matrix2) {
-        free(color_matrix2);
+    if (err) {
+        raise_dng_error(err);
+        goto err;
     }
 
-    free(color_matrix1);
+    free_dng_options(&opts);
 
     Py_INCREF(Py_None);
     return Py_None;
 
 err:
-    if (color_matrix2) {
-        free(color_matrix2);
+    free_dng_options(&opts);
+    return NULL;
+}
+
+static PyObject *tiffutils_update_dng_tags(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filename", "camera", "color_matrix1", "color_matrix2",
+        "calibration_illuminant1", "calibration_illuminant2", NULL
+    };
+
+    PyObject *color_matrix1 = Py_None;
+    PyObject *color_matrix2 = Py_None;
+    struct dng_options opts = {0};
+    char *filename;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|zOOHH", kwlist, &filename,
+                                     &opts.camera, &color_matrix1,
+                                     &color_matrix2,
+                                     &opts.calibration_illuminant1,
+                                     &opts.calibration_illuminant2)) {
+        return NULL;
+    }
+
+    if (color_matrix1 != Py_None &&
+        PyArray_to_float_array(color_matrix1, &opts.color_matrix1,
+                               &opts.color_matrix1_len)) {
+        goto err;
+    }
+
+    if (color_matrix2 != Py_None &&
+        PyArray_to_float_array(color_matrix2, &opts.color_matrix2,
+                               &opts.color_matrix2_len)) {
+        goto err;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = update_dng_tags(filename, &opts);
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        raise_dng_error(err);
+        goto err;
     }
-    free(color_matrix1);
+
+    free_dng_options(&opts);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+err:
+    free_dng_options(&opts);
     return NULL;
 }
 
@@ -330,180 +469,3993 @@ err:
  * @returns PyObject of CFA type (one of the CFA constants),
  *          or None, if unknown.  NULL if exception raised.
  */
+static PyObject *cfa_object(int pattern) {
+    if (pattern < 0) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    return PyLong_FromLong(pattern);
+}
+
 static PyObject *tiff_cfa(TIFF *tiff) {
-    uint16_t *cfarepeatpatterndim[2];
-    uint8_t *cfapattern[4];
-    short x, y;
+    return cfa_object(read_cfa_pattern(tiff));
+}
 
-    if (!TIFFGetField(tiff, TIFFTAG_CFAREPEATPATTERNDIM, &cfarepeatpatterndim)) {
-        goto none;
-    }
+/*
+ * Array type to decode an image into
+ *
+ * Multi-sample images are returned interleaved, and 24-bit floats are
+ * widened to float32.
+ *
+ * @param l     Layout of the image
+ * @param dims  Dimensions of the array returned here
+ * @returns number of dimensions
+ */
+static int layout_dims(const struct strip_layout *l, npy_intp *dims) {
+    dims[0] = l->height;
+    dims[1] = l->width;
+    dims[2] = l->samples;
 
-    x = (*cfarepeatpatterndim)[0];
-    y = (*cfarepeatpatterndim)[1];
+    return l->samples > 1 ? 3 : 2;
+}
 
-    /* Only support 2x2 CFA patterns */
-    if (x != 2 || y != 2) {
-        goto none;
+static int layout_type(const struct strip_layout *l) {
+    if (l->sampleformat == SAMPLEFORMAT_IEEEFP) {
+        return l->bits == 16 ? NPY_HALF : NPY_FLOAT32;
     }
 
-    if (!TIFFGetField(tiff, TIFFTAG_CFAPATTERN, &cfapattern)) {
-        goto none;
-    }
+    return l->bits == 8 ? NPY_UINT8 : NPY_UINT16;
+}
 
-    /* Look for matching known pattern */
-    for (int i = 0; i < CFA_NUM_PATTERNS; i++) {
-        for (int j = 0; j < 4; j++) {
-            if ((*cfapattern)[j] != cfa_patterns[i][j]) {
-                break;
-            }
-            /* Found a match */
-            else if (j == 3) {
-                return PyLong_FromLong(i);
-            }
-        }
+/*
+ * Allocate an array to decode an image into
+ *
+ * @param l  Layout of the image
+ * @returns new array, or NULL with exception set
+ */
+static PyObject *layout_array(const struct strip_layout *l) {
+    PyArray_Descr *descr;
+    npy_intp dims[3];
+    int ndims = layout_dims(l, dims);
+
+    descr = PyArray_DescrFromType(layout_type(l));
+    if (!descr) {
+        return NULL;
     }
 
-none:
-    Py_INCREF(Py_None);
-    return Py_None;
+    return PyArray_NewFromDescr(&PyArray_Type, descr, ndims, dims,
+                                NULL, NULL, 0, NULL);
 }
 
-static PyObject *tiffutils_load_dng(PyObject *self, PyObject *args, PyObject *kwds) {
-    static char *kwlist[] = {
-        "filename", NULL
-    };
+static void free_capsule_data(PyObject *capsule) {
+    free(PyCapsule_GetPointer(capsule, NULL));
+}
 
-    char *filename;
-    TIFF *tiff = NULL;
-    uint32_t imagelength;
-    tsize_t scanlinesize;
-    uint16_t planarconfig, samplesperpixel, bitspersample;
-    PyObject *cfa = NULL;
-    int type;
-    npy_intp dims[2];
-    PyObject *array;
+/*
+ * Array over an image in memory owned by another object
+ *
+ * @param l     Layout of the image
+ * @param data  Image in memory representation
+ * @param base  Owner of data, stolen
+ * @returns new array, or NULL with exception set
+ */
+static PyObject *layout_view(const struct strip_layout *l, void *data, PyObject *base) {
     PyArray_Descr *descr;
-    void *data;
+    PyObject *array;
+    npy_intp dims[3];
+    int ndims = layout_dims(l, dims);
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &filename)) {
-        return NULL;
+    descr = PyArray_DescrFromType(layout_type(l));
+    if (!descr) {
+        goto err_decref_base;
     }
 
-    /* Surpress warnings */
-    TIFFSetWarningHandler(NULL);
+    array = PyArray_NewFromDescr(&PyArray_Type, descr, ndims, dims,
+                                 NULL, data, NPY_ARRAY_CARRAY, NULL);
+    if (!array) {
+        goto err_decref_base;
+    }
 
-    tiff = TIFFOpen(filename, "r");
-    if (!tiff) {
-        PyErr_SetString(PyExc_IOError, "Failed to open file");
+    /* Steals base, even on failure */
+    if (PyArray_SetBaseObject((PyArrayObject *) array, base)) {
+        Py_DECREF(array);
         return NULL;
     }
 
-    scanlinesize = TIFFScanlineSize(tiff);
+    return array;
 
-    if (!TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &imagelength)) {
-        PyErr_SetString(PyExc_IOError, "Image length not found");
-        goto err;
-    }
+err_decref_base:
+    Py_DECREF(base);
+    return NULL;
+}
+
+/*
+ * Wrap an image decoded into malloc()ed memory
+ *
+ * @param l     Layout of the image
+ * @param data  Decoded image, owned by the array returned, or freed on
+ *              error
+ * @returns new array, or NULL with exception set
+ */
+static PyObject *layout_wrap(const struct strip_layout *l, void *data) {
+    PyObject *capsule = PyCapsule_New(data, NULL, free_capsule_data);
 
-    if (!TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &planarconfig)) {
-        /* Contiguous is default */
-        planarconfig = PLANARCONFIG_CONTIG;
+    if (!capsule) {
+        free(data);
+        return NULL;
     }
 
-    if (!TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel)) {
-        /* 1 is default */
-        samplesperpixel = 1;
+    return layout_view(l, data, capsule);
+}
+
+struct shm_mapping {
+    void *addr;
+    size_t size;
+};
+
+static void unmap_capsule(PyObject *capsule) {
+    struct shm_mapping *map = PyCapsule_GetPointer(capsule, NULL);
+
+    munmap(map->addr, map->size);
+    free(map);
+}
+
+/*
+ * Map a shared memory block to decode an image into
+ *
+ * The block is created if it does not exist, and grown if it is too small
+ * for the image.  Names are as for multiprocessing.shared_memory, with or
+ * without the leading slash.
+ *
+ * @param l     Layout of the image
+ * @param name  Name of the block
+ * @returns new array over the block, or NULL with exception set
+ */
+static PyObject *shm_array(const struct strip_layout *l, const char *name) {
+    struct shm_mapping *map;
+    PyObject *capsule;
+    char path[256];
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+
+    map = malloc(sizeof(*map));
+    if (!map) {
+        return PyErr_NoMemory();
     }
+    map->size = layout_mem_rowbytes(l) * l->height;
 
-    if (!TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &bitspersample)) {
-        /* 1 is default */
-        bitspersample = 1;
+    fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        goto err_free_map;
     }
 
-    if (planarconfig != PLANARCONFIG_CONTIG) {
-        PyErr_SetString(PyExc_ValueError, "Only contiguous planar configuration supported");
-        goto err;
+    if (fstat(fd, &st) || ((size_t) st.st_size < map->size && ftruncate(fd, map->size))) {
+        goto err_close;
     }
 
-    if (samplesperpixel != 1) {
-        PyErr_SetString(PyExc_ValueError, "Only 1 sample per pixel supported");
-        goto err;
+    map->addr = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map->addr == MAP_FAILED) {
+        goto err_close;
     }
+    close(fd);
 
-    /* Detect CFA pattern */
-    cfa = tiff_cfa(tiff);
-    if (!cfa) {
-        goto err;
+    capsule = PyCapsule_New(map, NULL, unmap_capsule);
+    if (!capsule) {
+        munmap(map->addr, map->size);
+        free(map);
+        return NULL;
     }
 
-    /* Create array */
+    return layout_view(l, map->addr, capsule);
 
-    switch (bitspersample) {
-    case 8:
-        type = NPY_UINT8;
-        break;
-    case 16:
-        type = NPY_UINT16;
-        break;
-    default:
-        PyErr_Format(PyExc_ValueError, "Unsupported bit depth %hu", bitspersample);
-        goto err_decref_cfa;
-    }
+err_close:
+    close(fd);
+err_free_map:
+    free(map);
+    return PyErr_SetFromErrnoWithFilename(PyExc_OSError, name);
+}
 
-    descr = PyArray_DescrFromType(type);
-    if (!descr) {
-        goto err_decref_cfa;
+/*
+ * Load the raw image, or a pyramid level, of the current top-level IFD
+ *
+ * @param tiff      File positioned at IFD0, or at the first IFD of a frame
+ * @param level     Pyramid level, or 0 for the raw image
+ * @param shm_name  Shared memory block to decode into, or NULL
+ * @returns (image, cfa) tuple, or NULL with exception set
+ */
+static PyObject *load_directory(TIFF *tiff, unsigned int level, const char *shm_name) {
+    struct strip_layout layout;
+    PyObject *cfa = NULL;
+    PyObject *array;
+    int err;
+
+    err = level ? select_level_directory(tiff, level) : select_raw_directory(tiff);
+    if (!err) {
+        err = read_layout(tiff, &layout);
+    }
+    if (err) {
+        return raise_dng_error(err);
     }
 
-    dims[0] = imagelength;
-    dims[1] = scanlinesize / (bitspersample/8);
+    /* Detect CFA pattern */
+    cfa = tiff_cfa(tiff);
+    if (!cfa) {
+        return NULL;
+    }
 
-    Py_INCREF(descr);
-    array = PyArray_NewFromDescr(&PyArray_Type, descr, 2, dims,
-                                 NULL, NULL, 0, NULL);
+    array = shm_name ? shm_array(&layout, shm_name) : layout_array(&layout);
     if (!array) {
         goto err_decref_cfa;
     }
 
-    data = PyArray_DATA(array);
+    Py_BEGIN_ALLOW_THREADS
+    err = read_strips(tiff, &layout, PyArray_DATA((PyArrayObject *) array));
+    Py_END_ALLOW_THREADS
 
-    for (size_t row = 0; row < imagelength; row++) {
-        if (TIFFReadScanline(tiff, data, row, 0) < 0) {
-            PyErr_SetString(PyExc_IOError, "libtiff failed to read row");
-            goto err_decref_array;
-        }
-
-        data += scanlinesize;
+    if (err) {
+        raise_dng_error(err);
+        goto err_decref_array;
     }
 
-    TIFFClose(tiff);
-
     return Py_BuildValue("(NN)", array, cfa);
 
 err_decref_array:
     Py_DECREF(array);
 err_decref_cfa:
     Py_DECREF(cfa);
+    return NULL;
+}
+
+/*
+ * DLPack, as in dlpack.h version 0.8, which is header-only and not
+ * needed to build
+ */
+enum {
+    DLPACK_CPU = 1,
+};
+
+enum {
+    DLPACK_UINT = 1,
+    DLPACK_FLOAT = 2,
+};
+
+struct dlpack_device {
+    int32_t device_type;
+    int32_t device_id;
+};
+
+struct dlpack_dtype {
+    uint8_t code;
+    uint8_t bits;
+    uint16_t lanes;
+};
+
+struct dlpack_tensor {
+    void *data;
+    struct dlpack_device device;
+    int32_t ndim;
+    struct dlpack_dtype dtype;
+    int64_t *shape;
+    int64_t *strides;       /* NULL for C order */
+    uint64_t byte_offset;
+};
+
+struct dlpack_managed_tensor {
+    struct dlpack_tensor tensor;
+    void *manager_ctx;
+    void (*deleter)(struct dlpack_managed_tensor *self);
+};
+
+/* DLManagedTensor with room for its shape, owning a reference to an image */
+struct dlpack_export {
+    struct dlpack_managed_tensor managed;
+    int64_t shape[3];
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct strip_layout l;
+    void *data;             /* image in memory representation, NULL until
+                               decoded for images from open_dng() */
+    int pattern;            /* CFA pattern, -1 if unknown */
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+    /* Images from open_dng() */
+    char *filename;
+    uint32_t level;
+    pthread_mutex_t lock;   /* held across decoding, without the GIL */
+    struct strip_cache cache;   /* strips decoded so far, if the native
+                                   codec reads them one by one */
+} DNGImage;
+
+static PyTypeObject DNGImageType;
+
+/*
+ * Wrap an image decoded into malloc()ed memory as a DNGImage
+ *
+ * @param l         Layout of the image
+ * @param pattern   CFA pattern, -1 if unknown
+ * @param data      Decoded image, owned by the image returned, or freed
+ *                  on error.  NULL for images decoded on demand.
+ * @returns new DNGImage, or NULL with exception set
+ */
+static PyObject *DNGImage_wrap(const struct strip_layout *l, int pattern, void *data) {
+    DNGImage *self = PyObject_New(DNGImage, &DNGImageType);
+    npy_intp dims[3];
+    int ndims;
+
+    if (!self) {
+        free(data);
+        return NULL;
+    }
+
+    self->l = *l;
+    self->data = data;
+    self->pattern = pattern;
+    self->filename = NULL;
+    self->level = 0;
+    pthread_mutex_init(&self->lock, NULL);
+    memset(&self->cache, 0, sizeof(self->cache));
+    self->cache.fd = -1;
+
+    ndims = layout_dims(l, dims);
+    for (int i = ndims - 1; i >= 0; i--) {
+        self->shape[i] = dims[i];
+        self->strides[i] = i == ndims - 1 ? (Py_ssize_t) layout_mem_bytes(l) :
+                                            self->strides[i + 1] * self->shape[i + 1];
+    }
+
+    return (PyObject *) self;
+}
+
+static void DNGImage_dealloc(DNGImage *self) {
+    strip_cache_free(&self->cache);
+    pthread_mutex_destroy(&self->lock);
+    free(self->filename);
+    free(self->data);
+    PyObject_Del(self);
+}
+
+static void *DNGImage_decoded(DNGImage *self) {
+    return __atomic_load_n(&self->data, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Decode the whole of an image from open_dng(), if not yet decoded
+ *
+ * Strips are read directly when the native codec can, and otherwise the
+ * image is loaded through libtiff.  The strip cache is dropped once the
+ * whole image is decoded.
+ *
+ * @returns 0 on success, negative on error, with exception set
+ */
+static int DNGImage_load(DNGImage *self) {
+    struct strip_layout l;
+    void *data = NULL;
+    int pattern, err = 0;
+
+    if (DNGImage_decoded(self)) {
+        return 0;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->lock);
+    if (!self->data) {
+        if (self->cache.strips) {
+            data = malloc(layout_mem_rowbytes(&self->l) * self->l.height);
+            if (!data) {
+                err = dng_fail(DNG_ENOMEM, "Unable to allocate image");
+            }
+            else {
+                err = read_strips_direct(self->cache.fd, &self->l, self->cache.strips, data);
+            }
+        }
+        else {
+            err = load_image(self->filename, self->level, &l, &pattern, &data);
+        }
+
+        if (err) {
+            free(data);
+        }
+        else {
+            strip_cache_free(&self->cache);
+            __atomic_store_n(&self->data, data, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        raise_dng_error(err);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy rows of an image, from the strips that hold them
+ *
+ * @param self  Image from open_dng()
+ * @param first First row to copy
+ * @param rows  Rows to copy
+ * @returns new array of the rows, or NULL with exception set
+ */
+static PyObject *DNGImage_rows(DNGImage *self, uint32_t first, uint32_t rows) {
+    struct strip_layout sub = self->l;
+    size_t rowbytes = layout_mem_rowbytes(&self->l);
+    PyObject *array;
+    uint8_t *dest;
+    int err = 0;
+
+    sub.height = rows;
+    array = layout_array(&sub);
+    if (!array) {
+        return NULL;
+    }
+    dest = PyArray_DATA((PyArrayObject *) array);
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->lock);
+    if (self->data) {
+        memcpy(dest, (uint8_t *) self->data + first * rowbytes, rows * rowbytes);
+    }
+    else {
+        err = strip_cache_read(&self->cache, first, rows, dest);
+    }
+    pthread_mutex_unlock(&self->lock);
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        Py_DECREF(array);
+        return raise_dng_error(err);
+    }
+
+    return array;
+}
+
+/*
+ * Index an image, decoding only the strips of the rows selected when the
+ * first index is an integer or a slice
+ */
+static PyObject *DNGImage_subscript(DNGImage *self, PyObject *key) {
+    Py_ssize_t height = self->l.height;
+    Py_ssize_t start, stop, step, len, lo = 0, hi = 0;
+    PyObject *rowkey, *newrow = NULL, *newkey, *array, *result;
+    int tuple = PyTuple_Check(key);
+
+    rowkey = !tuple ? key : PyTuple_GET_SIZE(key) ? PyTuple_GET_ITEM(key, 0) : NULL;
+
+    if (DNGImage_decoded(self) || !self->cache.strips || !rowkey) {
+        /* Whole image */
+    }
+    else if (PySlice_Check(rowkey)) {
+        if (PySlice_GetIndicesEx(rowkey, height, &start, &stop, &step, &len)) {
+            return NULL;
+        }
+
+        /* The same slice of the rows copied, which start at row lo */
+        if (len) {
+            Py_ssize_t last = start + (len - 1) * step;
+            PyObject *first, *end = NULL, *stride;
+
+            lo = step > 0 ? start : last;
+            hi = (step > 0 ? last : start) + 1;
+
+            first = PyLong_FromSsize_t(start - lo);
+            stride = PyLong_FromSsize_t(step);
+            if (stop - lo >= 0) {
+                end = PyLong_FromSsize_t(stop - lo);
+            }
+            if (first && stride && (end || stop - lo < 0)) {
+                newrow = PySlice_New(first, end, stride);
+            }
+            Py_XDECREF(first);
+            Py_XDECREF(end);
+            Py_XDECREF(stride);
+        }
+        else {
+            newrow = PySlice_New(NULL, NULL, NULL);
+        }
+    }
+    else if ((PyLong_Check(rowkey) && !PyBool_Check(rowkey)) ||
+             PyArray_IsScalar(rowkey, Integer)) {
+        Py_ssize_t i = PyNumber_AsSsize_t(rowkey, PyExc_IndexError);
+
+        if (i == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+
+        if (i < 0) {
+            i += height;
+        }
+
+        if (i < 0 || i >= height) {
+            PyErr_SetString(PyExc_IndexError, "row index out of range");
+            return NULL;
+        }
+
+        lo = i;
+        hi = i + 1;
+        newrow = PyLong_FromLong(0);
+    }
+
+    if (!newrow) {
+        if (PyErr_Occurred() || DNGImage_load(self)) {
+            return NULL;
+        }
+
+        Py_INCREF(self);
+        array = layout_view(&self->l, self->data, (PyObject *) self);
+        if (!array) {
+            return NULL;
+        }
+
+        result = PyObject_GetItem(array, key);
+        Py_DECREF(array);
+        return result;
+    }
+
+    /* The key itself may be shared, so is copied rather than modified */
+    if (tuple) {
+        newkey = PyTuple_New(PyTuple_GET_SIZE(key));
+        if (newkey) {
+            PyTuple_SET_ITEM(newkey, 0, newrow);
+            for (Py_ssize_t i = 1; i < PyTuple_GET_SIZE(key); i++) {
+                Py_INCREF(PyTuple_GET_ITEM(key, i));
+                PyTuple_SET_ITEM(newkey, i, PyTuple_GET_ITEM(key, i));
+            }
+        }
+        else {
+            Py_DECREF(newrow);
+        }
+    }
+    else {
+        newkey = newrow;
+    }
+    if (!newkey) {
+        return NULL;
+    }
+
+    array = DNGImage_rows(self, lo, hi - lo);
+    if (!array) {
+        Py_DECREF(newkey);
+        return NULL;
+    }
+
+    result = PyObject_GetItem(array, newkey);
+    Py_DECREF(newkey);
+    Py_DECREF(array);
+    return result;
+}
+
+static Py_ssize_t DNGImage_length(DNGImage *self) {
+    return self->l.height;
+}
+
+static PyMappingMethods DNGImage_as_mapping = {
+    .mp_length = (lenfunc) DNGImage_length,
+    .mp_subscript = (binaryfunc) DNGImage_subscript,
+};
+
+static int DNGImage_ndim(DNGImage *self) {
+    return self->l.samples > 1 ? 3 : 2;
+}
+
+static int DNGImage_getbuffer(DNGImage *self, Py_buffer *view, int flags) {
+    static char *formats[] = {
+        [NPY_UINT8] = "B", [NPY_UINT16] = "H", [NPY_HALF] = "e", [NPY_FLOAT32] = "f",
+    };
+
+    if (DNGImage_load(self)) {
+        view->obj = NULL;
+        return -1;
+    }
+
+    view->obj = (PyObject *) self;
+    view->buf = self->data;
+    view->itemsize = layout_mem_bytes(&self->l);
+    view->len = layout_mem_rowbytes(&self->l) * self->l.height;
+    view->readonly = 0;
+    view->ndim = DNGImage_ndim(self);
+    view->format = (flags & PyBUF_FORMAT) ? formats[layout_type(&self->l)] : NULL;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    Py_INCREF(self);
+    return 0;
+}
+
+static PyBufferProcs DNGImage_as_buffer = {
+    .bf_getbuffer = (getbufferproc) DNGImage_getbuffer,
+};
+
+static PyObject *DNGImage_array(DNGImage *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "dtype", "copy", NULL
+    };
+
+    PyObject *dtype = Py_None, *copy = Py_None;
+    PyObject *array, *result;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &dtype, &copy) ||
+        DNGImage_load(self)) {
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    array = layout_view(&self->l, self->data, (PyObject *) self);
+    if (!array || (dtype == Py_None && !PyObject_IsTrue(copy))) {
+        return array;
+    }
+
+    if (dtype == Py_None) {
+        result = PyArray_NewCopy((PyArrayObject *) array, NPY_CORDER);
+    }
+    else {
+        result = PyObject_CallMethod(array, "astype", "O", dtype);
+    }
+    Py_DECREF(array);
+
+    return result;
+}
+
+static void dlpack_delete(struct dlpack_managed_tensor *managed) {
+    PyGILState_STATE gil = PyGILState_Ensure();
+
+    Py_DECREF((PyObject *) managed->manager_ctx);
+    free(managed);
+
+    PyGILState_Release(gil);
+}
+
+/* Capsules never consumed still own their tensor */
+static void dlpack_capsule_destructor(PyObject *capsule) {
+    struct dlpack_managed_tensor *managed;
+
+    if (!PyCapsule_IsValid(capsule, "dltensor")) {
+        return;
+    }
+
+    managed = PyCapsule_GetPointer(capsule, "dltensor");
+    managed->deleter(managed);
+}
+
+static PyObject *DNGImage_dlpack(DNGImage *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "stream", "max_version", "dl_device", "copy", NULL
+    };
+
+    PyObject *stream = Py_None, *max_version = Py_None, *dl_device = Py_None;
+    PyObject *copy = Py_None, *capsule;
+    struct dlpack_export *export;
+    struct dlpack_tensor *t;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOOO", kwlist, &stream, &max_version,
+                                     &dl_device, &copy)) {
+        return NULL;
+    }
+
+    if (stream != Py_None) {
+        PyErr_SetString(PyExc_ValueError, "stream must be None for CPU images");
+        return NULL;
+    }
+
+    if (copy == Py_True) {
+        PyErr_SetString(PyExc_BufferError, "DNGImage is only exported without a copy");
+        return NULL;
+    }
+
+    if (DNGImage_load(self)) {
+        return NULL;
+    }
+
+    export = calloc(1, sizeof(*export));
+    if (!export) {
+        return PyErr_NoMemory();
+    }
+
+    t = &export->managed.tensor;
+    t->data = self->data;
+    t->device.device_type = DLPACK_CPU;
+    t->ndim = DNGImage_ndim(self);
+    t->dtype.code = self->l.sampleformat == SAMPLEFORMAT_IEEEFP ? DLPACK_FLOAT : DLPACK_UINT;
+    t->dtype.bits = 8 * layout_mem_bytes(&self->l);
+    t->dtype.lanes = 1;
+    t->shape = export->shape;
+    for (int i = 0; i < t->ndim; i++) {
+        export->shape[i] = self->shape[i];
+    }
+
+    Py_INCREF(self);
+    export->managed.manager_ctx = self;
+    export->managed.deleter = dlpack_delete;
+
+    capsule = PyCapsule_New(&export->managed, "dltensor", dlpack_capsule_destructor);
+    if (!capsule) {
+        Py_DECREF(self);
+        free(export);
+    }
+
+    return capsule;
+}
+
+static PyObject *DNGImage_dlpack_device(DNGImage *self, PyObject *unused) {
+    return Py_BuildValue("(ii)", DLPACK_CPU, 0);
+}
+
+static PyObject *DNGImage_get_shape(DNGImage *self, void *closure) {
+    return DNGImage_ndim(self) == 3 ?
+        Py_BuildValue("(nnn)", self->shape[0], self->shape[1], self->shape[2]) :
+        Py_BuildValue("(nn)", self->shape[0], self->shape[1]);
+}
+
+static PyObject *DNGImage_get_dtype(DNGImage *self, void *closure) {
+    return (PyObject *) PyArray_DescrFromType(layout_type(&self->l));
+}
+
+static PyObject *DNGImage_get_cfa(DNGImage *self, void *closure) {
+    return cfa_object(self->pattern);
+}
+
+static PyObject *DNGImage_get_nbytes(DNGImage *self, void *closure) {
+    return PyLong_FromSize_t(layout_mem_rowbytes(&self->l) * self->l.height);
+}
+
+static PyMethodDef DNGImage_methods[] = {
+    {"__array__", (PyCFunction) DNGImage_array, METH_VARARGS | METH_KEYWORDS,
+        "__array__([dtype=None, copy=None]) -> ndarray\n\n"
+        "View of the image, or a copy if dtype or copy is given."
+    },
+    {"__dlpack__", (PyCFunction) DNGImage_dlpack, METH_VARARGS | METH_KEYWORDS,
+        "__dlpack__(*, stream=None, max_version=None, dl_device=None,\n"
+        "   copy=None) -> capsule\n\n"
+        "Export the image as a DLPack tensor, sharing its memory.  The\n"
+        "image stays alive until the consumer releases the tensor."
+    },
+    {"__dlpack_device__", (PyCFunction) DNGImage_dlpack_device, METH_NOARGS,
+        "__dlpack_device__() -> (device_type, device_id)\n\n"
+        "Images are always in CPU memory."
+    },
+    {NULL}
+};
+
+static PyGetSetDef DNGImage_getset[] = {
+    {"shape", (getter) DNGImage_get_shape, NULL,
+        "(height, width), or (height, width, samples)", NULL},
+    {"dtype", (getter) DNGImage_get_dtype, NULL,
+        "numpy dtype of the samples", NULL},
+    {"cfa", (getter) DNGImage_get_cfa, NULL,
+        "One of tiffutils.CFA_*, or None if unknown", NULL},
+    {"nbytes", (getter) DNGImage_get_nbytes, NULL,
+        "Size of the image in memory", NULL},
+    {NULL}
+};
+
+static PyTypeObject DNGImageType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "tiffutils.DNGImage",
+    .tp_basicsize = sizeof(DNGImage),
+    .tp_dealloc = (destructor) DNGImage_dealloc,
+    .tp_as_buffer = &DNGImage_as_buffer,
+    .tp_as_mapping = &DNGImage_as_mapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Image returned by load_dng(..., as_='dlpack') or open_dng().\n\n"
+        "Exports its memory without a copy through the buffer protocol,\n"
+        "__dlpack__ and __array__, so numpy.asarray, memoryview,\n"
+        "torch.from_dlpack, jax.dlpack.from_dlpack and pyarrow can take\n"
+        "it directly.  Images from open_dng() are decoded on first export.\n"
+        "Indexing rows with an integer or slice, as in image[a:b, ...],\n"
+        "returns a new ndarray, decoding only the strips holding the rows\n"
+        "until the whole image is decoded.",
+    .tp_methods = DNGImage_methods,
+    .tp_getset = DNGImage_getset,
+};
+
+/*
+ * Frames decoded by load_dng(), kept while tiffutils.cache() allows
+ *
+ * Entries are (image, cfa) tuples keyed by (path, mtime, size, level), in
+ * least recently used order.  Callers get read-only views of the cached
+ * images, so a frame evicted while in use lives on until its views go.
+ */
+static struct {
+    PyObject *entries;      /* OrderedDict, NULL while disabled */
+    size_t max_bytes;
+    size_t bytes;           /* decoded bytes of the entries */
+    uint64_t hits, misses;
+} frame_cache;
+
+static size_t frame_cache_entry_bytes(PyObject *entry) {
+    return PyArray_NBYTES((PyArrayObject *) PyTuple_GET_ITEM(entry, 0));
+}
+
+/*
+ * Drop least recently used frames until the cache fits its budget
+ *
+ * @returns 0 on success, negative on error, with exception set
+ */
+static int frame_cache_evict(void) {
+    while (frame_cache.bytes > frame_cache.max_bytes && PyDict_Size(frame_cache.entries)) {
+        PyObject *item = PyObject_CallMethod(frame_cache.entries, "popitem", "O", Py_False);
+
+        if (!item) {
+            return -1;
+        }
+
+        frame_cache.bytes -= frame_cache_entry_bytes(PyTuple_GET_ITEM(item, 1));
+        Py_DECREF(item);
+    }
+
+    return 0;
+}
+
+/*
+ * Key of a file in the cache
+ *
+ * @returns new key, or Py_None if the file cannot be found, in which case
+ *          loading it raises the error.  NULL with exception set on error.
+ */
+static PyObject *frame_cache_key(const char *filename, unsigned int level) {
+    struct stat st;
+    char *path;
+    PyObject *key;
+
+    path = realpath(filename, NULL);
+    if (!path || stat(path, &st)) {
+        free(path);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    key = Py_BuildValue("(sLLI)", path,
+                        (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+                        (long long) st.st_size, level);
+    free(path);
+    return key;
+}
+
+/*
+ * (image, cfa) of an entry, with a read-only view of its image
+ */
+static PyObject *frame_cache_result(PyObject *entry) {
+    PyObject *view, *cfa = PyTuple_GET_ITEM(entry, 1);
+
+    view = PyArray_View((PyArrayObject *) PyTuple_GET_ITEM(entry, 0), NULL, NULL);
+    if (!view) {
+        return NULL;
+    }
+    PyArray_CLEARFLAGS((PyArrayObject *) view, NPY_ARRAY_WRITEABLE);
+
+    Py_INCREF(cfa);
+    return Py_BuildValue("(NN)", view, cfa);
+}
+
+/*
+ * Look up a frame, marking it most recently used
+ *
+ * @returns new (image, cfa) tuple, Py_None if not cached, or NULL with
+ *          exception set
+ */
+static PyObject *frame_cache_get(PyObject *key) {
+    PyObject *entry, *result;
+
+    entry = PyDict_GetItemWithError(frame_cache.entries, key);
+    if (!entry) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        frame_cache.misses++;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    Py_INCREF(entry);
+    result = PyObject_CallMethod(frame_cache.entries, "move_to_end", "(O)", key);
+    if (result) {
+        Py_DECREF(result);
+        result = frame_cache_result(entry);
+        frame_cache.hits++;
+    }
+    Py_DECREF(entry);
+
+    return result;
+}
+
+/*
+ * Cache a decoded frame, if it fits
+ *
+ * @param key       Key of the frame
+ * @param loaded    (image, cfa) tuple from load_directory(), stolen
+ * @returns new (image, cfa) tuple for the caller, with a read-only view
+ *          of the image if cached, or NULL with exception set
+ */
+static PyObject *frame_cache_put(PyObject *key, PyObject *loaded) {
+    PyObject *result;
+    int present;
+
+    /* Another thread may have loaded the frame while this one did */
+    present = PyDict_Contains(frame_cache.entries, key);
+    if (present < 0) {
+        goto err;
+    }
+
+    /* Frames not cached are the caller's alone */
+    if (present || frame_cache_entry_bytes(loaded) > frame_cache.max_bytes) {
+        return loaded;
+    }
+
+    if (PyObject_SetItem(frame_cache.entries, key, loaded)) {
+        goto err;
+    }
+    frame_cache.bytes += frame_cache_entry_bytes(loaded);
+
+    if (frame_cache_evict()) {
+        goto err;
+    }
+
+    result = frame_cache_result(loaded);
+    Py_DECREF(loaded);
+    return result;
+
+err:
+    Py_DECREF(loaded);
+    return NULL;
+}
+
+static PyObject *tiffutils_load_dng(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filename", "level", "shm_name", "as_", "out_path", NULL
+    };
+
+    char *filename;
+    unsigned int level = 0;
+    const char *shm_name = NULL;
+    const char *as = "ndarray";
+    const char *out_path = NULL;
+    TIFF *tiff = NULL;
+    PyObject *key = NULL, *result;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|Izsz", kwlist, &filename, &level,
+                                     &shm_name, &as, &out_path)) {
+        return NULL;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    if (out_path) {
+        PyObject *numpy, *array;
+        int pattern = -1, err;
+
+        if (shm_name || strcmp(as, "ndarray")) {
+            PyErr_SetString(PyExc_ValueError,
+                            "out_path cannot be combined with shm_name or as_");
+            return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        err = load_image_to_file(filename, level, out_path, &pattern);
+        Py_END_ALLOW_THREADS
+
+        if (err) {
+            return raise_dng_error(err);
+        }
+
+        numpy = PyImport_ImportModule("numpy");
+        if (!numpy) {
+            return NULL;
+        }
+        array = PyObject_CallMethod(numpy, "load", "ss", out_path, "r+");
+        Py_DECREF(numpy);
+        if (!array) {
+            return NULL;
+        }
+
+        return Py_BuildValue("(NN)", array, cfa_object(pattern));
+    }
+
+    if (!strcmp(as, "dlpack")) {
+        struct strip_layout layout;
+        void *data = NULL;
+        int pattern, err;
+
+        if (shm_name) {
+            PyErr_SetString(PyExc_ValueError, "shm_name is only supported for ndarrays");
+            return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        err = load_image(filename, level, &layout, &pattern, &data);
+        Py_END_ALLOW_THREADS
+
+        if (err) {
+            return raise_dng_error(err);
+        }
+
+        result = DNGImage_wrap(&layout, pattern, data);
+        if (!result) {
+            return NULL;
+        }
+
+        return Py_BuildValue("(NN)", result, cfa_object(pattern));
+    }
+    else if (strcmp(as, "ndarray")) {
+        PyErr_SetString(PyExc_ValueError, "as_ must be 'ndarray' or 'dlpack'");
+        return NULL;
+    }
+
+    if (frame_cache.entries && !shm_name) {
+        key = frame_cache_key(filename, level);
+        if (!key) {
+            return NULL;
+        }
+
+        if (key != Py_None) {
+            result = frame_cache_get(key);
+            if (result != Py_None) {
+                Py_DECREF(key);
+                return result;
+            }
+            Py_DECREF(result);
+        }
+    }
+
+    tiff = TIFFOpen(filename, "r");
+    if (!tiff) {
+        Py_XDECREF(key);
+        PyErr_SetString(PyExc_IOError, "Failed to open file");
+        return NULL;
+    }
+
+    result = load_directory(tiff, level, shm_name);
+    TIFFClose(tiff);
+
+    /* The cache may have been disabled while decoding */
+    if (result && key && key != Py_None && frame_cache.entries) {
+        result = frame_cache_put(key, result);
+    }
+    Py_XDECREF(key);
+
+    return result;
+}
+
+static PyObject *tiffutils_cache(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "max_bytes", NULL
+    };
+
+    PyObject *max_bytes = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &max_bytes)) {
+        return NULL;
+    }
+
+    if (max_bytes != Py_None) {
+        Py_ssize_t n = PyNumber_AsSsize_t(max_bytes, PyExc_OverflowError);
+
+        if (n == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+
+        if (n < 0) {
+            PyErr_SetString(PyExc_ValueError, "max_bytes must be positive");
+            return NULL;
+        }
+
+        frame_cache.max_bytes = n;
+
+        if (!n) {
+            Py_CLEAR(frame_cache.entries);
+            frame_cache.bytes = 0;
+        }
+        else if (!frame_cache.entries) {
+            PyObject *collections = PyImport_ImportModule("collections");
+
+            if (!collections) {
+                return NULL;
+            }
+            frame_cache.entries = PyObject_CallMethod(collections, "OrderedDict", NULL);
+            Py_DECREF(collections);
+            if (!frame_cache.entries) {
+                return NULL;
+            }
+        }
+        else if (frame_cache_evict()) {
+            return NULL;
+        }
+    }
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:K,s:K}",
+        "max_bytes", (Py_ssize_t) frame_cache.max_bytes,
+        "bytes", (Py_ssize_t) frame_cache.bytes,
+        "frames", frame_cache.entries ? PyDict_Size(frame_cache.entries) : 0,
+        "hits", (unsigned long long) frame_cache.hits,
+        "misses", (unsigned long long) frame_cache.misses);
+}
+
+/*
+ * Open an image to decode on demand
+ *
+ * @param filename      File to open
+ * @param level         Pyramid level, or 0 for the raw image
+ * @param cache_bytes   Decoded strips to keep
+ * @returns new DNGImage, or NULL with exception set
+ */
+static PyObject *DNGImage_open(const char *filename, unsigned int level, size_t cache_bytes) {
+    struct strip_layout layout;
+    uint64_t *strips = NULL;
+    DNGImage *image;
+    int pattern = -1, fd = -1, err;
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    Py_BEGIN_ALLOW_THREADS
+    err = open_image(filename, level, &layout, &pattern, &strips);
+    if (!err && strips) {
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            err = dng_fail(DNG_EIO, "Failed to open file: %s", strerror(errno));
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        free(strips);
+        return raise_dng_error(err);
+    }
+
+    image = (DNGImage *) DNGImage_wrap(&layout, pattern, NULL);
+    if (!image) {
+        goto err;
+    }
+
+    image->level = level;
+    image->filename = strdup(filename);
+    if (!image->filename) {
+        PyErr_NoMemory();
+        goto err_decref_image;
+    }
+
+    if (strips) {
+        err = strip_cache_init(&image->cache, fd, &layout, strips, cache_bytes);
+        if (err) {
+            raise_dng_error(err);
+            goto err_decref_image;
+        }
+    }
+
+    return (PyObject *) image;
+
+err:
+    free(strips);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+
+err_decref_image:
+    if (!image->cache.strips) {
+        free(strips);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    Py_DECREF(image);
+    return NULL;
+}
+
+static PyObject *tiffutils_open_dng(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filename", "level", "cache_bytes", NULL
+    };
+
+    char *filename;
+    unsigned int level = 0;
+    Py_ssize_t cache_bytes = 64 << 20;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|In", kwlist, &filename, &level,
+                                     &cache_bytes)) {
+        return NULL;
+    }
+
+    if (cache_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache_bytes must be positive");
+        return NULL;
+    }
+
+    return DNGImage_open(filename, level, cache_bytes);
+}
+
+/*
+ * Frames of many files, read as one array, in chunks of a strip of a frame
+ *
+ * Files are opened only to read from them, so long sequences do not hold
+ * a descriptor per file.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *filenames;    /* tuple of str */
+    unsigned int level;
+    struct strip_layout l;  /* layout of the first frame */
+} ChunkedArray;
+
+static void ChunkedArray_dealloc(ChunkedArray *self) {
+    Py_XDECREF(self->filenames);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int ChunkedArray_ndim(ChunkedArray *self) {
+    return self->l.samples > 1 ? 4 : 3;
+}
+
+static Py_ssize_t ChunkedArray_length(ChunkedArray *self) {
+    return PyTuple_GET_SIZE(self->filenames);
+}
+
+/*
+ * Index one frame, decoding only the strips it selects
+ *
+ * @param self  Array
+ * @param frame Frame to index
+ * @param key   Index into the frame
+ * @returns new ndarray, or NULL with exception set
+ */
+static PyObject *ChunkedArray_frame(ChunkedArray *self, Py_ssize_t frame, PyObject *key) {
+    const char *filename;
+    DNGImage *image;
+    PyObject *result;
+
+    filename = PyUnicode_AsUTF8(PyTuple_GET_ITEM(self->filenames, frame));
+    if (!filename) {
+        return NULL;
+    }
+
+    /* Strips are read once for each chunk, so none are cached */
+    image = (DNGImage *) DNGImage_open(filename, self->level, 0);
+    if (!image) {
+        return NULL;
+    }
+
+    if (image->l.width != self->l.width || image->l.height != self->l.height ||
+        image->l.samples != self->l.samples || layout_type(&image->l) != layout_type(&self->l)) {
+        PyErr_Format(PyExc_ValueError, "%s differs in shape or dtype from the first frame",
+                     filename);
+        Py_DECREF(image);
+        return NULL;
+    }
+
+    result = DNGImage_subscript(image, key);
+    Py_DECREF(image);
+    return result;
+}
+
+/*
+ * Index the frames, decoding only the strips selected when the first index
+ * is an integer or slice
+ */
+static PyObject *ChunkedArray_subscript(ChunkedArray *self, PyObject *key) {
+    Py_ssize_t nframes = ChunkedArray_length(self);
+    Py_ssize_t start, step, len, stop;
+    PyObject *framekey, *rest, *result = NULL;
+    npy_intp dims[NPY_MAXDIMS];
+
+    if (PyTuple_Check(key)) {
+        Py_INCREF(key);
+    }
+    else {
+        key = PyTuple_Pack(1, key);
+        if (!key) {
+            return NULL;
+        }
+    }
+
+    framekey = PyTuple_GET_SIZE(key) ? PyTuple_GET_ITEM(key, 0) : Py_None;
+
+    rest = PyTuple_GetSlice(key, 1, PyTuple_GET_SIZE(key));
+    if (!rest) {
+        goto out;
+    }
+
+    if ((PyLong_Check(framekey) && !PyBool_Check(framekey)) ||
+        PyArray_IsScalar(framekey, Integer)) {
+        Py_ssize_t i = PyNumber_AsSsize_t(framekey, PyExc_IndexError);
+
+        if (i == -1 && PyErr_Occurred()) {
+            goto out;
+        }
+
+        if (i < 0) {
+            i += nframes;
+        }
+
+        if (i < 0 || i >= nframes) {
+            PyErr_SetString(PyExc_IndexError, "frame index out of range");
+            goto out;
+        }
+
+        result = ChunkedArray_frame(self, i, rest);
+    }
+    else if (PySlice_Check(framekey)) {
+        PyObject *first;
+        int ndims;
+
+        if (PySlice_GetIndicesEx(framekey, nframes, &start, &stop, &step, &len)) {
+            goto out;
+        }
+
+        if (!len) {
+            /* The shape of no frames, from an empty array of frames */
+            PyObject *empty;
+
+            ndims = ChunkedArray_ndim(self);
+            dims[0] = 0;
+            layout_dims(&self->l, dims + 1);
+
+            empty = PyArray_Zeros(ndims, dims, PyArray_DescrFromType(layout_type(&self->l)), 0);
+            if (empty) {
+                result = PyObject_GetItem(empty, key);
+                Py_DECREF(empty);
+            }
+            goto out;
+        }
+
+        first = ChunkedArray_frame(self, start, rest);
+        if (!first) {
+            goto out;
+        }
+
+        ndims = PyArray_NDIM((PyArrayObject *) first);
+        dims[0] = len;
+        memcpy(dims + 1, PyArray_DIMS((PyArrayObject *) first), ndims * sizeof(npy_intp));
+
+        Py_INCREF(PyArray_DESCR((PyArrayObject *) first));
+        result = PyArray_NewFromDescr(&PyArray_Type, PyArray_DESCR((PyArrayObject *) first),
+                                      ndims + 1, dims, NULL, NULL, 0, NULL);
+
+        for (Py_ssize_t k = 0; result && k < len; k++) {
+            PyObject *frame, *dest;
+            int err = -1;
+
+            frame = k ? ChunkedArray_frame(self, start + k * step, rest) : first;
+            if (!k) {
+                first = NULL;
+            }
+            dest = frame ? PySequence_GetItem(result, k) : NULL;
+            if (dest) {
+                err = PyArray_CopyInto((PyArrayObject *) dest, (PyArrayObject *) frame);
+                Py_DECREF(dest);
+            }
+            Py_XDECREF(frame);
+
+            if (err) {
+                Py_CLEAR(result);
+            }
+        }
+        Py_XDECREF(first);
+    }
+    else {
+        /* Other indexes, of all frames */
+        PyObject *all = PySlice_New(NULL, NULL, NULL);
+        PyObject *array = all ? ChunkedArray_subscript(self, all) : NULL;
+
+        Py_XDECREF(all);
+        if (array) {
+            result = PyObject_GetItem(array, key);
+            Py_DECREF(array);
+        }
+    }
+
+out:
+    Py_XDECREF(rest);
+    Py_DECREF(key);
+    return result;
+}
+
+static PyMappingMethods ChunkedArray_as_mapping = {
+    .mp_length = (lenfunc) ChunkedArray_length,
+    .mp_subscript = (binaryfunc) ChunkedArray_subscript,
+};
+
+static PyObject *ChunkedArray_array(ChunkedArray *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "dtype", "copy", NULL
+    };
+
+    PyObject *dtype = Py_None, *copy = Py_None;
+    PyObject *all, *array, *result;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &dtype, &copy)) {
+        return NULL;
+    }
+
+    all = PySlice_New(NULL, NULL, NULL);
+    if (!all) {
+        return NULL;
+    }
+
+    array = ChunkedArray_subscript(self, all);
+    Py_DECREF(all);
+    if (!array || dtype == Py_None) {
+        return array;
+    }
+
+    result = PyObject_CallMethod(array, "astype", "O", dtype);
+    Py_DECREF(array);
+    return result;
+}
+
+static PyObject *ChunkedArray_get_shape(ChunkedArray *self, void *closure) {
+    PyObject *shape;
+    npy_intp dims[4];
+    int ndims = ChunkedArray_ndim(self);
+
+    dims[0] = ChunkedArray_length(self);
+    layout_dims(&self->l, dims + 1);
+
+    shape = PyTuple_New(ndims);
+    for (int i = 0; shape && i < ndims; i++) {
+        PyTuple_SET_ITEM(shape, i, PyLong_FromSsize_t(dims[i]));
+    }
+
+    return shape;
+}
+
+static PyObject *ChunkedArray_get_ndim(ChunkedArray *self, void *closure) {
+    return PyLong_FromLong(ChunkedArray_ndim(self));
+}
+
+static PyObject *ChunkedArray_get_dtype(ChunkedArray *self, void *closure) {
+    return (PyObject *) PyArray_DescrFromType(layout_type(&self->l));
+}
+
+static PyObject *ChunkedArray_get_nbytes(ChunkedArray *self, void *closure) {
+    return PyLong_FromSize_t(ChunkedArray_length(self) * layout_mem_rowbytes(&self->l) *
+                             self->l.height);
+}
+
+/*
+ * Chunks in the form of dask: a frame, by the strips of the first frame,
+ * by whole rows
+ */
+static PyObject *ChunkedArray_get_chunks(ChunkedArray *self, void *closure) {
+    const struct strip_layout *l = &self->l;
+    Py_ssize_t nframes = ChunkedArray_length(self);
+    uint32_t nstrips = layout_plane_strips(l);
+    PyObject *frames, *rows;
+
+    frames = PyTuple_New(nframes);
+    for (Py_ssize_t i = 0; frames && i < nframes; i++) {
+        PyTuple_SET_ITEM(frames, i, PyLong_FromLong(1));
+    }
+
+    rows = PyTuple_New(nstrips);
+    for (uint32_t s = 0; rows && s < nstrips; s++) {
+        PyTuple_SET_ITEM(rows, s, PyLong_FromUnsignedLong(layout_strip_rows(l, s)));
+    }
+
+    if (!frames || !rows) {
+        Py_XDECREF(frames);
+        Py_XDECREF(rows);
+        return NULL;
+    }
+
+    if (ChunkedArray_ndim(self) == 4) {
+        return Py_BuildValue("(NN(I)(H))", frames, rows, l->width, l->samples);
+    }
+
+    return Py_BuildValue("(NN(I))", frames, rows, l->width);
+}
+
+static PyMethodDef ChunkedArray_methods[] = {
+    {"__array__", (PyCFunction) ChunkedArray_array, METH_VARARGS | METH_KEYWORDS,
+        "__array__([dtype=None, copy=None]) -> ndarray\n\n"
+        "Decode every frame."
+    },
+    {NULL}
+};
+
+static PyGetSetDef ChunkedArray_getset[] = {
+    {"shape", (getter) ChunkedArray_get_shape, NULL,
+        "(frames, height, width), or (frames, height, width, samples)", NULL},
+    {"ndim", (getter) ChunkedArray_get_ndim, NULL, "Number of dimensions", NULL},
+    {"dtype", (getter) ChunkedArray_get_dtype, NULL, "numpy dtype of the samples", NULL},
+    {"nbytes", (getter) ChunkedArray_get_nbytes, NULL, "Size of every frame decoded", NULL},
+    {"chunks", (getter) ChunkedArray_get_chunks, NULL,
+        "Chunk sizes along each dimension, as dask expects them: one frame,\n"
+        "by the strips of the first frame, by whole rows", NULL},
+    {NULL}
+};
+
+static PyTypeObject ChunkedArrayType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "tiffutils.ChunkedArray",
+    .tp_basicsize = sizeof(ChunkedArray),
+    .tp_dealloc = (destructor) ChunkedArray_dealloc,
+    .tp_as_mapping = &ChunkedArray_as_mapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Frames of DNGs as one array, returned by as_chunked().\n\n"
+        "Indexing with an integer or slice of frames decodes only the\n"
+        "strips of the rows selected in each, as DNGImage does, opening\n"
+        "each file as it is read.  Usable as the source of\n"
+        "dask.array.from_array(array, chunks=array.chunks).",
+    .tp_methods = ChunkedArray_methods,
+    .tp_getset = ChunkedArray_getset,
+};
+
+static PyObject *tiffutils_as_chunked(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filenames", "level", NULL
+    };
+
+    PyObject *seq;
+    unsigned int level = 0;
+    ChunkedArray *array;
+    uint64_t *strips = NULL;
+    const char *first;
+    int pattern, err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|I", kwlist, &seq, &level)) {
+        return NULL;
+    }
+
+    array = PyObject_New(ChunkedArray, &ChunkedArrayType);
+    if (!array) {
+        return NULL;
+    }
+    array->level = level;
+
+    array->filenames = PySequence_Tuple(seq);
+    if (!array->filenames) {
+        goto err;
+    }
+
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(array->filenames); i++) {
+        if (!PyUnicode_Check(PyTuple_GET_ITEM(array->filenames, i))) {
+            PyErr_SetString(PyExc_TypeError, "filenames must be str");
+            goto err;
+        }
+    }
+
+    if (!PyTuple_GET_SIZE(array->filenames)) {
+        PyErr_SetString(PyExc_ValueError, "filenames must not be empty");
+        goto err;
+    }
+
+    first = PyUnicode_AsUTF8(PyTuple_GET_ITEM(array->filenames, 0));
+    if (!first) {
+        goto err;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    Py_BEGIN_ALLOW_THREADS
+    err = open_image(first, level, &array->l, &pattern, &strips);
+    free(strips);
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        raise_dng_error(err);
+        goto err;
+    }
+
+    return (PyObject *) array;
+
+err:
+    Py_DECREF(array);
+    return NULL;
+}
+
+static PyObject *tiffutils_load_preview(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filename", "max_size", NULL
+    };
+
+    char *filename;
+    unsigned int max_size = 0;
+    TIFF *tiff = NULL;
+    struct strip_layout layout;
+    uint16_t photometric;
+    uint8_t *jpeg = NULL;
+    size_t jpeg_size = 0;
+    int rgba = 0, err;
+    npy_intp dims[3];
+    PyObject *array = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|I", kwlist, &filename, &max_size)) {
+        return NULL;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    tiff = TIFFOpen(filename, "r");
+    if (!tiff) {
+        PyErr_SetString(PyExc_IOError, "Failed to open file");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = select_preview_directory(tiff, max_size);
+    if (!err && preview_is_jpeg(tiff)) {
+        err = read_jpeg_preview(tiff, &jpeg, &jpeg_size);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        raise_dng_error(err);
+        goto err;
+    }
+
+    if (jpeg) {
+        array = PyBytes_FromStringAndSize((char *) jpeg, jpeg_size);
+        free(jpeg);
+        TIFFClose(tiff);
+        return array;
+    }
+
+    /* Anything read_strips() cannot return as RGB goes through libtiff */
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_PHOTOMETRIC, &photometric);
+    if (TIFFIsTiled(tiff) || photometric == PHOTOMETRIC_YCBCR ||
+        read_layout(tiff, &layout) ||
+        layout.sampleformat == SAMPLEFORMAT_IEEEFP ||
+        (layout.samples != 1 && layout.samples != 3)) {
+        rgba = 1;
+        TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &layout.width);
+        TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &layout.height);
+        layout.samples = 3;
+        layout.bits = 8;
+    }
+
+    dims[0] = layout.height;
+    dims[1] = layout.width;
+    dims[2] = layout.samples;
+
+    array = PyArray_SimpleNew(layout.samples > 1 ? 3 : 2, dims,
+                              layout.bits == 8 ? NPY_UINT8 : NPY_UINT16);
+    if (!array) {
+        goto err;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (rgba) {
+        err = read_rgba_preview(tiff, layout.width, layout.height,
+                                PyArray_DATA((PyArrayObject *) array));
+    }
+    else {
+        err = read_strips(tiff, &layout, PyArray_DATA((PyArrayObject *) array));
+    }
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        raise_dng_error(err);
+        goto err_decref_array;
+    }
+
+    TIFFClose(tiff);
+
+    return array;
+
+err_decref_array:
+    Py_DECREF(array);
+err:
+    TIFFClose(tiff);
+    return NULL;
+}
+
+static PyObject *tiffutils_quicklook(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filename", "max_size", NULL
+    };
+
+    char *filename;
+    unsigned int max_size = 512;
+    TIFF *tiff;
+    struct preview ql = {0};
+    npy_intp dims[3];
+    PyObject *array;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|I", kwlist, &filename, &max_size)) {
+        return NULL;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    tiff = TIFFOpen(filename, "r");
+    if (!tiff) {
+        PyErr_SetString(PyExc_IOError, "Failed to open file");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = quicklook(tiff, max_size, &ql);
+    Py_END_ALLOW_THREADS
+
+    TIFFClose(tiff);
+
+    if (err) {
+        return raise_dng_error(err);
+    }
+
+    dims[0] = ql.height;
+    dims[1] = ql.width;
+    dims[2] = 3;
+
+    array = PyArray_SimpleNew(3, dims, NPY_UINT8);
+    if (array) {
+        memcpy(PyArray_DATA((PyArrayObject *) array), ql.rgb, 3 * (size_t) ql.width * ql.height);
+    }
+
+    free(ql.rgb);
+    return array;
+}
+
+static PyObject *tiffutils_export(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filenames", "out_dir", "format", "size", "quality", "threads", NULL
+    };
+
+    PyObject *filenames, *seq, *result = NULL;
+    char *out_dir;
+    char *format_name = "jpeg";
+    unsigned int size = 1024;
+    int quality = 90;
+    unsigned int threads = 0;
+    struct export_batch b = {0};
+    const char *ext;
+    size_t lanes;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|sIiI", kwlist, &filenames,
+                                     &out_dir, &format_name, &size, &quality,
+                                     &threads)) {
+        return NULL;
+    }
+
+    if (!strcmp(format_name, "jpeg") || !strcmp(format_name, "jpg")) {
+        b.format = EXPORT_JPEG;
+        ext = ".jpg";
+    }
+    else if (!strcmp(format_name, "png")) {
+        b.format = EXPORT_PNG;
+        ext = ".png";
+    }
+    else {
+        PyErr_SetString(PyExc_ValueError, "format must be 'jpeg' or 'png'");
+        return NULL;
+    }
+
+    if (quality < 1 || quality > 100) {
+        PyErr_SetString(PyExc_ValueError, "quality must be between 1 and 100");
+        return NULL;
+    }
+
+    seq = PySequence_Fast(filenames, "filenames must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+
+    b.count = PySequence_Fast_GET_SIZE(seq);
+    b.size = size;
+    b.quality = quality;
+    b.src = calloc(b.count + 1, sizeof(*b.src));
+    b.dst = calloc(b.count + 1, sizeof(*b.dst));
+    b.errs = calloc(b.count + 1, sizeof(*b.errs));
+    b.errmsgs = calloc(b.count + 1, sizeof(*b.errmsgs));
+    if (!b.src || !b.dst || !b.errs || !b.errmsgs) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    /* out_dir/<name without extension><ext> */
+    for (size_t i = 0; i < b.count; i++) {
+        if (!PyArg_Parse(PySequence_Fast_GET_ITEM(seq, i), "s", &b.src[i])) {
+            goto out;
+        }
+
+        b.dst[i] = output_path(b.src[i], out_dir, ext);
+        if (!b.dst[i]) {
+            PyErr_NoMemory();
+            goto out;
+        }
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    lanes = threads ? threads : (size_t) pool_threads();
+    if (lanes > b.count) {
+        lanes = b.count;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    parallel_for(lanes, export_lane, &b);
+    Py_END_ALLOW_THREADS
+
+    for (size_t i = 0; i < b.count; i++) {
+        if (b.errs[i]) {
+            raise_dng_error(dng_fail(b.errs[i], "%s: %s", b.src[i], b.errmsgs[i]));
+            goto out;
+        }
+    }
+
+    result = PyList_New(b.count);
+    if (!result) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < b.count; i++) {
+        PyObject *path = PyUnicode_FromString(b.dst[i]);
+
+        if (!path) {
+            Py_CLEAR(result);
+            goto out;
+        }
+        PyList_SET_ITEM(result, i, path);
+    }
+
+out:
+    if (b.dst) {
+        for (size_t i = 0; i < b.count; i++) {
+            free((char *) b.dst[i]);
+        }
+    }
+    free(b.errmsgs);
+    free(b.errs);
+    free(b.dst);
+    free(b.src);
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *tiffutils_recompress(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "paths", "compression", "threads", "out_dir", "rate_limit", NULL
+    };
+
+    PyObject *paths, *seq, *result = NULL;
+    char *compression = "deflate";
+    char *out_dir = NULL;
+    unsigned int threads = 0;
+    unsigned long long rate_limit = 0;
+    struct recompress_batch b = {0};
+    size_t lanes;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|sIzK", kwlist, &paths,
+                                     &compression, &threads, &out_dir,
+                                     &rate_limit)) {
+        return NULL;
+    }
+
+    if (!strcmp(compression, "deflate")) {
+        b.compression = COMPRESSION_ADOBE_DEFLATE;
+    }
+    else if (!strcmp(compression, "none")) {
+        b.compression = COMPRESSION_NONE;
+    }
+    else if (!strcmp(compression, "lj92") || !strcmp(compression, "jxl")) {
+        PyErr_Format(PyExc_ValueError, "No %s encoder is available", compression);
+        return NULL;
+    }
+    else {
+        PyErr_SetString(PyExc_ValueError, "compression must be 'deflate' or 'none'");
+        return NULL;
+    }
+
+    seq = PySequence_Fast(paths, "paths must be a sequence");
+    if (!seq) {
+        return NULL;
+    }
+
+    b.count = PySequence_Fast_GET_SIZE(seq);
+    b.src = calloc(b.count + 1, sizeof(*b.src));
+    b.dst = calloc(b.count + 1, sizeof(*b.dst));
+    b.errs = calloc(b.count + 1, sizeof(*b.errs));
+    b.errmsgs = calloc(b.count + 1, sizeof(*b.errmsgs));
+    if (!b.src || !b.dst || !b.errs || !b.errmsgs) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    /* out_dir/<name>, or the file itself */
+    for (size_t i = 0; i < b.count; i++) {
+        if (!PyArg_Parse(PySequence_Fast_GET_ITEM(seq, i), "s", &b.src[i])) {
+            goto out;
+        }
+
+        if (!out_dir) {
+            continue;
+        }
+
+        b.dst[i] = output_path(b.src[i], out_dir, NULL);
+        if (!b.dst[i]) {
+            PyErr_NoMemory();
+            goto out;
+        }
+    }
+
+    pthread_mutex_init(&b.rate.lock, NULL);
+    b.rate.rate = rate_limit;
+    b.rate.start = monotonic_ns();
+
+    lanes = threads ? threads : (size_t) pool_threads();
+    if (lanes > b.count) {
+        lanes = b.count;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    parallel_for(lanes, recompress_lane, &b);
+    Py_END_ALLOW_THREADS
+
+    pthread_mutex_destroy(&b.rate.lock);
+
+    for (size_t i = 0; i < b.count; i++) {
+        if (b.errs[i]) {
+            raise_dng_error(dng_fail(b.errs[i], "%s: %s", b.src[i], b.errmsgs[i]));
+            goto out;
+        }
+    }
+
+    result = PyList_New(b.count);
+    if (!result) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < b.count; i++) {
+        PyObject *path = PyUnicode_FromString(b.dst[i] ? b.dst[i] : b.src[i]);
+
+        if (!path) {
+            Py_CLEAR(result);
+            goto out;
+        }
+        PyList_SET_ITEM(result, i, path);
+    }
+
+out:
+    if (b.dst) {
+        for (size_t i = 0; i < b.count; i++) {
+            free((char *) b.dst[i]);
+        }
+    }
+    free(b.errmsgs);
+    free(b.errs);
+    free(b.dst);
+    free(b.src);
+    Py_DECREF(seq);
+    return result;
+}
+
+/*
+ * Multi-frame files
+ *
+ * Each frame is written as a top-level IFD (with any preview and pyramid
+ * levels in its SubIFDs), tagged as a complete DNG, so every frame is
+ * self-describing.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    TIFF *tiff;
+    pthread_mutex_t lock;       /* serializes writes with the GIL released */
+    struct dng_options opts;
+    unsigned short bits_per_sample;
+    unsigned short planar;
+    unsigned int frames;
+    FILE *index;                /* index file, or NULL if not indexing */
+    uint64_t index_frames;      /* frames in the index file */
+    uint64_t last_ifd;          /* first IFD of the last frame in the file */
+    uint64_t durable;           /* frames on disk as of the last checkpoint */
+    unsigned int checkpoint;    /* frames between checkpoints, 0 for none */
+} MultiFrameWriter;
+
+static void MultiFrameWriter_dealloc(MultiFrameWriter *self) {
+    if (self->tiff) {
+        TIFFClose(self->tiff);
+    }
+    if (self->index) {
+        fclose(self->index);
+    }
+    free((char *) self->opts.camera);
+    free_dng_options(&self->opts);
+    pthread_mutex_destroy(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *MultiFrameWriter_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    MultiFrameWriter *self = (MultiFrameWriter *) type->tp_alloc(type, 0);
+
+    if (self) {
+        pthread_mutex_init(&self->lock, NULL);
+    }
+
+    return (PyObject *) self;
+}
+
+static int MultiFrameWriter_init(MultiFrameWriter *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "path", "camera", "cfa_pattern", "color_matrix1", "color_matrix2",
+        "calibration_illuminant1", "calibration_illuminant2", "compression",
+        "bits_per_sample", "planar_config", "preview", "pyramid_levels",
+        "append", "index", "checkpoint", "bigtiff", NULL
+    };
+
+    PyObject *color_matrix1_ndarray = Py_None;
+    PyObject *color_matrix2_ndarray = Py_None;
+    struct dng_options opts = {
+        .camera = "Unknown",
+        .pattern = CFA_RGGB,
+    };
+    unsigned int compression = 0;
+    unsigned short planar = PLANARCONFIG_CONTIG;
+    unsigned int checkpoint = 0;
+    int append = 0, index = 0, bigtiff = 0, err = 0;
+    FILE *index_file = NULL;
+    char *path, *index_path;
+
+    if (self->tiff) {
+        PyErr_SetString(PyExc_ValueError, "MultiFrameWriter already open");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|sIOOHHIHHIIppIp", kwlist, &path,
+                                     &opts.camera, &opts.pattern,
+                                     &color_matrix1_ndarray,
+                                     &color_matrix2_ndarray,
+                                     &opts.calibration_illuminant1,
+                                     &opts.calibration_illuminant2,
+                                     &compression, &self->bits_per_sample,
+                                     &planar, &opts.preview,
+                                     &opts.pyramid_levels, &append, &index,
+                                     &checkpoint, &bigtiff)) {
+        return -1;
+    }
+
+    /* Checkpoints are recorded in the index */
+    index = index || checkpoint;
+
+    opts.compression = compression;
+
+    if (handle_dng_options(color_matrix1_ndarray, color_matrix2_ndarray, &opts)) {
+        return -1;
+    }
+
+    /* camera is borrowed from the argument */
+    opts.camera = strdup(opts.camera);
+    if (!opts.camera) {
+        free_dng_options(&opts);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    self->index_frames = 0;
+    self->last_ifd = 0;
+    self->durable = 0;
+
+    if (index) {
+        index_path = malloc(strlen(path) + sizeof(INDEX_SUFFIX));
+        if (!index_path) {
+            free((char *) opts.camera);
+            free_dng_options(&opts);
+            PyErr_NoMemory();
+            return -1;
+        }
+        sprintf(index_path, "%s" INDEX_SUFFIX, path);
+
+        Py_BEGIN_ALLOW_THREADS
+        if (append) {
+            err = index_resume(path, index_path, &index_file, &self->index_frames,
+                               &self->last_ifd);
+        }
+        else {
+            struct frame_index empty = {0};
+
+            err = index_save(index_path, &empty, 0, 0, &index_file);
+        }
+        Py_END_ALLOW_THREADS
+
+        free(index_path);
+        if (err) {
+            free((char *) opts.camera);
+            free_dng_options(&opts);
+            raise_dng_error(err);
+            return -1;
+        }
+    }
+
+    self->tiff = TIFFOpen(path, append ? "a" : bigtiff ? "w8" : "w");
+    if (!self->tiff) {
+        if (index_file) {
+            fclose(index_file);
+        }
+        free((char *) opts.camera);
+        free_dng_options(&opts);
+        PyErr_SetString(PyExc_IOError, "libtiff failed to open file for writing.");
+        return -1;
+    }
+
+    /* Frames already in the file start out durable */
+    if (checkpoint && self->index_frames) {
+        Py_BEGIN_ALLOW_THREADS
+        err = index_checkpoint(index_file, self->tiff, self->index_frames);
+        Py_END_ALLOW_THREADS
+
+        if (err) {
+            TIFFClose(self->tiff);
+            self->tiff = NULL;
+            fclose(index_file);
+            free((char *) opts.camera);
+            free_dng_options(&opts);
+            raise_dng_error(err);
+            return -1;
+        }
+        self->durable = self->index_frames;
+    }
+
+    self->opts = opts;
+    self->planar = planar;
+    self->frames = 0;
+    self->index = index_file;
+    self->checkpoint = checkpoint;
+
+    return 0;
+}
+
+static PyObject *MultiFrameWriter_write(MultiFrameWriter *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "image", "timestamp", NULL
+    };
+
+    PyArrayObject *array;
+    PyObject *timestamp = Py_None;
+    struct strip_layout layout = {
+        .planar = self->planar,
+    };
+    struct strip_table strips = {0};
+    struct dng_options opts;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &array, &timestamp)) {
+        return NULL;
+    }
+
+    if (!self->tiff) {
+        PyErr_SetString(PyExc_ValueError, "MultiFrameWriter is closed");
+        return NULL;
+    }
+
+    if (PyArray_to_layout(array, self->bits_per_sample, &layout)) {
+        return NULL;
+    }
+
+    opts = self->opts;
+    if (timestamp == Py_None) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        opts.timestamp = now.tv_sec + now.tv_nsec / 1e9;
+    }
+    else {
+        opts.timestamp = PyFloat_AsDouble(timestamp);
+        if (opts.timestamp == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->lock);
+    err = write_dng(self->tiff, &opts, &layout, PyArray_BYTES(array),
+                    self->index ? &strips : NULL);
+    if (!err && self->index) {
+        struct index_record rec = {
+            .timestamp = opts.timestamp,
+        };
+
+        record_from_layout(&rec, &layout, 0, layout.samples == 1 ? (int) opts.pattern : -1);
+        err = index_append(self->index, self->tiff, &self->index_frames,
+                           &self->last_ifd, self->durable, &rec, &strips);
+    }
+    if (!err && self->checkpoint &&
+        self->index_frames - self->durable >= self->checkpoint) {
+        err = index_checkpoint(self->index, self->tiff, self->index_frames);
+        if (!err) {
+            self->durable = self->index_frames;
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+    Py_END_ALLOW_THREADS
+
+    free(strips.offsets);
+
+    if (err) {
+        return raise_dng_error(err);
+    }
+
+    return PyLong_FromUnsignedLong(self->frames++);
+}
+
+static PyObject *MultiFrameWriter_checkpoint(MultiFrameWriter *self, PyObject *unused) {
+    int err;
+
+    if (!self->tiff) {
+        PyErr_SetString(PyExc_ValueError, "MultiFrameWriter is closed");
+        return NULL;
+    }
+
+    if (!self->index) {
+        PyErr_SetString(PyExc_ValueError, "MultiFrameWriter has no index");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->lock);
+    err = index_checkpoint(self->index, self->tiff, self->index_frames);
+    if (!err) {
+        self->durable = self->index_frames;
+    }
+    pthread_mutex_unlock(&self->lock);
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        return raise_dng_error(err);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *MultiFrameWriter_close(MultiFrameWriter *self, PyObject *unused) {
+    int err = 0;
+
+    if (self->tiff) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->lock);
+        if (self->checkpoint && self->durable != self->index_frames) {
+            err = index_checkpoint(self->index, self->tiff, self->index_frames);
+        }
+        TIFFClose(self->tiff);
+        self->tiff = NULL;
+        if (self->index) {
+            fclose(self->index);
+            self->index = NULL;
+        }
+        pthread_mutex_unlock(&self->lock);
+        Py_END_ALLOW_THREADS
+    }
+
+    free((char *) self->opts.camera);
+    self->opts.camera = NULL;
+
+    if (err) {
+        return raise_dng_error(err);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *MultiFrameWriter_enter(PyObject *self, PyObject *unused) {
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject *MultiFrameWriter_exit(MultiFrameWriter *self, PyObject *args) {
+    PyObject *result = MultiFrameWriter_close(self, NULL);
+
+    if (!result) {
+        return NULL;
+    }
+    Py_DECREF(result);
+
+    Py_INCREF(Py_False);
+    return Py_False;
+}
+
+static PyObject *MultiFrameWriter_get_frames(MultiFrameWriter *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->frames);
+}
+
+static PyMethodDef MultiFrameWriter_methods[] = {
+    {"write", (PyCFunction) MultiFrameWriter_write, METH_VARARGS | METH_KEYWORDS,
+        "write(image, [timestamp=None]) -> frame index\n\n"
+        "Append an image as the next frame.  The image is saved as by\n"
+        "save_dng, with the options given to the writer.  The frame's\n"
+        "DateTime is timestamp, in seconds since the epoch, or the current\n"
+        "time if None.\n\n"
+        "Raises:\n"
+        "    TypeError: image not ndarray\n"
+        "    ValueError: ndarray incorrect layout, dimensions, or dtype, or\n"
+        "        writer closed\n"
+        "    IOError: frame could not be written"
+    },
+    {"checkpoint", (PyCFunction) MultiFrameWriter_checkpoint, METH_NOARGS,
+        "checkpoint()\n\n"
+        "Sync the file and then the index, making every frame written so\n"
+        "far durable.\n\n"
+        "Raises:\n"
+        "    ValueError: writer closed, or not indexing\n"
+        "    IOError: file or index could not be synced"
+    },
+    {"close", (PyCFunction) MultiFrameWriter_close, METH_NOARGS,
+        "close()\n\n"
+        "Finish the file, with a final checkpoint if checkpointing.\n"
+        "Further writes raise ValueError."
+    },
+    {"__enter__", (PyCFunction) MultiFrameWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) MultiFrameWriter_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef MultiFrameWriter_getset[] = {
+    {"frames", (getter) MultiFrameWriter_get_frames, NULL,
+        "Frames written by this writer", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject MultiFrameWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "tiffutils.MultiFrameWriter",
+    .tp_basicsize = sizeof(MultiFrameWriter),
+    .tp_dealloc = (destructor) MultiFrameWriter_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "MultiFrameWriter(path, [camera='Unknown',\n"
+        "   cfa_pattern=tiffutils.CFA_RGGB, color_matrix1=None,\n"
+        "   color_matrix2=None, calibration_illuminant1=0,\n"
+        "   calibration_illuminant2=0, compression=False, bits_per_sample=0,\n"
+        "   planar_config=tiffutils.PLANARCONFIG_CONTIG, preview=0,\n"
+        "   pyramid_levels=0, append=False, index=False, checkpoint=0,\n"
+        "   bigtiff=False])\n\n"
+        "Write many frames to one file, each as a new top-level directory,\n"
+        "avoiding a file per frame.  The options apply to every frame, and\n"
+        "are as for save_dng.  With append, frames are added after those\n"
+        "already in path.  With index, the offsets, timestamps and strip\n"
+        "tables of all frames are kept in the sidecar file path + '.idx',\n"
+        "which MultiFrameReader uses to reach any frame without walking the\n"
+        "file.  With checkpoint, frames are not synced as they are written,\n"
+        "but every checkpoint frames the file and then the index are\n"
+        "synced, and recover() can restore the file after a crash.  A\n"
+        "checkpoint implies index.  With bigtiff, the file is BigTIFF, so\n"
+        "it may grow past the 4 GiB of classic TIFF; appending keeps the\n"
+        "format of the file.  Usable as a context manager.",
+    .tp_methods = MultiFrameWriter_methods,
+    .tp_getset = MultiFrameWriter_getset,
+    .tp_init = (initproc) MultiFrameWriter_init,
+    .tp_new = MultiFrameWriter_new,
+};
+
+typedef struct {
+    PyObject_HEAD
+    TIFF *tiff;
+    pthread_mutex_t lock;       /* serializes reads with the GIL released */
+    struct frame_index idx;
+    int stale;                  /* index file missing or incomplete */
+} MultiFrameReader;
+
+static void MultiFrameReader_dealloc(MultiFrameReader *self) {
+    if (self->tiff) {
+        TIFFClose(self->tiff);
+    }
+    index_free(&self->idx);
+    pthread_mutex_destroy(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *MultiFrameReader_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    MultiFrameReader *self = (MultiFrameReader *) type->tp_alloc(type, 0);
+
+    if (self) {
+        pthread_mutex_init(&self->lock, NULL);
+    }
+
+    return (PyObject *) self;
+}
+
+static int MultiFrameReader_init(MultiFrameReader *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "path", "index", NULL
+    };
+
+    char *path, *index_path;
+    int index = 1;
+    int err;
+
+    if (self->tiff) {
+        PyErr_SetString(PyExc_ValueError, "MultiFrameReader already open");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|p", kwlist, &path, &index)) {
+        return -1;
+    }
+
+    index_path = malloc(strlen(path) + sizeof(INDEX_SUFFIX));
+    if (!index_path) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    sprintf(index_path, "%s" INDEX_SUFFIX, path);
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    self->tiff = TIFFOpen(path, "r");
+    if (!self->tiff) {
+        free(index_path);
+        PyErr_SetString(PyExc_IOError, "Failed to open file");
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (index) {
+        err = index_open(self->tiff, index_path, &self->idx, &self->stale);
+    }
+    else {
+        memset(&self->idx, 0, sizeof(self->idx));
+        self->stale = 0;
+        err = index_scan(self->tiff, &self->idx);
+    }
+    Py_END_ALLOW_THREADS
+
+    free(index_path);
+
+    if (err) {
+        raise_dng_error(err);
+        TIFFClose(self->tiff);
+        self->tiff = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static Py_ssize_t MultiFrameReader_len(MultiFrameReader *self) {
+    return self->idx.frames;
+}
+
+/*
+ * Resolve a frame index, which may count from the last frame
+ *
+ * @returns frame index, or -1 with exception set
+ */
+static Py_ssize_t MultiFrameReader_frame(MultiFrameReader *self, Py_ssize_t index) {
+    if (!self->tiff) {
+        PyErr_SetString(PyExc_ValueError, "MultiFrameReader is closed");
+        return -1;
+    }
+
+    if (index < 0) {
+        index += self->idx.frames;
+    }
+
+    if (index < 0 || index >= self->idx.frames) {
+        PyErr_SetString(PyExc_IndexError, "frame index out of range");
+        return -1;
+    }
+
+    return index;
+}
+
+/*
+ * Load a raw image from its strip table, bypassing libtiff
+ *
+ * pread() leaves the file position alone, so this doesn't take the lock.
+ */
+static PyObject *MultiFrameReader_load_direct(MultiFrameReader *self, Py_ssize_t index) {
+    const struct index_record *rec = &self->idx.records[index];
+    struct strip_layout layout;
+    PyObject *array, *cfa;
+    int err;
+
+    layout_from_record(&layout, rec);
+
+    array = layout_array(&layout);
+    if (!array) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = read_strips_direct(TIFFFileno(self->tiff), &layout, self->idx.strips[index],
+                             PyArray_DATA((PyArrayObject *) array));
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        Py_DECREF(array);
+        return raise_dng_error(err);
+    }
+
+    cfa = cfa_object(rec->pattern);
+    if (!cfa) {
+        Py_DECREF(array);
+        return NULL;
+    }
+
+    return Py_BuildValue("(NN)", array, cfa);
+}
+
+static PyObject *MultiFrameReader_load(MultiFrameReader *self, Py_ssize_t index,
+                                       unsigned int level) {
+    PyObject *result;
+    int ok;
+
+    index = MultiFrameReader_frame(self, index);
+    if (index < 0) {
+        return NULL;
+    }
+
+    if (!level && self->idx.records[index].nstrips) {
+        return MultiFrameReader_load_direct(self, index);
+    }
+
+    /*
+     * The lock is held across load_directory(), which releases the GIL
+     * while decoding, as the directory must not move under it
+     */
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->lock);
+    ok = TIFFSetSubDirectory(self->tiff, self->idx.records[index].ifd_offset);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        pthread_mutex_unlock(&self->lock);
+        PyErr_SetString(PyExc_IOError, "Failed to read frame directory");
+        return NULL;
+    }
+
+    result = load_directory(self->tiff, level, NULL);
+    pthread_mutex_unlock(&self->lock);
+
+    return result;
+}
+
+static PyObject *MultiFrameReader_read(MultiFrameReader *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "index", "level", NULL
+    };
+
+    Py_ssize_t index;
+    unsigned int level = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|I", kwlist, &index, &level)) {
+        return NULL;
+    }
+
+    return MultiFrameReader_load(self, index, level);
+}
+
+static PyObject *MultiFrameReader_item(MultiFrameReader *self, Py_ssize_t index) {
+    return MultiFrameReader_load(self, index, 0);
+}
+
+static PyObject *MultiFrameReader_timestamp(MultiFrameReader *self, PyObject *args) {
+    Py_ssize_t index;
+    double timestamp;
+
+    if (!PyArg_ParseTuple(args, "n", &index)) {
+        return NULL;
+    }
+
+    index = MultiFrameReader_frame(self, index);
+    if (index < 0) {
+        return NULL;
+    }
+
+    timestamp = self->idx.records[index].timestamp;
+    if (!timestamp) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    return PyFloat_FromDouble(timestamp);
+}
+
+static PyObject *MultiFrameReader_get_stale(MultiFrameReader *self, void *closure) {
+    return PyBool_FromLong(self->stale);
+}
+
+static PyObject *MultiFrameReader_close(MultiFrameReader *self, PyObject *unused) {
+    if (self->tiff) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->lock);
+        TIFFClose(self->tiff);
+        self->tiff = NULL;
+        pthread_mutex_unlock(&self->lock);
+        Py_END_ALLOW_THREADS
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *MultiFrameReader_exit(MultiFrameReader *self, PyObject *args) {
+    PyObject *result = MultiFrameReader_close(self, NULL);
+
+    if (!result) {
+        return NULL;
+    }
+    Py_DECREF(result);
+
+    Py_INCREF(Py_False);
+    return Py_False;
+}
+
+static PyMethodDef MultiFrameReader_methods[] = {
+    {"read", (PyCFunction) MultiFrameReader_read, METH_VARARGS | METH_KEYWORDS,
+        "read(index, [level=0]) -> (image, cfa)\n\n"
+        "Load a frame, as load_dng loads a file.  Negative indices count\n"
+        "from the last frame.\n\n"
+        "Raises:\n"
+        "   IndexError: No such frame\n"
+        "   IOError: Unable to read frame\n"
+        "   ValueError: Unsupported DNG format, or reader closed\n"
+    },
+    {"timestamp", (PyCFunction) MultiFrameReader_timestamp, METH_VARARGS,
+        "timestamp(index) -> seconds since the epoch, or None\n\n"
+        "Time a frame was captured, from its DateTime, to the second\n"
+        "unless recorded in the index.\n\n"
+        "Raises:\n"
+        "   IndexError: No such frame\n"
+        "   ValueError: Reader closed\n"
+    },
+    {"close", (PyCFunction) MultiFrameReader_close, METH_NOARGS,
+        "close()\n\n"
+        "Close the file.  Further reads raise ValueError."
+    },
+    {"__enter__", (PyCFunction) MultiFrameWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) MultiFrameReader_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef MultiFrameReader_getset[] = {
+    {"stale", (getter) MultiFrameReader_get_stale, NULL,
+        "Whether the index file was missing or incomplete", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PySequenceMethods MultiFrameReader_as_sequence = {
+    .sq_length = (lenfunc) MultiFrameReader_len,
+    .sq_item = (ssizeargfunc) MultiFrameReader_item,
+};
+
+static PyTypeObject MultiFrameReaderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "tiffutils.MultiFrameReader",
+    .tp_basicsize = sizeof(MultiFrameReader),
+    .tp_dealloc = (destructor) MultiFrameReader_dealloc,
+    .tp_as_sequence = &MultiFrameReader_as_sequence,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "MultiFrameReader(path, [index=True])\n\n"
+        "Read frames of a file written by MultiFrameWriter, or of any\n"
+        "multi-directory DNG or TIFF.  The offset of every frame is read\n"
+        "once on opening, from the index file path + '.idx' when there is\n"
+        "one, walking on from its last frame if it is stale.  Frames whose\n"
+        "strips are indexed are read straight from the file, in parallel.\n"
+        "reader[k] loads frame k as load_dng does.  Usable as a context\n"
+        "manager.",
+    .tp_methods = MultiFrameReader_methods,
+    .tp_getset = MultiFrameReader_getset,
+    .tp_init = (initproc) MultiFrameReader_init,
+    .tp_new = MultiFrameReader_new,
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct cinema_io io;
+    int open;
+    struct cinema_template template;
+    struct cinema_frame slots[2];   /* frames alternate between slots */
+    PyObject *images[2];            /* arrays templated frames borrow */
+    struct dng_options opts;
+    unsigned short bits_per_sample;
+    unsigned short planar;
+    double fps;
+    char *dir;
+    char *name;
+    unsigned long long start_frame;
+    unsigned int frames;
+} CinemaDNGWriter;
+
+/*
+ * Wait for the I/O thread and release the arrays of written frames
+ *
+ * @returns 0 on success, negative with exception set if a frame failed
+ */
+static int CinemaDNGWriter_wait(CinemaDNGWriter *self) {
+    int err;
+
+    Py_BEGIN_ALLOW_THREADS
+    err = cinema_io_wait(&self->io);
+    Py_END_ALLOW_THREADS
+
+    Py_CLEAR(self->images[0]);
+    Py_CLEAR(self->images[1]);
+
+    if (err) {
+        raise_dng_error(err);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void CinemaDNGWriter_release(CinemaDNGWriter *self) {
+    if (self->open) {
+        Py_BEGIN_ALLOW_THREADS
+        cinema_io_stop(&self->io);
+        Py_END_ALLOW_THREADS
+        self->open = 0;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        free(self->slots[i].path);
+        free(self->slots[i].encoded.data);
+        Py_CLEAR(self->images[i]);
+    }
+    memset(self->slots, 0, sizeof(self->slots));
+
+    cinema_template_free(&self->template);
+    free((char *) self->opts.camera);
+    free_dng_options(&self->opts);
+    memset(&self->opts, 0, sizeof(self->opts));
+    free(self->dir);
+    free(self->name);
+    self->dir = self->name = NULL;
+}
+
+static void CinemaDNGWriter_dealloc(CinemaDNGWriter *self) {
+    CinemaDNGWriter_release(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int CinemaDNGWriter_init(CinemaDNGWriter *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "dir", "fps", "camera", "cfa_pattern", "color_matrix1", "color_matrix2",
+        "calibration_illuminant1", "calibration_illuminant2", "compression",
+        "bits_per_sample", "planar_config", "preview", "pyramid_levels",
+        "name", "start_frame", NULL
+    };
+
+    PyObject *color_matrix1_ndarray = Py_None;
+    PyObject *color_matrix2_ndarray = Py_None;
+    struct dng_options opts = {
+        .camera = "Unknown",
+        .pattern = CFA_RGGB,
+    };
+    unsigned int compression = 0;
+    unsigned short planar = PLANARCONFIG_CONTIG;
+    unsigned long long start_frame = 0;
+    char *dir, *name = NULL;
+    double fps;
+    int err;
+
+    if (self->open) {
+        PyErr_SetString(PyExc_ValueError, "CinemaDNGWriter already open");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sd|sIOOHHIHHIIzK", kwlist, &dir, &fps,
+                                     &opts.camera, &opts.pattern,
+                                     &color_matrix1_ndarray,
+                                     &color_matrix2_ndarray,
+                                     &opts.calibration_illuminant1,
+                                     &opts.calibration_illuminant2,
+                                     &compression, &self->bits_per_sample,
+                                     &planar, &opts.preview,
+                                     &opts.pyramid_levels, &name, &start_frame)) {
+        return -1;
+    }
+
+    if (!(fps > 0)) {
+        PyErr_SetString(PyExc_ValueError, "fps must be positive");
+        return -1;
+    }
+
+    opts.compression = compression;
+
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, dir);
+        return -1;
+    }
+
+    if (handle_dng_options(color_matrix1_ndarray, color_matrix2_ndarray, &opts)) {
+        return -1;
+    }
+
+    /* Frames are named after the directory by default */
+    self->dir = strdup(dir);
+    if (!name && self->dir) {
+        size_t len = strlen(dir);
+        const char *base;
+
+        while (len > 1 && dir[len - 1] == '/') {
+            len--;
+        }
+        self->dir[len] = '\0';
+        base = strrchr(self->dir, '/');
+        name = base && base[1] ? (char *) base + 1 : self->dir;
+    }
+    self->name = self->dir ? strdup(name) : NULL;
+
+    /* camera is borrowed from the argument */
+    opts.camera = strdup(opts.camera);
+
+    self->opts = opts;
+    if (!self->dir || !self->name || !opts.camera) {
+        CinemaDNGWriter_release(self);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    err = cinema_io_start(&self->io);
+    if (err) {
+        CinemaDNGWriter_release(self);
+        raise_dng_error(err);
+        return -1;
+    }
+
+    self->open = 1;
+    self->planar = planar;
+    self->fps = fps;
+    self->start_frame = start_frame;
+    self->frames = 0;
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    return 0;
+}
+
+static PyObject *CinemaDNGWriter_write(CinemaDNGWriter *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "image", NULL
+    };
+
+    PyArrayObject *array;
+    struct strip_layout layout = {
+        .planar = self->planar,
+    };
+    struct cinema_frame *frame;
+    struct dng_options opts;
+    struct timespec now;
+    uint8_t timecode[8];
+    unsigned long long number;
+    int err, io_err;
+    char *path;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &array)) {
+        return NULL;
+    }
+
+    if (!self->open) {
+        PyErr_SetString(PyExc_ValueError, "CinemaDNGWriter is closed");
+        return NULL;
+    }
+
+    if (PyArray_to_layout(array, self->bits_per_sample, &layout)) {
+        return NULL;
+    }
+
+    number = self->start_frame + self->frames;
+    path = malloc(strlen(self->dir) + strlen(self->name) + 32);
+    if (!path) {
+        return PyErr_NoMemory();
+    }
+    sprintf(path, "%s/%s_%06llu.dng", self->dir, self->name, number);
+
+    /* The slot of the frame before last, which has been written */
+    frame = &self->slots[self->frames % 2];
+    free(frame->path);
+    frame->path = path;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    cinema_timecode(number, self->fps, timecode);
+
+    opts = self->opts;
+    opts.timestamp = now.tv_sec + now.tv_nsec / 1e9;
+    opts.timecode = timecode;
+    opts.frame_rate = self->fps;
+
+    /* Encode while the last frame is written, then hand this one over */
+    Py_BEGIN_ALLOW_THREADS
+    err = cinema_encode(&self->template, frame, &opts, &layout, PyArray_BYTES(array));
+    io_err = cinema_io_wait(&self->io);
+    if (!err && !io_err) {
+        cinema_io_submit(&self->io, frame);
+    }
+    Py_END_ALLOW_THREADS
+
+    /* The last frame is written */
+    Py_CLEAR(self->images[(self->frames + 1) % 2]);
+
+    if (err || io_err) {
+        return raise_dng_error(io_err ? io_err : err);
+    }
+
+    if (frame->image) {
+        Py_INCREF(array);
+        self->images[self->frames % 2] = (PyObject *) array;
+    }
+
+    self->frames++;
+    return PyLong_FromUnsignedLongLong(number);
+}
+
+static PyObject *CinemaDNGWriter_flush(CinemaDNGWriter *self, PyObject *unused) {
+    if (self->open && CinemaDNGWriter_wait(self)) {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *CinemaDNGWriter_close(CinemaDNGWriter *self, PyObject *unused) {
+    int err = 0;
+
+    if (self->open) {
+        err = CinemaDNGWriter_wait(self);
+        CinemaDNGWriter_release(self);
+    }
+
+    if (err) {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *CinemaDNGWriter_exit(CinemaDNGWriter *self, PyObject *args) {
+    PyObject *result = CinemaDNGWriter_close(self, NULL);
+
+    if (!result) {
+        return NULL;
+    }
+    Py_DECREF(result);
+
+    Py_INCREF(Py_False);
+    return Py_False;
+}
+
+static PyObject *CinemaDNGWriter_get_frames(CinemaDNGWriter *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->frames);
+}
+
+static PyMethodDef CinemaDNGWriter_methods[] = {
+    {"write", (PyCFunction) CinemaDNGWriter_write, METH_VARARGS | METH_KEYWORDS,
+        "write(image) -> frame number\n\n"
+        "Encode an image as the next frame of the sequence, and queue it\n"
+        "to be written while the caller moves on.  The image is saved as\n"
+        "by save_dng, with the options given to the writer.  An\n"
+        "uncompressed image is written straight from the array, which\n"
+        "must not be modified until the next write(), flush() or close().\n\n"
+        "Raises:\n"
+        "    TypeError: image not ndarray\n"
+        "    ValueError: ndarray incorrect layout, dimensions, or dtype, or\n"
+        "        writer closed\n"
+        "    IOError: this or the previous frame could not be written"
+    },
+    {"flush", (PyCFunction) CinemaDNGWriter_flush, METH_NOARGS,
+        "flush()\n\n"
+        "Wait until every frame has been written.\n\n"
+        "Raises:\n"
+        "    IOError: the last frame could not be written"
+    },
+    {"close", (PyCFunction) CinemaDNGWriter_close, METH_NOARGS,
+        "close()\n\n"
+        "Write any queued frame and stop.  Further writes raise ValueError."
+    },
+    {"__enter__", (PyCFunction) MultiFrameWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) CinemaDNGWriter_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef CinemaDNGWriter_getset[] = {
+    {"frames", (getter) CinemaDNGWriter_get_frames, NULL,
+        "Frames written by this writer", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject CinemaDNGWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "tiffutils.CinemaDNGWriter",
+    .tp_basicsize = sizeof(CinemaDNGWriter),
+    .tp_dealloc = (destructor) CinemaDNGWriter_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "CinemaDNGWriter(dir, fps, [camera='Unknown',\n"
+        "   cfa_pattern=tiffutils.CFA_RGGB, color_matrix1=None,\n"
+        "   color_matrix2=None, calibration_illuminant1=0,\n"
+        "   calibration_illuminant2=0, compression=False, bits_per_sample=0,\n"
+        "   planar_config=tiffutils.PLANARCONFIG_CONTIG, preview=0,\n"
+        "   pyramid_levels=0, name=None, start_frame=0])\n\n"
+        "Write an image sequence as CinemaDNG: a DNG per frame in dir,\n"
+        "named <name>_<frame number>.dng, with name defaulting to the name\n"
+        "of dir.  Each frame carries its SMPTE time code in TimeCodes,\n"
+        "counted from start_frame, and fps in FrameRate.  The other\n"
+        "options apply to every frame, and are as for save_dng.\n\n"
+        "Each frame is encoded in memory and written by a background\n"
+        "thread while the next is encoded.  Uncompressed frames after the\n"
+        "first are written from a template of its directory, with only\n"
+        "the time code and date patched.  Usable as a context manager.",
+    .tp_methods = CinemaDNGWriter_methods,
+    .tp_getset = CinemaDNGWriter_getset,
+    .tp_init = (initproc) CinemaDNGWriter_init,
+    .tp_new = PyType_GenericNew,
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct capture c;
+    int open;
+    PyArray_Descr *descr;       /* of each buffer */
+    int ndims;
+    npy_intp dims[3];
+} CaptureSession;
+
+static void CaptureSession_dealloc(CaptureSession *self) {
+    Py_BEGIN_ALLOW_THREADS
+    capture_stop(&self->c);
+    Py_END_ALLOW_THREADS
+
+    capture_free(&self->c);
+    free((char *) self->c.opts.camera);
+    free_dng_options(&self->c.opts);
+    Py_XDECREF(self->descr);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int CaptureSession_init(CaptureSession *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "shape", "dtype", "max_inflight_bytes", "writers", "on_full",
+        "lock_memory", "camera", "cfa_pattern", "color_matrix1",
+        "color_matrix2", "calibration_illuminant1", "calibration_illuminant2",
+        "compression", "bits_per_sample", "planar_config", "preview",
+        "pyramid_levels", NULL
+    };
+
+    static char dummy;
+
+    PyObject *shape, *seq, *array;
+    PyArray_Descr *descr = NULL;
+    PyObject *color_matrix1_ndarray = Py_None;
+    PyObject *color_matrix2_ndarray = Py_None;
+    struct capture *c = &self->c;
+    struct dng_options opts = {
+        .camera = "Unknown",
+        .pattern = CFA_RGGB,
+    };
+    unsigned int compression = 0;
+    unsigned short bits_per_sample = 0;
+    Py_ssize_t max_bytes = 256 << 20;
+    int writers = 0, lock = 0, err;
+    const char *on_full = "block";
+
+    if (self->open || c->pool) {
+        PyErr_SetString(PyExc_ValueError, "CaptureSession already open");
+        return -1;
+    }
+
+    c->l.planar = PLANARCONFIG_CONTIG;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O&nispsIOOHHIHHII", kwlist, &shape,
+                                     PyArray_DescrConverter2, &descr, &max_bytes,
+                                     &writers, &on_full, &lock,
+                                     &opts.camera, &opts.pattern,
+                                     &color_matrix1_ndarray,
+                                     &color_matrix2_ndarray,
+                                     &opts.calibration_illuminant1,
+                                     &opts.calibration_illuminant2,
+                                     &compression, &bits_per_sample,
+                                     &c->l.planar, &opts.preview,
+                                     &opts.pyramid_levels)) {
+        return -1;
+    }
+
+    if (!descr) {
+        descr = PyArray_DescrFromType(NPY_UINT16);
+    }
+
+    if (!strcmp(on_full, "block")) {
+        c->policy = CAPTURE_BLOCK;
+    }
+    else if (!strcmp(on_full, "drop_oldest")) {
+        c->policy = CAPTURE_DROP_OLDEST;
+    }
+    else if (!strcmp(on_full, "drop_newest")) {
+        c->policy = CAPTURE_DROP_NEWEST;
+    }
+    else {
+        PyErr_SetString(PyExc_ValueError,
+                        "on_full must be 'block', 'drop_oldest' or 'drop_newest'");
+        goto err_decref_descr;
+    }
+
+    if (writers < 0 || max_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "writers and max_inflight_bytes must be positive");
+        goto err_decref_descr;
+    }
+
+    seq = PySequence_Fast(shape, "shape must be a sequence");
+    if (!seq) {
+        goto err_decref_descr;
+    }
+
+    self->ndims = PySequence_Fast_GET_SIZE(seq);
+    for (int i = 0; i < self->ndims && i < 3; i++) {
+        self->dims[i] = PyLong_AsSsize_t(PySequence_Fast_GET_ITEM(seq, i));
+    }
+    Py_DECREF(seq);
+    if (PyErr_Occurred()) {
+        goto err_decref_descr;
+    }
+
+    if (self->ndims < 2 || self->ndims > 3 || self->dims[0] <= 0 || self->dims[1] <= 0) {
+        PyErr_SetString(PyExc_ValueError, "shape must be (height, width) or (height, width, 3)");
+        goto err_decref_descr;
+    }
+
+    /* Validate the buffers as save_dng validates its image, without data */
+    Py_INCREF(descr);
+    array = PyArray_NewFromDescr(&PyArray_Type, descr, self->ndims, self->dims, NULL,
+                                 &dummy, NPY_ARRAY_CARRAY, NULL);
+    if (!array) {
+        goto err_decref_descr;
+    }
+
+    err = PyArray_to_layout((PyArrayObject *) array, bits_per_sample, &c->l);
+    Py_DECREF(array);
+    if (err) {
+        goto err_decref_descr;
+    }
+
+    opts.compression = compression;
+
+    if (handle_dng_options(color_matrix1_ndarray, color_matrix2_ndarray, &opts)) {
+        goto err_decref_descr;
+    }
+
+    /* camera is borrowed from the argument */
+    opts.camera = strdup(opts.camera);
+    c->opts = opts;
+    if (!opts.camera) {
+        PyErr_NoMemory();
+        goto err_free;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    Py_BEGIN_ALLOW_THREADS
+    err = capture_start(c, max_bytes, writers ? writers : pool_threads(), lock);
+    if (err) {
+        capture_stop(c);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        raise_dng_error(err);
+        goto err_free;
+    }
+
+    self->descr = descr;
+    self->open = 1;
+    return 0;
+
+err_free:
+    capture_free(c);
+    free((char *) c->opts.camera);
+    free_dng_options(&c->opts);
+    memset(c, 0, sizeof(*c));
+err_decref_descr:
+    Py_DECREF(descr);
+    return -1;
+}
+
+/*
+ * Buffer number of a buffer handed out by a session
+ *
+ * @returns buffer number, or -1 with exception set
+ */
+static int64_t CaptureSession_slot(CaptureSession *self, PyObject *frame) {
+    const uint8_t *data;
+    size_t offset;
+
+    if (!self->open) {
+        PyErr_SetString(PyExc_ValueError, "CaptureSession is closed");
+        return -1;
+    }
+
+    if (!PyArray_Check(frame)) {
+        PyErr_SetString(PyExc_TypeError, "frame must be an ndarray from acquire()");
+        return -1;
+    }
+
+    data = (const uint8_t *) PyArray_DATA((PyArrayObject *) frame);
+    offset = data - self->c.pool;
+    if (data < self->c.pool || offset >= self->c.pool_bytes ||
+        offset % self->c.slot_bytes) {
+        PyErr_SetString(PyExc_ValueError, "frame must be an ndarray from acquire()");
+        return -1;
+    }
+
+    return offset / self->c.slot_bytes;
+}
+
+static PyObject *CaptureSession_acquire(CaptureSession *self, PyObject *unused) {
+    PyObject *array;
+    int64_t k;
+
+    if (!self->open) {
+        PyErr_SetString(PyExc_ValueError, "CaptureSession is closed");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    k = capture_acquire(&self->c);
+    Py_END_ALLOW_THREADS
+
+    if (k < 0) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    Py_INCREF(self->descr);
+    array = PyArray_NewFromDescr(&PyArray_Type, self->descr, self->ndims, self->dims,
+                                 NULL, self->c.pool + k * self->c.slot_bytes,
+                                 NPY_ARRAY_CARRAY, NULL);
+    if (!array) {
+        capture_release(&self->c, k);
+        return NULL;
+    }
+
+    /* The pool outlives the buffers */
+    Py_INCREF(self);
+    if (PyArray_SetBaseObject((PyArrayObject *) array, (PyObject *) self)) {
+        Py_DECREF(array);
+        capture_release(&self->c, k);
+        return NULL;
+    }
+
+    return array;
+}
+
+static PyObject *CaptureSession_submit(CaptureSession *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "frame", "filename", NULL
+    };
+
+    PyObject *frame;
+    char *filename, *path;
+    int64_t k;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os", kwlist, &frame, &filename)) {
+        return NULL;
+    }
+
+    k = CaptureSession_slot(self, frame);
+    if (k < 0) {
+        return NULL;
+    }
+
+    path = strdup(filename);
+    if (!path) {
+        return PyErr_NoMemory();
+    }
+
+    err = capture_submit(&self->c, k, path);
+    if (err) {
+        return raise_dng_error(err);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *CaptureSession_release(CaptureSession *self, PyObject *frame) {
+    int64_t k = CaptureSession_slot(self, frame);
+    int err;
+
+    if (k < 0) {
+        return NULL;
+    }
+
+    err = capture_release(&self->c, k);
+    if (err) {
+        return raise_dng_error(err);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *CaptureSession_close(CaptureSession *self, PyObject *unused) {
+    if (self->open) {
+        self->open = 0;
+
+        Py_BEGIN_ALLOW_THREADS
+        capture_stop(&self->c);
+        Py_END_ALLOW_THREADS
+
+        if (self->c.err) {
+            uint64_t failed = self->c.failed;
+
+            return raise_dng_error(dng_fail(self->c.err, "%" PRIu64 " frames failed, first %s: %s",
+                                            failed, self->c.errpath ? self->c.errpath : "",
+                                            self->c.errmsg));
+        }
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *CaptureSession_exit(CaptureSession *self, PyObject *args) {
+    PyObject *result = CaptureSession_close(self, NULL);
+
+    if (!result) {
+        return NULL;
+    }
+    Py_DECREF(result);
+
+    Py_INCREF(Py_False);
+    return Py_False;
+}
+
+static PyObject *CaptureSession_get_stats(CaptureSession *self, void *closure) {
+    struct capture *c = &self->c;
+    uint64_t written = __atomic_load_n(&c->written, __ATOMIC_RELAXED);
+    uint64_t total_ns = __atomic_load_n(&c->latency_total_ns, __ATOMIC_RELAXED);
+    int queued = 0;
+
+    if (c->slots) {
+        sem_getvalue(&c->ready_count, &queued);
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:i,s:d,s:d}",
+        "submitted", (unsigned long long) __atomic_load_n(&c->submitted, __ATOMIC_RELAXED),
+        "written", (unsigned long long) written,
+        "dropped", (unsigned long long) __atomic_load_n(&c->dropped, __ATOMIC_RELAXED),
+        "failed", (unsigned long long) __atomic_load_n(&c->failed, __ATOMIC_RELAXED),
+        "queued", queued > 0 ? queued : 0,
+        "latency_mean", written ? total_ns / 1e9 / written : 0.0,
+        "latency_max", __atomic_load_n(&c->latency_max_ns, __ATOMIC_RELAXED) / 1e9);
+}
+
+static PyObject *CaptureSession_get_buffers(CaptureSession *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->c.nslots);
+}
+
+static PyMethodDef CaptureSession_methods[] = {
+    {"acquire", (PyCFunction) CaptureSession_acquire, METH_NOARGS,
+        "acquire() -> ndarray, or None\n\n"
+        "Take a buffer from the pool to fill with a frame.  When every\n"
+        "buffer is in use, 'block' waits for one, 'drop_oldest' takes the\n"
+        "buffer of the oldest frame still queued, dropping that frame, and\n"
+        "'drop_newest' returns None, dropping the new frame.\n\n"
+        "Raises:\n"
+        "    ValueError: session closed"
+    },
+    {"submit", (PyCFunction) CaptureSession_submit, METH_VARARGS | METH_KEYWORDS,
+        "submit(frame, filename)\n\n"
+        "Queue a filled buffer to be saved as a DNG, as by save_dng with the\n"
+        "options given to the session.  The buffer must not be touched\n"
+        "afterwards.\n\n"
+        "Raises:\n"
+        "    TypeError: frame not ndarray\n"
+        "    ValueError: frame not acquired from this session, already\n"
+        "        submitted, or session closed"
+    },
+    {"release", (PyCFunction) CaptureSession_release, METH_O,
+        "release(frame)\n\n"
+        "Return an acquired buffer to the pool without saving it.\n\n"
+        "Raises:\n"
+        "    TypeError: frame not ndarray\n"
+        "    ValueError: frame not acquired from this session, already\n"
+        "        submitted, or session closed"
+    },
+    {"close", (PyCFunction) CaptureSession_close, METH_NOARGS,
+        "close()\n\n"
+        "Save every queued frame and stop the writers.  No frame may be\n"
+        "acquired or submitted meanwhile.\n\n"
+        "Raises:\n"
+        "    IOError: a frame could not be saved"
+    },
+    {"__enter__", (PyCFunction) MultiFrameWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) CaptureSession_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef CaptureSession_getset[] = {
+    {"stats", (getter) CaptureSession_get_stats, NULL,
+        "Counters: frames submitted, written (saved or failed), dropped and\n"
+        "failed, frames queued now, and the mean and maximum latency from\n"
+        "submit() to saved, in seconds", NULL},
+    {"buffers", (getter) CaptureSession_get_buffers, NULL,
+        "Buffers in the pool", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject CaptureSessionType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "tiffutils.CaptureSession",
+    .tp_basicsize = sizeof(CaptureSession),
+    .tp_dealloc = (destructor) CaptureSession_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "CaptureSession(shape, [dtype=numpy.uint16,\n"
+        "   max_inflight_bytes=256 MiB, writers=0, on_full='block',\n"
+        "   lock_memory=False, camera='Unknown',\n"
+        "   cfa_pattern=tiffutils.CFA_RGGB, color_matrix1=None,\n"
+        "   color_matrix2=None, calibration_illuminant1=0,\n"
+        "   calibration_illuminant2=0, compression=False, bits_per_sample=0,\n"
+        "   planar_config=tiffutils.PLANARCONFIG_CONTIG, preview=0,\n"
+        "   pyramid_levels=0])\n\n"
+        "Save captured frames as DNGs from native writer threads.\n"
+        "Frames are filled into buffers of the given shape and dtype,\n"
+        "taken with acquire() and queued with submit().  As many buffers as\n"
+        "fit in max_inflight_bytes (at least one) are allocated up front,\n"
+        "and locked into memory with lock_memory.  on_full chooses what\n"
+        "acquire() does when none is free.  writers threads save frames,\n"
+        "one per CPU if 0.  The other options are as for save_dng.  Usable\n"
+        "as a context manager.",
+    .tp_methods = CaptureSession_methods,
+    .tp_getset = CaptureSession_getset,
+    .tp_init = (initproc) CaptureSession_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static PyObject *tiffutils_recover(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "path", NULL
+    };
+
+    char *path;
+    uint64_t frames = 0;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path)) {
+        return NULL;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    Py_BEGIN_ALLOW_THREADS
+    err = recover_frames(path, &frames);
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        return raise_dng_error(err);
+    }
+
+    return PyLong_FromUnsignedLongLong(frames);
+}
+
+/*
+ * asyncio support
+ *
+ * Loads and saves run on the worker pool.  Finished jobs are handed back
+ * to the event loop through a queue per loop, whose eventfd the loop
+ * watches, and their futures resolved there.
+ */
+
+struct aio_job {
+    PyObject *queue;
+    PyObject *future;
+    PyObject *image;        /* image to save, NULL to load */
+    char *filename;
+    uint32_t level;
+    struct dng_options opts;
+    struct strip_layout l;
+    void *data;             /* image loaded */
+    int pattern;
+    int err;
+    char errmsg[sizeof(dng_errmsg)];
+    struct aio_job *next;
+};
+
+typedef struct {
+    PyObject_HEAD
+    int fd;                 /* eventfd, readable while jobs are done */
+    pthread_mutex_t lock;
+    struct aio_job *done;   /* most recent first, under lock */
+} AioQueue;
+
+/* Queue of each event loop, by loop */
+static PyObject *aio_queues;
+
+static void aio_job_free(struct aio_job *job) {
+    Py_XDECREF(job->queue);
+    Py_XDECREF(job->future);
+    Py_XDECREF(job->image);
+    free(job->filename);
+    free((char *) job->opts.camera);
+    free_dng_options(&job->opts);
+    free(job->data);
+    free(job);
+}
+
+/*
+ * Run a job on a worker, and hand it back to its loop
+ */
+static void aio_run(void *arg) {
+    struct aio_job *job = arg;
+    AioQueue *q = (AioQueue *) job->queue;
+    uint64_t one = 1;
+    TIFF *tiff;
+
+    if (job->image) {
+        tiff = TIFFOpen(job->filename, dng_open_mode(BIGTIFF_AUTO, &job->opts, &job->l));
+        if (!tiff) {
+            job->err = dng_fail(DNG_EIO, "libtiff failed to open file for writing.");
+        }
+        else {
+            job->err = write_dng(tiff, &job->opts, &job->l,
+                                 PyArray_BYTES((PyArrayObject *) job->image), NULL);
+            TIFFClose(tiff);
+        }
+    }
+    else {
+        job->err = load_image(job->filename, job->level, &job->l, &job->pattern,
+                              &job->data);
+    }
+
+    if (job->err) {
+        memcpy(job->errmsg, dng_errmsg, sizeof(job->errmsg));
+    }
+
+    pthread_mutex_lock(&q->lock);
+    job->next = q->done;
+    q->done = job;
+    pthread_mutex_unlock(&q->lock);
+
+    /* Cannot fail short of overflowing the counter */
+    (void) !write(q->fd, &one, sizeof(one));
+}
+
+/*
+ * Resolve a future with the exception set
+ *
+ * @returns 0 on success, negative on error, with exception set
+ */
+static int aio_fail(PyObject *future) {
+    PyObject *type, *value, *tb, *result;
+
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    if (tb) {
+        PyException_SetTraceback(value, tb);
+    }
+
+    result = PyObject_CallMethod(future, "set_exception", "O", value);
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(tb);
+
+    if (!result) {
+        return -1;
+    }
+
+    Py_DECREF(result);
+    return 0;
+}
+
+/*
+ * Resolve the future of a finished job, unless it was cancelled
+ *
+ * @returns 0 on success, negative on error, with exception set
+ */
+static int aio_resolve(struct aio_job *job) {
+    PyObject *done, *result;
+    int cancelled;
+
+    done = PyObject_CallMethod(job->future, "done", NULL);
+    if (!done) {
+        return -1;
+    }
+    cancelled = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    if (cancelled) {
+        return cancelled < 0 ? -1 : 0;
+    }
+
+    if (job->err) {
+        memcpy(dng_errmsg, job->errmsg, sizeof(dng_errmsg));
+        raise_dng_error(job->err);
+        return aio_fail(job->future);
+    }
+    else if (job->image) {
+        result = PyObject_CallMethod(job->future, "set_result", "O", Py_None);
+    }
+    else {
+        PyObject *array, *cfa;
+
+        array = layout_wrap(&job->l, job->data);
+        job->data = NULL;
+        if (!array) {
+            return aio_fail(job->future);
+        }
+
+        cfa = cfa_object(job->pattern);
+        if (!cfa) {
+            Py_DECREF(array);
+            return aio_fail(job->future);
+        }
+
+        result = PyObject_CallMethod(job->future, "set_result", "((NN))", array, cfa);
+    }
+
+    if (!result) {
+        return -1;
+    }
+
+    Py_DECREF(result);
+    return 0;
+}
+
+static PyObject *AioQueue_complete(AioQueue *self, PyObject *unused) {
+    struct aio_job *job, *next, *ready = NULL;
+    uint64_t count;
+
+    /* Nonblocking, so a spurious wakeup is harmless */
+    (void) !read(self->fd, &count, sizeof(count));
+
+    pthread_mutex_lock(&self->lock);
+    job = self->done;
+    self->done = NULL;
+    pthread_mutex_unlock(&self->lock);
+
+    /* Resolve in the order jobs finished */
+    for (; job; job = next) {
+        next = job->next;
+        job->next = ready;
+        ready = job;
+    }
+
+    for (job = ready; job; job = next) {
+        next = job->next;
+        if (aio_resolve(job)) {
+            PyErr_WriteUnraisable(job->future);
+        }
+        aio_job_free(job);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *AioQueue_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    AioQueue *self = (AioQueue *) type->tp_alloc(type, 0);
+
+    if (!self) {
+        return NULL;
+    }
+
+    self->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->fd < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+    return (PyObject *) self;
+}
+
+/*
+ * Jobs hold their queue until resolved, so none are left but those
+ * of a loop that stopped running
+ */
+static void AioQueue_dealloc(AioQueue *self) {
+    if (self->fd >= 0) {
+        close(self->fd);
+        pthread_mutex_destroy(&self->lock);
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyMethodDef AioQueue_methods[] = {
+    {"_complete", (PyCFunction) AioQueue_complete, METH_NOARGS,
+        "Resolve the futures of finished jobs"
+    },
+    {NULL}
+};
+
+static PyTypeObject AioQueueType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "tiffutils.aio._Queue",
+    .tp_basicsize = sizeof(AioQueue),
+    .tp_dealloc = (destructor) AioQueue_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Completion queue of an event loop",
+    .tp_methods = AioQueue_methods,
+    .tp_new = AioQueue_new,
+};
+
+/*
+ * Queue of the running loop, created and watched on first use
+ *
+ * @param loop  Running loop
+ * @returns new reference, or NULL with exception set
+ */
+static PyObject *aio_queue(PyObject *loop) {
+    PyObject *q, *complete, *result;
+
+    q = PyObject_GetItem(aio_queues, loop);
+    if (q || !PyErr_ExceptionMatches(PyExc_KeyError)) {
+        return q;
+    }
+    PyErr_Clear();
+
+    q = PyObject_CallObject((PyObject *) &AioQueueType, NULL);
+    if (!q) {
+        return NULL;
+    }
+
+    complete = PyObject_GetAttrString(q, "_complete");
+    if (!complete) {
+        goto err_decref_q;
+    }
+
+    result = PyObject_CallMethod(loop, "add_reader", "iO", ((AioQueue *) q)->fd, complete);
+    Py_DECREF(complete);
+    if (!result) {
+        goto err_decref_q;
+    }
+    Py_DECREF(result);
+
+    if (PyObject_SetItem(aio_queues, loop, q)) {
+        goto err_decref_q;
+    }
+
+    return q;
+
+err_decref_q:
+    Py_DECREF(q);
+    return NULL;
+}
+
+/*
+ * Start a job on the running loop
+ *
+ * @param job   Job, freed here on error
+ * @returns future of the job, or NULL with exception set
+ */
+static PyObject *aio_submit(struct aio_job *job) {
+    PyObject *asyncio, *loop;
+    int err;
+
+    asyncio = PyImport_ImportModule("asyncio");
+    if (!asyncio) {
+        goto err;
+    }
+
+    loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+    Py_DECREF(asyncio);
+    if (!loop) {
+        goto err;
+    }
+
+    job->queue = aio_queue(loop);
+    if (job->queue) {
+        job->future = PyObject_CallMethod(loop, "create_future", NULL);
+    }
+    Py_DECREF(loop);
+    if (!job->future) {
+        goto err;
+    }
+
+    /* Surpress warnings */
+    TIFFSetWarningHandler(NULL);
+
+    /* The worker holds the job, and the caller a reference to its future */
+    Py_INCREF(job->future);
+
+    Py_BEGIN_ALLOW_THREADS
+    err = pool_submit(aio_run, job);
+    Py_END_ALLOW_THREADS
+
+    if (err) {
+        Py_DECREF(job->future);
+        PyErr_NoMemory();
+        goto err;
+    }
+
+    return job->future;
+
 err:
-    TIFFClose(tiff);
+    aio_job_free(job);
     return NULL;
 }
 
+static PyObject *aio_load_dng(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "filename", "level", NULL
+    };
+
+    struct aio_job *job;
+    char *filename;
+    unsigned int level = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|I", kwlist, &filename, &level)) {
+        return NULL;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        return PyErr_NoMemory();
+    }
+
+    job->level = level;
+    job->filename = strdup(filename);
+    if (!job->filename) {
+        aio_job_free(job);
+        return PyErr_NoMemory();
+    }
+
+    return aio_submit(job);
+}
+
+static PyObject *aio_save_dng(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "image", "filename", "camera", "cfa_pattern", "color_matrix1",
+        "color_matrix2", "calibration_illuminant1", "calibration_illuminant2",
+        "compression", "bits_per_sample", "planar_config", "preview",
+        "pyramid_levels", NULL
+    };
+
+    PyArrayObject *array;
+    PyObject *color_matrix1_ndarray = Py_None;
+    PyObject *color_matrix2_ndarray = Py_None;
+    struct dng_options opts = {
+        .camera = "Unknown",
+        .pattern = CFA_RGGB,
+    };
+    struct strip_layout layout = {
+        .planar = PLANARCONFIG_CONTIG,
+    };
+    unsigned int compression = 0;
+    unsigned short bits_per_sample = 0;
+    struct aio_job *job;
+    char *filename;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|sIOOHHIHHII", kwlist, &array,
+                                     &filename, &opts.camera, &opts.pattern,
+                                     &color_matrix1_ndarray,
+                                     &color_matrix2_ndarray,
+                                     &opts.calibration_illuminant1,
+                                     &opts.calibration_illuminant2,
+                                     &compression, &bits_per_sample,
+                                     &layout.planar, &opts.preview,
+                                     &opts.pyramid_levels)) {
+        return NULL;
+    }
+
+    if (PyArray_to_layout(array, bits_per_sample, &layout)) {
+        return NULL;
+    }
+
+    opts.compression = compression;
+
+    if (handle_dng_options(color_matrix1_ndarray, color_matrix2_ndarray, &opts)) {
+        return NULL;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        free_dng_options(&opts);
+        return PyErr_NoMemory();
+    }
+
+    /* camera is borrowed from the argument */
+    opts.camera = strdup(opts.camera);
+    job->opts = opts;
+    job->l = layout;
+    job->filename = strdup(filename);
+    if (!opts.camera || !job->filename) {
+        aio_job_free(job);
+        return PyErr_NoMemory();
+    }
+
+    Py_INCREF(array);
+    job->image = (PyObject *) array;
+
+    return aio_submit(job);
+}
+
+static PyMethodDef aioMethods[] = {
+    {"load_dng", (PyCFunction) aio_load_dng, METH_VARARGS | METH_KEYWORDS,
+        "load_dng(filename, [level=0]) -> future of (ndarray, cfa_pattern)\n\n"
+        "Load a DNG on the native worker pool, as by tiffutils.load_dng.\n"
+        "Must be called from a running event loop, which resolves the\n"
+        "future without a thread of its own.\n\n"
+        "Raises (through the future):\n"
+        "   IOError: Unable to open or read file\n"
+        "   ValueError: Unsupported DNG format\n"
+    },
+    {"save_dng", (PyCFunction) aio_save_dng, METH_VARARGS | METH_KEYWORDS,
+        "save_dng(image, filename, [...]) -> future of None\n\n"
+        "Save an ndarray as a DNG on the native worker pool, with the\n"
+        "options of tiffutils.save_dng.  Must be called from a running\n"
+        "event loop.  The image must not be modified until the future is\n"
+        "done.\n\n"
+        "Raises:\n"
+        "   TypeError, ValueError: Invalid image or options, immediately\n"
+        "   IOError: Unable to write file, through the future\n"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+/*
+ * Create the tiffutils.aio submodule
+ *
+ * @returns new module, or NULL with exception set
+ */
+static PyObject *aio_module(void) {
+    PyObject *m, *weakref;
+
+    if (PyType_Ready(&AioQueueType) < 0) {
+        return NULL;
+    }
+
+    weakref = PyImport_ImportModule("weakref");
+    if (!weakref) {
+        return NULL;
+    }
+    aio_queues = PyObject_CallMethod(weakref, "WeakKeyDictionary", NULL);
+    Py_DECREF(weakref);
+    if (!aio_queues) {
+        return NULL;
+    }
+
+    m = PyModule_New("tiffutils.aio");
+    if (!m) {
+        return NULL;
+    }
+
+    if (PyModule_AddFunctions(m, aioMethods) ||
+        PyModule_AddStringConstant(m, "__doc__",
+                                   "asyncio versions of load_dng and save_dng")) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    return m;
+}
+
 PyMethodDef tiffutilsMethods[] = {
     {"save_dng", (PyCFunction) tiffutils_save_dng, METH_VARARGS | METH_KEYWORDS,
         "save_dng(image, filename, [compression=False, camera='Unknown',\n"
         "   cfa_pattern=tiffutils.CFA_RGGB, color_matrix1=None,\n"
         "   color_matrix2=None, calibration_illuminant1=0,\n"
-        "   calibration_illuminant2=0])\n\n"
+        "   calibration_illuminant2=0, bits_per_sample=0,\n"
+        "   planar_config=tiffutils.PLANARCONFIG_CONTIG, preview=0,\n"
+        "   pyramid_levels=0, bigtiff='auto'])\n\n"
         "Save an ndarray as a DNG.  The ndarray must be contiguous.\n"
-        "Use np.ascontiguousarray() to force an array to be contiguous.\n\n"
+        "Use np.ascontiguousarray() to force an array to be contiguous.\n"
+        "The image is encoded where it lies, so an ndarray over a\n"
+        "multiprocessing.shared_memory block is saved without a copy.  A\n"
+        "numpy.memmap (other than copy-on-write) is read ahead and dropped\n"
+        "from memory as it is encoded.\n\n"
         "The image will be saved as a RAW DNG, a superset of TIFF.\n\n"
         "Arguments:\n"
-        "    image: Image to save.  This should be a 2-dimensional, uint8 or\n"
-        "        uint16 Numpy array.\n"
+        "    image: Image to save.  This should be a 2-dimensional CFA\n"
+        "        image, or a (height, width, 3) LinearRaw image, as a uint8,\n"
+        "        uint16, float16 or float32 Numpy array.  Floating point\n"
+        "        images are saved as DNG 1.4 floating point data.\n"
         "    filename: Destination file to save DNG to.\n"
-        "    compression: enable DEFLATE compression (DNG 1.4)\n"
+        "    compression: enable DEFLATE compression (DNG 1.4).  Floating\n"
+        "       point images are compressed with the DNG 1.5 floating point\n"
+        "       predictor.  Strips are compressed in parallel.\n"
         "    camera: Unique name of camera model\n"
         "    cfa_pattern: Bayer color filter array pattern.\n"
         "       One of tiffutils.CFA_*\n"
@@ -514,19 +4466,82 @@ PyMethodDef tiffutilsMethods[] = {
         "    calibration_illuminant1: The desired CalibrationIlluminant1 value.\n"
         "       If not specified or 0, the field is omitted.\n"
         "    calibration_illuminant2: The desired CalibrationIlluminant2 value.\n"
-        "       If not specified or 0, the field is omitted.\n\n"
+        "       If not specified or 0, the field is omitted.\n"
+        "    bits_per_sample: Bits per sample to store.  If not specified or\n"
+        "       0, the size of the dtype.  float32 images may be stored as\n"
+        "       24-bit floating point.\n"
+        "    planar_config: Layout of LinearRaw samples in the file, one of\n"
+        "       tiffutils.PLANARCONFIG_*.  Separate planes are encoded\n"
+        "       concurrently.\n"
+        "    preview: Maximum dimension of an embedded 8-bit RGB preview.\n"
+        "       The preview is written as IFD0, with the raw image in a\n"
+        "       SubIFD.  If not specified or 0, no preview is written.\n"
+        "    pyramid_levels: Number of reduced resolution levels to write as\n"
+        "       LinearRaw SubIFDs, each half the size of the one before.  The\n"
+        "       first bins CFA quads into RGB pixels.  Levels are downsampled\n"
+        "       in parallel, each from the one before it.\n"
+        "    bigtiff: Write BigTIFF, which has 64-bit offsets, rather than\n"
+        "       classic TIFF, limited to 4 GiB.  If 'auto', BigTIFF is\n"
+        "       written only if the file could reach 4 GiB.\n\n"
         "Raises:\n"
         "    TypeError: image, color_matrix1, or color_matrix2 not ndarray\n"
         "    ValueError: ndarray incorrect layout, dimensions, or dtype\n"
         "    IOError: file could not be written"
     },
+    {"update_dng_tags", (PyCFunction) tiffutils_update_dng_tags,
+        METH_VARARGS | METH_KEYWORDS,
+        "update_dng_tags(filename, [camera=None, color_matrix1=None,\n"
+        "   color_matrix2=None, calibration_illuminant1=0,\n"
+        "   calibration_illuminant2=0])\n\n"
+        "Update the tags of a DNG in place, without rewriting its image\n"
+        "data.  IFD0 is rewritten at the end of the file with the new\n"
+        "tags, pointing at the strips and SubIFDs already there, and\n"
+        "linked in place of the old IFD.  In a multi-frame file, the tags\n"
+        "of the first frame are updated, and its index is rebuilt by the\n"
+        "next reader.\n\n"
+        "Arguments:\n"
+        "    filename: DNG to update\n"
+        "    camera: Unique name of camera model\n"
+        "    color_matrix1: A 2D ndarray containing the new ColorMatrix1.\n"
+        "    color_matrix2: A 2D ndarray containing the new ColorMatrix2.\n"
+        "    calibration_illuminant1: The new CalibrationIlluminant1 value.\n"
+        "    calibration_illuminant2: The new CalibrationIlluminant2 value.\n"
+        "    Tags not specified, or None or 0, are left as they are.\n\n"
+        "Raises:\n"
+        "    TypeError: color_matrix1 or color_matrix2 not ndarray\n"
+        "    ValueError: file is not a DNG\n"
+        "    IOError: file could not be updated"
+    },
     {"load_dng", (PyCFunction) tiffutils_load_dng, METH_VARARGS | METH_KEYWORDS,
-        "load_dng(filename) -> image ndarray\n\n"
+        "load_dng(filename, [level=0, shm_name=None, as_='ndarray',\n"
+        "   out_path=None])\n"
+        "   -> image ndarray\n\n"
         "Load DNG file as ndarray.\n"
-        "Expects a CFA image, with 1 sample per pixel and 8- or\n"
-        "16-bits per pixel.\n\n"
+        "Expects a CFA image with 1 sample per pixel, or a LinearRaw image\n"
+        "with contiguous or separate planes, and 8- or 16-bit integer, or\n"
+        "16-, 24- or 32-bit floating point samples.  Multi-sample images\n"
+        "are returned as (height, width, samples) arrays.\n"
+        "16-bit floating point images are returned as float16, and 24- and\n"
+        "32-bit as float32.\n\n"
         "Arguments:\n"
-        "   filename: Path to file to load\n\n"
+        "   filename: Path to file to load.  The raw image is read from\n"
+        "       IFD0, or from a SubIFD when IFD0 is a preview.\n"
+        "   level: Pyramid level to load, as written by save_dng's\n"
+        "       pyramid_levels.  Only the requested level is read.  If not\n"
+        "       specified or 0, the raw image.\n"
+        "   shm_name: Name of a multiprocessing.shared_memory block to\n"
+        "       decode into, created if it does not exist and grown if it\n"
+        "       is too small.  The image is returned as a view of the block,\n"
+        "       which other processes can attach to by name without a copy.\n"
+        "       The block is not unlinked.\n"
+        "   out_path: Path of a .npy file to decode into, replacing any file\n"
+        "       there.  The image is decoded strip by strip through a\n"
+        "       shared mapping, dropping strips from memory once decoded,\n"
+        "       and returned as a numpy.memmap of the file, so images larger\n"
+        "       than memory can be loaded.\n"
+        "   as_: 'ndarray', or 'dlpack' to return the image as a DNGImage,\n"
+        "       which exports its memory through the buffer protocol and\n"
+        "       __dlpack__ to consumers that take ownership without numpy.\n\n"
         "Returns:\n"
         "   (image, cfa), where image is an ndarray containing the image\n"
         "   data, and cfa is one of the tiffutils.CFA_* constants describing\n"
@@ -535,10 +4550,162 @@ PyMethodDef tiffutilsMethods[] = {
         "   IOError: Unable to open or read file\n"
         "   ValueError: Unsupported DNG format\n"
     },
+    {"cache", (PyCFunction) tiffutils_cache, METH_VARARGS | METH_KEYWORDS,
+        "cache([max_bytes]) -> dict\n\n"
+        "Set the budget of the decoded frame cache of load_dng.  While it\n"
+        "is above 0, load_dng keeps the most recently loaded frames, keyed\n"
+        "by path, modification time, size and level, and returns read-only\n"
+        "views of them instead of decoding again.  Frames loaded with\n"
+        "shm_name or as_ are not cached.  0, the default, disables the\n"
+        "cache and drops its frames.\n\n"
+        "Arguments:\n"
+        "   max_bytes: Decoded bytes to keep.  If not specified, the budget\n"
+        "       is left as it is.\n\n"
+        "Returns:\n"
+        "   Dict of max_bytes, bytes and frames cached, and the hits and\n"
+        "   misses of load_dng.\n"
+    },
+    {"open_dng", (PyCFunction) tiffutils_open_dng, METH_VARARGS | METH_KEYWORDS,
+        "open_dng(filename, [level=0, cache_bytes=64 MiB]) -> DNGImage\n\n"
+        "Open a DNG without decoding it.  shape, dtype and cfa of the\n"
+        "image returned are available at once.  Indexing rows decodes only\n"
+        "the strips holding them, in parallel, keeping the most recently\n"
+        "used decoded strips up to cache_bytes.  Exporting the image, as\n"
+        "by numpy.asarray, decodes all of it.  Images the native codec\n"
+        "cannot read a strip at a time are decoded whole on first access.\n\n"
+        "Arguments:\n"
+        "   filename: Path to file to open.\n"
+        "   level: Pyramid level to open, as for load_dng.\n"
+        "   cache_bytes: Decoded strips to keep, in bytes.\n\n"
+        "Returns:\n"
+        "   DNGImage\n\n"
+        "Raises:\n"
+        "   IOError: Unable to open or read file\n"
+        "   ValueError: Unsupported DNG format\n"
+    },
+    {"as_chunked", (PyCFunction) tiffutils_as_chunked, METH_VARARGS | METH_KEYWORDS,
+        "as_chunked(filenames, [level=0]) -> ChunkedArray\n\n"
+        "Present the frames of DNGs as one lazily decoded array of shape\n"
+        "(frames, height, width[, samples]).  Its chunks are a strip of a\n"
+        "frame, and reading a chunk decodes just that strip, so dask or\n"
+        "xarray can schedule work without decoding whole frames.  The\n"
+        "layout is read from the first file; the others must match it.\n\n"
+        "Arguments:\n"
+        "   filenames: Sequence of paths of DNGs, one frame each.\n"
+        "   level: Pyramid level to read, as for load_dng.\n\n"
+        "Returns:\n"
+        "   ChunkedArray\n\n"
+        "Raises:\n"
+        "   IOError: Unable to open or read the first file\n"
+        "   ValueError: Unsupported DNG format, or no files\n"
+    },
+    {"load_preview", (PyCFunction) tiffutils_load_preview, METH_VARARGS | METH_KEYWORDS,
+        "load_preview(filename, [max_size=0]) -> preview ndarray or bytes\n\n"
+        "Load an embedded preview without reading the raw image.\n"
+        "Reduced resolution RGB, YCbCr and grayscale images in the IFD chain\n"
+        "and their SubIFDs are previews.  Only directory tags are read\n"
+        "until the preview is chosen.\n\n"
+        "Arguments:\n"
+        "   filename: Path to file to load.\n"
+        "   max_size: Requested size of the larger side of the preview.\n"
+        "       The smallest preview at least this large is returned, or\n"
+        "       the largest preview if none is.  If not specified or 0, the\n"
+        "       smallest preview.\n\n"
+        "Returns:\n"
+        "   The preview as a (height, width, 3) RGB or (height, width)\n"
+        "   grayscale ndarray, or as the bytes of a JPEG stream if the\n"
+        "   preview is a single JPEG strip.\n\n"
+        "Raises:\n"
+        "   IOError: Unable to open or read file\n"
+        "   ValueError: No preview found, or unsupported preview format\n"
+    },
+    {"quicklook", (PyCFunction) tiffutils_quicklook, METH_VARARGS | METH_KEYWORDS,
+        "quicklook(filename, [max_size=512]) -> image ndarray\n\n"
+        "Render a small 8-bit sRGB image of the raw image of a DNG.\n"
+        "CFA quads are binned into pixels and box-averaged, decoding strips\n"
+        "band by band across native threads.  The smallest pyramid level at\n"
+        "least max_size is read instead of the raw image when there is one.\n"
+        "Colors are white balanced to AsShotNeutral (or D65) and mapped to\n"
+        "sRGB through ColorMatrix1.  The image is scaled to WhiteLevel, or\n"
+        "to its brightest pixel when there is none.\n\n"
+        "Arguments:\n"
+        "   filename: Path to file to load.\n"
+        "   max_size: Maximum size of the larger side of the image.\n\n"
+        "Returns:\n"
+        "   (height, width, 3) uint8 ndarray\n\n"
+        "Raises:\n"
+        "   IOError: Unable to open or read file\n"
+        "   ValueError: Unsupported DNG format\n"
+    },
+    {"export", (PyCFunction) tiffutils_export, METH_VARARGS | METH_KEYWORDS,
+        "export(filenames, out_dir, [format='jpeg', size=1024, quality=90,\n"
+        "   threads=0]) -> list of output paths\n\n"
+        "Export DNGs as 8-bit sRGB JPEG or PNG images.\n"
+        "Each image is rendered as by quicklook() and encoded with libjpeg\n"
+        "or libpng, in one native pass per image.  Images are processed\n"
+        "concurrently by native threads.\n\n"
+        "Arguments:\n"
+        "   filenames: Sequence of paths of DNGs to export.\n"
+        "   out_dir: Directory to write images to.  Each image is named\n"
+        "       after its DNG, with the extension replaced by .jpg or .png.\n"
+        "   format: 'jpeg' or 'png'.\n"
+        "   size: Maximum size of the larger side of each image.\n"
+        "   quality: JPEG quality, from 1 to 100.\n"
+        "   threads: Images processed at once.  If not specified or 0, one\n"
+        "       per CPU.\n\n"
+        "Returns:\n"
+        "   List of the paths written, in the order of filenames.\n\n"
+        "Raises:\n"
+        "   IOError: Unable to read a DNG or write an image.  Every other\n"
+        "       image is still exported.\n"
+        "   ValueError: Unsupported DNG, format or quality\n"
+    },
+    {"recompress", (PyCFunction) tiffutils_recompress, METH_VARARGS | METH_KEYWORDS,
+        "recompress(paths, [compression='deflate', threads=0, out_dir=None,\n"
+        "   rate_limit=0]) -> list of output paths\n\n"
+        "Recompress DNGs, or other TIFF files, without libtiff.  Every IFD\n"
+        "is copied with its tags as they are, and only the strips and the\n"
+        "entries describing them change.  Strips already in the target\n"
+        "compression, or in one that cannot be decoded natively, such as a\n"
+        "JPEG preview, are copied verbatim without being decoded.  Files\n"
+        "are processed concurrently by native threads.\n\n"
+        "Arguments:\n"
+        "   paths: Sequence of paths of files to recompress.\n"
+        "   compression: 'deflate' (DNG 1.4), or 'none' to decompress.\n"
+        "       Floating point images are compressed with the floating point\n"
+        "       predictor, and DNGVersion raised as needed.\n"
+        "   threads: Files processed at once.  If not specified or 0, one\n"
+        "       per CPU.\n"
+        "   out_dir: Directory to write files to, with the same names.  If\n"
+        "       not specified, each file is replaced once its copy is\n"
+        "       complete.\n"
+        "   rate_limit: Bytes per second read and written by every thread\n"
+        "       together.  If not specified or 0, unlimited.\n\n"
+        "Returns:\n"
+        "   List of the paths written, in the order of paths.\n\n"
+        "Raises:\n"
+        "   IOError: Unable to read or write a file.  Every other file is\n"
+        "       still recompressed.\n"
+        "   ValueError: Unsupported file or compression.  There are no\n"
+        "       LJ92 or JPEG XL encoders.\n"
+    },
+    {"recover", (PyCFunction) tiffutils_recover, METH_VARARGS | METH_KEYWORDS,
+        "recover(path) -> number of frames\n\n"
+        "Restore a multi-frame file after a crash while writing it.\n"
+        "Frames are checked from the last checkpoint recorded in its index,\n"
+        "or from the first frame if there is none.  The file is cut after\n"
+        "the last complete frame, and its index rewritten.\n\n"
+        "Arguments:\n"
+        "   path: File written by MultiFrameWriter.\n\n"
+        "Returns:\n"
+        "   Number of frames in the recovered file.\n\n"
+        "Raises:\n"
+        "   IOError: Unable to read or write the file, or no complete frames\n"
+        "   ValueError: Not a TIFF file\n"
+    },
     {NULL, NULL, 0, NULL}
 };
 
-#if PY_MAJOR_VERSION >= 3
 static struct PyModuleDef tiffutilsmodule = {
     PyModuleDef_HEAD_INIT,
     "tiffutils",    /* name of module */
@@ -547,29 +4714,52 @@ static struct PyModuleDef tiffutilsmodule = {
                 or -1 if the module keeps state in global variables. */
     tiffutilsMethods
 };
-#endif
 
-#if PY_MAJOR_VERSION >= 3
 PyMODINIT_FUNC PyInit_tiffutils(void) {
-#else
-PyMODINIT_FUNC inittiffutils(void) {
-#endif
     PyObject* m;
 
     import_array();
 
-#if PY_MAJOR_VERSION >= 3
+    engine_init();
+
     m = PyModule_Create(&tiffutilsmodule);
-#else
-    m = Py_InitModule("tiffutils", tiffutilsMethods);
-#endif
 
     if (m == NULL) {
-#if PY_MAJOR_VERSION >= 3
         return NULL;
-#else
-        return;
-#endif
+    }
+
+    if (PyType_Ready(&DNGImageType) < 0 ||
+        PyType_Ready(&ChunkedArrayType) < 0 ||
+        PyType_Ready(&MultiFrameWriterType) < 0 ||
+        PyType_Ready(&MultiFrameReaderType) < 0 ||
+        PyType_Ready(&CinemaDNGWriterType) < 0 ||
+        PyType_Ready(&CaptureSessionType) < 0) {
+        return NULL;
+    }
+
+    Py_INCREF(&DNGImageType);
+    PyModule_AddObject(m, "DNGImage", (PyObject *) &DNGImageType);
+    Py_INCREF(&ChunkedArrayType);
+    PyModule_AddObject(m, "ChunkedArray", (PyObject *) &ChunkedArrayType);
+    Py_INCREF(&MultiFrameWriterType);
+    PyModule_AddObject(m, "MultiFrameWriter", (PyObject *) &MultiFrameWriterType);
+    Py_INCREF(&MultiFrameReaderType);
+    PyModule_AddObject(m, "MultiFrameReader", (PyObject *) &MultiFrameReaderType);
+    Py_INCREF(&CinemaDNGWriterType);
+    PyModule_AddObject(m, "CinemaDNGWriter", (PyObject *) &CinemaDNGWriterType);
+    Py_INCREF(&CaptureSessionType);
+    PyModule_AddObject(m, "CaptureSession", (PyObject *) &CaptureSessionType);
+
+    {
+        PyObject *aio = aio_module();
+
+        /* Importable as tiffutils.aio */
+        if (!aio || PyDict_SetItemString(PyImport_GetModuleDict(), "tiffutils.aio", aio)) {
+            Py_XDECREF(aio);
+            Py_DECREF(m);
+            return NULL;
+        }
+        PyModule_AddObject(m, "aio", aio);
     }
 
     PyModule_AddIntConstant(m, "ILLUMINANT_UNKNOWN", ILLUMINANT_UNKNOWN);
@@ -598,32 +4788,8 @@ PyMODINIT_FUNC inittiffutils(void) {
     PyModule_AddIntConstant(m, "CFA_GRBG", CFA_GRBG);
     PyModule_AddIntConstant(m, "CFA_RGGB", CFA_RGGB);
 
-#if PY_MAJOR_VERSION >= 3
-    return m;
-#endif
-}
-
-int main(int argc, char *argv[]) {
-#if PY_MAJOR_VERSION >= 3
-    wchar_t name[128];
-    mbstowcs(name, argv[0], 128);
-#else
-    char name[128];
-    strncpy(name, argv[0], 128);
-#endif
-
-    /* Pass argv[0] to the Python interpreter */
-    Py_SetProgramName(name);
+    PyModule_AddIntConstant(m, "PLANARCONFIG_CONTIG", PLANARCONFIG_CONTIG);
+    PyModule_AddIntConstant(m, "PLANARCONFIG_SEPARATE", PLANARCONFIG_SEPARATE);
 
-    /* Initialize the Python interpreter.  Required. */
-    Py_Initialize();
-
-    /* Add a static module */
-#if PY_MAJOR_VERSION >= 3
-    PyInit_tiffutils();
-#else
-    inittiffutils();
-#endif
-
-    return 0;
+    return m;
 }
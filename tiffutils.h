@@ -0,0 +1,116 @@
+/*
+ * libtiffutils
+ *
+ * Read and write DNG raw images from C or C++, without Python.  Link with
+ * -ltiffutils.
+ *
+ * Every function returns 0 on success, or a negative enum tdng_error on
+ * failure, with a description from tdng_errmsg() on the same thread.  All
+ * functions may be called from any number of threads at once.
+ */
+
+#ifndef TIFFUTILS_H
+#define TIFFUTILS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum tdng_error {
+    TDNG_EIO = -1,          /* the file could not be read or written */
+    TDNG_EFORMAT = -2,      /* unsupported or invalid image */
+    TDNG_ENOMEM = -3,       /* out of memory */
+};
+
+/* Color filter array patterns, by the colors of the top left 2x2 block */
+enum tdng_cfa {
+    TDNG_CFA_BGGR = 0,
+    TDNG_CFA_GBRG,
+    TDNG_CFA_GRBG,
+    TDNG_CFA_RGGB,
+};
+
+/* Sample formats, as the TIFF SampleFormat tag */
+enum tdng_format {
+    TDNG_UINT = 1,
+    TDNG_FLOAT = 3,
+};
+
+enum tdng_bigtiff {
+    TDNG_BIGTIFF_AUTO = 0,  /* only when the file could exceed 4GiB */
+    TDNG_BIGTIFF_NEVER,
+    TDNG_BIGTIFF_ALWAYS,
+};
+
+/*
+ * A raw image
+ *
+ * Samples are held in native byte order, rows top to bottom, with the
+ * samples of each pixel interleaved.  24-bit floats are held as 32-bit
+ * floats.
+ */
+struct tdng_image {
+    uint32_t width;
+    uint32_t height;
+    uint16_t samples;       /* 1 for a CFA image, 3 for LinearRaw */
+    uint16_t bits;          /* 8 or 16 for TDNG_UINT, 16, 24 or 32 for TDNG_FLOAT */
+    uint16_t format;        /* enum tdng_format */
+    int pattern;            /* enum tdng_cfa of a read CFA image, otherwise -1 */
+    void *data;
+};
+
+struct tdng_options {
+    const char *camera;             /* UniqueCameraModel, NULL for "Unknown" */
+    enum tdng_cfa pattern;          /* CFA pattern of single sample images */
+    const float *color_matrix1;     /* 3x3, row major, NULL for a default */
+    const float *color_matrix2;     /* 3x3, row major, NULL to omit */
+    unsigned short illuminant1;     /* CalibrationIlluminant1, EXIF LightSource, 0 to omit */
+    unsigned short illuminant2;     /* CalibrationIlluminant2, EXIF LightSource, 0 to omit */
+    int compress;                   /* deflate compress the image (DNG 1.4) */
+    uint32_t preview;               /* maximum RGB preview dimension, 0 for none */
+    uint32_t pyramid_levels;        /* reduced resolution levels to write */
+    enum tdng_bigtiff bigtiff;
+};
+
+/*
+ * Write an image as a DNG
+ *
+ * @param path  File to create, replacing any file there
+ * @param img   Image to write
+ * @param opts  Options, or NULL for defaults
+ * @returns 0 on success, negative enum tdng_error on error
+ */
+int tdng_write(const char *path, const struct tdng_image *img,
+               const struct tdng_options *opts);
+
+/*
+ * Read the raw image of a DNG
+ *
+ * @param path  File to read
+ * @param img   Image returned here, its data to be freed by tdng_free()
+ * @returns 0 on success, negative enum tdng_error on error
+ */
+int tdng_read(const char *path, struct tdng_image *img);
+
+/*
+ * Read the layout of the raw image of a DNG without decoding it
+ *
+ * @param path  File to read
+ * @param img   Image returned here, with NULL data
+ * @returns 0 on success, negative enum tdng_error on error
+ */
+int tdng_info(const char *path, struct tdng_image *img);
+
+/* Free the data of an image returned by tdng_read() */
+void tdng_free(struct tdng_image *img);
+
+/* Description of the last error on the calling thread */
+const char *tdng_errmsg(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif